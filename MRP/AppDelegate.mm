@@ -290,8 +290,22 @@
 		}
         
         NSString *pathToDefaultCal = [touchkeyCalibrationDirectoryPath_ stringByAppendingString:@"calibration.xml"];
+        NSString *pathToDefaultSnapshot = [touchkeyCalibrationDirectoryPath_ stringByAppendingString:@"calibration.tkcal"];
         
-        if (touchkeyController_->calibrationLoadFromFile([pathToDefaultCal cStringUsingEncoding:NSASCIIStringEncoding])) {
+        // The binary snapshot loads fastest, but it only stands in for the XML if it is at least as
+        // new. Otherwise load the XML and make a fresh snapshot for next time.
+        NSDate *calDate = [[[NSFileManager defaultManager] attributesOfItemAtPath:pathToDefaultCal error:nil] fileModificationDate];
+        NSDate *snapshotDate = [[[NSFileManager defaultManager] attributesOfItemAtPath:pathToDefaultSnapshot error:nil] fileModificationDate];
+        bool snapshotIsCurrent = (snapshotDate != nil && (calDate == nil || [snapshotDate compare:calDate] != NSOrderedAscending));
+        
+        bool loadedCalibration = snapshotIsCurrent &&
+            touchkeyController_->calibrationLoadSnapshot([pathToDefaultSnapshot cStringUsingEncoding:NSASCIIStringEncoding]);
+        if (!loadedCalibration && touchkeyController_->calibrationLoadFromFile([pathToDefaultCal cStringUsingEncoding:NSASCIIStringEncoding])) {
+            touchkeyController_->calibrationSaveSnapshot([pathToDefaultSnapshot cStringUsingEncoding:NSASCIIStringEncoding], "default");
+            loadedCalibration = true;
+        }
+        
+        if (loadedCalibration) {
             
             [kObjectTouchkeyCalibrationStatusField setStringValue: @"Calibrated"];
             [kObjectTouchkeyCalibrationLoadButton setEnabled: YES];
@@ -1,34 +0,0 @@
-//
-//  MRPTests.m
-//  MRPTests
-//
-//  Created by Jeff Gregorio on 12/12/13.
-//  Copyright (c) 2013 Jeff Gregorio. All rights reserved.
-//
-
-#import <XCTest/XCTest.h>
-
-@interface MRPTests : XCTestCase
-
-@end
-
-@implementation MRPTests
-
-- (void)setUp
-{
-    [super setUp];
-    // Put setup code here. This method is called before the invocation of each test method in the class.
-}
-
-- (void)tearDown
-{
-    // Put teardown code here. This method is called after the invocation of each test method in the class.
-    [super tearDown];
-}
-
-- (void)testExample
-{
-    XCTFail(@"No implementation for \"%s\"", __PRETTY_FUNCTION__);
-}
-
-@end
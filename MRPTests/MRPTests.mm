@@ -0,0 +1,560 @@
+//
+//  MRPTests.mm
+//  MRPTests
+//
+//  Created by Jeff Gregorio on 12/12/13.
+//  Copyright (c) 2013 Jeff Gregorio. All rights reserved.
+//
+
+#import <XCTest/XCTest.h>
+
+#include <algorithm>
+#include <cmath>
+#include <cstring>
+#include <list>
+#include <set>
+#include <string>
+#include <vector>
+#include <unistd.h>
+#include <boost/bind.hpp>
+#include <boost/thread.hpp>
+#include "SessionLog.h"
+#include "SessionLogCodec.h"
+#include "Node.h"
+#include "KeyPositionTracker.h"
+#include "KeyTouchFrame.h"
+#include "PianoKey.h"
+#include "KeyboardStateTable.h"
+
+namespace {
+    // Deterministic pseudo-random numbers, so failures can be reproduced
+    class TestRandom {
+    public:
+        TestRandom(unsigned int seed) : state_(seed) {}
+        unsigned int next() { state_ = state_ * 1664525 + 1013904223; return state_ >> 8; }
+        int next(int range) { return (int)(next() % (unsigned int)range); }
+        float nextFloat() { return (float)next(1 << 16) / (float)(1 << 16); }
+    private:
+        unsigned int state_;
+    };
+
+    // A run of records resembling a session: keys resting and moving, touches coming
+    // and going, with the occasional MIDI and OSC message
+    std::vector<SessionLogRecord> makeSessionLogRecords(int count, unsigned int seed) {
+        std::vector<SessionLogRecord> records(count);
+        TestRandom random(seed);
+        double timestamp = 1.0;
+        int frame = 0;
+
+        for(int i = 0; i < count; i++) {
+            SessionLogRecord& record = records[i];
+
+            memset(&record, 0, sizeof(record));
+            timestamp += 0.0005 * random.next(4);
+            frame += random.next(2);
+            record.timestamp = timestamp;
+            record.frame = frame;
+            record.source = random.next(2);
+
+            int kind = random.next(16);
+            if(kind < 7) {
+                record.type = kSessionLogRecordAnalog;
+                record.note = 36 + random.next(61);
+                record.analog.rawValue = 1024 + random.next(8);
+                record.analog.position = (kind < 5) ? 0.0f : random.nextFloat();
+            }
+            else if(kind < 14) {
+                record.type = kSessionLogRecordTouch;
+                record.note = 36 + random.next(61);
+                record.touch.count = random.next(4);
+                for(int touch = 0; touch < record.touch.count; touch++) {
+                    record.touch.locs[touch] = random.nextFloat();
+                    record.touch.sizes[touch] = random.nextFloat();
+                }
+                record.touch.locH = (record.touch.count > 0) ? random.nextFloat() : -1.0f;
+                record.touch.white = (boost::uint8_t)random.next(2);
+            }
+            else if(kind < 15) {
+                record.type = kSessionLogRecordMidi;
+                record.note = -1;
+                record.midi.length = 3;
+                record.midi.bytes[0] = 0x90;
+                record.midi.bytes[1] = (boost::uint8_t)(36 + random.next(61));
+                record.midi.bytes[2] = (boost::uint8_t)random.next(128);
+            }
+            else {
+                record.type = kSessionLogRecordOsc;
+                record.note = 36 + random.next(61);
+                strcpy(record.osc.path, "/touchkeys/raw");
+                strcpy(record.osc.types, "if");
+                record.osc.args[0].i = record.note;
+                record.osc.args[1].f = random.nextFloat();
+            }
+        }
+
+        return records;
+    }
+
+    std::string temporaryLogPath(const char *name) {
+        return std::string([NSTemporaryDirectory() UTF8String]) + name;
+    }
+
+    // Positions of one key (sampled every millisecond) through a struck press and its
+    // release, a partial press that turns back, and a slow full press and release
+    const float kRecordedKeyPositions[] = {
+        0.008f, 0.004f, 0.012f, 0.0f, 0.0f, 0.0f, 0.008f, 0.0f, 0.004f, 0.0f, 0.0f, 0.012f,
+        0.012f, 0.0f, 0.004f, 0.0f, 0.012f, 0.0f, 0.0f, 0.004f, 0.03f, 0.12f, 0.31f, 0.55f,
+        0.78f, 0.93f, 0.88f, 0.84f, 0.9f, 0.97f, 1.01f, 1.03f, 1.016f, 1.0f, 1.016f, 1.016f,
+        1.012f, 1.0f, 1.004f, 1.0f, 1.016f, 1.004f, 1.008f, 1.012f, 1.004f, 1.016f, 1.0f,
+        1.016f, 1.008f, 1.016f, 1.004f, 1.0f, 1.016f, 1.016f, 1.004f, 1.008f, 1.0f, 1.016f,
+        1.0f, 1.016f, 1.0f, 1.016f, 1.004f, 1.012f, 1.016f, 1.012f, 1.008f, 1.012f, 1.016f,
+        1.012f, 1.008f, 1.008f, 1.004f, 1.004f, 1.004f, 1.0f, 1.016f, 1.008f, 1.016f, 1.012f,
+        1.008f, 1.012f, 1.008f, 1.016f, 1.0f, 1.0f, 1.016f, 1.012f, 1.004f, 1.008f, 1.004f,
+        1.012f, 1.012f, 1.0f, 1.0f, 1.016f, 1.016f, 1.008f, 1.008f, 1.008f, 1.016f, 1.012f,
+        1.0f, 0.955f, 0.91f, 0.865f, 0.82f, 0.775f, 0.73f, 0.685f, 0.64f, 0.595f, 0.55f, 0.505f,
+        0.46f, 0.415f, 0.37f, 0.325f, 0.28f, 0.235f, 0.19f, 0.145f, 0.1f, 0.055f, 0.012f, 0.0f,
+        0.0f, 0.008f, 0.012f, 0.0f, 0.0f, 0.008f, 0.012f, 0.008f, 0.012f, 0.008f, 0.0f, 0.012f,
+        0.008f, 0.004f, 0.0f, 0.012f, 0.0f, 0.004f, 0.008f, 0.004f, 0.004f, 0.012f, 0.012f,
+        0.02f, 0.05f, 0.09f, 0.14f, 0.2f, 0.26f, 0.31f, 0.34f, 0.35f, 0.33f, 0.28f, 0.22f,
+        0.15f, 0.09f, 0.05f, 0.02f, 0.01f, 0.012f, 0.0f, 0.004f, 0.012f, 0.012f, 0.008f, 0.004f,
+        0.012f, 0.008f, 0.012f, 0.008f, 0.012f, 0.004f, 0.004f, 0.0f, 0.04f, 0.08f, 0.12f,
+        0.16f, 0.2f, 0.24f, 0.28f, 0.32f, 0.36f, 0.4f, 0.44f, 0.48f, 0.52f, 0.56f, 0.6f, 0.64f,
+        0.68f, 0.72f, 0.76f, 0.8f, 0.84f, 0.88f, 0.92f, 0.96f, 1.0f, 1.004f, 1.004f, 1.004f,
+        1.004f, 1.0f, 1.012f, 1.016f, 1.004f, 1.008f, 1.008f, 1.0f, 1.004f, 1.012f, 1.016f,
+        1.008f, 1.016f, 1.016f, 1.008f, 1.004f, 1.016f, 1.016f, 1.0f, 1.012f, 1.016f, 1.012f,
+        1.012f, 1.012f, 1.012f, 1.0f, 1.012f, 1.012f, 1.0f, 1.004f, 1.0f, 1.004f, 1.012f,
+        1.004f, 1.0f, 1.008f, 1.016f, 1.0f, 1.0f, 1.0f, 1.016f, 1.004f, 1.016f, 1.0f, 1.008f,
+        1.016f, 1.0f, 1.0f, 0.92f, 0.84f, 0.76f, 0.68f, 0.6f, 0.52f, 0.44f, 0.36f, 0.28f, 0.2f,
+        0.12f, 0.04f, 0.0f, 0.004f, 0.012f, 0.004f, 0.008f, 0.008f, 0.008f, 0.012f, 0.0f, 0.0f,
+        0.012f, 0.012f, 0.012f, 0.012f, 0.008f, 0.0f, 0.004f, 0.0f, 0.008f, 0.008f, 0.012f,
+        0.004f, 0.0f, 0.004f, 0.008f
+    };
+
+    // Whether two feature values agree, treating two missing (NaN) values as equal
+    template<typename T>
+    bool sameFeature(T a, T b) {
+        return (a != a && b != b) || a == b;
+    }
+
+    bool sameVelocity(std::pair<timestamp_type, key_velocity> a, std::pair<timestamp_type, key_velocity> b) {
+        return sameFeature(a.first, b.first) && sameFeature(a.second, b.second);
+    }
+
+    // The original way of finding the velocity at a threshold crossing: search the whole
+    // buffer from the anchor on every call
+    std::pair<timestamp_type, key_velocity> rescanCrossingVelocity(Node<key_position>& buffer, KeyPositionTracker::Event anchor,
+                                                                   KeyPositionTracker::Event finish, key_position threshold,
+                                                                   bool pressing, int samplesAfterCrossing) {
+        std::pair<timestamp_type, key_velocity> none(missing_value<timestamp_type>::missing(), missing_value<key_velocity>::missing());
+
+        if(missing_value<timestamp_type>::isMissing(anchor.timestamp))
+            return none;
+
+        KeyPositionTracker::key_buffer_index index = anchor.index;
+        if(index < buffer.beginIndex() + 2)
+            index = buffer.beginIndex() + 2;
+
+        while(index < buffer.endIndex() - samplesAfterCrossing) {
+            if(finish.index != 0 && index >= finish.index)
+                break;
+            if(pressing ? (buffer[index] > threshold) : (buffer[index] < threshold)) {
+                key_position diffPosition = buffer[index + samplesAfterCrossing] - buffer[index - 2];
+                timestamp_diff_type diffTimestamp = buffer.timestampAt(index + samplesAfterCrossing) - buffer.timestampAt(index - 2);
+                return std::pair<timestamp_type, key_velocity>(buffer.timestampAt(index), calculate_key_velocity(diffPosition, diffTimestamp));
+            }
+            index++;
+        }
+
+        return none;
+    }
+
+    // The original percussiveness calculation, rescanning the press from its start
+    KeyPositionTracker::PercussivenessFeatures rescanPercussiveness(Node<key_position>& buffer, KeyPositionTracker& tracker) {
+        KeyPositionTracker::PercussivenessFeatures features;
+        KeyPositionTracker::Event start = tracker.pressStart(), finish = tracker.pressFinish();
+        KeyPositionTracker::key_buffer_index index, maximumVelocityIndex, largestVelocityDifferenceIndex;
+        key_velocity maximumVelocity, largestVelocityDifference;
+
+        if(missing_value<timestamp_type>::isMissing(start.timestamp) || buffer.beginIndex() > start.index - 1) {
+            features.percussiveness = missing_value<float>::missing();
+            return features;
+        }
+
+        maximumVelocity = largestVelocityDifference = scale_key_velocity(0);
+        maximumVelocityIndex = largestVelocityDifferenceIndex = start.index;
+
+        for(index = start.index; index < buffer.endIndex(); index++) {
+            if(finish.index != 0 && index >= finish.index)
+                break;
+
+            key_position diffPosition = buffer[index] - buffer[index - 1];
+            timestamp_diff_type diffTimestamp = buffer.timestampAt(index) - buffer.timestampAt(index - 1);
+            key_velocity velocity = calculate_key_velocity(diffPosition, diffTimestamp);
+
+            if(velocity > maximumVelocity) {
+                maximumVelocity = velocity;
+                maximumVelocityIndex = index;
+            }
+            if(maximumVelocity - velocity > largestVelocityDifference) {
+                largestVelocityDifference = maximumVelocity - velocity;
+                largestVelocityDifferenceIndex = index;
+            }
+            if(index - start.index >= 4 && buffer[index] > kPositionTrackerPositionThresholdForPercussivenessCalculation)
+                break;
+        }
+
+        features.velocitySpikeMaximum = KeyPositionTracker::Event(maximumVelocityIndex, maximumVelocity, buffer.timestampAt(maximumVelocityIndex));
+        features.velocitySpikeMinimum = KeyPositionTracker::Event(largestVelocityDifferenceIndex, maximumVelocity - largestVelocityDifference,
+                                                                  buffer.timestampAt(largestVelocityDifferenceIndex));
+        features.timeFromStartToSpike = buffer.timestampAt(maximumVelocityIndex) - buffer.timestampAt(start.index);
+
+        if(largestVelocityDifference == scale_key_velocity(0)) {
+            features.percussiveness = 0.0;
+            features.areaPrecedingSpike = features.areaFollowingSpike = scale_key_velocity(0);
+            return features;
+        }
+
+        features.areaPrecedingSpike = features.areaFollowingSpike = scale_key_velocity(0);
+        for(index = start.index; index < maximumVelocityIndex; index++) {
+            key_position diffPosition = buffer[index] - buffer[index - 1];
+            timestamp_diff_type diffTimestamp = buffer.timestampAt(index) - buffer.timestampAt(index - 1);
+            features.areaPrecedingSpike += calculate_key_velocity(diffPosition, diffTimestamp);
+        }
+        for(index = maximumVelocityIndex; index < largestVelocityDifferenceIndex; index++) {
+            key_position diffPosition = buffer[index] - buffer[index - 1];
+            timestamp_diff_type diffTimestamp = buffer.timestampAt(index) - buffer.timestampAt(index - 1);
+            features.areaFollowingSpike += calculate_key_velocity(diffPosition, diffTimestamp);
+        }
+        features.percussiveness = features.velocitySpikeMaximum.position;
+
+        return features;
+    }
+
+    // The original recursive touch matcher, with the contact size term added to its
+    // distance: try each available new touch for the next old touch, recursing on the rest
+    std::pair<float, std::list<int> > recursiveTouchMatch(const KeyTouchFrame& oldFrame, const KeyTouchFrame& newFrame, int oldIndex,
+                                                          std::set<int>& availableNewPoints, float currentTotalDistance) {
+        float minVal = INFINITY;
+        std::set<int> newPointsCopy(availableNewPoints);
+        std::list<int> order;
+
+        for(std::set<int>::iterator it = availableNewPoints.begin(); it != availableNewPoints.end(); ++it) {
+            float dist;
+            if(newFrame.locs[*it] >= 0.0 && oldFrame.locs[oldIndex] >= 0.0) {
+                float locDiff = oldFrame.locs[oldIndex] - newFrame.locs[*it];
+                float sizeDiff = oldFrame.sizes[oldIndex] - newFrame.sizes[*it];
+                dist = locDiff*locDiff + kPianoKeyTouchMatchSizeWeight*sizeDiff*sizeDiff;
+            }
+            else
+                dist = kPianoKeyTouchMatchMissingDistance;
+
+            // End case: only one possible point available
+            if(availableNewPoints.size() == 1) {
+                order.push_front(*it);
+                return std::pair<float, std::list<int> >(currentTotalDistance + dist, order);
+            }
+
+            newPointsCopy.erase(*it);
+            std::pair<float, std::list<int> > rval = recursiveTouchMatch(oldFrame, newFrame, oldIndex + 1, newPointsCopy,
+                                                                         currentTotalDistance + dist);
+            if(rval.first < minVal) {
+                minVal = rval.first;
+                order = rval.second;
+                order.push_front(*it);
+            }
+            newPointsCopy.insert(*it);
+        }
+
+        return std::pair<float, std::list<int> >(minVal, order);
+    }
+
+    // A frame of touches at random positions, in ascending order as the sensor reports
+    // them. With sameSize, every touch has the same size, so only position matters.
+    KeyTouchFrame makeTouchFrame(TestRandom& random, int count, bool sameSize) {
+        float locs[3], sizes[3];
+        float size = random.nextFloat();
+
+        for(int i = 0; i < count; i++) {
+            locs[i] = random.nextFloat();
+            sizes[i] = sameSize ? size : random.nextFloat();
+        }
+        std::sort(locs, locs + count);
+
+        return KeyTouchFrame(count, locs, sizes, random.nextFloat(), true);
+    }
+
+    bool sameEvent(KeyPositionTracker::Event const& a, KeyPositionTracker::Event const& b) {
+        return a.index == b.index && sameFeature(a.position, b.position) && sameFeature(a.timestamp, b.timestamp);
+    }
+
+    bool samePercussiveness(KeyPositionTracker::PercussivenessFeatures const& a, KeyPositionTracker::PercussivenessFeatures const& b) {
+        if(!sameFeature(a.percussiveness, b.percussiveness))
+            return false;
+        if(missing_value<float>::isMissing(a.percussiveness))
+            return true;
+        return sameEvent(a.velocitySpikeMaximum, b.velocitySpikeMaximum) && sameEvent(a.velocitySpikeMinimum, b.velocitySpikeMinimum) &&
+               sameFeature(a.timeFromStartToSpike, b.timeFromStartToSpike) &&
+               sameFeature(a.areaPrecedingSpike, b.areaPrecedingSpike) && sameFeature(a.areaFollowingSpike, b.areaFollowingSpike);
+    }
+
+    // Notes shared by the writers in the state table test
+    const int kStateTableTestLowestNote = 60;
+    const int kStateTableTestNotes = 4;
+
+    // Hammer a few notes of the table, each write keeping its fields in step with each
+    // other: the position equals its timestamp and the key state is the low bits of its
+    // timestamp. Each writer uses its own values so a mix of two writes also shows up.
+    void writeStateTable(KeyboardStateTable *table, int writer, int iterations, boost::atomic<int> *finished) {
+        for(int i = 0; i < iterations; i++) {
+            int note = kStateTableTestLowestNote + (i % kStateTableTestNotes);
+            int value = i * 2 + writer + 1;
+
+            table->setPosition(note, (key_position)value, (timestamp_type)value);
+            table->setKeyState(note, value & 3, (timestamp_type)value);
+            table->setMidiNote(note, (value & 4) != 0, 1 + (value & 0x7E));
+        }
+        (*finished)++;
+    }
+
+    bool consistentSnapshot(KeyStateSnapshot const& snapshot) {
+        return snapshot.position == (key_position)snapshot.timestamp &&
+               snapshot.keyState == ((int)snapshot.stateTimestamp & 3) &&
+               (snapshot.midiNoteIsOn != 0) == (snapshot.midiVelocity != 0);
+    }
+}
+
+@interface MRPTests : XCTestCase
+
+@end
+
+@implementation MRPTests
+
+- (void)setUp
+{
+    [super setUp];
+    // Put setup code here. This method is called before the invocation of each test method in the class.
+}
+
+- (void)tearDown
+{
+    // Put teardown code here. This method is called after the invocation of each test method in the class.
+    [super tearDown];
+}
+
+- (void)testExample
+{
+    XCTFail(@"No implementation for \"%s\"", __PRETTY_FUNCTION__);
+}
+
+// Every block the codec encodes must decode to the same bytes, with and without the LZ stage
+- (void)testSessionLogCodecRoundTrip
+{
+    const int counts[] = { 0, 1, 1000, kSessionLogRecordsPerBlock };
+    std::vector<SessionLogRecord> records = makeSessionLogRecords(kSessionLogRecordsPerBlock, 1);
+    std::vector<SessionLogRecord> decoded(kSessionLogRecordsPerBlock + 1);
+    SessionLogCodec codec;
+
+    for(int useLZ = 0; useLZ <= 1; useLZ++) {
+        for(int i = 0; i < (int)(sizeof(counts) / sizeof(counts[0])); i++) {
+            int count = counts[i];
+            std::vector<unsigned char> encoded;
+
+            codec.encode(&records[0], count, useLZ != 0, encoded);
+            XCTAssertTrue(codec.decode(encoded.empty() ? 0 : &encoded[0], encoded.size(), useLZ != 0, &decoded[0], count),
+                          @"decode failed for %d records (LZ %d)", count, useLZ);
+            XCTAssertTrue(memcmp(&decoded[0], &records[0], count * sizeof(SessionLogRecord)) == 0,
+                          @"round trip differs for %d records (LZ %d)", count, useLZ);
+
+            // Asking for more records than were encoded must fail rather than invent them
+            XCTAssertFalse(codec.decode(encoded.empty() ? 0 : &encoded[0], encoded.size(), useLZ != 0, &decoded[0], count + 1),
+                           @"decode of %d records accepted a short block (LZ %d)", count, useLZ);
+        }
+    }
+}
+
+// Logs written with each block encoding read back unchanged: an empty log, and one
+// full block followed by a partial one
+- (void)testSessionLogEncodingsRoundTrip
+{
+    const int encodings[] = { kSessionLogEncodingRaw, kSessionLogEncodingDelta, kSessionLogEncodingDeltaLZ };
+    const int counts[] = { 0, kSessionLogRecordsPerBlock + 100 };
+    std::string path = temporaryLogPath("MRPTestsSessionLog.tklog");
+
+    for(int e = 0; e < (int)(sizeof(encodings) / sizeof(encodings[0])); e++) {
+        for(int c = 0; c < (int)(sizeof(counts) / sizeof(counts[0])); c++) {
+            std::vector<SessionLogRecord> records = makeSessionLogRecords(counts[c], 2 + e);
+            SessionLog log;
+
+            log.setEncoding(encodings[e]);
+            XCTAssertTrue(log.open(path), @"unable to open %s", path.c_str());
+            for(size_t i = 0; i < records.size(); i++)
+                log.append(records[i]);
+            log.close();
+            XCTAssertEqual(log.recordsDropped(), 0UL, @"records dropped (encoding %d)", encodings[e]);
+
+            SessionLogReader reader;
+            SessionLogRecord record;
+            size_t read = 0;
+
+            XCTAssertTrue(reader.open(path), @"unable to read back %s", path.c_str());
+            XCTAssertEqual(reader.recordCount(), (boost::uint64_t)records.size(), @"record count (encoding %d)", encodings[e]);
+            while(reader.next(record)) {
+                if(read >= records.size()) {
+                    XCTFail(@"extra records read back (encoding %d)", encodings[e]);
+                    break;
+                }
+                XCTAssertTrue(memcmp(&record, &records[read], sizeof(record)) == 0,
+                              @"record %zu differs (encoding %d)", read, encodings[e]);
+                read++;
+            }
+            XCTAssertEqual(read, records.size(), @"records read back (encoding %d)", encodings[e]);
+            reader.close();
+        }
+    }
+
+    unlink(path.c_str());
+}
+
+// Replay a recorded key through KeyPositionTracker and check after every sample that the
+// features it keeps up to date match a full rescan of the buffer, as it used to do.
+// The recording is played at its own speed, with timing jitter, and at half speed.
+- (void)testKeyPositionTrackerFeaturesMatchRescan
+{
+    const int recordedSamples = (int)(sizeof(kRecordedKeyPositions) / sizeof(kRecordedKeyPositions[0]));
+    const key_position otherEscapement = scale_key_position(0.5);
+    Node<key_position> buffer(4 * recordedSamples);
+    KeyPositionTracker tracker(64, buffer);
+    TestRandom random(3);
+    timestamp_type timestamp = 0;
+    int pressVelocities = 0, releaseVelocities = 0, percussivePresses = 0;
+
+    tracker.engage();
+
+    for(int replay = 0; replay < 3; replay++) {
+        int repeats = (replay == 2) ? 2 : 1;
+
+        for(int sample = 0; sample < recordedSamples * repeats; sample++) {
+            timestamp += 0.001 + ((replay == 1) ? 0.00001 * random.next(10) : 0);
+            buffer.insert(scale_key_position(kRecordedKeyPositions[sample / repeats]), timestamp);
+
+            std::pair<timestamp_type, key_velocity> pressVelocity = tracker.pressVelocity();
+            std::pair<timestamp_type, key_velocity> releaseVelocity = tracker.releaseVelocity();
+            KeyPositionTracker::PercussivenessFeatures percussiveness = tracker.pressPercussiveness();
+
+            XCTAssertTrue(sameVelocity(pressVelocity, rescanCrossingVelocity(buffer, tracker.pressStart(), tracker.pressFinish(),
+                                       kPositionTrackerDefaultPositionForPressVelocityCalculation, true,
+                                       kPositionTrackerSamplesNeededForPressVelocityAfterEscapement)),
+                          @"press velocity differs at sample %d of replay %d", sample, replay);
+            XCTAssertTrue(sameVelocity(tracker.pressVelocity(otherEscapement), rescanCrossingVelocity(buffer, tracker.pressStart(),
+                                       tracker.pressFinish(), otherEscapement, true, kPositionTrackerSamplesNeededForPressVelocityAfterEscapement)),
+                          @"press velocity at another threshold differs at sample %d of replay %d", sample, replay);
+            XCTAssertTrue(sameVelocity(releaseVelocity, rescanCrossingVelocity(buffer, tracker.releaseStart(), tracker.releaseFinish(),
+                                       kPositionTrackerDefaultPositionForReleaseVelocityCalculation, false,
+                                       kPositionTrackerSamplesNeededForReleaseVelocityAfterEscapement)),
+                          @"release velocity differs at sample %d of replay %d", sample, replay);
+            XCTAssertTrue(samePercussiveness(percussiveness, rescanPercussiveness(buffer, tracker)),
+                          @"percussiveness differs at sample %d of replay %d", sample, replay);
+
+            if(!missing_value<key_velocity>::isMissing(pressVelocity.second))
+                pressVelocities++;
+            if(!missing_value<key_velocity>::isMissing(releaseVelocity.second))
+                releaseVelocities++;
+            if(!missing_value<float>::isMissing(percussiveness.percussiveness) && percussiveness.percussiveness > 0)
+                percussivePresses++;
+        }
+    }
+
+    // Make sure the recording really exercised each feature
+    XCTAssertTrue(pressVelocities > 0, @"no press velocity found");
+    XCTAssertTrue(releaseVelocities > 0, @"no release velocity found");
+    XCTAssertTrue(percussivePresses > 0, @"no percussive press found");
+}
+
+// The permutation table must pick the same ordering as the recursive search it replaced,
+// for every number of touches before and after, with sizes the same and different.
+// The number of touches matched follows touchInsertFrame(): the new count when touches
+// are added, otherwise all three.
+- (void)testTouchMatchAgreesWithRecursiveSearch
+{
+    TestRandom random(4);
+
+    for(int oldCount = 0; oldCount <= 3; oldCount++) {
+        for(int newCount = 0; newCount <= 3; newCount++) {
+            int count = (newCount > oldCount) ? newCount : 3;
+
+            for(int trial = 0; trial < 2000; trial++) {
+                KeyTouchFrame oldFrame = makeTouchFrame(random, oldCount, (trial & 1) != 0);
+                KeyTouchFrame newFrame = makeTouchFrame(random, newCount, (trial & 1) != 0);
+
+                // Now and then, put a new touch exactly where an old one was
+                if(trial % 10 == 0 && oldCount > 0 && newCount > 0) {
+                    newFrame.locs[newCount - 1] = oldFrame.locs[0];
+                    newFrame.sizes[newCount - 1] = oldFrame.sizes[0];
+                }
+
+                std::set<int> available;
+                for(int i = 0; i < count; i++)
+                    available.insert(i);
+                std::list<int> expected(recursiveTouchMatch(oldFrame, newFrame, 0, available, 0.0).second);
+
+                int ordering[3];
+                PianoKey::touchMatchClosestPoints(oldFrame, newFrame, count, ordering);
+
+                int oldIndex = 0;
+                for(std::list<int>::iterator it = expected.begin(); it != expected.end(); ++it, oldIndex++) {
+                    if(ordering[oldIndex] != *it) {
+                        XCTFail(@"%d -> %d touches, trial %d: old touch %d matched %d, expected %d",
+                                oldCount, newCount, trial, oldIndex, ordering[oldIndex], *it);
+                        break;
+                    }
+                }
+            }
+        }
+    }
+}
+
+// Two writers update the same notes while a reader copies them out, one at a time and
+// as a range. Every snapshot must come from a single write, never a mix of two.
+- (void)testKeyboardStateTableReadsAreNeverTorn
+{
+    const int kWriters = 2;
+    const int kIterations = 200000;
+    KeyboardStateTable table;
+    boost::atomic<int> finished(0);
+    boost::thread_group writers;
+    long reads = 0, torn = 0;
+
+    for(int writer = 0; writer < kWriters; writer++)
+        writers.create_thread(boost::bind(&writeStateTable, &table, writer, kIterations, &finished));
+
+    while(finished.load() < kWriters) {
+        KeyStateSnapshot snapshots[kStateTableTestNotes];
+
+        for(int i = 0; i < kStateTableTestNotes; i++) {
+            table.read(kStateTableTestLowestNote + i, snapshots[i]);
+            if(!consistentSnapshot(snapshots[i]))
+                torn++;
+        }
+        table.read(kStateTableTestLowestNote, kStateTableTestNotes, snapshots);
+        for(int i = 0; i < kStateTableTestNotes; i++) {
+            if(!consistentSnapshot(snapshots[i]))
+                torn++;
+        }
+        reads += 2 * kStateTableTestNotes;
+    }
+    writers.join_all();
+
+    XCTAssertTrue(reads > 0, @"reader never ran while the writers were busy");
+    XCTAssertEqual(torn, 0L, @"%ld of %ld snapshots were torn", torn, reads);
+
+    // Once the writers are done, each note holds one of the last writes made to it
+    for(int i = 0; i < kStateTableTestNotes; i++) {
+        KeyStateSnapshot snapshot;
+        XCTAssertTrue(table.read(kStateTableTestLowestNote + i, snapshot));
+        XCTAssertTrue(consistentSnapshot(snapshot), @"note %d is inconsistent at rest", kStateTableTestLowestNote + i);
+        XCTAssertTrue(snapshot.timestamp >= (timestamp_type)((kIterations - kStateTableTestNotes) * 2),
+                      @"note %d lost its last write", kStateTableTestLowestNote + i);
+    }
+}
+
+@end
@@ -14,7 +14,7 @@ KeyIdleDetector::KeyIdleDetector(capacity_type capacity, Node<key_position>& key
 								 key_position activityThreshold, int counterThreshold) 
   : Node<int>(capacity), keyBuffer_(keyBuffer), accumulator_(kKeyIdleNumSamples+1, keyBuffer), idleState_(kIdleDetectorUnknown), 
     activityThreshold_(activityThreshold), positionThreshold_(positionThreshold), keyIdleThreshold_(kDefaultKeyIdleThreshold),
-    numberOfFramesWithoutActivity_(0), noActivityCounterThreshold_(counterThreshold) {
+    numberOfFramesWithoutActivity_(0), noActivityCounterThreshold_(counterThreshold), detached_(false) {
 	// Register to receive messages from the accumulator each time it gets a new sample
 	  //std::cout << "Registering IdleDetector\n";
 	  
@@ -28,8 +28,12 @@ KeyIdleDetector::KeyIdleDetector(KeyIdleDetector const& obj)
   : Node<int>(obj), keyBuffer_(obj.keyBuffer_), accumulator_(obj.accumulator_), idleState_(obj.idleState_), 
     activityThreshold_(obj.activityThreshold_), positionThreshold_(obj.positionThreshold_),
     numberOfFramesWithoutActivity_(obj.numberOfFramesWithoutActivity_),
-    keyIdleThreshold_(obj.keyIdleThreshold_), noActivityCounterThreshold_(obj.noActivityCounterThreshold_) {
-	registerForTrigger(&accumulator_);
+    keyIdleThreshold_(obj.keyIdleThreshold_), noActivityCounterThreshold_(obj.noActivityCounterThreshold_),
+    detached_(obj.detached_) {
+	if(detached_)
+		accumulator_.unregisterForTrigger(&keyBuffer_);
+	else
+		registerForTrigger(&accumulator_);
 }
 
 // Clear current state and reset to unknown idle state.
@@ -39,6 +43,24 @@ void KeyIdleDetector::clear() {
 	numberOfFramesWithoutActivity_ = 0;
 }
 
+// Stop evaluating samples here; the accumulator isn't needed either
+void KeyIdleDetector::detach() {
+	if(detached_)
+		return;
+	unregisterForTrigger(&accumulator_);
+	accumulator_.unregisterForTrigger(&keyBuffer_);
+	accumulator_.clear();
+	detached_ = true;
+}
+
+// Change state on behalf of an outside detector, notifying listeners
+void KeyIdleDetector::setIdleState(int state, timestamp_type timestamp) {
+	if(state == idleState_)
+		return;
+	idleState_ = state;
+	insert(state, timestamp);
+}
+
 // Evaluator function.  Find the maximum deviation from average of the key motion.
 
 void KeyIdleDetector::triggerReceived(TriggerSource* who, timestamp_type timestamp) {
@@ -59,11 +59,23 @@ public:
 	key_position positionThreshold() { return positionThreshold_; }
 	void setActivityThreshold(key_position thresh) { activityThreshold_ = thresh; }
 	void setPositionThreshold(key_position thresh) { positionThreshold_ = thresh; }
+	key_position keyIdleThreshold() { return keyIdleThreshold_; }
+	int noActivityCounterThreshold() { return noActivityCounterThreshold_; }
 	
 	// ***** Modifiers *****
 	
 	void clear();
 	
+	// ***** External Evaluation *****
+	//
+	// A KeyboardIdleDetector can take over the evaluation for all keys together. Once
+	// detached, this object stops looking at samples itself and is told of changes
+	// through setIdleState(), which notifies listeners the same way.
+	
+	void detach();
+	bool detached() { return detached_; }
+	void setIdleState(int state, timestamp_type timestamp);
+	
 	// ***** Evaluator *****
 	
 	// This method actually handles the quantification of key activity.  When it
@@ -83,6 +95,7 @@ public:
 	int numberOfFramesWithoutActivity_;                         // For how many samples have we been below the idle threshold?
     int noActivityCounterThreshold_;
 	int idleState_;												// Currently idle?
+	bool detached_;												// Evaluated by a KeyboardIdleDetector
 
 };
  
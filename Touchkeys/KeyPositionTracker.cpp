@@ -7,10 +7,14 @@
 //
 
 #include "KeyPositionTracker.h"
+#include "Logger.h"
+#include <cmath>
 
 // Default constructor
 KeyPositionTracker::KeyPositionTracker(capacity_type capacity, Node<key_position>& keyBuffer)
-: Node<KeyPositionTrackerNotification>(capacity), keyBuffer_(keyBuffer), engaged_(false) {
+: Node<KeyPositionTrackerNotification>(capacity), keyBuffer_(keyBuffer), engaged_(false),
+  onsetPredictionEnabled_(false), predictionState_(kPredictionNone) {
+    clearOnsetPredictionStatistics();
     reset();
 }
 
@@ -33,34 +37,18 @@ std::pair<timestamp_type, key_velocity> KeyPositionTracker::pressVelocity(key_po
                                                        missing_value<key_velocity>::missing());
     }
     
-    // Find where the key position crosses the indicated level
-    key_buffer_index index = startIndex_;
-    if(index < keyBuffer_.beginIndex() + 2)
-        index = keyBuffer_.beginIndex() + 2;
-
-    while(index < keyBuffer_.endIndex() - kPositionTrackerSamplesNeededForPressVelocityAfterEscapement) {
-        // If the key press has a defined end, make sure we don't go past it
-        if(pressIndex_ != 0 && index >= pressIndex_)
-            break;
-        
-        if(keyBuffer_[index] > escapementPosition) {
-            // Found the place the position crosses the indicated threshold
-            // Now find the exact (interpolated) timestamp and velocity
-            timestamp_type exactPressTimestamp = keyBuffer_.timestampAt(index); // TODO
-            
-            // Velocity is calculated by an average of 2 samples before and 1 after
-            key_position diffPosition = keyBuffer_[index + kPositionTrackerSamplesNeededForPressVelocityAfterEscapement] - keyBuffer_[index - 2];
-            timestamp_diff_type diffTimestamp = keyBuffer_.timestampAt(index + kPositionTrackerSamplesNeededForPressVelocityAfterEscapement) - keyBuffer_.timestampAt(index - 2);
-            key_velocity velocity = calculate_key_velocity(diffPosition, diffTimestamp);
-            
-            return std::pair<timestamp_type, key_velocity>(exactPressTimestamp, velocity);
-        }
-        index++;
-    }
+    // Find where the key position crosses the indicated level. The usual escapement
+    // point is tracked as samples arrive; any other gets a search of its own.
+    CrossingScan otherScan;
+    CrossingScan& scan = (escapementPosition == pressVelocityEscapementPosition_) ? pressVelocityScan_ : otherScan;
+    advanceCrossingScan(scan, startIndex_, escapementPosition, true, kPositionTrackerSamplesNeededForPressVelocityAfterEscapement);
     
-    // Didn't find anything matching that threshold
-    return std::pair<timestamp_type, key_velocity>(missing_value<timestamp_type>::missing(),
-                                                   missing_value<key_velocity>::missing());
+    // If the key press has a defined end, the crossing has to come before it
+    if(scan.crossing == 0 || (pressIndex_ != 0 && scan.crossing >= pressIndex_)) {
+        return std::pair<timestamp_type, key_velocity>(missing_value<timestamp_type>::missing(),
+                                                       missing_value<key_velocity>::missing());
+    }
+    return scan.velocity;
 }
 
 // Calculate (MIDI-style) key release velocity from continuous key position
@@ -76,131 +64,83 @@ std::pair<timestamp_type, key_velocity> KeyPositionTracker::releaseVelocity(key_
     }
     
     // Find where the key position crosses the indicated level
-    key_buffer_index index = releaseBeginIndex_;
-    if(index < keyBuffer_.beginIndex() + 2)
-        index = keyBuffer_.beginIndex() + 2;
-
-    while(index < keyBuffer_.endIndex() - kPositionTrackerSamplesNeededForReleaseVelocityAfterEscapement) {
-        // Check for whether we've hit the end of the release interval, assuming
-        // the interval exists yet
-        if(releaseEndIndex_ != 0 && index >= releaseEndIndex_)
-            break;
-        
-        if(keyBuffer_[index] < returnPosition) {
-            // Found the place the position crosses the indicated threshold
-            // Now find the exact (interpolated) timestamp and velocity
-            timestamp_type exactPressTimestamp = keyBuffer_.timestampAt(index); // TODO
-            
-            // Velocity is calculated by an average of 2 samples before and 1 after
-            key_position diffPosition = keyBuffer_[index + kPositionTrackerSamplesNeededForReleaseVelocityAfterEscapement] - keyBuffer_[index - 2];
-            timestamp_diff_type diffTimestamp = keyBuffer_.timestampAt(index + kPositionTrackerSamplesNeededForReleaseVelocityAfterEscapement) - keyBuffer_.timestampAt(index - 2);
-            key_velocity velocity = calculate_key_velocity(diffPosition, diffTimestamp);
-            
-            std::cout << "found release velocity " << velocity << "(diffp " << diffPosition << ", diffT " << diffTimestamp << ")" << std::endl;
-            
-            return std::pair<timestamp_type, key_velocity>(exactPressTimestamp, velocity);
-        }
-        index++;
-    }
+    CrossingScan otherScan;
+    CrossingScan& scan = (returnPosition == releaseVelocityEscapementPosition_) ? releaseVelocityScan_ : otherScan;
+    advanceCrossingScan(scan, releaseBeginIndex_, returnPosition, false, kPositionTrackerSamplesNeededForReleaseVelocityAfterEscapement);
     
-    // Didn't find anything matching that threshold
-    return std::pair<timestamp_type, key_velocity>(missing_value<timestamp_type>::missing(),
-                                                   missing_value<key_velocity>::missing());
+    // Check for whether the crossing is past the end of the release interval, assuming
+    // the interval exists yet
+    if(scan.crossing == 0 || (releaseEndIndex_ != 0 && scan.crossing >= releaseEndIndex_)) {
+        return std::pair<timestamp_type, key_velocity>(missing_value<timestamp_type>::missing(),
+                                                       missing_value<key_velocity>::missing());
+    }
+    return scan.velocity;
 }
 
 // Calculate and return features about the percussiveness of the key press
 KeyPositionTracker::PercussivenessFeatures KeyPositionTracker::pressPercussiveness() {
     PercussivenessFeatures features;
-    key_buffer_index index;
-    key_velocity maximumVelocity, largestVelocityDifference;
-    key_buffer_index maximumVelocityIndex, largestVelocityDifferenceIndex;
     
     // Check that we have a valid start point from which to calculate
     if(missing_value<timestamp_type>::isMissing(startTimestamp_) || keyBuffer_.beginIndex() > startIndex_ - 1) {
-        std::cout << "*** no start time\n";
+        TOUCHKEY_LOG(kLogLevelTrace, "*** no start time");
         features.percussiveness = missing_value<float>::missing();
         return features;
     }
     
-    // From the start of the key press, look for an initial maximum in velocity
-    index = startIndex_;
+    // Only the samples before the end of the key press count, if it has one
+    key_buffer_index limit = keyBuffer_.endIndex();
+    if(pressIndex_ != 0 && pressIndex_ < limit)
+        limit = pressIndex_;
+    advancePercussivenessScan(percussivenessScan_, limit);
     
-    maximumVelocity = scale_key_velocity(0);
-    maximumVelocityIndex = startIndex_;
-    largestVelocityDifference = scale_key_velocity(0);
-    largestVelocityDifferenceIndex = startIndex_;
-    
-    std::cout << "*** start index " << index << std::endl;
-    
-    while(index < keyBuffer_.endIndex()) {
-        if(pressIndex_ != 0 && index >= pressIndex_)
-            break;
-        
-        key_position diffPosition = keyBuffer_[index] - keyBuffer_[index - 1];
-        timestamp_diff_type diffTimestamp = keyBuffer_.timestampAt(index) - keyBuffer_.timestampAt(index - 1);
-        key_velocity velocity = calculate_key_velocity(diffPosition, diffTimestamp);
-        
-        // Look for maximum of velocity
-        if(velocity > maximumVelocity) {
-            maximumVelocity = velocity;
-            maximumVelocityIndex = index;
-            std::cout << "*** found new max velocity " << maximumVelocity << " at index " << index << std::endl;
-        }
-        
-        // And given the difference between the max and the current sample,
-        // look for the largest rebound (velocity hitting a peak and falling)
-        if(maximumVelocity - velocity > largestVelocityDifference) {
-            largestVelocityDifference = maximumVelocity - velocity;
-            largestVelocityDifferenceIndex = index;
-            std::cout << "*** found new diff velocity " << largestVelocityDifference << " at index " << index << std::endl;
-        }
-        
-        // Only look at the early part of the key press: if the key position
-        // makes it more than a certain amount down, assume the initial spike
-        // has passed and finish up. But always allow at least 5 points for the
-        // fastest key presses to be considered.
-        if(index - startIndex_ >= 4 && keyBuffer_[index] > kPositionTrackerPositionThresholdForPercussivenessCalculation) {
-            break;
-        }
-        
-        index++;
-    }
+    PercussivenessScan const& scan = percussivenessScan_;
     
     // Now transfer what we've found to the data structure
-    features.velocitySpikeMaximum = Event(maximumVelocityIndex, maximumVelocity, keyBuffer_.timestampAt(maximumVelocityIndex));
-    features.velocitySpikeMinimum = Event(largestVelocityDifferenceIndex, maximumVelocity - largestVelocityDifference,
-                                          keyBuffer_.timestampAt(largestVelocityDifferenceIndex));
-    features.timeFromStartToSpike = keyBuffer_.timestampAt(maximumVelocityIndex) - keyBuffer_.timestampAt(startIndex_);
+    features.velocitySpikeMaximum = Event(scan.maximumVelocityIndex, scan.maximumVelocity, scan.maximumVelocityTimestamp);
+    features.velocitySpikeMinimum = Event(scan.largestVelocityDifferenceIndex, scan.maximumVelocity - scan.largestVelocityDifference,
+                                          scan.largestVelocityDifferenceTimestamp);
+    features.timeFromStartToSpike = scan.maximumVelocityTimestamp - scan.startTimestamp;
     
     // Check if we found a meaningful difference. If not, percussiveness is set to 0
-    if(largestVelocityDifference == scale_key_velocity(0)) {
+    if(scan.largestVelocityDifference == scale_key_velocity(0)) {
         features.percussiveness = 0.0;
         features.areaPrecedingSpike = scale_key_velocity(0);
         features.areaFollowingSpike = scale_key_velocity(0);
         return features;
     }
     
-    // Calculate the area under the velocity curve before and after the maximum
-    features.areaPrecedingSpike = scale_key_velocity(0);
-    for(index = startIndex_; index < maximumVelocityIndex; index++) {
-        key_position diffPosition = keyBuffer_[index] - keyBuffer_[index - 1];
-        timestamp_diff_type diffTimestamp = keyBuffer_.timestampAt(index) - keyBuffer_.timestampAt(index - 1);
-        features.areaPrecedingSpike += calculate_key_velocity(diffPosition, diffTimestamp);
-    }
-    features.areaFollowingSpike = scale_key_velocity(0);
-    for(index = maximumVelocityIndex; index < largestVelocityDifferenceIndex; index++) {
-        key_position diffPosition = keyBuffer_[index] - keyBuffer_[index - 1];
-        timestamp_diff_type diffTimestamp = keyBuffer_.timestampAt(index) - keyBuffer_.timestampAt(index - 1);
-        features.areaFollowingSpike += calculate_key_velocity(diffPosition, diffTimestamp);
-    }
+    // Area under the velocity curve before and after the maximum. If the maximum moved
+    // on after the largest difference was found, nothing follows it.
+    features.areaPrecedingSpike = scan.areaPrecedingSpike;
+    features.areaFollowingSpike = (scan.largestVelocityDifferenceIndex > scan.maximumVelocityIndex) ?
+                                   scan.areaFollowingSpike : scale_key_velocity(0);
     
-    std::cout << "area before = " << features.areaPrecedingSpike << " after = " << features.areaFollowingSpike << std::endl;
+    TOUCHKEY_LOG(kLogLevelTrace, "area before = {} after = {}") << features.areaPrecedingSpike << features.areaFollowingSpike;
     
     features.percussiveness = features.velocitySpikeMaximum.position;
     
     return features;
 }
 
+// Forecast escapement time and velocity, if a prediction was made for this press
+std::pair<timestamp_type, key_velocity> KeyPositionTracker::predictedPressVelocity() {
+    if(predictionState_ == kPredictionNone) {
+        return std::pair<timestamp_type, key_velocity>(missing_value<timestamp_type>::missing(),
+                                                       missing_value<key_velocity>::missing());
+    }
+    return predictedVelocity_;
+}
+
+// Clear the running totals for onset prediction
+void KeyPositionTracker::clearOnsetPredictionStatistics() {
+    onsetPredictionStatistics_.predictions = onsetPredictionStatistics_.confirmed = 0;
+    onsetPredictionStatistics_.corrected = onsetPredictionStatistics_.cancelled = 0;
+    onsetPredictionStatistics_.missed = 0;
+    onsetPredictionStatistics_.totalLeadTime = onsetPredictionStatistics_.totalTimingError = 0;
+    onsetPredictionStatistics_.totalVelocityError = 0;
+}
+
 // Register to receive messages from the key buffer on each new sample
 void KeyPositionTracker::engage() {
     if(engaged_)
@@ -217,11 +157,15 @@ void KeyPositionTracker::disengage() {
     
     unregisterForTrigger(&keyBuffer_);
     engaged_ = false;
+    
+    // A press that never arrived. Nobody is listening by now, so just count it.
+    cancelPrediction(missing_value<timestamp_type>::missing(), false);
 }
 
 // Clear current state and reset to unknown state
 void KeyPositionTracker::reset() {
 	Node<KeyPositionTrackerNotification>::clear();
+    cancelPrediction(missing_value<timestamp_type>::missing(), false);
     
     currentState_ = kPositionTrackerStateUnknown;
     currentlyAvailableFeatures_ = KeyPositionTrackerNotification::kFeaturesNone;
@@ -237,6 +181,12 @@ void KeyPositionTracker::reset() {
     releaseVelocityEscapementPosition_ = kPositionTrackerDefaultPositionForReleaseVelocityCalculation;
     pressVelocityAvailableIndex_ = releaseVelocityAvailableIndex_ = percussivenessAvailableIndex_ = 0;
     releaseVelocityWaitingForThresholdCross_ = false;
+    pressVelocityScan_.engaged = releaseVelocityScan_.engaged = percussivenessScan_.engaged = false;
+    predictionState_ = kPredictionNone;
+    predictionTimestamp_ = missing_value<timestamp_type>::missing();
+    predictionPosition_ = missing_value<key_position>::missing();
+    predictedVelocity_ = std::pair<timestamp_type, key_velocity>(missing_value<timestamp_type>::missing(),
+                                                                 missing_value<key_velocity>::missing());
 }
 
 // Evaluator function. Update the current state
@@ -261,10 +211,19 @@ void KeyPositionTracker::triggerReceived(TriggerSource* who, timestamp_type time
         if(currentBufferIndex >= pressVelocityAvailableIndex_) {
             // Can now calculate press velocity
             currentlyAvailableFeatures_ |= KeyPositionTrackerNotification::kFeaturePressVelocity;
+            confirmPrediction(timestamp);
             notifyFeature(KeyPositionTrackerNotification::kNotificationTypeFeatureAvailableVelocity, timestamp);
             pressVelocityAvailableIndex_ = 0;
         }
     }
+    // ** Predicted Onset **
+    // Call off a prediction if the key has turned back, or if it is long overdue at escapement
+    if(predictionState_ == kPredictionPending) {
+        if(currentKeyPosition < predictionPosition_ - kPositionTrackerPressHysteresis ||
+           (currentKeyPosition < pressVelocityEscapementPosition_ &&
+            timestamp > predictedVelocity_.first + kPositionTrackerOnsetPredictionTimeout))
+            cancelPrediction(timestamp, true);
+    }
     // ** Release Velocity **
     if(releaseVelocityWaitingForThresholdCross_) {
         if(currentKeyPosition < releaseVelocityEscapementPosition_)
@@ -427,6 +386,19 @@ void KeyPositionTracker::triggerReceived(TriggerSource* who, timestamp_type time
             }
         }
     }
+    
+    // Take the new sample into the features, now that any start or release point has moved
+    updateFeatures();
+    
+    // Look ahead to the onset on the way down, whether from rest or from a partial release
+    if(onsetPredictionEnabled_ && predictionState_ == kPredictionNone &&
+       (currentState_ == kPositionTrackerStatePartialPressAwaitingMax ||
+        currentState_ == kPositionTrackerStateReleaseInProgress ||
+        currentState_ == kPositionTrackerStateReleaseFinished)) {
+        if(currentKeyPosition >= kPositionTrackerMinimumPositionForOnsetPrediction &&
+           currentKeyPosition < pressVelocityEscapementPosition_)
+            predictOnset(timestamp);
+    }
 }
 
 // Change the current state of the tracker and generate a notification
@@ -461,6 +433,7 @@ void KeyPositionTracker::changeState(int newState, timestamp_type timestamp) {
             if(index + kPositionTrackerSamplesNeededForPressVelocityAfterEscapement <= mostRecentIndex) {
                 // Here, we already have the velocity information
                 currentlyAvailableFeatures_ |= KeyPositionTrackerNotification::kFeaturePressVelocity;
+                confirmPrediction(timestamp);
                 notifyFeature(KeyPositionTrackerNotification::kNotificationTypeFeatureAvailableVelocity, timestamp);
             }
             else {
@@ -469,6 +442,10 @@ void KeyPositionTracker::changeState(int newState, timestamp_type timestamp) {
             }
             break;
         case kPositionTrackerStateReleaseInProgress:
+            // The next press gets a prediction of its own
+            cancelPrediction(timestamp, true);
+            predictionState_ = kPredictionNone;
+            
             // Start looking for the data needed for MIDI release velocity.
             // Where did the key cross the release escaoentb position? How many more samples do
             // we need to calculate velocity?
@@ -485,8 +462,11 @@ void KeyPositionTracker::changeState(int newState, timestamp_type timestamp) {
             break;
         case kPositionTrackerStatePartialPressAwaitingMax:
         case kPositionTrackerStateUnknown:
-            // Reset all features
+            // Reset all features. A prediction still pending carries over if the key
+            // is heading down again.
             currentlyAvailableFeatures_ = KeyPositionTrackerNotification::kFeaturesNone;
+            if(predictionState_ == kPredictionSettled)
+                predictionState_ = kPredictionNone;
             break;
         case kPositionTrackerStateDown:
         case kPositionTrackerStateReleaseFinished:
@@ -564,12 +544,12 @@ void KeyPositionTracker::findKeyPressStart(timestamp_type timestamp) {
         key_velocity velocity = calculate_key_velocity(diffPosition, diffTimestamp);
         
         if(velocity > kPositionTrackerStartVelocitySpikeThreshold) {
-            std::cout << "At index " << index << ", velocity is " << velocity << std::endl;
+            TOUCHKEY_LOG(kLogLevelTrace, "At index {}, velocity is {}") << index << velocity;
             haveFoundVelocitySpike = true;
         }
         
         if(velocity < kPositionTrackerStartVelocityThreshold && haveFoundVelocitySpike) {
-            std::cout << "At index " << index << ", velocity is " << velocity << std::endl;
+            TOUCHKEY_LOG(kLogLevelTrace, "At index {}, velocity is {}") << index << velocity;
             haveFoundNewMinimum = true;
             break;
         }
@@ -585,7 +565,7 @@ void KeyPositionTracker::findKeyPressStart(timestamp_type timestamp) {
         startTimestamp_ = keyBuffer_.timestampAt(index - kPositionTrackerSamplesToAverageForStartVelocity/2);
         lastMinMaxPosition_ = startPosition_;
         
-        std::cout << "Found previous location\n";
+        TOUCHKEY_LOG(kLogLevelTrace, "Found previous location");
     }
 }
 
@@ -604,7 +584,7 @@ void KeyPositionTracker::findKeyReleaseStart(timestamp_type timestamp) {
         key_velocity velocity = calculate_key_velocity(diffPosition, diffTimestamp);
         
         if(velocity > kPositionTrackerReleaseVelocityThreshold) {
-            std::cout << "Found release at index " << index << " (vel = " << velocity << ")\n";
+            TOUCHKEY_LOG(kLogLevelTrace, "Found release at index {} (vel = {})") << index << velocity;
             break;
         }
         
@@ -668,15 +648,247 @@ void KeyPositionTracker::prepareReleaseVelocityFeature(KeyPositionTracker::key_b
     }
     else if(index + kPositionTrackerSamplesNeededForReleaseVelocityAfterEscapement + 1 <= mostRecentIndex) {
         // Here, we already have the velocity information
-        std::cout << "release available, at index = " << keyBuffer_[index] << ", most recent position = " << keyBuffer_[mostRecentIndex] << std::endl;
+        TOUCHKEY_LOG(kLogLevelTrace, "release available, at index = {}, most recent position = {}") << keyBuffer_[index] << keyBuffer_[mostRecentIndex];
         currentlyAvailableFeatures_ |= KeyPositionTrackerNotification::kFeatureReleaseVelocity;
         notifyFeature(KeyPositionTrackerNotification::kNotificationTypeFeatureAvailableReleaseVelocity, timestamp);
         releaseVelocityWaitingForThresholdCross_ = false;
     }
     else {
         // Otherwise, we need to send a notification when the information becomes available
-        std::cout << "release available at index " << index + kPositionTrackerSamplesNeededForReleaseVelocityAfterEscapement + 1 << std::endl;
+        TOUCHKEY_LOG(kLogLevelTrace, "release available at index {}") << index + kPositionTrackerSamplesNeededForReleaseVelocityAfterEscapement + 1;
         releaseVelocityAvailableIndex_ = index + kPositionTrackerSamplesNeededForReleaseVelocityAfterEscapement + 1;
         releaseVelocityWaitingForThresholdCross_ = false;
     }
-}
\ No newline at end of file
+}
+
+// Fit a quadratic to the most recent samples and, if it reaches the escapement position
+// within the prediction horizon, send a provisional onset with the forecast time and
+// velocity. The velocity is taken over the same span around the crossing as the measured
+// one (2 samples before to 1 after), so the two can be compared directly.
+void KeyPositionTracker::predictOnset(timestamp_type timestamp) {
+    const int count = kPositionTrackerSamplesForOnsetPrediction;
+    
+    if(keyBuffer_.size() < count)
+        return;
+    
+    // Least-squares fit of p(t) = a + b*t + c*t^2, with t measured back from the latest
+    // sample so that a is the smoothed current position
+    key_buffer_index last = keyBuffer_.endIndex() - 1;
+    timestamp_type latestTimestamp = keyBuffer_.timestampAt(last);
+    double s1 = 0, s2 = 0, s3 = 0, s4 = 0, sy = 0, sty = 0, st2y = 0;
+    
+    for(key_buffer_index index = last + 1 - count; index <= last; index++) {
+        double t = -(double)(timestamp_diff_type)(latestTimestamp - keyBuffer_.timestampAt(index));
+        double y = (double)keyBuffer_[index];
+        
+        s1 += t;
+        s2 += t*t;
+        s3 += t*t*t;
+        s4 += t*t*t*t;
+        sy += y;
+        sty += t*y;
+        st2y += t*t*y;
+    }
+    
+    // Solve the normal equations by Cramer's rule
+    double det = count*(s2*s4 - s3*s3) - s1*(s1*s4 - s3*s2) + s2*(s1*s3 - s2*s2);
+    if(det == 0)
+        return;
+    double a = (sy*(s2*s4 - s3*s3) - s1*(sty*s4 - s3*st2y) + s2*(sty*s3 - s2*st2y)) / det;
+    double b = (count*(sty*s4 - s3*st2y) - sy*(s1*s4 - s3*s2) + s2*(s1*st2y - sty*s2)) / det;
+    double c = (count*(s2*st2y - sty*s3) - s1*(s1*st2y - sty*s2) + sy*(s1*s3 - s2*s2)) / det;
+    double interval = -s1 * 2.0 / (double)(count * (count - 1));   // Mean sample spacing
+    
+    // Only fast presses are worth predicting
+    key_velocity currentVelocity = calculate_key_velocity((key_position)(b * 3.0 * interval),
+                                                          (timestamp_diff_type)(3.0 * interval));
+    if(currentVelocity < kPositionTrackerMinimumVelocityForOnsetPrediction)
+        return;
+    
+    // First time the fit reaches escapement, in the form that stays accurate as c goes to 0.
+    // If the discriminant is negative the key is slowing down too fast to get there.
+    double distance = (double)pressVelocityEscapementPosition_ - a;
+    double discriminant = b*b + 4.0*c*distance;
+    if(distance <= 0 || discriminant < 0)
+        return;
+    double crossing = 2.0 * distance / (b + sqrt(discriminant));
+    if(crossing > (double)kPositionTrackerOnsetPredictionHorizon)
+        return;
+    
+    double before = crossing - 1.5 * interval, after = crossing + 1.5 * interval;
+    double positionBefore = a + b*before + c*before*before;
+    double positionAfter = a + b*after + c*after*after;
+    
+    predictedVelocity_.first = latestTimestamp + (timestamp_diff_type)crossing;
+    predictedVelocity_.second = calculate_key_velocity((key_position)(positionAfter - positionBefore),
+                                                       (timestamp_diff_type)(after - before));
+    predictionTimestamp_ = timestamp;
+    predictionPosition_ = keyBuffer_[last];
+    predictionState_ = kPredictionPending;
+    onsetPredictionStatistics_.predictions++;
+    
+    TOUCHKEY_LOG(kLogLevelTrace, "predicted escapement at {} velocity {}") << predictedVelocity_.first << predictedVelocity_.second;
+    notifyFeature(KeyPositionTrackerNotification::kNotificationTypePredictedVelocity, timestamp);
+}
+
+// Press velocity has just become available: compare it to the prediction, if there was one
+void KeyPositionTracker::confirmPrediction(timestamp_type timestamp) {
+    if(predictionState_ != kPredictionPending) {
+        if(onsetPredictionEnabled_ && predictionState_ == kPredictionNone)
+            onsetPredictionStatistics_.missed++;
+        predictionState_ = kPredictionSettled;
+        return;
+    }
+    
+    std::pair<timestamp_type, key_velocity> measured = pressVelocity();
+    float velocityError = 1.0;
+    
+    if(!missing_value<key_velocity>::isMissing(measured.second) && measured.second != scale_key_velocity(0)) {
+        velocityError = fabsf((float)(predictedVelocity_.second - measured.second) / (float)measured.second);
+        onsetPredictionStatistics_.totalTimingError += timestamp_abs((timestamp_diff_type)(measured.first - predictedVelocity_.first));
+    }
+    onsetPredictionStatistics_.totalLeadTime += (timestamp_diff_type)(timestamp - predictionTimestamp_);
+    onsetPredictionStatistics_.totalVelocityError += velocityError;
+    predictionState_ = kPredictionSettled;
+    
+    if(velocityError <= kPositionTrackerOnsetPredictionVelocityTolerance) {
+        onsetPredictionStatistics_.confirmed++;
+        notifyFeature(KeyPositionTrackerNotification::kNotificationTypePredictionConfirmed, timestamp);
+    }
+    else {
+        TOUCHKEY_LOG(kLogLevelDebug, "onset prediction corrected: velocity {} predicted {}") << measured.second << predictedVelocity_.second;
+        onsetPredictionStatistics_.corrected++;
+        notifyFeature(KeyPositionTrackerNotification::kNotificationTypePredictionCorrected, timestamp);
+    }
+}
+
+// Give up on a pending prediction
+void KeyPositionTracker::cancelPrediction(timestamp_type timestamp, bool notify) {
+    if(predictionState_ != kPredictionPending)
+        return;
+    
+    onsetPredictionStatistics_.cancelled++;
+    predictionState_ = kPredictionSettled;
+    if(notify)
+        notifyFeature(KeyPositionTrackerNotification::kNotificationTypePredictionCancelled, timestamp);
+}
+
+// Advance each feature calculation by the newest sample. Queries catch up the same
+// way, so this just spreads the work out to one sample at a time.
+void KeyPositionTracker::updateFeatures() {
+    if(!missing_value<timestamp_type>::isMissing(startTimestamp_)) {
+        advanceCrossingScan(pressVelocityScan_, startIndex_, pressVelocityEscapementPosition_, true,
+                            kPositionTrackerSamplesNeededForPressVelocityAfterEscapement);
+        
+        if(keyBuffer_.beginIndex() <= startIndex_ - 1) {
+            key_buffer_index limit = keyBuffer_.endIndex();
+            if(pressIndex_ != 0 && pressIndex_ < limit)
+                limit = pressIndex_;
+            advancePercussivenessScan(percussivenessScan_, limit);
+        }
+    }
+    if(!missing_value<timestamp_type>::isMissing(releaseBeginTimestamp_)) {
+        advanceCrossingScan(releaseVelocityScan_, releaseBeginIndex_, releaseVelocityEscapementPosition_, false,
+                            kPositionTrackerSamplesNeededForReleaseVelocityAfterEscapement);
+    }
+}
+
+// Look at any samples the crossing search hasn't seen yet. Pressing looks for the
+// position rising past the threshold, otherwise falling below it. The velocity is an average
+// of 2 samples before the crossing and samplesAfterCrossing after it.
+void KeyPositionTracker::advanceCrossingScan(CrossingScan& scan, key_buffer_index anchor, key_position threshold,
+                                             bool pressing, int samplesAfterCrossing) {
+    key_buffer_index first = anchor;
+    if(first < keyBuffer_.beginIndex() + 2)
+        first = keyBuffer_.beginIndex() + 2;
+    
+    // Start again if looking for something else, or if the crossing has dropped out of
+    // the buffer (in which case the first crossing still in it is wanted)
+    if(!scan.engaged || scan.anchor != anchor || scan.threshold != threshold ||
+       (scan.crossing != 0 && scan.crossing < first)) {
+        scan.engaged = true;
+        scan.anchor = anchor;
+        scan.threshold = threshold;
+        scan.next = first;
+        scan.crossing = 0;
+    }
+    else if(scan.next < first)
+        scan.next = first;
+    
+    while(scan.crossing == 0 && scan.next < keyBuffer_.endIndex() - samplesAfterCrossing) {
+        key_buffer_index index = scan.next++;
+        
+        if(pressing ? (keyBuffer_[index] > threshold) : (keyBuffer_[index] < threshold)) {
+            // Found the place the position crosses the indicated threshold
+            // Now find the exact (interpolated) timestamp and velocity
+            timestamp_type exactTimestamp = keyBuffer_.timestampAt(index); // TODO
+            
+            key_position diffPosition = keyBuffer_[index + samplesAfterCrossing] - keyBuffer_[index - 2];
+            timestamp_diff_type diffTimestamp = keyBuffer_.timestampAt(index + samplesAfterCrossing) - keyBuffer_.timestampAt(index - 2);
+            key_velocity velocity = calculate_key_velocity(diffPosition, diffTimestamp);
+            
+            if(!pressing)
+                TOUCHKEY_LOG(kLogLevelTrace, "found release velocity {}(diffp {}, diffT {})") << velocity << diffPosition << diffTimestamp;
+            
+            scan.crossing = index;
+            scan.velocity = std::pair<timestamp_type, key_velocity>(exactTimestamp, velocity);
+        }
+    }
+}
+
+// Take the samples up to limit into the percussiveness features. Starts again if the
+// press start has moved, or if samples already taken in turn out to be past the limit
+// (when the end of the press is found after the fact).
+void KeyPositionTracker::advancePercussivenessScan(PercussivenessScan& scan, key_buffer_index limit) {
+    if(!scan.engaged || scan.anchor != startIndex_ || scan.next > limit) {
+        scan.engaged = true;
+        scan.anchor = scan.next = startIndex_;
+        scan.finished = false;
+        scan.maximumVelocity = scan.largestVelocityDifference = scale_key_velocity(0);
+        scan.maximumVelocityIndex = scan.largestVelocityDifferenceIndex = startIndex_;
+        scan.startTimestamp = keyBuffer_.timestampAt(startIndex_);
+        scan.maximumVelocityTimestamp = scan.largestVelocityDifferenceTimestamp = scan.startTimestamp;
+        scan.totalArea = scan.areaSinceMaximum = scale_key_velocity(0);
+        scan.areaPrecedingSpike = scan.areaFollowingSpike = scale_key_velocity(0);
+        
+        TOUCHKEY_LOG(kLogLevelTrace, "*** start index {}") << startIndex_;
+    }
+    
+    while(!scan.finished && scan.next < limit) {
+        key_buffer_index index = scan.next++;
+        
+        key_position diffPosition = keyBuffer_[index] - keyBuffer_[index - 1];
+        timestamp_diff_type diffTimestamp = keyBuffer_.timestampAt(index) - keyBuffer_.timestampAt(index - 1);
+        key_velocity velocity = calculate_key_velocity(diffPosition, diffTimestamp);
+        
+        // Look for maximum of velocity
+        if(velocity > scan.maximumVelocity) {
+            scan.maximumVelocity = velocity;
+            scan.maximumVelocityIndex = index;
+            scan.maximumVelocityTimestamp = keyBuffer_.timestampAt(index);
+            scan.areaPrecedingSpike = scan.totalArea;
+            scan.areaSinceMaximum = scale_key_velocity(0);
+            TOUCHKEY_LOG(kLogLevelTrace, "*** found new max velocity {} at index {}") << scan.maximumVelocity << index;
+        }
+        
+        // And given the difference between the max and the current sample,
+        // look for the largest rebound (velocity hitting a peak and falling)
+        if(scan.maximumVelocity - velocity > scan.largestVelocityDifference) {
+            scan.largestVelocityDifference = scan.maximumVelocity - velocity;
+            scan.largestVelocityDifferenceIndex = index;
+            scan.largestVelocityDifferenceTimestamp = keyBuffer_.timestampAt(index);
+            scan.areaFollowingSpike = scan.areaSinceMaximum;
+            TOUCHKEY_LOG(kLogLevelTrace, "*** found new diff velocity {} at index {}") << scan.largestVelocityDifference << index;
+        }
+        
+        scan.totalArea += velocity;
+        scan.areaSinceMaximum += velocity;
+        
+        // Only look at the early part of the key press: if the key position
+        // makes it more than a certain amount down, assume the initial spike
+        // has passed and finish up. But always allow at least 5 points for the
+        // fastest key presses to be considered.
+        if(index - startIndex_ >= 4 && keyBuffer_[index] > kPositionTrackerPositionThresholdForPercussivenessCalculation)
+            scan.finished = true;
+    }
+}
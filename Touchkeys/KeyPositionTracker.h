@@ -49,6 +49,16 @@ const key_position kPositionTrackerPositionThresholdForPercussivenessCalculation
 const int kPositionTrackerSamplesNeededForPressVelocityAfterEscapement = 1;
 const int kPositionTrackerSamplesNeededForReleaseVelocityAfterEscapement = 1;
 
+// Constants for onset prediction. A quadratic fit to the most recent samples forecasts when
+// and how fast the key will reach the escapement position; a prediction is only made once
+// the key is well on its way down and the forecast crossing is close.
+const int kPositionTrackerSamplesForOnsetPrediction = 6;
+const key_position kPositionTrackerMinimumPositionForOnsetPrediction = scale_key_position(0.3);
+const key_velocity kPositionTrackerMinimumVelocityForOnsetPrediction = scale_key_velocity(5.0);
+const timestamp_diff_type kPositionTrackerOnsetPredictionHorizon = microseconds_to_timestamp(5000);
+const timestamp_diff_type kPositionTrackerOnsetPredictionTimeout = microseconds_to_timestamp(20000);  // Late arrival at escapement
+const float kPositionTrackerOnsetPredictionVelocityTolerance = 0.2;     // Relative error for a confirmed prediction
+
 // KeyPositionTrackerNotification
 //
 // This class contains information on the notifications sent and stored by
@@ -62,7 +72,11 @@ public:
         kNotificationTypeFeatureAvailableReleaseVelocity,
         kNotificationTypeFeatureAvailablePercussiveness,
         kNotificationTypeNewMinimum,
-        kNotificationTypeNewMaximum
+        kNotificationTypeNewMaximum,
+        kNotificationTypePredictedVelocity,         // Provisional onset, see KeyPositionTracker::predictedPressVelocity()
+        kNotificationTypePredictionConfirmed,       // The measured velocity agreed with the prediction
+        kNotificationTypePredictionCorrected,       // The measured velocity differed: use pressVelocity()
+        kNotificationTypePredictionCancelled        // The key turned back before reaching escapement
     };
     
     enum {
@@ -126,6 +140,19 @@ public:
         key_velocity areaFollowingSpike;        // Total sum of velocity values from max to min
     };
     
+    // Running totals on how well onset prediction is doing. Each prediction ends up
+    // confirmed, corrected or cancelled; presses with no prediction count as missed.
+    struct OnsetPredictionStatistics {
+        unsigned long predictions;              // Provisional onsets sent
+        unsigned long confirmed;                // Measured velocity within tolerance of the prediction
+        unsigned long corrected;                // Key pressed, but at a different velocity
+        unsigned long cancelled;                // Key never reached escapement
+        unsigned long missed;                   // Presses that arrived without a prediction
+        timestamp_diff_type totalLeadTime;      // Time gained over the measured velocity (confirmed + corrected)
+        timestamp_diff_type totalTimingError;   // Absolute error in the escapement time (confirmed + corrected)
+        float totalVelocityError;               // Relative error in the velocity (confirmed + corrected)
+    };
+    
 public:
 	// ***** Constructors *****
 	
@@ -171,6 +198,8 @@ public:
     
     // Velocity for onset and release. The values without an argument use the stored
     // current escapement point (which is also used for notification of availability).
+    // These, and percussiveness, are accumulated as samples arrive, so asking for them
+    // repeatedly during a press costs nothing.
     std::pair<timestamp_type, key_velocity> pressVelocity();
     std::pair<timestamp_type, key_velocity> releaseVelocity();
     
@@ -197,6 +226,22 @@ public:
     // Percussiveness (struck vs. pressed keys)
     PercussivenessFeatures pressPercussiveness();
     
+    // ***** Onset Prediction *****
+    //
+    // When enabled, fast presses get a kNotificationTypePredictedVelocity notification a few
+    // milliseconds before the velocity can be measured, followed later by one saying whether
+    // the prediction was confirmed, corrected or cancelled. The usual velocity notification
+    // is sent as before.
+    bool onsetPredictionEnabled() { return onsetPredictionEnabled_; }
+    void setOnsetPredictionEnabled(bool enable) { onsetPredictionEnabled_ = enable; }
+    
+    // Forecast escapement time and velocity for the current press (missing if none)
+    std::pair<timestamp_type, key_velocity> predictedPressVelocity();
+    
+    // Statistics survive reset(), so they cover every press since they were last cleared
+    OnsetPredictionStatistics const& onsetPredictionStatistics() { return onsetPredictionStatistics_; }
+    void clearOnsetPredictionStatistics();
+    
 	// ***** Modifiers *****
     
     // Register for updates from the key positon buffer
@@ -215,6 +260,49 @@ public:
 	void triggerReceived(TriggerSource* who, timestamp_type timestamp);
 	
 private:
+    // Progress of onset prediction through a press
+    enum {
+        kPredictionNone = 0,                // Nothing predicted yet
+        kPredictionPending,                 // Provisional onset sent, waiting for the measurement
+        kPredictionSettled                  // Confirmed, corrected or cancelled
+    };
+    
+    // Search for the sample where the key first crosses a threshold after an anchor point
+    // (press start or release start), kept up to date one sample at a time. It starts
+    // again only if the anchor or threshold changes.
+    struct CrossingScan {
+        CrossingScan() : engaged(false), anchor(0), threshold(0), next(0), crossing(0) {}
+        
+        bool engaged;                       // Whether the fields below belong to a search
+        key_buffer_index anchor;            // Where the search starts
+        key_position threshold;             // Position being looked for
+        key_buffer_index next;              // Next sample to look at
+        key_buffer_index crossing;          // First sample past the threshold, or 0 if none yet
+        std::pair<timestamp_type, key_velocity> velocity;  // Velocity at the crossing
+    };
+    
+    // Running percussiveness features from the start of a press: the velocity spike
+    // and the areas either side of it, accumulated sample by sample
+    struct PercussivenessScan {
+        PercussivenessScan() : engaged(false), anchor(0), next(0), finished(false) {}
+        
+        bool engaged;
+        key_buffer_index anchor;            // Press start
+        key_buffer_index next;              // Next sample to look at
+        bool finished;                      // The key has gone past the initial spike
+        key_velocity maximumVelocity;
+        key_buffer_index maximumVelocityIndex;
+        timestamp_type maximumVelocityTimestamp;
+        key_velocity largestVelocityDifference;
+        key_buffer_index largestVelocityDifferenceIndex;
+        timestamp_type largestVelocityDifferenceTimestamp;
+        timestamp_type startTimestamp;
+        key_velocity totalArea;             // Velocities summed from the start...
+        key_velocity areaSinceMaximum;      // ...and from the maximum, up to here
+        key_velocity areaPrecedingSpike;    // Area from the start to the maximum
+        key_velocity areaFollowingSpike;    // Area from the maximum to the largest difference
+    };
+    
     // ***** Internal Helper Methods *****
     
     // Change the current state
@@ -233,6 +321,19 @@ private:
     // Look for the crossing of the release velocity threshold to prepare to send the feature
     void prepareReleaseVelocityFeature(KeyPositionTracker::key_buffer_index mostRecentIndex, timestamp_type timestamp);
     
+    // Fit the recent trajectory and send a provisional onset if escapement is near
+    void predictOnset(timestamp_type timestamp);
+    
+    // Settle a pending prediction against the measured velocity, or call it off
+    void confirmPrediction(timestamp_type timestamp);
+    void cancelPrediction(timestamp_type timestamp, bool notify);
+    
+    // Bring the feature searches up to date with the key buffer
+    void updateFeatures();
+    void advanceCrossingScan(CrossingScan& scan, key_buffer_index anchor, key_position threshold,
+                             bool pressing, int samplesAfterCrossing);
+    void advancePercussivenessScan(PercussivenessScan& scan, key_buffer_index limit);
+    
 	// ***** Member Variables *****
 	
 	Node<key_position>& keyBuffer_;		// Raw key position data
@@ -266,6 +367,19 @@ private:
     bool releaseVelocityWaitingForThresholdCross_;              // Set to true if we need to look for release escapement cross
     key_buffer_index percussivenessAvailableIndex_;             // When we can calculate percussiveness features
     
+    // Feature calculations in progress for the current press
+    CrossingScan pressVelocityScan_;
+    CrossingScan releaseVelocityScan_;
+    PercussivenessScan percussivenessScan_;
+    
+    // Onset prediction
+    bool onsetPredictionEnabled_;                               // Whether to predict onsets at all
+    int predictionState_;                                       // kPrediction... for the current press
+    timestamp_type predictionTimestamp_;                        // When the prediction was made
+    key_position predictionPosition_;                           // Key position at the time
+    std::pair<timestamp_type, key_velocity> predictedVelocity_; // Forecast escapement time and velocity
+    OnsetPredictionStatistics onsetPredictionStatistics_;
+    
     /*
     typedef struct {
 		int runningSum;						// sum of last N points (i.e. mean * N)
@@ -0,0 +1,232 @@
+//
+//  KeyboardGestureDetector.cpp
+//  touchkeys
+//
+
+#include "KeyboardGestureDetector.h"
+#include "PianoKey.h"
+#include <algorithm>
+#include <cstdlib>
+
+// Constructor
+KeyboardGestureDetector::KeyboardGestureDetector(KeyboardStateTable& stateTable)
+: Node<KeyboardGestureEvent>(kKeyboardGestureHistoryLength), stateTable_(stateTable),
+  lowestNote_(0), highestNote_(-1)
+{
+    resetState();
+}
+
+// Set the range of notes to watch
+void KeyboardGestureDetector::setKeyboardRange(int lowest, int highest) {
+    if(lowest < 0)
+        lowest = 0;
+    if(highest >= kKeyboardStateTableNotes)
+        highest = kKeyboardStateTableNotes - 1;
+
+    boost::mutex::scoped_lock lock(mutex_);
+    lowestNote_ = lowest;
+    highestNote_ = highest;
+    resetState();
+}
+
+// Forget any gestures in progress. The event history is kept so that anyone
+// following it doesn't lose their place.
+void KeyboardGestureDetector::reset() {
+    boost::mutex::scoped_lock lock(mutex_);
+    resetState();
+}
+
+void KeyboardGestureDetector::resetState() {
+    for(int note = 0; note < kKeyboardStateTableNotes; note++) {
+        previousTrackerState_[note] = kPositionTrackerStateUnknown;
+        partialPressTimestamp_[note] = 0;
+        inCluster_[note] = false;
+    }
+    chordCount_ = 0;
+    glissandoCount_ = 0;
+    latestTimestamp_ = 0;
+}
+
+// One pass over the keyboard: find the presses that began since the last frame,
+// check each new partial press for a neighbour to bend, and find the runs of
+// adjacent keys that are down. Then bring the chord and glissando in progress up to date.
+void KeyboardGestureDetector::evaluate() {
+    boost::mutex::scoped_lock lock(mutex_);
+    int keyCount = highestNote_ - lowestNote_ + 1;
+    if(keyCount <= 0)
+        return;
+
+    KeyStateSnapshot snapshots[kKeyboardStateTableNotes];
+    Onset onsets[kKeyboardStateTableNotes];
+    int onsetCount = 0;
+    int runStart = -1;
+
+    stateTable_.read(lowestNote_, keyCount, snapshots);
+
+    for(int i = 0; i <= keyCount; i++) {
+        int note = lowestNote_ + i;
+        bool isDown = false;
+
+        if(i < keyCount) {
+            const KeyStateSnapshot& key = snapshots[i];
+            int previousState = previousTrackerState_[note];
+
+            if(key.timestamp > latestTimestamp_)
+                latestTimestamp_ = key.timestamp;
+
+            // A new press on this key
+            if(isPressing(key.trackerState) && !isPressing(previousState)) {
+                onsets[onsetCount].note = note;
+                onsets[onsetCount].timestamp = key.stateTimestamp;
+                onsetCount++;
+            }
+
+            // A new partial press bends any neighbour that was already down when it began
+            if(isPartialPress(key.trackerState) && !isPartialPress(previousState)) {
+                partialPressTimestamp_[note] = key.stateTimestamp;
+
+                for(int neighbor = note - kKeyboardGesturePitchBendRange; neighbor <= note + kKeyboardGesturePitchBendRange; neighbor++) {
+                    if(neighbor == note || neighbor < lowestNote_ || neighbor > highestNote_)
+                        continue;
+                    const KeyStateSnapshot& neighborKey = snapshots[neighbor - lowestNote_];
+                    if(neighborKey.keyState == kKeyStateActive && neighborKey.trackerState == kPositionTrackerStateDown &&
+                       partialPressTimestamp_[note] > neighborKey.stateTimestamp) {
+                        publish(KeyboardGestureEvent::kGesturePitchBend, note, neighbor, std::min(note, neighbor),
+                                std::max(note, neighbor), 2, key.stateTimestamp);
+                    }
+                }
+            }
+
+            isDown = (key.trackerState == kPositionTrackerStatePressInProgress ||
+                      key.trackerState == kPositionTrackerStateDown);
+            previousTrackerState_[note] = key.trackerState;
+        }
+
+        // Runs of adjacent keys that are down. A run is reported when it first
+        // reaches the minimum size, and again if it takes in keys it didn't have.
+        if(isDown) {
+            if(runStart < 0)
+                runStart = note;
+        }
+        else if(runStart >= 0) {
+            int runLength = note - runStart;
+            bool isNew = false;
+
+            for(int n = runStart; n < note; n++) {
+                if(runLength >= kKeyboardGestureClusterMinimumKeys && !inCluster_[n])
+                    isNew = true;
+                inCluster_[n] = (runLength >= kKeyboardGestureClusterMinimumKeys);
+            }
+            if(isNew)
+                publish(KeyboardGestureEvent::kGestureCluster, runStart, note - 1, runStart, note - 1, runLength, latestTimestamp_);
+            runStart = -1;
+        }
+        if(!isDown && i < keyCount)
+            inCluster_[note] = false;
+    }
+
+    // Onsets were found in note order; the windows need them in time order
+    for(int i = 1; i < onsetCount; i++) {
+        Onset onset = onsets[i];
+        int j = i;
+        while(j > 0 && onsets[j - 1].timestamp > onset.timestamp) {
+            onsets[j] = onsets[j - 1];
+            j--;
+        }
+        onsets[j] = onset;
+    }
+    for(int i = 0; i < onsetCount; i++)
+        addOnset(onsets[i].note, onsets[i].timestamp);
+
+    // Close the chord and glissando if their time has run out
+    if(chordCount_ > 0 && latestTimestamp_ - chordOnsets_[0].timestamp > kKeyboardGestureChordWindow)
+        finishChord();
+    if(glissandoCount_ > 0 && latestTimestamp_ - glissandoLastTimestamp_ > kKeyboardGestureGlissandoInterval)
+        finishGlissando();
+}
+
+// Whether the tracker state means the key is on its way down or there
+bool KeyboardGestureDetector::isPressing(int trackerState) {
+    return (trackerState == kPositionTrackerStatePartialPressAwaitingMax ||
+            trackerState == kPositionTrackerStatePartialPressFoundMax ||
+            trackerState == kPositionTrackerStatePressInProgress ||
+            trackerState == kPositionTrackerStateDown);
+}
+
+bool KeyboardGestureDetector::isPartialPress(int trackerState) {
+    return (trackerState == kPositionTrackerStatePartialPressAwaitingMax ||
+            trackerState == kPositionTrackerStatePartialPressFoundMax);
+}
+
+// Add a new press to the chord and glissando in progress, finishing either one
+// if the press doesn't belong to it
+void KeyboardGestureDetector::addOnset(int note, timestamp_type timestamp) {
+    if(chordCount_ > 0 && timestamp - chordOnsets_[0].timestamp > kKeyboardGestureChordWindow)
+        finishChord();
+    if(chordCount_ < kKeyboardGestureMaxPendingOnsets) {
+        chordOnsets_[chordCount_].note = note;
+        chordOnsets_[chordCount_].timestamp = timestamp;
+        chordCount_++;
+    }
+
+    if(glissandoCount_ > 0) {
+        int step = note - glissandoLastNote_;
+        int direction = (step > 0) ? 1 : -1;
+
+        if(step != 0 && abs(step) <= kKeyboardGestureGlissandoMaximumStep &&
+           (glissandoDirection_ == 0 || direction == glissandoDirection_) &&
+           timestamp - glissandoLastTimestamp_ <= kKeyboardGestureGlissandoInterval) {
+            glissandoDirection_ = direction;
+            glissandoLastNote_ = note;
+            glissandoLastTimestamp_ = timestamp;
+            glissandoLowNote_ = std::min(glissandoLowNote_, note);
+            glissandoHighNote_ = std::max(glissandoHighNote_, note);
+            glissandoCount_++;
+            return;
+        }
+        finishGlissando();
+    }
+
+    glissandoFirstNote_ = glissandoLastNote_ = glissandoLowNote_ = glissandoHighNote_ = note;
+    glissandoFirstTimestamp_ = glissandoLastTimestamp_ = timestamp;
+    glissandoDirection_ = 0;
+    glissandoCount_ = 1;
+}
+
+// Report the chord in progress if it had enough keys
+void KeyboardGestureDetector::finishChord() {
+    if(chordCount_ >= kKeyboardGestureChordMinimumKeys) {
+        int lowNote = chordOnsets_[0].note, highNote = chordOnsets_[0].note;
+        for(int i = 1; i < chordCount_; i++) {
+            lowNote = std::min(lowNote, chordOnsets_[i].note);
+            highNote = std::max(highNote, chordOnsets_[i].note);
+        }
+        publish(KeyboardGestureEvent::kGestureChord, lowNote, highNote, lowNote, highNote, chordCount_,
+                chordOnsets_[0].timestamp);
+    }
+    chordCount_ = 0;
+}
+
+// Report the glissando in progress if it had enough keys and was slower than a chord
+void KeyboardGestureDetector::finishGlissando() {
+    if(glissandoCount_ >= kKeyboardGestureGlissandoMinimumKeys &&
+       glissandoLastTimestamp_ - glissandoFirstTimestamp_ > kKeyboardGestureChordWindow) {
+        publish(KeyboardGestureEvent::kGestureGlissando, glissandoFirstNote_, glissandoLastNote_,
+                glissandoLowNote_, glissandoHighNote_, glissandoCount_, glissandoFirstTimestamp_);
+    }
+    glissandoCount_ = 0;
+}
+
+// Add an event to the history, notifying anyone listening
+void KeyboardGestureDetector::publish(int type, int note, int otherNote, int lowNote, int highNote, int count,
+                                      timestamp_type timestamp) {
+    KeyboardGestureEvent event;
+
+    event.type = type;
+    event.note = note;
+    event.otherNote = otherNote;
+    event.lowNote = lowNote;
+    event.highNote = highNote;
+    event.count = count;
+    insert(event, timestamp);
+}
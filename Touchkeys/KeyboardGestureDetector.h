@@ -0,0 +1,111 @@
+//
+//  KeyboardGestureDetector.h
+//  touchkeys
+//
+
+#ifndef __touchkeys__KeyboardGestureDetector__
+#define __touchkeys__KeyboardGestureDetector__
+
+#include <boost/thread/mutex.hpp>
+#include "Node.h"
+#include "KeyboardStateTable.h"
+
+const int kKeyboardGestureHistoryLength = 64;
+const int kKeyboardGestureMaxPendingOnsets = 32;
+const timestamp_diff_type kKeyboardGestureChordWindow = microseconds_to_timestamp(30000);      // Onsets this close form a chord
+const int kKeyboardGestureChordMinimumKeys = 3;
+const timestamp_diff_type kKeyboardGestureGlissandoInterval = microseconds_to_timestamp(80000); // Longest gap between glissando notes
+const int kKeyboardGestureGlissandoMaximumStep = 2;                                            // Semitones between successive notes
+const int kKeyboardGestureGlissandoMinimumKeys = 4;
+const int kKeyboardGestureClusterMinimumKeys = 3;                                              // Adjacent keys down together
+const int kKeyboardGesturePitchBendRange = 2;                                                  // Semitones to search for a bend partner
+
+// A gesture involving more than one key
+struct KeyboardGestureEvent {
+    enum {
+        kGestureChord = 1,          // count keys pressed together, lowNote to highNote
+        kGesturePitchBend,          // note is pressed while its neighbour otherNote is down: note bends otherNote
+        kGestureGlissando,          // count keys pressed in turn, from note to otherNote
+        kGestureCluster             // count adjacent keys down at once, lowNote to highNote
+    };
+
+    int type;
+    int note, otherNote;            // For pitch bends and glissandi
+    int lowNote, highNote;          // Range of keys involved
+    int count;                      // Number of keys involved
+};
+
+/*
+ * KeyboardGestureDetector
+ *
+ * Looks for gestures involving several keys: chords, pitch bends between
+ * neighbouring keys, glissandi and clusters. It runs once per frame over the
+ * KeyboardStateTable, in one pass over the keyboard, finding the keys whose
+ * presses began in the frame and the runs of adjacent keys that are down. Chords and
+ * glissandi are tracked incrementally from those onsets and reported once they end.
+ *
+ * Gestures are published as a Node of KeyboardGestureEvents. Anyone interested
+ * (e.g. a mapping) keeps its own index into the history and reads the events it
+ * hasn't seen yet, the same way it would follow any other buffer.
+ *
+ * Each device's I/O thread evaluates at the end of its frames, so evaluation is
+ * serialised by a mutex; whichever thread gets there sees every key's latest state.
+ */
+
+class KeyboardGestureDetector : public Node<KeyboardGestureEvent> {
+public:
+    // ***** Constructor *****
+    KeyboardGestureDetector(KeyboardStateTable& stateTable);
+
+    // ***** Modifiers *****
+
+    // Range of MIDI notes to watch
+    void setKeyboardRange(int lowest, int highest);
+
+    // Forget everything in progress
+    void reset();
+
+    // ***** Evaluation *****
+
+    // Look at the latest state of every key, publishing any gestures found
+    void evaluate();
+
+private:
+    // A key whose press began during the frame being evaluated
+    struct Onset {
+        int note;
+        timestamp_type timestamp;
+    };
+
+    // Clear the gestures in progress, with the mutex held
+    void resetState();
+
+    bool isPressing(int trackerState);
+    bool isPartialPress(int trackerState);
+    void addOnset(int note, timestamp_type timestamp);
+    void finishChord();
+    void finishGlissando();
+    void publish(int type, int note, int otherNote, int lowNote, int highNote, int count, timestamp_type timestamp);
+
+    KeyboardStateTable& stateTable_;
+    int lowestNote_, highestNote_;
+    boost::mutex mutex_;                                             // Several I/O threads evaluate
+
+    // State of each key at the previous frame, by MIDI note
+    int previousTrackerState_[kKeyboardStateTableNotes];
+    timestamp_type partialPressTimestamp_[kKeyboardStateTableNotes];  // When the current partial press began
+    bool inCluster_[kKeyboardStateTableNotes];                       // Part of a cluster already reported
+
+    // Chord in progress: onsets within the window of the first
+    Onset chordOnsets_[kKeyboardGestureMaxPendingOnsets];
+    int chordCount_;
+
+    // Glissando in progress
+    int glissandoFirstNote_, glissandoLastNote_, glissandoDirection_, glissandoCount_;
+    int glissandoLowNote_, glissandoHighNote_;
+    timestamp_type glissandoFirstTimestamp_, glissandoLastTimestamp_;
+
+    timestamp_type latestTimestamp_;                                 // Newest sample seen on any key
+};
+
+#endif /* defined(__touchkeys__KeyboardGestureDetector__) */
@@ -0,0 +1,264 @@
+//
+//  KeyboardIdleDetector.cpp
+//  touchkeys
+//
+
+#include "KeyboardIdleDetector.h"
+#include <cmath>
+#include <cstring>
+
+// Constructor
+KeyboardIdleDetector::KeyboardIdleDetector() {
+    setNumberOfKeys(0);
+}
+
+// Set how many keys there are, forgetting everything about the previous ones
+void KeyboardIdleDetector::setNumberOfKeys(int keys) {
+    boost::mutex::scoped_lock lock(mutex_);
+
+    if(keys < 0)
+        keys = 0;
+    if(keys > kKeyboardIdleDetectorMaxKeys)
+        keys = kKeyboardIdleDetectorMaxKeys;
+    numberOfKeys_ = keys;
+    lowestPendingKey_ = kKeyboardIdleDetectorMaxKeys;
+    highestPendingKey_ = -1;
+    candidateCount_ = 0;
+
+    memset(history_, 0, sizeof(history_));
+    memset(sum_, 0, sizeof(sum_));
+    memset(latest_, 0, sizeof(latest_));
+    memset(count_, 0, sizeof(count_));
+    memset(slot_, 0, sizeof(slot_));
+    memset(framesWithoutActivity_, 0, sizeof(framesWithoutActivity_));
+    memset(pending_, 0, sizeof(pending_));
+    memset(detectors_, 0, sizeof(detectors_));
+    for(int key = 0; key < kKeyboardIdleDetectorMaxKeys; key++) {
+        idleState_[key] = kIdleDetectorUnknown;
+        timestamp_[key] = 0;
+        keyIdleThreshold_[key] = kDefaultKeyIdleThreshold;
+        activityThreshold_[key] = 0;
+        noActivityCounterThreshold_[key] = 0;
+    }
+}
+
+// Make room for more keys without disturbing the ones already here
+void KeyboardIdleDetector::growKeys(int keysBelow, int keysAbove) {
+    boost::mutex::scoped_lock lock(mutex_);
+
+    if(keysBelow < 0)
+        keysBelow = 0;
+    if(keysAbove < 0)
+        keysAbove = 0;
+    if(numberOfKeys_ + keysBelow > kKeyboardIdleDetectorMaxKeys)
+        keysBelow = kKeyboardIdleDetectorMaxKeys - numberOfKeys_;
+    if(numberOfKeys_ + keysBelow + keysAbove > kKeyboardIdleDetectorMaxKeys)
+        keysAbove = kKeyboardIdleDetectorMaxKeys - numberOfKeys_ - keysBelow;
+
+    for(int sample = 0; sample < kKeyIdleNumSamples; sample++)
+        shiftKeys(history_[sample], keysBelow, (key_position)0);
+    shiftKeys(sum_, keysBelow, (key_position)0);
+    shiftKeys(latest_, keysBelow, (key_position)0);
+    shiftKeys(timestamp_, keysBelow, (timestamp_type)0);
+    shiftKeys(count_, keysBelow, 0);
+    shiftKeys(slot_, keysBelow, 0);
+    shiftKeys(framesWithoutActivity_, keysBelow, 0);
+    shiftKeys(idleState_, keysBelow, (int)kIdleDetectorUnknown);
+    shiftKeys(pending_, keysBelow, false);
+    shiftKeys(keyIdleThreshold_, keysBelow, kDefaultKeyIdleThreshold);
+    shiftKeys(activityThreshold_, keysBelow, (key_position)0);
+    shiftKeys(noActivityCounterThreshold_, keysBelow, 0);
+    shiftKeys(detectors_, keysBelow, (KeyIdleDetector*)0);
+
+    if(highestPendingKey_ >= 0) {
+        lowestPendingKey_ += keysBelow;
+        highestPendingKey_ += keysBelow;
+    }
+    numberOfKeys_ += keysBelow + keysAbove;
+}
+
+template<typename T>
+void KeyboardIdleDetector::shiftKeys(T *values, int offset, T fill) {
+    for(int key = numberOfKeys_ - 1; key >= 0; key--)
+        values[key + offset] = values[key];
+    for(int key = 0; key < offset; key++)
+        values[key] = fill;
+}
+
+// Take over evaluation for one key
+void KeyboardIdleDetector::attach(int key, KeyIdleDetector* detector) {
+    if(key < 0 || key >= numberOfKeys_ || detector == 0)
+        return;
+
+    detector->detach();
+    clear(key);
+
+    boost::mutex::scoped_lock lock(mutex_);
+    detectors_[key] = detector;
+    keyIdleThreshold_[key] = detector->keyIdleThreshold();
+    activityThreshold_[key] = detector->activityThreshold();
+    noActivityCounterThreshold_[key] = detector->noActivityCounterThreshold();
+}
+
+// Forget a key's history
+void KeyboardIdleDetector::clear(int key) {
+    if(key < 0 || key >= numberOfKeys_)
+        return;
+
+    boost::mutex::scoped_lock lock(mutex_);
+    for(int sample = 0; sample < kKeyIdleNumSamples; sample++)
+        history_[sample][key] = 0;
+    sum_[key] = latest_[key] = 0;
+    count_[key] = slot_[key] = framesWithoutActivity_[key] = 0;
+    idleState_[key] = kIdleDetectorUnknown;
+}
+
+// Rebuild a key's history and running sum from the given samples
+void KeyboardIdleDetector::setHistory(int key, const key_position *positions, int count) {
+    if(key < 0 || key >= numberOfKeys_)
+        return;
+    if(count > kKeyIdleNumSamples) {
+        positions += count - kKeyIdleNumSamples;
+        count = kKeyIdleNumSamples;
+    }
+
+    boost::mutex::scoped_lock lock(mutex_);
+    sum_[key] = 0;
+    for(int i = 0; i < count; i++) {
+        history_[i][key] = positions[i];
+        sum_[key] += positions[i];
+    }
+    count_[key] = count;
+    slot_[key] = (count == kKeyIdleNumSamples) ? 0 : count;
+    if(count > 0)
+        latest_[key] = positions[count - 1];
+}
+
+// Add a sample to the key's history. Only a little bookkeeping happens here; the
+// thresholds are applied in evaluate().
+void KeyboardIdleDetector::insertSample(int key, key_position position, timestamp_type timestamp) {
+    if(key < 0 || key >= numberOfKeys_)
+        return;
+
+    KeyIdleDetector *changedDetectors[kKeyboardIdleDetectorMaxKeys];
+    int changedStates[kKeyboardIdleDetectorMaxKeys];
+    timestamp_type changedTimestamps[kKeyboardIdleDetectorMaxKeys];
+    int changedCount = 0;
+
+    mutex_.lock();
+
+    // A second sample before the frame was evaluated: evaluate it now
+    if(pending_[key])
+        changedCount = evaluatePendingKeys(changedDetectors, changedStates, changedTimestamps);
+
+    // Running sum of the last N samples, in the same order of operations as Accumulator
+    int slot = slot_[key];
+    key_position sum = position + sum_[key];
+    if(count_[key] >= kKeyIdleNumSamples)
+        sum -= history_[slot][key];
+    else
+        count_[key]++;
+    sum_[key] = sum;
+    history_[slot][key] = position;
+    slot_[key] = (slot + 1 == kKeyIdleNumSamples) ? 0 : slot + 1;
+    latest_[key] = position;
+    timestamp_[key] = timestamp;
+
+    // An idle key below its threshold can't change state, so it needn't be looked at
+    pending_[key] = true;
+    if(idleState_[key] != kIdleDetectorIdle || position >= keyIdleThreshold_[key])
+        candidateCount_++;
+    if(key < lowestPendingKey_)
+        lowestPendingKey_ = key;
+    if(key > highestPendingKey_)
+        highestPendingKey_ = key;
+
+    mutex_.unlock();
+
+    notify(changedCount, changedDetectors, changedStates, changedTimestamps);
+}
+
+// Evaluate the frame of samples that has arrived since the last call
+void KeyboardIdleDetector::evaluate() {
+    KeyIdleDetector *changedDetectors[kKeyboardIdleDetectorMaxKeys];
+    int changedStates[kKeyboardIdleDetectorMaxKeys];
+    timestamp_type changedTimestamps[kKeyboardIdleDetectorMaxKeys];
+    int changedCount;
+
+    mutex_.lock();
+    changedCount = evaluatePendingKeys(changedDetectors, changedStates, changedTimestamps);
+    mutex_.unlock();
+
+    notify(changedCount, changedDetectors, changedStates, changedTimestamps);
+}
+
+// The same rules as KeyIdleDetector::triggerReceived(), applied to a range of keys at
+// once. The averages and deviations are straight loops over the arrays, which the
+// compiler turns into vector instructions; only the final decisions are per key.
+int KeyboardIdleDetector::evaluatePendingKeys(KeyIdleDetector **changedDetectors, int *changedStates,
+                                              timestamp_type *changedTimestamps) {
+    int low = lowestPendingKey_, high = highestPendingKey_ + 1;
+    int changedCount = 0;
+
+    if(low >= high)
+        return 0;
+
+    if(candidateCount_ > 0) {
+        for(int key = low; key < high; key++) {
+            average_[key] = sum_[key] / (key_position)(count_[key] > 0 ? count_[key] : 1);
+            deviation_[key] = 0;
+        }
+        for(int sample = 0; sample < kKeyIdleNumSamples; sample++) {
+            const key_position *row = history_[sample];
+            for(int key = low; key < high; key++)
+                deviation_[key] += key_abs(row[key] - average_[key]);
+        }
+
+        for(int key = low; key < high; key++) {
+            if(!pending_[key] || count_[key] < kKeyIdleNumSamples)
+                continue;
+
+            int newState = idleState_[key];
+
+            if(idleState_[key] == kIdleDetectorIdle) {
+                // Go active once both the position and its average are clear of the threshold
+                if(latest_[key] >= keyIdleThreshold_[key] && average_[key] >= keyIdleThreshold_[key] * 2)
+                    newState = kIdleDetectorActive;
+            }
+            else if(average_[key] >= keyIdleThreshold_[key] * 2)
+                framesWithoutActivity_[key] = 0;
+            else if(deviation_[key] / kKeyIdleNumSamples < activityThreshold_[key]) {
+                // Flat for long enough near the resting position: back to idle
+                if(++framesWithoutActivity_[key] >= noActivityCounterThreshold_[key])
+                    newState = kIdleDetectorIdle;
+            }
+            else
+                framesWithoutActivity_[key] = 0;
+
+            if(newState != idleState_[key]) {
+                idleState_[key] = newState;
+                if(detectors_[key] != 0) {
+                    changedDetectors[changedCount] = detectors_[key];
+                    changedStates[changedCount] = newState;
+                    changedTimestamps[changedCount] = timestamp_[key];
+                    changedCount++;
+                }
+            }
+        }
+    }
+
+    for(int key = low; key < high; key++)
+        pending_[key] = false;
+    lowestPendingKey_ = kKeyboardIdleDetectorMaxKeys;
+    highestPendingKey_ = -1;
+    candidateCount_ = 0;
+
+    return changedCount;
+}
+
+// Tell each key's detector about its new state
+void KeyboardIdleDetector::notify(int count, KeyIdleDetector **changedDetectors, const int *changedStates,
+                                  const timestamp_type *changedTimestamps) {
+    for(int i = 0; i < count; i++)
+        changedDetectors[i]->setIdleState(changedStates[i], changedTimestamps[i]);
+}
@@ -0,0 +1,99 @@
+//
+//  KeyboardIdleDetector.h
+//  touchkeys
+//
+
+#ifndef __touchkeys__KeyboardIdleDetector__
+#define __touchkeys__KeyboardIdleDetector__
+
+#include <boost/thread/mutex.hpp>
+#include "KeyIdleDetector.h"
+
+const int kKeyboardIdleDetectorMaxKeys = 128;
+
+/*
+ * KeyboardIdleDetector
+ *
+ * Evaluates the KeyIdleDetector rules for every key of the keyboard at once. The
+ * recent positions and running sums of all keys are kept side by side, one array per
+ * quantity, so that a frame of samples is judged in a few straight passes over those
+ * arrays rather than through a chain of triggers per key per sample.
+ *
+ * Samples are added with insertSample() as they arrive and judged together by
+ * evaluate() at the end of each frame. If a key gets a second sample before the frame
+ * ends, the pending frame is evaluated first so nothing is lost. When no key is active
+ * or above its idle threshold, evaluate() returns without looking at anything.
+ *
+ * Each key's KeyIdleDetector is detached once attached here, and only hears about
+ * changes of state, which it passes on to its listeners as before.
+ */
+
+class KeyboardIdleDetector {
+public:
+    // ***** Constructor *****
+    KeyboardIdleDetector();
+
+    // ***** Keys *****
+    //
+    // Keys are numbered from 0 (the lowest note on the keyboard). The thresholds of the
+    // key's detector are copied when it is attached.
+    void setNumberOfKeys(int keys);
+    int numberOfKeys() { return numberOfKeys_; }
+
+    // Add keys below and above the existing ones, which keep their state and move up
+    // by keysBelow. The new keys are unknown until attached.
+    void growKeys(int keysBelow, int keysAbove);
+    void attach(int key, KeyIdleDetector* detector);
+
+    // Forget the history of one key, returning it to the unknown state
+    void clear(int key);
+
+    // Replace a key's recent history (oldest first, only the last N count), for keys that
+    // stopped sending samples here while idle. The state is unchanged.
+    void setHistory(int key, const key_position *positions, int count);
+
+    // ***** Evaluation *****
+
+    // Add the newest sample for a key
+    void insertSample(int key, key_position position, timestamp_type timestamp);
+
+    // Judge every key with a new sample, notifying those whose state changes
+    void evaluate();
+
+private:
+    // Apply the thresholds to the pending keys, with the mutex held. Returns how many
+    // keys changed state, listing them so they can be notified once the mutex is released.
+    int evaluatePendingKeys(KeyIdleDetector **changedDetectors, int *changedStates, timestamp_type *changedTimestamps);
+    void notify(int count, KeyIdleDetector **changedDetectors, const int *changedStates, const timestamp_type *changedTimestamps);
+
+    // Move the first numberOfKeys_ entries of a per-key array up by offset and fill the gap
+    template<typename T>
+    void shiftKeys(T *values, int offset, T fill);
+
+    boost::mutex mutex_;
+    int numberOfKeys_;
+    int lowestPendingKey_, highestPendingKey_;  // Range of keys waiting for evaluation
+    int candidateCount_;                        // Pending keys that might change state
+
+    // Per-key state, one array per quantity
+    key_position history_[kKeyIdleNumSamples][kKeyboardIdleDetectorMaxKeys];  // Last N samples
+    key_position sum_[kKeyboardIdleDetectorMaxKeys];            // Running sum of the above
+    key_position latest_[kKeyboardIdleDetectorMaxKeys];         // Newest sample
+    key_position average_[kKeyboardIdleDetectorMaxKeys];        // Scratch for evaluation
+    key_position deviation_[kKeyboardIdleDetectorMaxKeys];
+    timestamp_type timestamp_[kKeyboardIdleDetectorMaxKeys];    // Time of the newest sample
+    int count_[kKeyboardIdleDetectorMaxKeys];                   // Samples in the sum, up to N
+    int slot_[kKeyboardIdleDetectorMaxKeys];                    // Where the next sample goes
+    int framesWithoutActivity_[kKeyboardIdleDetectorMaxKeys];
+    int idleState_[kKeyboardIdleDetectorMaxKeys];
+    bool pending_[kKeyboardIdleDetectorMaxKeys];                // New sample since the last evaluation
+
+    // Thresholds, as in KeyIdleDetector
+    key_position keyIdleThreshold_[kKeyboardIdleDetectorMaxKeys];
+    key_position activityThreshold_[kKeyboardIdleDetectorMaxKeys];
+    int noActivityCounterThreshold_[kKeyboardIdleDetectorMaxKeys];
+
+    KeyIdleDetector* detectors_[kKeyboardIdleDetectorMaxKeys];
+};
+
+#endif /* defined(__touchkeys__KeyboardIdleDetector__) */
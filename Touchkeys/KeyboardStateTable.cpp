@@ -0,0 +1,161 @@
+//
+//  KeyboardStateTable.cpp
+//  touchkeys
+//
+
+#include "KeyboardStateTable.h"
+#include "PianoKey.h"
+#include <cstdlib>
+#include <cstring>
+#include <new>
+
+// Constructor
+KeyboardStateTable::KeyboardStateTable() {
+    BOOST_STATIC_ASSERT(sizeof(Entry) == kKeyboardStateTableLineSize);
+
+    void *buffer = 0;
+    if(posix_memalign(&buffer, kKeyboardStateTableLineSize, kKeyboardStateTableNotes * sizeof(Entry)) != 0)
+        throw std::bad_alloc();
+    entries_ = (Entry *)buffer;
+
+    for(int note = 0; note < kKeyboardStateTableNotes; note++) {
+        new (&entries_[note]) Entry;
+        entries_[note].sequence.store(0, boost::memory_order_relaxed);
+        initialize(entries_[note].snapshot);
+    }
+}
+
+// Destructor
+KeyboardStateTable::~KeyboardStateTable() {
+    for(int note = 0; note < kKeyboardStateTableNotes; note++)
+        entries_[note].~Entry();
+    free(entries_);
+}
+
+// Copy the entry, trying again if a writer was in the middle of it
+bool KeyboardStateTable::read(int note, KeyStateSnapshot& snapshot) const {
+    if(note < 0 || note >= kKeyboardStateTableNotes)
+        return false;
+
+    const Entry& entry = entries_[note];
+    boost::uint64_t before, after;
+
+    do {
+        before = entry.sequence.load(boost::memory_order_acquire);
+        memcpy(&snapshot, &entry.snapshot, sizeof(KeyStateSnapshot));
+        boost::atomic_thread_fence(boost::memory_order_acquire);
+        after = entry.sequence.load(boost::memory_order_relaxed);
+    } while((before & 1) != 0 || before != after);
+
+    return true;
+}
+
+// Copy a range of entries. Notes outside the table come back in their initial state.
+void KeyboardStateTable::read(int lowestNote, int count, KeyStateSnapshot *snapshots) const {
+    for(int i = 0; i < count; i++) {
+        if(!read(lowestNote + i, snapshots[i]))
+            initialize(snapshots[i]);
+    }
+}
+
+// New position sample; the velocity comes from the previous one
+void KeyboardStateTable::setPosition(int note, key_position position, timestamp_type timestamp) {
+    KeyStateSnapshot *snapshot = beginWrite(note);
+    if(snapshot == 0)
+        return;
+    if(snapshot->timestamp > 0 && timestamp > snapshot->timestamp) {
+        key_position diffPosition = position - snapshot->position;
+        timestamp_diff_type diffTimestamp = timestamp - snapshot->timestamp;
+        snapshot->velocity = calculate_key_velocity(diffPosition, diffTimestamp);
+    }
+    else
+        snapshot->velocity = 0;
+    snapshot->position = position;
+    snapshot->timestamp = timestamp;
+    endWrite(note);
+}
+
+void KeyboardStateTable::setKeyState(int note, int state, timestamp_type timestamp) {
+    KeyStateSnapshot *snapshot = beginWrite(note);
+    if(snapshot == 0)
+        return;
+    snapshot->keyState = state;
+    snapshot->stateTimestamp = timestamp;
+    endWrite(note);
+}
+
+void KeyboardStateTable::setTrackerState(int note, int state, timestamp_type timestamp) {
+    KeyStateSnapshot *snapshot = beginWrite(note);
+    if(snapshot == 0)
+        return;
+    snapshot->trackerState = state;
+    snapshot->stateTimestamp = timestamp;
+    endWrite(note);
+}
+
+void KeyboardStateTable::setIdleState(int note, int state) {
+    KeyStateSnapshot *snapshot = beginWrite(note);
+    if(snapshot == 0)
+        return;
+    snapshot->idleState = state;
+    endWrite(note);
+}
+
+void KeyboardStateTable::setTouchCount(int note, int count) {
+    KeyStateSnapshot *snapshot = beginWrite(note);
+    if(snapshot == 0)
+        return;
+    snapshot->touchCount = count;
+    endWrite(note);
+}
+
+void KeyboardStateTable::setMidiNote(int note, bool isOn, int velocity) {
+    KeyStateSnapshot *snapshot = beginWrite(note);
+    if(snapshot == 0)
+        return;
+    snapshot->midiNoteIsOn = isOn;
+    snapshot->midiVelocity = isOn ? velocity : 0;
+    endWrite(note);
+}
+
+// Return a note to its initial state
+void KeyboardStateTable::clear(int note) {
+    KeyStateSnapshot *snapshot = beginWrite(note);
+    if(snapshot == 0)
+        return;
+    initialize(*snapshot);
+    endWrite(note);
+}
+
+// Move the sequence from even to odd. If another writer has it, wait for them.
+KeyStateSnapshot* KeyboardStateTable::beginWrite(int note) {
+    if(note < 0 || note >= kKeyboardStateTableNotes)
+        return 0;
+
+    Entry& entry = entries_[note];
+    boost::uint64_t sequence = entry.sequence.load(boost::memory_order_relaxed);
+
+    while(true) {
+        if((sequence & 1) != 0)
+            sequence = entry.sequence.load(boost::memory_order_relaxed);
+        else if(entry.sequence.compare_exchange_weak(sequence, sequence + 1, boost::memory_order_acquire,
+                                                     boost::memory_order_relaxed))
+            break;
+    }
+    boost::atomic_thread_fence(boost::memory_order_release);
+
+    return &entry.snapshot;
+}
+
+// Move the sequence back to even, publishing the change
+void KeyboardStateTable::endWrite(int note) {
+    entries_[note].sequence.fetch_add(1, boost::memory_order_release);
+}
+
+// Initial state of an entry
+void KeyboardStateTable::initialize(KeyStateSnapshot& snapshot) {
+    memset(&snapshot, 0, sizeof(KeyStateSnapshot));
+    snapshot.keyState = kKeyStateUnknown;
+    snapshot.trackerState = kPositionTrackerStateUnknown;
+    snapshot.idleState = kIdleDetectorUnknown;
+}
@@ -0,0 +1,91 @@
+//
+//  KeyboardStateTable.h
+//  touchkeys
+//
+
+#ifndef __touchkeys__KeyboardStateTable__
+#define __touchkeys__KeyboardStateTable__
+
+#include <boost/atomic.hpp>
+#include <boost/cstdint.hpp>
+#include <boost/static_assert.hpp>
+#include "PianoTypes.h"
+
+const int kKeyboardStateTableNotes = 128;
+const int kKeyboardStateTableLineSize = 64;     // Bytes per entry, one cache line
+
+// The latest state of one key, gathered from the objects that track it
+struct KeyStateSnapshot {
+    timestamp_type timestamp;           // Time of the latest position sample
+    timestamp_type stateTimestamp;      // When keyState or trackerState last changed
+    key_position position;              // Latest position
+    key_velocity velocity;              // Velocity over the latest two samples
+    boost::int8_t keyState;             // kKeyState...
+    boost::int8_t trackerState;         // kPositionTrackerState...
+    boost::int8_t idleState;            // kIdleDetector...
+    boost::int8_t touchCount;           // Number of touches on the surface (0-3)
+    boost::int8_t midiNoteIsOn;         // Whether a MIDI note is sounding on this key
+    boost::uint8_t midiVelocity;        // ...and its velocity
+};
+
+/*
+ * KeyboardStateTable
+ *
+ * One entry per MIDI note holding a snapshot of that key's state, so that other
+ * threads (GUI, mappings on other keys, OSC) can see any key or scan the whole
+ * keyboard without taking the locks of the objects that own the state.
+ *
+ * Each entry sits in its own cache line and is protected by a sequence lock: a
+ * writer makes the sequence odd, changes the entry and makes it even again; a
+ * reader copies the entry and retries if the sequence was odd or changed meanwhile.
+ * Writers claim the entry with an atomic compare-and-swap, so updates from the
+ * I/O and MIDI threads don't interfere. Readers never block writers.
+ */
+
+class KeyboardStateTable {
+public:
+    // ***** Constructor *****
+    KeyboardStateTable();
+
+    // ***** Destructor *****
+    ~KeyboardStateTable();
+
+    // ***** Reading *****
+
+    // Copy out a consistent snapshot of one note. Returns false if the note is out of range.
+    bool read(int note, KeyStateSnapshot& snapshot) const;
+
+    // Copy out the snapshots of a range of notes, each consistent on its own
+    void read(int lowestNote, int count, KeyStateSnapshot *snapshots) const;
+
+    // ***** Writing *****
+    //
+    // Each of these updates part of a note's entry and leaves the rest alone.
+
+    void setPosition(int note, key_position position, timestamp_type timestamp);
+    void setKeyState(int note, int state, timestamp_type timestamp);
+    void setTrackerState(int note, int state, timestamp_type timestamp);
+    void setIdleState(int note, int state);
+    void setTouchCount(int note, int count);
+    void setMidiNote(int note, bool isOn, int velocity);
+
+    // Return a note to its initial state
+    void clear(int note);
+
+private:
+    struct Entry {
+        boost::atomic<boost::uint64_t> sequence;    // Odd while being written
+        KeyStateSnapshot snapshot;
+        char padding[kKeyboardStateTableLineSize - sizeof(boost::uint64_t) - sizeof(KeyStateSnapshot)];
+    };
+
+    // Claim an entry for writing (making its sequence odd) and publish the change
+    KeyStateSnapshot* beginWrite(int note);
+    void endWrite(int note);
+
+    static void initialize(KeyStateSnapshot& snapshot);
+
+    Entry *entries_;        // Allocated on a cache line boundary
+};
+
+#endif /* defined(__touchkeys__KeyboardStateTable__) */
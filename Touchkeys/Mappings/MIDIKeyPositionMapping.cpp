@@ -7,6 +7,7 @@
 //
 
 #include "MIDIKeyPositionMapping.h"
+#include "Logger.h"
 #include "MidiOutputController.h"
 
 // Main constructor takes references/pointers from objects which keep track
@@ -36,7 +37,7 @@ MIDIKeyPositionMapping::~MIDIKeyPositionMapping() {
         disengage();
     }
     catch(...) {
-        std::cerr << "~MIDIKeyPositionMapping(): exception during disengage()\n";
+        TOUCHKEY_LOG(kLogLevelError, "~MIDIKeyPositionMapping(): exception during disengage()");
     }
 }
 
@@ -53,6 +54,7 @@ void MIDIKeyPositionMapping::disengage() {
 void MIDIKeyPositionMapping::reset() {
     Mapping::reset();
     noteIsOn_ = false;
+    lastAftertouchValue_ = 0;
 }
 
 // Set the aftertouch sensitivity on continuous key position
@@ -77,18 +79,30 @@ void MIDIKeyPositionMapping::triggerReceived(TriggerSource* who, timestamp_type
             KeyPositionTrackerNotification notification = positionTracker_->latest();
             
             // New message from the key position tracker. Might be time to start or end MIDI note.
-            if(notification.type == KeyPositionTrackerNotification::kNotificationTypeFeatureAvailableVelocity && !noteIsOn_) {
-                cout << "Key " << noteNumber_ << " velocity available\n";
-                generateMidiNoteOn();
+            // A predicted onset starts the note early; if the key then turns back, the note
+            // is ended again. Otherwise the measured velocity finds the note already on.
+            if(notification.type == KeyPositionTrackerNotification::kNotificationTypePredictedVelocity && !noteIsOn_) {
+                TOUCHKEY_LOG(kLogLevelDebug, "Key {} velocity predicted") << noteNumber_;
+                generateMidiNoteOn(true);
+                noteIsOn_ = true;
+            }
+            else if(notification.type == KeyPositionTrackerNotification::kNotificationTypePredictionCancelled && noteIsOn_) {
+                TOUCHKEY_LOG(kLogLevelDebug, "Key {} predicted onset cancelled") << noteNumber_;
+                generateMidiNoteOff();
+                noteIsOn_ = false;
+            }
+            else if(notification.type == KeyPositionTrackerNotification::kNotificationTypeFeatureAvailableVelocity && !noteIsOn_) {
+                TOUCHKEY_LOG(kLogLevelDebug, "Key {} velocity available") << noteNumber_;
+                generateMidiNoteOn(false);
                 noteIsOn_ = true;
             }
             else if(notification.type == KeyPositionTrackerNotification::kNotificationTypeFeatureAvailableReleaseVelocity && noteIsOn_) {
-                cout << "Key " << noteNumber_ << " release velocity available\n";
+                TOUCHKEY_LOG(kLogLevelDebug, "Key {} release velocity available") << noteNumber_;
                 generateMidiNoteOff();
                 noteIsOn_ = false;
             }
             else if(notification.type == KeyPositionTrackerNotification::kNotificationTypeFeatureAvailablePercussiveness) {
-                cout << "Key " << noteNumber_ << " percussiveness available\n";
+                TOUCHKEY_LOG(kLogLevelDebug, "Key {} percussiveness available") << noteNumber_;
                 generateMidiPercussivenessNoteOn();
             }
         }
@@ -144,12 +158,14 @@ timestamp_type MIDIKeyPositionMapping::performMapping() {
     return nextScheduledTimestamp_;
 }
 
-// Generate a MIDI Note On from continuous key data
-void MIDIKeyPositionMapping::generateMidiNoteOn() {
+// Generate a MIDI Note On from continuous key data, using either the measured
+// or the predicted velocity
+void MIDIKeyPositionMapping::generateMidiNoteOn(bool predicted) {
     if(positionTracker_ == 0)
         return;
     
-    std::pair<timestamp_type, key_velocity> velocityInfo = positionTracker_->pressVelocity();
+    std::pair<timestamp_type, key_velocity> velocityInfo = predicted ? positionTracker_->predictedPressVelocity() :
+                                                                       positionTracker_->pressVelocity();
     
     // MIDI Velocity now available. Send a MIDI message if relevant.
     if(keyboard_.midiOutputController() != 0) {
@@ -195,7 +211,7 @@ void MIDIKeyPositionMapping::generateMidiPercussivenessNoteOn() {
         return;
     
     KeyPositionTracker::PercussivenessFeatures features = positionTracker_->pressPercussiveness();
-    std::cout << "found percussiveness value of " << features.percussiveness << std::endl;
+    TOUCHKEY_LOG(kLogLevelDebug, "found percussiveness value of {}") << features.percussiveness;
     
     // MIDI Velocity now available. Send a MIDI message if relevant.
     if(keyboard_.midiOutputController() != 0) {
@@ -86,7 +86,7 @@ public:
 private:
     // ***** Private Methods *****
 
-    void generateMidiNoteOn();
+    void generateMidiNoteOn(bool predicted);
     void generateMidiNoteOff();
     void generateMidiPercussivenessNoteOn();
     
@@ -7,6 +7,7 @@
 //
 
 #include "MRPMapping.h"
+#include "Logger.h"
 #include <vector>
 
 // Main constructor takes references/pointers from objects which keep track
@@ -20,7 +21,7 @@ MRPMapping::MRPMapping(PianoKeyboard &keyboard, int noteNumber, Node<KeyTouchFra
   noteIsOn_(false), lastIntensity_(missing_value<float>::missing()),
   lastBrightness_(missing_value<float>::missing()), lastPitch_(missing_value<float>::missing()),
   lastHarmonic_(missing_value<float>::missing()),
-  shouldLookForPitchBends_(true), rawVelocity_(kMRPMappingVelocityBufferLength),
+  lastGestureIndex_(keyboard.gestureDetector().endIndex()), rawVelocity_(kMRPMappingVelocityBufferLength),
   filteredVelocity_(kMRPMappingVelocityBufferLength, rawVelocity_), lastCalculatedVelocityIndex_(0),
   vibratoActive_(false), vibratoVelocityPeakCount_(0), vibratoLastPeakTimestamp_(missing_value<timestamp_type>::missing())
 {
@@ -38,7 +39,7 @@ MRPMapping::MRPMapping(MRPMapping const& obj)
 : Mapping(obj), lastIntensity_(obj.lastIntensity_), lastBrightness_(obj.lastBrightness_),
 aftertouchScaler_(obj.aftertouchScaler_), noteIsOn_(obj.noteIsOn_), lastPitch_(obj.lastPitch_),
 lastHarmonic_(obj.lastHarmonic_),
-shouldLookForPitchBends_(obj.shouldLookForPitchBends_), activePitchBends_(obj.activePitchBends_),
+activePitchBends_(obj.activePitchBends_), lastGestureIndex_(obj.lastGestureIndex_),
 rawVelocity_(obj.rawVelocity_), filteredVelocity_(obj.filteredVelocity_),
 lastCalculatedVelocityIndex_(obj.lastCalculatedVelocityIndex_), vibratoActive_(obj.vibratoActive_),
 vibratoVelocityPeakCount_(obj.vibratoVelocityPeakCount_), vibratoLastPeakTimestamp_(obj.vibratoLastPeakTimestamp_) {
@@ -52,7 +53,7 @@ MRPMapping::~MRPMapping() {
         disengage();
     }
     catch(...) {
-        std::cerr << "~MRPMapping(): exception during disengage()\n";
+        TOUCHKEY_LOG(kLogLevelError, "~MRPMapping(): exception during disengage()");
     }
     
     //std::cerr << "~MRPMapping(): done\n";
@@ -73,14 +74,21 @@ void MRPMapping::disengage() {
         lastPitch_ = lastHarmonic_ = lastBrightness_ = lastIntensity_ = missing_value<float>::missing();
     }
     noteIsOn_ = false;
-    shouldLookForPitchBends_ = true;
 }
 
 // Reset state back to defaults
 void MRPMapping::reset() {
     Mapping::reset();
     noteIsOn_ = false;
-    shouldLookForPitchBends_ = true;
+    lastPitch_ = lastHarmonic_ = lastBrightness_ = lastIntensity_ = missing_value<float>::missing();
+    activePitchBends_.clear();
+    lastGestureIndex_ = keyboard_.gestureDetector().endIndex();
+    rawVelocity_.clear();
+    filteredVelocity_.clear();
+    lastCalculatedVelocityIndex_ = 0;
+    vibratoActive_ = false;
+    vibratoVelocityPeakCount_ = 0;
+    vibratoLastPeakTimestamp_ = missing_value<timestamp_type>::missing();
 }
 
 // Set the aftertouch sensitivity on continuous key position
@@ -93,19 +101,6 @@ void MRPMapping::setAftertouchSensitivity(float sensitivity) {
         aftertouchScaler_ = kDefaultAftertouchScaler * sensitivity;
 }
 
-// This is called by another MRPMapping when it finds a pitch bend starting.
-// Add the sending note to our list of bends, with the sending note marked
-// as controlling the bend
-void MRPMapping::enablePitchBend(int toNote, Node<key_position>* toPositionBuffer,
-                                KeyPositionTracker *toPositionTracker) {
-    if(toPositionBuffer == 0 || toPositionTracker == 0)
-        return;
-    
-    std::cout << "enablePitchBend(): this note = " << noteNumber_ << " note = " << toNote << " posBuf = " << toPositionBuffer << " posTrack = " << toPositionTracker << "\n";
-    PitchBend newBend = {toNote, true, false, toPositionBuffer, toPositionTracker};
-    activePitchBends_.push_back(newBend);
-}
-
 // Trigger method. This receives updates from the TouchKey data or from state changes in
 // the continuous key position (KeyPositionTracker). It will potentially change the scheduled
 // behavior of future mapping calls, but the actual OSC messages should be transmitted in a different
@@ -151,84 +146,9 @@ timestamp_type MRPMapping::performMapping() {
         // Get the latest velocity measurements
         key_velocity latestVelocity = updateVelocityMeasurements();
         
-        // Every time we enter a state of PartialPress, check whether this key
-        // is part of a multi-key pitch bend gesture with another key that's already
-        // down. Only do this once, though, since keys that go down after we enter
-        // PartialPress state are not part of such a gesture.
-        if(shouldLookForPitchBends_) {
-            if(trackerState == kPositionTrackerStatePartialPressAwaitingMax ||
-               trackerState == kPositionTrackerStatePartialPressFoundMax) {
-                // Look for a pitch bend gesture by searching for neighboring
-                // keys which are in the Down state and reached that state before
-                // this one reached PartialPress state.
-                for(int neighborNote = noteNumber_ - 2; neighborNote < noteNumber_; neighborNote++) {
-                    // If one of the lower keys is in the Down state, then this note should bend it up
-                    MRPMapping *neighborMapper = dynamic_cast<MRPMapping*>(keyboard_.mapping(neighborNote));
-                    if(neighborMapper == 0)
-                        continue;
-                    if(neighborMapper->positionTracker_ != 0) {
-                        int neighborState = neighborMapper->positionTracker_->currentState();
-                        if(neighborState == kPositionTrackerStateDown) {
-                            // Here we've found a neighboring note in the Down state. But did it precede our transition?
-                            timestamp_type timeOfDownTransition = neighborMapper->positionTracker_->latestTimestamp();
-                            timestamp_type timeOfOurPartialActivation = findTimestampOfPartialPress();
-                            
-                            cout << "Found key " << neighborNote << " in Down state\n";
-                            
-                            if(!missing_value<timestamp_type>::isMissing(timeOfOurPartialActivation)) {
-                                if(timeOfOurPartialActivation > timeOfDownTransition) {
-                                    // The neighbor note went down before us; pitch bend should engage
-                                    cout << "Found pitch bend: " << noteNumber_ << " to " << neighborNote << endl;
-                                    
-                                    // Insert the details for the neighboring note into our buffer. The bend
-                                    // is controlled by our own key, and the target is the neighbor note.
-                                    PitchBend newBend = {neighborNote, false, false, neighborMapper->positionBuffer_,
-                                        neighborMapper->positionTracker_};
-                                    activePitchBends_.push_back(newBend);
-                                
-                                    // Tell the other note to bend its pitch based on our position
-                                    neighborMapper->enablePitchBend(noteNumber_, positionBuffer_, positionTracker_);
-                                }
-                            }
-                        }
-                    }
-                }
-                for(int neighborNote = noteNumber_ + 1; neighborNote < noteNumber_ + 3; neighborNote++) {
-                    // If one of the upper keys is in the Down state, then this note should bend it down
-                    MRPMapping *neighborMapper = dynamic_cast<MRPMapping*>(keyboard_.mapping(neighborNote));
-                    if(neighborMapper == 0)
-                        continue;
-                    if(neighborMapper->positionTracker_ != 0) {
-                        int neighborState = neighborMapper->positionTracker_->currentState();
-                        if(neighborState == kPositionTrackerStateDown) {
-                            // Here we've found a neighboring note in the Down state. But did it precede our transition?
-                            timestamp_type timeOfDownTransition = neighborMapper->positionTracker_->latestTimestamp();
-                            timestamp_type timeOfOurPartialActivation = findTimestampOfPartialPress();
-                            
-                            cout << "Found key " << neighborNote << " in Down state\n";
-                            
-                            if(!missing_value<timestamp_type>::isMissing(timeOfOurPartialActivation)) {
-                                if(timeOfOurPartialActivation > timeOfDownTransition) {
-                                    // The neighbor note went down before us; pitch bend should engage
-                                    cout << "Found pitch bend: " << noteNumber_ << " to " << neighborNote << endl;
-                                    
-                                    // Insert the details for the neighboring note into our buffer. The bend
-                                    // is controlled by our own key, and the target is the neighbor note.
-                                    PitchBend newBend = {neighborNote, false, false, neighborMapper->positionBuffer_,
-                                        neighborMapper->positionTracker_};
-                                    activePitchBends_.push_back(newBend);
-                                    
-                                    // Tell the other note to bend its pitch based on our position
-                                    neighborMapper->enablePitchBend(noteNumber_, positionBuffer_, positionTracker_);
-                                }
-                            }
-                        }
-                    }
-                }
-                
-                shouldLookForPitchBends_ = false;
-            }
-        }
+        // Pitch bends between this key and its neighbours are found by the keyboard's
+        // gesture detector. Pick up any it has reported since we last looked.
+        updatePitchBends();
         
         if(trackerState == kPositionTrackerStatePartialPressAwaitingMax ||
            trackerState == kPositionTrackerStatePartialPressFoundMax) {
@@ -241,14 +161,14 @@ timestamp_type MRPMapping::performMapping() {
             
             if(vibratoVelocityPeakCount_ % 2 == 0) {
                 if(latestVelocity > kVibratoVelocityThreshold && currentTimestamp - vibratoLastPeakTimestamp_ > kVibratoMinimumPeakSpacing) {
-                    std::cout << "Vibrato count = " << vibratoVelocityPeakCount_ << std::endl;
+                    TOUCHKEY_LOG(kLogLevelTrace, "Vibrato count = {}") << vibratoVelocityPeakCount_;
                     vibratoVelocityPeakCount_++;
                     vibratoLastPeakTimestamp_ = currentTimestamp;
                 }
             }
             else {
                 if(latestVelocity < -kVibratoVelocityThreshold && currentTimestamp - vibratoLastPeakTimestamp_ > kVibratoMinimumPeakSpacing) {
-                    std::cout << "Vibrato count = " << vibratoVelocityPeakCount_ << std::endl;
+                    TOUCHKEY_LOG(kLogLevelTrace, "Vibrato count = {}") << vibratoVelocityPeakCount_;
                     vibratoVelocityPeakCount_++;
                     vibratoLastPeakTimestamp_ = currentTimestamp;
                 }
@@ -267,11 +187,11 @@ timestamp_type MRPMapping::performMapping() {
                 if(missing_value<float>::isMissing(lastHarmonic_))
                     lastHarmonic_ = 0.0;
                 harmonic = lastHarmonic_ + fabsf(latestVelocity) * kVibratoRateScaler;
-                std::cout << "harmonic = " << harmonic << std::endl;
+                TOUCHKEY_LOG(kLogLevelTrace, "harmonic = {}") << harmonic;
                 
                 // Check whether the current vibrato has timed out
                 if(currentTimestamp - vibratoLastPeakTimestamp_ > kVibratoTimeout) {
-                    std::cout << "Vibrato timed out\n";
+                    TOUCHKEY_LOG(kLogLevelDebug, "Vibrato timed out");
                     vibratoActive_ = false;
                     vibratoVelocityPeakCount_ = 0;
                     vibratoLastPeakTimestamp_ = currentTimestamp;
@@ -280,7 +200,7 @@ timestamp_type MRPMapping::performMapping() {
         }
         else {
             // Vibrato can't be active in these states
-            std::cout << "Vibrato finished from state change\n";
+            TOUCHKEY_LOG(kLogLevelDebug, "Vibrato finished from state change");
             vibratoActive_ = false;
             vibratoVelocityPeakCount_ = 0;
             vibratoLastPeakTimestamp_ = currentTimestamp;
@@ -317,7 +237,7 @@ timestamp_type MRPMapping::performMapping() {
                         if((bend.positionTracker->currentState() != kPositionTrackerStatePartialPressAwaitingMax &&
                            bend.positionTracker->currentState() != kPositionTrackerStatePartialPressFoundMax)
                            || !bend.positionTracker->engaged()) {
-                            cout << "Removing bend from note " << bend.note << endl;
+                            TOUCHKEY_LOG(kLogLevelDebug, "Removing bend from note {}") << bend.note;
                             bend.isFinished = true;
                             continue;
                         }
@@ -345,7 +265,7 @@ timestamp_type MRPMapping::performMapping() {
                         
                         if(trackerState != kPositionTrackerStatePartialPressAwaitingMax &&
                            trackerState != kPositionTrackerStatePartialPressFoundMax) {
-                            cout << "Removing our bend on note " << bend.note << endl;
+                            TOUCHKEY_LOG(kLogLevelDebug, "Removing our bend on note {}") << bend.note;
                             bend.isFinished = true;
                             continue;
                         }
@@ -375,7 +295,7 @@ timestamp_type MRPMapping::performMapping() {
                         it++;
                 }
                 
-                std::cout << "pitch = " << pitch << std::endl;
+                TOUCHKEY_LOG(kLogLevelTrace, "pitch = {}") << pitch;
             }
             else
                 pitch = 0.0;
@@ -391,7 +311,6 @@ timestamp_type MRPMapping::performMapping() {
                 //keyboard_.testLog_ << currentTimestamp << " /mrp/midi iii " << (kMIDINoteOnMessage + kDefaultMIDIChannel) << " " << newNoteNumber << " " << 0 << endl;
             }
             noteIsOn_ = false;
-            shouldLookForPitchBends_ = true;
         }
     }
     
@@ -514,47 +433,42 @@ key_velocity MRPMapping::updateVelocityMeasurements() {
     return filteredVel;
 }
 
-// Helper function that locates the timestamp at which this key entered the
-// PartialPress (i.e. first non-idle) state. Returns missing value if the
-// state can't be located.
-timestamp_type MRPMapping::findTimestampOfPartialPress() {
-    if(positionTracker_ == 0)
-        return missing_value<timestamp_type>::missing();
-    if(positionTracker_->empty())
-        return missing_value<timestamp_type>::missing();
-    //Node<int>::reverse_iterator it = positionTracker_->rbegin();
-    Node<int>::size_type index = positionTracker_->endIndex() - 1;
-    bool foundPartialPressState = false;
-    timestamp_type earliestPartialPressTimestamp;
-
-    // Search backwards from present
-    while(index >= positionTracker_->beginIndex()/*it != positionTracker_->rend()*/) {
-        if((*positionTracker_)[index].state == kPositionTrackerStatePartialPressAwaitingMax ||
-           (*positionTracker_)[index].state == kPositionTrackerStatePartialPressFoundMax) {
-            cout << "index " << index << " state " << (*positionTracker_)[index].state << endl;
-            foundPartialPressState = true;
-            earliestPartialPressTimestamp = positionTracker_->timestampAt(index);
+// Read the gesture events published since the last call, adding a bend for
+// each one this key takes part in. The key that went into PartialPress bends its
+// neighbour, which was already down; the neighbour follows the bending key's position.
+void MRPMapping::updatePitchBends() {
+    KeyboardGestureDetector& gestures = keyboard_.gestureDetector();
+    
+    // The keys are locked first, as they are by the I/O threads that publish gestures
+    boost::shared_lock<boost::shared_mutex> keysLock(keyboard_.keysMutex());
+    gestures.lock_shared();
+    if(lastGestureIndex_ < gestures.beginIndex())
+        lastGestureIndex_ = gestures.beginIndex();
+    
+    while(lastGestureIndex_ < gestures.endIndex()) {
+        KeyboardGestureEvent event = gestures[lastGestureIndex_++];
+        if(event.type != KeyboardGestureEvent::kGesturePitchBend)
+            continue;
+        
+        if(event.note == noteNumber_) {
+            // This key controls the bend, and the target is the neighbour note
+            PianoKey *neighbor = keyboard_.key(event.otherNote);
+            if(neighbor == 0)
+                continue;
+            TOUCHKEY_LOG(kLogLevelDebug, "Found pitch bend: {} to {}") << noteNumber_ << event.otherNote;
+            PitchBend newBend = {event.otherNote, false, false, &neighbor->buffer(), &neighbor->positionTracker()};
+            activePitchBends_.push_back(newBend);
         }
-        else {
-            // This state is not a PartialPress state. Two cases: either
-            // we haven't yet encountered a partial press or we have found
-            // a state before the partial press, in which case the previous
-            // state we found was the first.
-                        cout << "index " << index << " state " << (*positionTracker_)[index].state << endl;
-            if(foundPartialPressState) {
-                return earliestPartialPressTimestamp;
-            }
+        else if(event.otherNote == noteNumber_) {
+            // The neighbour bends this note based on its position
+            PianoKey *bender = keyboard_.key(event.note);
+            if(bender == 0)
+                continue;
+            TOUCHKEY_LOG(kLogLevelDebug, "Pitch bend from {}: this note = {}") << event.note << noteNumber_;
+            PitchBend newBend = {event.note, true, false, &bender->buffer(), &bender->positionTracker()};
+            activePitchBends_.push_back(newBend);
         }
-        
-        // Step backwards one sample, but stop if we hit the beginning index
-        if(index == 0)
-            break;
-        index--;
     }
     
-    if(foundPartialPressState)
-        return earliestPartialPressTimestamp;
-    
-    // Didn't find anything if we get here
-    return missing_value<timestamp_type>::missing();
+    gestures.unlock_shared();
 }
\ No newline at end of file
@@ -77,10 +77,6 @@ public:
     // from there
     void setAftertouchSensitivity(float sensitivity);
     
-    // Engage a pitch bend from a different key, based on its position and state
-    void enablePitchBend(int toNote, Node<key_position>* toPositionBuffer,
-                         KeyPositionTracker *toPositionTracker);
-    
 	// ***** Evaluators *****
 	
     // This method receives triggers whenever events occur in the touch data or the
@@ -98,8 +94,8 @@ private:
     // Bring velocity calculations up to date
     key_velocity updateVelocityMeasurements();
     
-    // Find the timestamp of the first transition into a PartialPress state
-    timestamp_type findTimestampOfPartialPress();
+    // Start any pitch bends the gesture detector has found involving this key
+    void updatePitchBends();
     
 	// ***** Member Variables *****
     
@@ -108,8 +104,8 @@ private:
     float lastIntensity_, lastBrightness_;      // Cached values for mapping qualities
     float lastPitch_, lastHarmonic_;
     
-    bool shouldLookForPitchBends_;              // Whether to search for adjacent keys to start a pitch bend
     std::vector<PitchBend> activePitchBends_;   // Which keys are involved in a pitch bend
+    Node<KeyboardGestureEvent>::size_type lastGestureIndex_; // Next gesture event to read
     
     Node<key_velocity> rawVelocity_;            // History of key velocity measurements
     IIRFilter<key_velocity> filteredVelocity_;  // Filtered key velocity information
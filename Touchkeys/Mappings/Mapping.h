@@ -49,6 +49,9 @@ public:
     // Reset the state back initial values
 	virtual void reset();
     
+    // Which note this mapping belongs to
+    int noteNumber() { return noteNumber_; }
+    
     // Set the interval between mapping actions
     virtual void setUpdateInterval(timestamp_diff_type interval) {
         if(interval <= 0)
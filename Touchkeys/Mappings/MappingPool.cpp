@@ -0,0 +1,144 @@
+//
+//  MappingPool.cpp
+//  touchkeys
+//
+
+#include "MappingPool.h"
+#include "MRPMapping.h"
+#include "MIDIKeyPositionMapping.h"
+#include "TouchkeyVibratoMapping.h"
+#include <cstring>
+
+// Constructor
+MappingPool::MappingPool(PianoKeyboard& keyboard)
+: keyboard_(keyboard)
+{
+    memset(slots_, 0, sizeof(slots_));
+    clearStatistics();
+}
+
+// Destructor
+MappingPool::~MappingPool() {
+    clear();
+}
+
+// Construct the instance for a note ahead of time
+void MappingPool::preallocate(int type, int noteNumber, Node<KeyTouchFrame>* touchBuffer,
+                              Node<key_position>* positionBuffer, KeyPositionTracker* positionTracker) {
+    if(type < 0 || type >= kNumMappingTypes || noteNumber < 0 || noteNumber >= kMappingPoolMaxNotes)
+        return;
+
+    Slot& slot = slots_[type][noteNumber];
+    if(slot.mapping != 0)
+        return;
+    slot.mapping = create(type, noteNumber, touchBuffer, positionBuffer, positionTracker);
+    slot.inUse = false;
+    slot.touchBuffer = touchBuffer;
+    slot.positionBuffer = positionBuffer;
+    slot.positionTracker = positionTracker;
+}
+
+// Hand out the note's instance if it's free and built for the same buffers,
+// otherwise construct one
+Mapping* MappingPool::acquire(int type, int noteNumber, Node<KeyTouchFrame>* touchBuffer,
+                              Node<key_position>* positionBuffer, KeyPositionTracker* positionTracker) {
+    if(type < 0 || type >= kNumMappingTypes)
+        return 0;
+    if(noteNumber < 0 || noteNumber >= kMappingPoolMaxNotes) {
+        misses_.fetch_add(1, boost::memory_order_relaxed);
+        return create(type, noteNumber, touchBuffer, positionBuffer, positionTracker);
+    }
+
+    Slot& slot = slots_[type][noteNumber];
+
+    if(slot.mapping != 0 && !slot.inUse) {
+        if(slot.touchBuffer == touchBuffer && slot.positionBuffer == positionBuffer &&
+           slot.positionTracker == positionTracker) {
+            hits_.fetch_add(1, boost::memory_order_relaxed);
+            slot.inUse = true;
+            slot.mapping->reset();
+            return slot.mapping;
+        }
+
+        // Built for a key that no longer exists
+        delete slot.mapping;
+        slot.mapping = 0;
+    }
+
+    misses_.fetch_add(1, boost::memory_order_relaxed);
+    Mapping *mapping = create(type, noteNumber, touchBuffer, positionBuffer, positionTracker);
+    if(slot.mapping == 0) {
+        slot.mapping = mapping;
+        slot.inUse = true;
+        slot.touchBuffer = touchBuffer;
+        slot.positionBuffer = positionBuffer;
+        slot.positionTracker = positionTracker;
+    }
+    return mapping;
+}
+
+// Take a mapping back, keeping it if it's one of ours
+void MappingPool::release(Mapping* mapping) {
+    if(mapping == 0)
+        return;
+
+    int noteNumber = mapping->noteNumber();
+    if(noteNumber >= 0 && noteNumber < kMappingPoolMaxNotes) {
+        for(int type = 0; type < kNumMappingTypes; type++) {
+            Slot& slot = slots_[type][noteNumber];
+            if(slot.mapping == mapping && slot.inUse) {
+                mapping->disengage();
+                slot.inUse = false;
+                returns_.fetch_add(1, boost::memory_order_relaxed);
+                return;
+            }
+        }
+    }
+
+    delete mapping;
+    discards_.fetch_add(1, boost::memory_order_relaxed);
+}
+
+// Delete the idle instances and forget the ones in use
+void MappingPool::clear() {
+    for(int type = 0; type < kNumMappingTypes; type++) {
+        for(int note = 0; note < kMappingPoolMaxNotes; note++) {
+            Slot& slot = slots_[type][note];
+            if(slot.mapping != 0 && !slot.inUse)
+                delete slot.mapping;
+            slot.mapping = 0;
+            slot.inUse = false;
+        }
+    }
+}
+
+// Current values of the counters
+MappingPool::Statistics MappingPool::statistics() {
+    Statistics statistics;
+
+    statistics.hits = hits_.load(boost::memory_order_relaxed);
+    statistics.misses = misses_.load(boost::memory_order_relaxed);
+    statistics.returns = returns_.load(boost::memory_order_relaxed);
+    statistics.discards = discards_.load(boost::memory_order_relaxed);
+    return statistics;
+}
+
+// Reset the counters
+void MappingPool::clearStatistics() {
+    hits_ = misses_ = returns_ = discards_ = 0;
+}
+
+// Construct a new mapping of the given type
+Mapping* MappingPool::create(int type, int noteNumber, Node<KeyTouchFrame>* touchBuffer,
+                             Node<key_position>* positionBuffer, KeyPositionTracker* positionTracker) {
+    switch(type) {
+        case kMappingTypeMRP:
+            return new MRPMapping(keyboard_, noteNumber, touchBuffer, positionBuffer, positionTracker);
+        case kMappingTypeMIDIKeyPosition:
+            return new MIDIKeyPositionMapping(keyboard_, noteNumber, touchBuffer, positionBuffer, positionTracker);
+        case kMappingTypeTouchkeyVibrato:
+            return new TouchkeyVibratoMapping(keyboard_, noteNumber, touchBuffer, positionBuffer, positionTracker);
+        default:
+            return 0;
+    }
+}
@@ -0,0 +1,98 @@
+//
+//  MappingPool.h
+//  touchkeys
+//
+
+#ifndef __touchkeys__MappingPool__
+#define __touchkeys__MappingPool__
+
+#include <boost/atomic.hpp>
+#include "KeyTouchFrame.h"
+#include "KeyPositionTracker.h"
+
+class PianoKeyboard;
+class Mapping;
+
+// Kinds of mapping the pool knows how to construct
+enum {
+    kMappingTypeMRP = 0,
+    kMappingTypeMIDIKeyPosition,
+    kMappingTypeTouchkeyVibrato,
+    kNumMappingTypes
+};
+
+const int kMappingPoolMaxNotes = 128;
+
+/*
+ * MappingPool
+ *
+ * Keeps one instance of each type of mapping for each note, so that a key going
+ * active doesn't have to construct a mapping (with its buffers and filters) and a
+ * key going idle doesn't have to destroy one. Instances handed out by acquire() are
+ * reset() first; instances given back by release() are disengaged and kept for the
+ * next press of the same note.
+ *
+ * If the note's instance is already in use, or was built for different buffers,
+ * acquire() falls back to constructing a new one. That counts as a miss. release()
+ * deletes any mapping it didn't hand out, so it can be used for every mapping.
+ */
+
+class MappingPool {
+public:
+    struct Statistics {
+        unsigned long hits;             // acquire() calls served from the pool
+        unsigned long misses;           // acquire() calls that had to construct a mapping
+        unsigned long returns;          // release() calls that kept the mapping
+        unsigned long discards;         // release() calls that deleted it
+    };
+
+    // ***** Constructor *****
+    MappingPool(PianoKeyboard& keyboard);
+
+    // ***** Destructor *****
+    ~MappingPool();
+
+    // ***** Pool Methods *****
+
+    // Construct the instance for a note ahead of time, if there isn't one already
+    void preallocate(int type, int noteNumber, Node<KeyTouchFrame>* touchBuffer,
+                     Node<key_position>* positionBuffer, KeyPositionTracker* positionTracker);
+
+    // Get a freshly reset mapping of the given type for a note. It is not engaged.
+    Mapping* acquire(int type, int noteNumber, Node<KeyTouchFrame>* touchBuffer,
+                     Node<key_position>* positionBuffer, KeyPositionTracker* positionTracker);
+
+    // Give a mapping back. The pool's own instances are disengaged and kept;
+    // anything else is deleted.
+    void release(Mapping* mapping);
+
+    // Delete every instance that isn't in use, e.g. before the keys' buffers go away.
+    // Instances in use are forgotten and will be deleted when released.
+    void clear();
+
+    // ***** Statistics *****
+    //
+    // Keys acquire and release mappings from each device's I/O thread, so the counters
+    // are atomic; the snapshot is not taken all at once.
+    Statistics statistics();
+    void clearStatistics();
+
+private:
+    // Per-note instance of one type, with the buffers it was built for
+    struct Slot {
+        Mapping* mapping;
+        bool inUse;
+        Node<KeyTouchFrame>* touchBuffer;
+        Node<key_position>* positionBuffer;
+        KeyPositionTracker* positionTracker;
+    };
+
+    Mapping* create(int type, int noteNumber, Node<KeyTouchFrame>* touchBuffer,
+                    Node<key_position>* positionBuffer, KeyPositionTracker* positionTracker);
+
+    PianoKeyboard& keyboard_;
+    Slot slots_[kNumMappingTypes][kMappingPoolMaxNotes];
+    boost::atomic<unsigned long> hits_, misses_, returns_, discards_;
+};
+
+#endif /* defined(__touchkeys__MappingPool__) */
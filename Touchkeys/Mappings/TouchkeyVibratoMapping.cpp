@@ -7,6 +7,7 @@
 //
 
 #include "TouchkeyVibratoMapping.h"
+#include "Logger.h"
 #include "MidiOutputController.h"
 #include <vector>
 #include <climits>
@@ -75,7 +76,7 @@ TouchkeyVibratoMapping::~TouchkeyVibratoMapping() {
         disengage();
     }
     catch(...) {
-        std::cerr << "~TouchkeyVibratoMapping(): exception during disengage()\n";
+        TOUCHKEY_LOG(kLogLevelError, "~TouchkeyVibratoMapping(): exception during disengage()");
     }
 }
 
@@ -110,6 +111,20 @@ void TouchkeyVibratoMapping::reset() {
     Mapping::reset();
     sendVibratoMessage(0.0);
     noteIsOn_ = false;
+    vibratoState_ = kStateInactive;
+    resetDetectionState();
+    idOfCurrentTouch_ = -1;
+    lastX_ = lastY_ = missing_value<float>::missing();
+    lastTimestamp_ = missing_value<timestamp_type>::missing();
+    rawDistance_.clear();
+    filteredDistance_.clear();
+    lastProcessedIndex_ = 0;
+    rampBeginTime_ = missing_value<timestamp_type>::missing();
+    rampScaleValue_ = lastCalculatedRampValue_ = 0;
+    rampLength_ = 0;
+    lastZeroCrossingInterval_ = 0;
+    lastSampleWasPositive_ = false;
+    lastPitchBendSemitones_ = 0;
 }
 
 // OSC handler method. Called from PianoKeyboard when MIDI data comes in.
@@ -126,10 +141,10 @@ bool TouchkeyVibratoMapping::oscHandlerMethod(const char *path, const char *type
                 // Clear buffer and start with 0 distance for this point
                 clearBuffers();
                 
-                std::cout << "MIDI on: starting at (" << onsetLocationX_ << ", " << onsetLocationY_ << ")\n";
+                TOUCHKEY_LOG(kLogLevelDebug, "MIDI on: starting at ({}, {})") << onsetLocationX_ << onsetLocationY_;
             }
             else
-                std::cout << "MIDI on but no touch\n";
+                TOUCHKEY_LOG(kLogLevelDebug, "MIDI on but no touch");
             
             noteIsOn_ = true;
             return true;
@@ -144,7 +159,7 @@ bool TouchkeyVibratoMapping::oscHandlerMethod(const char *path, const char *type
             }
             // lastX_ = lastY_ = missing_value<float>::missing();
             // idOfCurrentTouch_ = -1;
-            std::cout << "MIDI off\n";
+            TOUCHKEY_LOG(kLogLevelDebug, "MIDI off");
             return true;
         }
     }
@@ -172,7 +187,7 @@ void TouchkeyVibratoMapping::triggerReceived(TriggerSource* who, timestamp_type
                 lastX_ = lastY_ = missing_value<float>::missing();
                 idOfCurrentTouch_ = -1;
                 
-                std::cout << "Touch off\n";
+                TOUCHKEY_LOG(kLogLevelDebug, "Touch off");
             }
             else {
                 // At least one touch. Check if we are already tracking an ID and, if so,
@@ -213,7 +228,7 @@ void TouchkeyVibratoMapping::triggerReceived(TriggerSource* who, timestamp_type
                     else
                         lastX_ = frame.locH;
                     
-                    std::cout << "Previous touch stopped; now ID " << idOfCurrentTouch_ << " at (" << lastX_ << ", " << lastY_ << ")\n";
+                    TOUCHKEY_LOG(kLogLevelDebug, "Previous touch stopped; now ID {} at ({}, {})") << idOfCurrentTouch_ << lastX_ << lastY_;
                 }
                 
                 // Now we have an X and (maybe) a Y coordinate for the most recent touch.
@@ -230,7 +245,7 @@ void TouchkeyVibratoMapping::triggerReceived(TriggerSource* who, timestamp_type
                         // Clear buffer and start with 0 distance for this point
                         clearBuffers();
                         
-                        std::cout << "Starting at (" << onsetLocationX_ << ", " << onsetLocationY_ << ")\n";
+                        TOUCHKEY_LOG(kLogLevelDebug, "Starting at ({}, {})") << onsetLocationX_ << onsetLocationY_;
                     }
                     else {
                         float distance = 0.0;
@@ -243,7 +258,7 @@ void TouchkeyVibratoMapping::triggerReceived(TriggerSource* who, timestamp_type
                             // No X location indicated for onset but we have one now.
                             // Update the onset X location.
                             onsetLocationX_ = lastX_;
-                            std::cout << "Found first X location at " << onsetLocationX_ << std::endl;
+                            TOUCHKEY_LOG(kLogLevelTrace, "Found first X location at {}") << onsetLocationX_;
                         }
                         
                         
@@ -309,7 +324,7 @@ timestamp_type TouchkeyVibratoMapping::performMapping() {
                    if(vibratoState_ == kStateActive || vibratoState_ == kStateSwitchingOn ||
                       foundFirstExtremum_) {
                        lastZeroCrossingInterval_ = timestamp - lastZeroCrossingTimestamp_;
-                       std::cout << "Zero crossing interval " << lastZeroCrossingInterval_ << std::endl;
+                       TOUCHKEY_LOG(kLogLevelTrace, "Zero crossing interval {}") << lastZeroCrossingInterval_;
                    }
                }
                lastZeroCrossingTimestamp_ = timestamp;
@@ -325,12 +340,12 @@ timestamp_type TouchkeyVibratoMapping::performMapping() {
                 if((firstExtremumX_ > 0 && distance < 0) ||
                    (firstExtremumX_ < 0 && distance > 0)) {
                     if(fabsf(distance) >= fabsf(firstExtremumX_) * onsetRatioX_) {
-                        std::cout << "Found second extremum at " << distance << ", TS " << timestamp << std::endl;
+                        TOUCHKEY_LOG(kLogLevelTrace, "Found second extremum at {}, TS {}") << distance << timestamp;
                         changeStateSwitchingOn(timestamp);
                     }
                 }
                 else if(timestamp - lastExtremumTimestamp_ > onsetTimeout_) {
-                    std::cout << "Onset timeout at " << timestamp << endl;
+                    TOUCHKEY_LOG(kLogLevelDebug, "Onset timeout at {}") << timestamp;
                     resetDetectionState();
                 }
             }
@@ -341,7 +356,7 @@ timestamp_type TouchkeyVibratoMapping::performMapping() {
                        fabsf(distance) > fabsf(firstExtremumX_)) {
                         firstExtremumX_ = distance;
                         lastExtremumTimestamp_ = timestamp;
-                        std::cout << "First extremum candidate at " << firstExtremumX_ << ", TS " << lastExtremumTimestamp_ << std::endl;
+                        TOUCHKEY_LOG(kLogLevelTrace, "First extremum candidate at {}, TS {}") << firstExtremumX_ << lastExtremumTimestamp_;
                     }
                 }
                 else if(!missing_value<float>::isMissing(firstExtremumX_) &&
@@ -353,7 +368,7 @@ timestamp_type TouchkeyVibratoMapping::performMapping() {
                     // another extremum is found later.
                     firstExtremumTimestamp_ = lastExtremumTimestamp_;
                     foundFirstExtremum_ = true;
-                    std::cout << "Found first extremum at " << firstExtremumX_ << ", TS " << lastExtremumTimestamp_ << std::endl;
+                    TOUCHKEY_LOG(kLogLevelTrace, "Found first extremum at {}, TS {}") << firstExtremumX_ << lastExtremumTimestamp_;
                 }
             }
         }
@@ -362,7 +377,7 @@ timestamp_type TouchkeyVibratoMapping::performMapping() {
             if(fabsf(distance) >= onsetThresholdX_ * onsetRatioX_)
                 lastExtremumTimestamp_ = timestamp;
             if(timestamp - lastExtremumTimestamp_ > onsetTimeout_) {
-                std::cout << "Vibrato timeout at " << timestamp << " (last was " << lastExtremumTimestamp_ << ")" << endl;
+                TOUCHKEY_LOG(kLogLevelDebug, "Vibrato timeout at {} (last was {})") << timestamp << lastExtremumTimestamp_;
                 changeStateSwitchingOff(timestamp);
             }
         }
@@ -382,7 +397,7 @@ timestamp_type TouchkeyVibratoMapping::performMapping() {
             if(rampLength_ <= 0 || (currentTimestamp - rampBeginTime_ >= rampLength_)) {
                 scale = 1.0;
                 changeStateActive(currentTimestamp);
-                std::cout << "Vibrato switch on finished, going to Active\n";
+                TOUCHKEY_LOG(kLogLevelDebug, "Vibrato switch on finished, going to Active");
             }
             else {
                 lastCalculatedRampValue_ = rampScaleValue_ * (float)(currentTimestamp - rampBeginTime_)/(float)rampLength_;
@@ -396,7 +411,7 @@ timestamp_type TouchkeyVibratoMapping::performMapping() {
             if(rampLength_ <= 0 || (currentTimestamp - rampBeginTime_ >= rampLength_)) {
                 scale = 0.0;
                 changeStateInactive(currentTimestamp);
-                std::cout << "Vibrato switch off finished, going to Inactive\n";
+                TOUCHKEY_LOG(kLogLevelDebug, "Vibrato switch off finished, going to Inactive");
             }
             else {
                 lastCalculatedRampValue_ = rampScaleValue_ * (1.0 - (float)(currentTimestamp - rampBeginTime_)/(float)rampLength_);
@@ -422,7 +437,7 @@ timestamp_type TouchkeyVibratoMapping::performMapping() {
                 sendVibratoMessage(0.0);
                 lastPitchBendSemitones_ = 0;
                 changeStateInactive(currentTimestamp);
-                std::cout << "Vibrato switch off finished, going to Inactive\n";
+                TOUCHKEY_LOG(kLogLevelDebug, "Vibrato switch off finished, going to Inactive");
             }
             else {
                 // Still in the middle of the ramp. Calculate its current value based on the last one
@@ -437,7 +452,7 @@ timestamp_type TouchkeyVibratoMapping::performMapping() {
         else if(vibratoState_ != kStateInactive) {
             // Might still be active but with no data coming in. We need to look for a timeout here too.
             if(currentTimestamp - lastExtremumTimestamp_ > onsetTimeout_) {
-                std::cout << "Vibrato timeout at " << currentTimestamp << " (2; last was " << lastExtremumTimestamp_ << ")" << endl;
+                TOUCHKEY_LOG(kLogLevelDebug, "Vibrato timeout at {} (2; last was {})") << currentTimestamp << lastExtremumTimestamp_;
                 changeStateSwitchingOff(currentTimestamp);
             }
         }
@@ -467,7 +482,7 @@ void TouchkeyVibratoMapping::changeStateSwitchingOn(timestamp_type timestamp) {
             rampLength_ = kMinimumOnsetTime;
         if(rampLength_ > kMaximumOnsetTime)
             rampLength_ = kMaximumOnsetTime;
-        std::cout << "Switching on with ramp length " << rampLength_ << " (peak " << firstExtremumTimestamp_ << ", zero " << lastZeroCrossingTimestamp_ << ")" << std::endl;
+        TOUCHKEY_LOG(kLogLevelDebug, "Switching on with ramp length {} (peak {}, zero {})") << rampLength_ << firstExtremumTimestamp_ << lastZeroCrossingTimestamp_;
     }
     
     vibratoState_ = kStateSwitchingOn;    
@@ -490,7 +505,7 @@ void TouchkeyVibratoMapping::changeStateSwitchingOff(timestamp_type timestamp) {
     if(rampLength_ > kMaximumReleaseTime)
         rampLength_ = kMaximumReleaseTime;
     
-    std::cout << "Switching off with ramp length " << rampLength_ << std::endl;
+    TOUCHKEY_LOG(kLogLevelDebug, "Switching off with ramp length {}") << rampLength_;
     
     resetDetectionState();
     vibratoState_ = kStateSwitchingOff;
@@ -9,6 +9,7 @@
 
 #include "MidiInputController.h"
 #include "MidiOutputController.h"
+#include "Logger.h"
 
 // Constructor
 
@@ -29,9 +30,6 @@ MidiInputController::MidiInputController(PianoKeyboard& keyboard)
 // create a new MIDI log file, ready to have data written to it
 void MidiInputController::createLogFile(string midiLog_filename, string path)
 {
-    // indicate that we have created a log file (so we can close it later)
-    logFileCreated = true;
-    
     if (path.compare("") != 0)
     {
         path = path + "/";
@@ -39,11 +37,8 @@ void MidiInputController::createLogFile(string midiLog_filename, string path)
     
     midiLog_filename = path + midiLog_filename;
     
-    char *fileName = (char*)midiLog_filename.c_str();
-    
-    // create output file
-    midiLog.open (fileName, ios::out | ios::binary);
-    midiLog.seekp(0);
+    // create output file; indicate that we have created a log file (so we can close it later)
+    logFileCreated = midiLog.open(midiLog_filename);
 }
 
 // ------------------------------------------------------
@@ -106,7 +101,7 @@ bool MidiInputController::enablePort(int portNumber) {
 		MidiInputCallback *callback = new MidiInputCallback;
 		RtMidiIn *rtMidiIn = new RtMidiIn;
 		
-		cout << "Enabling MIDI port " << portNumber << " (" << rtMidiIn->getPortName(portNumber) << ")\n";
+		TOUCHKEY_LOG(kLogLevelInfo, "Enabling MIDI port {} ({})") << portNumber << rtMidiIn->getPortName(portNumber);
 		
 		rtMidiIn->openPort(portNumber);				// Open the port
 		rtMidiIn->ignoreTypes(true, true, true);	// Ignore sysex, timing, active sensing	
@@ -152,7 +147,7 @@ void MidiInputController::disablePort(int portNumber) {
 	
 	MidiInputCallback *callback = activePorts_[portNumber];	
 
-	cout << "Disabling MIDI port " << portNumber << " (" << callback->midiIn->getPortName(portNumber) << ")\n";
+	TOUCHKEY_LOG(kLogLevelInfo, "Disabling MIDI port {} ({})") << portNumber << callback->midiIn->getPortName(portNumber);
 
 	callback->midiIn->cancelCallback();
 	delete callback->midiIn;
@@ -166,7 +161,7 @@ void MidiInputController::disablePort(int portNumber) {
 void MidiInputController::disableAllPorts() {
 	map<int, MidiInputCallback*>::iterator it;
 	
-	cout << "Disabling all MIDI ports\n";
+	TOUCHKEY_LOG(kLogLevelInfo, "Disabling all MIDI ports");
 	
 	it = activePorts_.begin();
 	
@@ -295,31 +290,26 @@ void MidiInputController::rtMidiCallback(double deltaTime, vector<unsigned char>
         ////////////////////////////////////////////////////////
         //////////////////// BEGIN LOGGING /////////////////////
         
-        int midi_channel = (int)((*message)[0]);
-        int midi_number = (int)((*message)[1]);
-        int midi_velocity = (int)((*message)[2]);
-        timestamp_type timestamp = eventScheduler_.currentTimestamp();
+        // Timestamps come from the keyboard so they line up with the sensor logs
+        timestamp_type timestamp = keyboard_.schedulerCurrentTimestamp();
         
-        midiLog.write ((char*)&timestamp, sizeof (timestamp_type));
-        midiLog.write ((char*)&midi_channel, sizeof (int));
-        midiLog.write ((char*)&midi_number, sizeof (int));
-        midiLog.write ((char*)&midi_velocity, sizeof (int));
+        midiLog.logMidi(timestamp, &(*message)[0], (int)message->size());
         
         ///////////////////// END LOGGING //////////////////////
         ////////////////////////////////////////////////////////
         ////////////////////////////////////////////////////////
     }
         
-#ifdef MIDI_INPUT_CONTROLLER_DEBUG_RAW
-	cout << "MIDI Input " << inputNumber << ": ";
-	for(int debugPrint = 0; debugPrint < message->size(); debugPrint++)
-		printf("%x ", (*message)[debugPrint]);
-	cout << endl;
-#endif /* MIDI_INPUT_CONTROLLER_DEBUG_RAW */
+	TOUCHKEY_LOG(kLogLevelTrace, "MIDI Input {}: {}") << inputNumber << LogBytes(&(*message)[0], (int)message->size());
 
 	if(!messageIsForActiveChannel(message))
 		return;
 	
+	// Keep the keyboard from adding keys while the message is passed to them
+	boost::shared_lock<boost::shared_mutex> keysLock(keyboard_.keysMutex());
+	
+	pedalControllerHandler(message);
+	
     ////
     
 	switch(mode_) {
@@ -387,6 +377,29 @@ bool MidiInputController::messageIsForActiveChannel(vector<unsigned char> *messa
 	return (activeChannels_.count(channel) > 0);
 }
 
+// Damper, sostenuto and soft pedal controllers update the corresponding pedal
+// of the keyboard. The message is still handled by the mode afterwards.
+
+void MidiInputController::pedalControllerHandler(vector<unsigned char> *message) {
+	if(message->size() < 3)
+		return;
+	if(((*message)[0] & 0xF0) != kMidiMessageControlChange)
+		return;
+	
+	int pedal;
+	if((*message)[1] == kMidiControlDamperPedal)
+		pedal = kPedalDamper;
+	else if((*message)[1] == kMidiControlSostenutoPedal)
+		pedal = kPedalSostenuto;
+	else if((*message)[1] == kMidiControlSoftPedal)
+		pedal = kPedalUnaCorda;
+	else
+		return;
+	
+	if(keyboard_.pedal(pedal) != 0)
+		keyboard_.pedal(pedal)->insertMidiValue((*message)[2], keyboard_.schedulerCurrentTimestamp());
+}
+
 // Mode-specific MIDI handlers.  These methods handle incoming MIDI data according to the rules
 // defined by a particular mode of operation.
 
@@ -525,7 +538,7 @@ void MidiInputController::modePolyphonicHandler(double deltaTime,
 void MidiInputController::modePolyphonicNoteOn(unsigned char note, unsigned char velocity) {
 	if(retransmitChannelsAvailable_.size() == 0) {
 		// No channels available.  Print a warning and finish
-		cout << "No MIDI output channel available for note " << (int)note << endl;
+		TOUCHKEY_LOG(kLogLevelWarning, "No MIDI output channel available for note {}") << (int)note;
 		return;
 	}
 	
@@ -771,10 +784,10 @@ void MidiInputController::modeChannelSelectNoteOnCallback(const char *path, cons
 			// Look for the location of the first touch on this key
 			int numTouches = values[3]->i;
 			
-			cout << "numTouches = " << numTouches << endl;
+			TOUCHKEY_LOG(kLogLevelTrace, "numTouches = {}") << numTouches;
 			if(numTouches > 0) {
 				int firstTouch = values[4]->i;
-				cout << "firstTouch = " << firstTouch << endl;
+				TOUCHKEY_LOG(kLogLevelTrace, "firstTouch = {}") << firstTouch;
 				if(firstTouch < 0 || firstTouch > 2)
 					channelSelectLastOnsetChannel_ = channelSelectDefaultChannel_;	
 				else {
@@ -782,7 +795,7 @@ void MidiInputController::modeChannelSelectNoteOnCallback(const char *path, cons
 					float location = values[6 + 3*firstTouch]->f;
 					float normalizedLocation = location * (float)channelSelectNumberOfDivisions_;
 					
-					cout << "location = " << location << " norm = " << normalizedLocation << endl;
+					TOUCHKEY_LOG(kLogLevelTrace, "location = {} norm = {}") << location << normalizedLocation;
 					
 					// Round down to get the channel number to send to
 					channelSelectLastOnsetChannel_ = (int)floorf(normalizedLocation);
@@ -13,8 +13,6 @@
 #ifndef MIDI_INPUT_CONTROLLER_H
 #define MIDI_INPUT_CONTROLLER_H
 
-#define MIDI_INPUT_CONTROLLER_DEBUG_RAW
-
 #include <iostream>
 #include <vector>
 #include <map>
@@ -22,6 +20,7 @@
 #include "RtMidi.h"
 #include "PianoKeyboard.h"
 #include "Osc.h"
+#include "SessionLog.h"
 
 using namespace std;
 
@@ -44,6 +43,9 @@ enum {
 };
 
 enum {
+	kMidiControlDamperPedal = 64,
+	kMidiControlSostenutoPedal = 66,
+	kMidiControlSoftPedal = 67,
 	kMidiControlAllSoundOff = 120,
 	kMidiControlAllControllersOff = 121,
 	kMidiControlLocalControl = 122,
@@ -142,6 +144,9 @@ private:
 	// we're listening to.
 	bool messageIsForActiveChannel(vector<unsigned char> *message);
 	
+	// Pass pedal controllers on to the keyboard's pedals, whatever the mode
+	void pedalControllerHandler(vector<unsigned char> *message);
+	
 	// Mode-specific MIDI input handlers
 	void modePassThroughHandler(double deltaTime, vector<unsigned char> *message, int inputNumber);	
 	void modeMonophonicHandler(double deltaTime, vector<unsigned char> *message, int inputNumber);
@@ -184,7 +189,7 @@ private:
     
     
     // for logging
-    ofstream midiLog;
+    SessionLog midiLog;
     
     // for generating timestamps
     Scheduler eventScheduler_;
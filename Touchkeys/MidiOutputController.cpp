@@ -8,6 +8,7 @@
  */
 
 #include "MidiOutputController.h"
+#include "Logger.h"
 
 // Constructor
 MidiOutputController::MidiOutputController() : isOpen_(false)
@@ -180,12 +181,7 @@ void MidiOutputController::sendMessage(std::vector<unsigned char>* message) {
 	if(message == 0 || !isOpen_)
 		return;
 	
-#ifdef MIDI_OUTPUT_CONTROLLER_DEBUG_RAW
-	cout << "MIDI Output: ";
-	for(int debugPrint = 0; debugPrint < message->size(); debugPrint++)
-		printf("%x ", (*message)[debugPrint]);
-	cout << endl;
-#endif /* MIDI_OUTPUT_CONTROLLER_DEBUG_RAW */
+	TOUCHKEY_LOG(kLogLevelTrace, "MIDI Output: {}") << LogBytes(&(*message)[0], (int)message->size());
 	
 	midiOut_.sendMessage(message);
 }
\ No newline at end of file
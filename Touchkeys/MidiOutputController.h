@@ -13,8 +13,6 @@
 #ifndef MIDI_OUTPUT_CONTROLLER_H
 #define MIDI_OUTPUT_CONTROLLER_H
 
-#define MIDI_OUTPUT_CONTROLLER_DEBUG_RAW
-
 #include "MidiInputController.h"
 
 const string kMidiVirtualOutputName = "keycontrol";
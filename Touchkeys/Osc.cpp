@@ -8,6 +8,8 @@
  */
 
 #include "osc.h"
+#include "Logger.h"
+#include <sstream>
 
 #pragma mark OscHandler
 
@@ -19,7 +21,7 @@ OscHandler::~OscHandler()
 		
 		for(it = oscListenerPaths_.begin(); it != oscListenerPaths_.end(); ++it)
 		{
-			cout << "Deleting path " << *it << endl;
+			TOUCHKEY_LOG(kLogLevelDebug, "Deleting path {}") << *it;
 			
 			string pathToRemove = *it;
 			oscController_->removeListener(pathToRemove, this);
@@ -81,9 +83,7 @@ bool OscMessageSource::addListener(const string& path, OscHandler *object)
 	noteListeners_.insert(pair<string, OscHandler*>(path, object));
 	pthread_mutex_unlock(&oscListenerMutex_);
 	
-#ifdef DEBUG_MESSAGES
-	cout << "Added OSC listener to path '" << path << "'\n";
-#endif
+	TOUCHKEY_LOG(kLogLevelTrace, "Added OSC listener to path '{}'") << path;
 	
 	return true;
 }
@@ -123,12 +123,10 @@ bool OscMessageSource::removeListener(const string& path, OscHandler *object)
 	
 	pthread_mutex_unlock(&oscListenerMutex_);
 	
-#ifdef DEBUG_MESSAGES	
 	if(removedAny)
-		cout << "Removed OSC listener from path '" << path << "'\n";	
+		TOUCHKEY_LOG(kLogLevelTrace, "Removed OSC listener from path '{}'") << path;
 	else
-		cout << "Removal failed to find OSC listener on path '" << path << "'\n";
-#endif
+		TOUCHKEY_LOG(kLogLevelTrace, "Removal failed to find OSC listener on path '{}'") << path;
 	
 	return removedAny;
 }
@@ -165,12 +163,10 @@ bool OscMessageSource::removeListener(OscHandler *object)
 	
 	pthread_mutex_unlock(&oscListenerMutex_);
 	
-#ifdef DEBUG_MESSAGES	
 	if(removedAny)
-		cout << "Removed OSC listener from all paths\n";	
+		TOUCHKEY_LOG(kLogLevelTrace, "Removed OSC listener from all paths");
 	else
-		cout << "Removal failed to find OSC listener on any path\n";
-#endif
+		TOUCHKEY_LOG(kLogLevelTrace, "Removal failed to find OSC listener on any path");
 	
 	return removedAny;
 }
@@ -199,7 +195,7 @@ int OscReceiver::handler(const char *path, const char *types, lo_arg **argv, int
 	// Check if the incoming message matches the global prefix for this program.  If not, discard it.
 	if(pathString.compare(0, globalPrefix_.length(), globalPrefix_))
 	{
-		cout << "OSC message '" << path << "' received\n";
+		TOUCHKEY_LOG(kLogLevelDebug, "OSC message '{}' received") << path;
 		return 1;
 	}
 	
@@ -218,9 +214,7 @@ int OscReceiver::handler(const char *path, const char *types, lo_arg **argv, int
 	{
 		OscHandler *object = (*it++).second;
 		
-#ifdef DEBUG_MESSAGES
-		cout << "Matched OSC path '" << path << "' to handler " << object << endl;
-#endif
+		TOUCHKEY_LOG(kLogLevelTrace, "Matched OSC path '{}' to handler {}") << path << object;
 		object->oscHandlerMethod(truncatedPath.c_str(), types, argc, argv, data);
 		matched = true;
 	}
@@ -230,15 +224,23 @@ int OscReceiver::handler(const char *path, const char *types, lo_arg **argv, int
 	if(matched)		// This message has been handled
 		return 0;
 	
-	printf("Unhandled OSC path: <%s>\n", path);
+	TOUCHKEY_LOG(kLogLevelInfo, "Unhandled OSC path: <{}>") << path;
 	
-#ifdef DEBUG_MESSAGES
     for (int i=0; i<argc; i++) {
-		printf("arg %d '%c' ", i, types[i]);
-		lo_arg_pp((lo_type)types[i], argv[i]);
-		printf("\n");
+        switch(types[i]) {
+            case 'i':
+                TOUCHKEY_LOG(kLogLevelTrace, "arg {} '{}' {}") << i << types[i] << argv[i]->i;
+                break;
+            case 'f':
+                TOUCHKEY_LOG(kLogLevelTrace, "arg {} '{}' {}") << i << types[i] << argv[i]->f;
+                break;
+            case 's':
+                TOUCHKEY_LOG(kLogLevelTrace, "arg {} '{}' {}") << i << types[i] << &argv[i]->s;
+                break;
+            default:
+                TOUCHKEY_LOG(kLogLevelTrace, "arg {} '{}'") << i << types[i];
+        }
     }
-#endif
 	
     return 1;
 }
@@ -319,15 +321,21 @@ void OscTransmitter::sendMessage(const char * path, const char * type, ...)
 void OscTransmitter::sendMessage(const char * path, const char * type, const lo_message& message)
 {
     if(debugMessages_) {
-        cout << path << " " << type << " ";
-
+        // Only when asked for, so formatting the arguments here is acceptable
+        std::ostringstream arguments;
         int argc = lo_message_get_argc(message);
         lo_arg **argv = lo_message_get_argv(message);
         for (int i=0; i<argc; i++) {
-            lo_arg_pp((lo_type)type[i], argv[i]);
-            cout << " ";
+            if(type[i] == 'i')
+                arguments << argv[i]->i << " ";
+            else if(type[i] == 'f')
+                arguments << argv[i]->f << " ";
+            else if(type[i] == 's')
+                arguments << &argv[i]->s << " ";
+            else
+                arguments << "? ";
         }
-        cout << endl;
+        TOUCHKEY_LOG(kLogLevelInfo, "{} {} {}") << path << type << arguments.str();
     }
     
 	// Send message to everyone who's currently listening
@@ -348,10 +356,8 @@ void OscTransmitter::sendByteArray(const char * path, const unsigned char * data
 	lo_message msg = lo_message_new();
 	lo_message_add_blob(msg, b);
 	
-	if(debugMessages_) {
-		cout << path << " ";
-		lo_message_pp(msg);
-	}
+	if(debugMessages_)
+		TOUCHKEY_LOG(kLogLevelInfo, "{} {}") << path << LogBytes(data, length);
 	
 	// Send message to everyone who's currently listening
 	for(vector<lo_address>::iterator it = addresses_.begin(); it != addresses_.end(); it++) {
@@ -12,6 +12,7 @@
 #include "MRPMapping.h"
 #include "MIDIKeyPositionMapping.h"
 #include "TouchkeyVibratoMapping.h"
+#include "Logger.h"
 
 // Default constructor
 
@@ -22,6 +23,7 @@ PianoKey::PianoKey(PianoKeyboard& keyboard, int noteNumber, int bufferLength)
 	idleDetector_(kPianoKeyIdleBufferLength, positionBuffer_, kPianoKeyDefaultIdlePositionThreshold, 
 				  kPianoKeyDefaultIdleActivityThreshold, kPianoKeyDefaultIdleCounter),
     positionTracker_(kPianoKeyPositionTrackerBufferLength, positionBuffer_),
+    idleRingActive_(false), idleRingStart_(0), idleRingCount_(0),
     state_(kKeyStateToBeInitialized), noteNumber_(noteNumber), touchTimeoutInterval_(kPianoKeyDefaultTouchTimeoutInterval),
     touchIsWaiting_(false)
     //testFilter_(bufferLength, positionBuffer_)
@@ -46,7 +48,8 @@ PianoKey::PianoKey(PianoKey const& obj)
   touchBuffer_(obj.touchBuffer_), midiAftertouch_(obj.midiAftertouch_), touchSensorsArePresent_(obj.touchSensorsArePresent_),
   touchIsActive_(obj.touchIsActive_), midiNoteIsOn_(obj.midiNoteIsOn_),
   midiVelocity_(obj.midiVelocity_), midiChannel_(obj.midiChannel_),
-  idleDetector_(obj.idleDetector_), positionTracker_(obj.positionTracker_), state_(obj.state_), noteNumber_(obj.noteNumber_)
+  idleDetector_(obj.idleDetector_), positionTracker_(obj.positionTracker_),
+  idleRingActive_(false), idleRingStart_(0), idleRingCount_(0), state_(obj.state_), noteNumber_(obj.noteNumber_)
   //testFilter_(obj.testFilter_)
 {
 	enable();
@@ -97,8 +100,12 @@ void PianoKey::reset() {
 	
 	terminateActivity();		// Stop any current activity
 	positionBuffer_.clear();	// Clear all history
+	idleRingActive_ = false;
+	idleRingStart_ = idleRingCount_ = 0;
 	stateBuffer_.clear();
 	idleDetector_.clear();
+	keyboard_.idleDetector().clear(noteNumber_ - keyboard_.keyboardRange().first);
+	keyboard_.stateTable().clear(noteNumber_);
 	changeState(kKeyStateUnknown);	// Reinitialize with unknown state
 	
 	stateMutex_.unlock();	
@@ -106,15 +113,30 @@ void PianoKey::reset() {
 
 // Insert a new sample in the key buffer
 void PianoKey::insertSample(key_position pos, timestamp_type ts) {
-    positionBuffer_.insert(pos, ts);
+    keyboard_.stateTable().setPosition(noteNumber_, pos, ts);
     
-    if((timestamp_diff_type)ts - (timestamp_diff_type)timeOfLastGuiUpdate_ > kPianoKeyGuiUpdateInterval) {
-        timeOfLastGuiUpdate_ = ts;
-        if(keyboard_.gui() != 0) {
-            keyboard_.gui()->setAnalogValueForKey(noteNumber_, pos);
+    // An idle key below the wake threshold can't change anything, so its samples
+    // just go in the ring. Crossing the threshold brings everything up to date.
+    if(idleRingActive_ && state_ == kKeyStateIdle && pos < idleDetector_.keyIdleThreshold())
+        idleRingInsert(pos, ts);
+    else {
+        if(idleRingActive_)
+            idleRingWake();
+        
+        positionBuffer_.insert(pos, ts);
+        keyboard_.idleDetector().insertSample(noteNumber_ - keyboard_.keyboardRange().first, pos, ts);
+        
+        if(state_ == kKeyStateIdle && pos < idleDetector_.keyIdleThreshold()) {
+            idleRingActive_ = true;
+            idleRingStart_ = idleRingCount_ = 0;
         }
     }
     
+    if(keyboard_.gui() != 0 && (timestamp_diff_type)ts - (timestamp_diff_type)timeOfLastGuiUpdate_ > kPianoKeyGuiUpdateInterval) {
+        timeOfLastGuiUpdate_ = ts;
+        keyboard_.gui()->setAnalogValueForKey(noteNumber_, pos);
+    }
+    
     /*if((timestamp_diff_type)ts - (timestamp_diff_type)timeOfLastDebugPrint_ > 1.0) {
         timeOfLastDebugPrint_ = ts;
         key_position kmin = missing_value<key_position>::missing(), kmax = missing_value<key_position>::missing();
@@ -148,6 +170,46 @@ void PianoKey::insertSample(key_position pos, timestamp_type ts) {
     }*/
 }
 
+// Keep a sample for an idle key, overwriting the oldest once the ring is full
+void PianoKey::idleRingInsert(key_position pos, timestamp_type ts) {
+    int slot = idleRingStart_ + idleRingCount_;
+    if(slot >= kPianoKeyIdleRingLength)
+        slot -= kPianoKeyIdleRingLength;
+    
+    idleRingPositions_[slot] = pos;
+    idleRingTimestamps_[slot] = ts;
+    if(idleRingCount_ < kPianoKeyIdleRingLength)
+        idleRingCount_++;
+    else if(++idleRingStart_ == kPianoKeyIdleRingLength)
+        idleRingStart_ = 0;
+}
+
+// Move the ring's samples into the position buffer, oldest first, and give the idle
+// detector the most recent of them. Nothing listens to the buffer while the key is
+// idle, so this triggers no processing of its own.
+void PianoKey::idleRingWake() {
+    for(int i = 0; i < idleRingCount_; i++) {
+        int slot = idleRingStart_ + i;
+        if(slot >= kPianoKeyIdleRingLength)
+            slot -= kPianoKeyIdleRingLength;
+        positionBuffer_.insert(idleRingPositions_[slot], idleRingTimestamps_[slot]);
+    }
+    
+    key_position recentPositions[kKeyIdleNumSamples];
+    int count = 0;
+    Node<key_position>::size_type index = positionBuffer_.endIndex();
+    while(count < kKeyIdleNumSamples && index > positionBuffer_.beginIndex()) {
+        index--;
+        count++;
+    }
+    for(int i = 0; i < count; i++)
+        recentPositions[i] = positionBuffer_[index + i];
+    keyboard_.idleDetector().setHistory(noteNumber_ - keyboard_.keyboardRange().first, recentPositions, count);
+    
+    idleRingActive_ = false;
+    idleRingStart_ = idleRingCount_ = 0;
+}
+
 // If a key is active, force it to become idle, stopping any processes that it has created
 void PianoKey::forceIdle() {
 	stateMutex_.lock();
@@ -167,20 +229,22 @@ void PianoKey::triggerReceived(TriggerSource* who, timestamp_type timestamp) {
 	
 	if(who == &idleDetector_) {
 		//std::cout << "Key " << noteNumber_ << ": IdleDetector says: " << idleDetector_.latest() << std::endl;
+		keyboard_.stateTable().setIdleState(noteNumber_, idleDetector_.latest());
 		
 		if(idleDetector_.latest() == kIdleDetectorIdle) {
-            cout << "Key " << noteNumber_ << " --> Idle\n";
+            TOUCHKEY_LOG(kLogLevelDebug, "Key {} --> Idle") << noteNumber_;
             // Remove any mapping present on this key
             keyboard_.removeMapping(noteNumber_);
             
             positionTracker_.disengage();
             unregisterForTrigger(&positionTracker_);
+            keyboard_.stateTable().setTrackerState(noteNumber_, kPositionTrackerStateUnknown, timestamp);
 			terminateActivity();
 			changeState(kKeyStateIdle);
             keyboard_.setKeyLEDColorRGB(noteNumber_, 0, 0, 0);
 		}
 		else if(idleDetector_.latest() == kIdleDetectorActive && state_ != kKeyStateUnknown) {
-            cout << "Key " << noteNumber_ << " --> Active\n";
+            TOUCHKEY_LOG(kLogLevelDebug, "Key {} --> Active") << noteNumber_;
 			// Only allow transition to active from a known previous state
 			// TODO: set up min/max listener
 			// TODO: may want to change the parameters on the idleDetector
@@ -192,12 +256,12 @@ void PianoKey::triggerReceived(TriggerSource* who, timestamp_type timestamp) {
             positionTracker_.reset();
             positionTracker_.engage();
             
-            // Allocate a new mapping that converts key position gestures to sound
+            // Take a mapping from the pool that converts key position gestures to sound
             // control messages. TODO: how do we handle this with the TouchKey data too?
-            MRPMapping *mapping = new MRPMapping(keyboard_, noteNumber_, &touchBuffer_,
-                                               &positionBuffer_, &positionTracker_);
-            //MIDIKeyPositionMapping *mapping = new MIDIKeyPositionMapping(keyboard_, noteNumber_, &touchBuffer_,
-            //                                                             &positionBuffer_, &positionTracker_);
+            Mapping *mapping = keyboard_.mappingPool().acquire(kMappingTypeMRP, noteNumber_, &touchBuffer_,
+                                                               &positionBuffer_, &positionTracker_);
+            //Mapping *mapping = keyboard_.mappingPool().acquire(kMappingTypeMIDIKeyPosition, noteNumber_, &touchBuffer_,
+            //                                                   &positionBuffer_, &positionTracker_);
             keyboard_.addMapping(noteNumber_, mapping);
             //mapping->setPercussivenessMIDIChannel(1);
             mapping->engage();
@@ -208,35 +272,36 @@ void PianoKey::triggerReceived(TriggerSource* who, timestamp_type timestamp) {
         
         if(notification.type == KeyPositionTrackerNotification::kNotificationTypeStateChange) {
             int positionTrackerState = notification.state;
+            keyboard_.stateTable().setTrackerState(noteNumber_, positionTrackerState, timestamp);
             
             KeyPositionTracker::Event recentEvent;
             std::pair<timestamp_type, key_velocity> velocityInfo;
-            cout << "Key " << noteNumber_ << " --> State " << positionTrackerState << endl;
+            TOUCHKEY_LOG(kLogLevelDebug, "Key {} --> State {}") << noteNumber_ << positionTrackerState;
             
             switch(positionTrackerState) {
                 case kPositionTrackerStatePartialPressAwaitingMax:
                     //keyboard_.setKeyLEDColorRGB(noteNumber_, 1.0, 0.0, 0);
                     recentEvent = positionTracker_.pressStart();
-                    cout << "  start = (" << recentEvent.index << ", " << recentEvent.position << ", " << recentEvent.timestamp << ")\n";
+                    TOUCHKEY_LOG(kLogLevelTrace, "  start = ({}, {}, {})") << recentEvent.index << recentEvent.position << recentEvent.timestamp;
                     break;
                 case kPositionTrackerStatePartialPressFoundMax:
                     //keyboard_.setKeyLEDColorRGB(noteNumber_, 1.0, 0.6, 0);
                     recentEvent = positionTracker_.currentMax();
-                    cout << "  max = (" << recentEvent.index << ", " << recentEvent.position << ", " << recentEvent.timestamp << ")\n";
+                    TOUCHKEY_LOG(kLogLevelTrace, "  max = ({}, {}, {})") << recentEvent.index << recentEvent.position << recentEvent.timestamp;
                     break;
                 case kPositionTrackerStatePressInProgress:                    
                     //keyboard_.setKeyLEDColorRGB(noteNumber_, 0.8, 0.8, 0);
                     velocityInfo = positionTracker_.pressVelocity();
-                    cout << "  escapement time = " << velocityInfo.first << " velocity = " << velocityInfo.second << endl;
+                    TOUCHKEY_LOG(kLogLevelTrace, "  escapement time = {} velocity = {}") << velocityInfo.first << velocityInfo.second;
                     break;
                 case kPositionTrackerStateDown:
                     //keyboard_.setKeyLEDColorRGB(noteNumber_, 0, 1.0, 0);
                     recentEvent = positionTracker_.pressStart();
-                    cout << "  start = (" << recentEvent.index << ", " << recentEvent.position << ", " << recentEvent.timestamp << ")\n";
+                    TOUCHKEY_LOG(kLogLevelTrace, "  start = ({}, {}, {})") << recentEvent.index << recentEvent.position << recentEvent.timestamp;
                     recentEvent = positionTracker_.pressFinish();
-                    cout << "  finish = (" << recentEvent.index << ", " << recentEvent.position << ", " << recentEvent.timestamp << ")\n";
+                    TOUCHKEY_LOG(kLogLevelTrace, "  finish = ({}, {}, {})") << recentEvent.index << recentEvent.position << recentEvent.timestamp;
                     velocityInfo = positionTracker_.pressVelocity();
-                    cout << "  escapement time = " << velocityInfo.first << " velocity = " << velocityInfo.second << endl;
+                    TOUCHKEY_LOG(kLogLevelTrace, "  escapement time = {} velocity = {}") << velocityInfo.first << velocityInfo.second;
                     
                     if(keyboard_.graphGUI() != 0) {
                         keyboard_.graphGUI()->setKeyPressStart(positionTracker_.pressStart().position, positionTracker_.pressStart().timestamp);
@@ -248,7 +313,7 @@ void PianoKey::triggerReceived(TriggerSource* who, timestamp_type timestamp) {
                 case kPositionTrackerStateReleaseInProgress:
                     //keyboard_.setKeyLEDColorRGB(noteNumber_, 0, 0, 1.0);
                     recentEvent = positionTracker_.releaseStart();
-                    cout << "  start = (" << recentEvent.index << ", " << recentEvent.position << ", " << recentEvent.timestamp << ")\n";
+                    TOUCHKEY_LOG(kLogLevelTrace, "  start = ({}, {}, {})") << recentEvent.index << recentEvent.position << recentEvent.timestamp;
                     if(keyboard_.graphGUI() != 0) {
                         keyboard_.graphGUI()->setKeyReleaseStart(positionTracker_.releaseStart().position, positionTracker_.releaseStart().timestamp);
                         keyboard_.graphGUI()->copyKeyDataFromBuffer(positionBuffer_, positionTracker_.pressStart().index - 10,
@@ -259,7 +324,7 @@ void PianoKey::triggerReceived(TriggerSource* who, timestamp_type timestamp) {
                 case kPositionTrackerStateReleaseFinished:
                     //keyboard_.setKeyLEDColorRGB(noteNumber_, 0.5, 0, 1.0);
                     recentEvent = positionTracker_.releaseFinish();
-                    cout << "  finish = (" << recentEvent.index << ", " << recentEvent.position << ", " << recentEvent.timestamp << ")\n";
+                    TOUCHKEY_LOG(kLogLevelTrace, "  finish = ({}, {}, {})") << recentEvent.index << recentEvent.position << recentEvent.timestamp;
                     if(keyboard_.graphGUI() != 0) {
                         keyboard_.graphGUI()->setKeyReleaseStart(positionTracker_.releaseStart().position, positionTracker_.releaseStart().timestamp);
                         keyboard_.graphGUI()->setKeyReleaseFinish(positionTracker_.releaseFinish().position, positionTracker_.releaseFinish().timestamp);
@@ -280,7 +345,9 @@ void PianoKey::triggerReceived(TriggerSource* who, timestamp_type timestamp) {
 // Update the current state
 
 void PianoKey::changeState(key_state newState) {
-	if(!positionBuffer_.empty())
+	if(idleRingActive_ && idleRingCount_ > 0)
+		changeState(newState, idleRingTimestamps_[(idleRingStart_ + idleRingCount_ - 1) % kPianoKeyIdleRingLength]);
+	else if(!positionBuffer_.empty())
 		changeState(newState, positionBuffer_.latestTimestamp());
 	else
 		changeState(newState, 0);
@@ -289,6 +356,7 @@ void PianoKey::changeState(key_state newState) {
 void PianoKey::changeState(key_state newState, timestamp_type timestamp) {
 	stateBuffer_.insert(newState, timestamp);
 	state_ = newState;
+	keyboard_.stateTable().setKeyState(noteNumber_, newState, timestamp);
 }
 
 // Stop any activity that's currently taking place on account of the key motion
@@ -307,12 +375,13 @@ void PianoKey::midiNoteOn(int velocity, int channel, timestamp_type timestamp) {
 	midiChannel_ = channel;
 	midiVelocity_ = velocity;
 	midiOnTimestamp_ = timestamp;
+	keyboard_.stateTable().setMidiNote(noteNumber_, true, velocity);
     
     if(keyboard_.mapping(noteNumber_) == 0) {
 #ifdef TOUCHKEY_VIBRATO_MAPPING
-        std::cout << "Note " << noteNumber_ << ": adding mapping (MIDI)\n";
-        TouchkeyVibratoMapping *mapping = new TouchkeyVibratoMapping(keyboard_, noteNumber_, &touchBuffer_,
-                                                                     &positionBuffer_, &positionTracker_);
+        TOUCHKEY_LOG(kLogLevelDebug, "Note {}: adding mapping (MIDI)") << noteNumber_;
+        Mapping *mapping = keyboard_.mappingPool().acquire(kMappingTypeTouchkeyVibrato, noteNumber_, &touchBuffer_,
+                                                           &positionBuffer_, &positionTracker_);
         keyboard_.addMapping(noteNumber_, mapping);
         //mapping->setMIDIChannel(channel);
         mapping->engage();
@@ -418,12 +487,13 @@ void PianoKey::midiNoteOff(timestamp_type timestamp) {
 	midiNoteIsOn_ = false;
 	midiVelocity_ = 0;
 	midiChannel_ = -1;
+	keyboard_.stateTable().setMidiNote(noteNumber_, false, 0);
 	midiAftertouch_.clear();
 	midiOffTimestamp_ = timestamp;
     
 #ifdef TOUCHKEY_VIBRATO_MAPPING
     if(keyboard_.mapping(noteNumber_) != 0 && !touchIsActive_) {
-        std::cout << "Note " << noteNumber_ << ": removing mapping (MIDI)\n";
+        TOUCHKEY_LOG(kLogLevelDebug, "Note {}: removing mapping (MIDI)") << noteNumber_;
         keyboard_.removeMapping(noteNumber_);
     }
 #endif
@@ -452,9 +522,9 @@ void PianoKey::touchInsertFrame(KeyTouchFrame& newFrame, timestamp_type timestam
         
     if(keyboard_.mapping(noteNumber_) == 0 && noteNumber_ != 91) { // FIXME: quick hack for bad sensor
 #ifdef TOUCHKEY_VIBRATO_MAPPING
-        std::cout << "Note " << noteNumber_ << ": adding mapping (touch)\n";
-        TouchkeyVibratoMapping *mapping = new TouchkeyVibratoMapping(keyboard_, noteNumber_, &touchBuffer_,
-                                                                     &positionBuffer_, &positionTracker_);
+        TOUCHKEY_LOG(kLogLevelDebug, "Note {}: adding mapping (touch)") << noteNumber_;
+        Mapping *mapping = keyboard_.mappingPool().acquire(kMappingTypeTouchkeyVibrato, noteNumber_, &touchBuffer_,
+                                                           &positionBuffer_, &positionTracker_);
         keyboard_.addMapping(noteNumber_, mapping);
         mapping->engage();
 #endif
@@ -467,6 +537,7 @@ void PianoKey::touchInsertFrame(KeyTouchFrame& newFrame, timestamp_type timestam
 	}
 	
 	touchIsActive_ = true;
+	keyboard_.stateTable().setTouchCount(noteNumber_, newFrame.count);
 	
 	// If previous touch frames are present on this key, check the preceding
 	// frame to see if the state has changed in any important ways
@@ -486,11 +557,8 @@ void PianoKey::touchInsertFrame(KeyTouchFrame& newFrame, timestamp_type timestam
 			// One or more points have been added.  Match the new points to the old ones to figure out
 			// which points have been added, versus which moved from before.
 			
-			std::set<int> availableNewPoints;
-			for(int i = 0; i < newFrame.count; i++)
-				availableNewPoints.insert(i);
-			
-			std::list<int> ordering(touchMatchClosestPoints(lastFrame.locs, newFrame.locs, 3, 0, availableNewPoints, 0.0).second);
+			int ordering[3];
+			touchMatchClosestPoints(lastFrame, newFrame, newFrame.count, ordering);
 			
 			// ordering tells us the index of the new point corresponding to each old index,
 			// e.g. {2, 0, 1} --> old point 0 goes to new point 2, old point 1 goes to new point 0, ...
@@ -498,38 +566,34 @@ void PianoKey::touchInsertFrame(KeyTouchFrame& newFrame, timestamp_type timestam
 			// new points are still in ascending position order, so we use this matching to assign unique IDs
 			// and send relevant "add" messages
 			
-			int counter = 0;
-			for(std::list<int>::iterator it = ordering.begin(); it != ordering.end(); ++it) {
-				newFrame.ids[*it] = lastFrame.ids[counter];
+			for(int counter = 0; counter < newFrame.count; counter++) {
+				int index = ordering[counter];
+				
+				newFrame.ids[index] = lastFrame.ids[counter];
 				
-				if(newFrame.ids[*it] < 0) {
+				if(newFrame.ids[index] < 0) {
 					// Matching to a negative ID means the touch is new
 					
-					newFrame.ids[*it] = newFrame.nextId++;
-					touchAdd(newFrame, *it, timestamp);
+					newFrame.ids[index] = newFrame.nextId++;
+					touchAdd(newFrame, index, timestamp);
 				}
 				else {
 					// Send "move" messages for the points that have moved
-					if(fabsf(newFrame.locs[*it] - lastFrame.locs[counter]) > 0 /*moveThreshold_*/)
-						keyboard_.sendMessage("/touchkeys/move", "iiff", noteNumber_, newFrame.ids[*it],
-													 newFrame.locs[*it], newFrame.horizontal(*it), LO_ARGS_END);
-					if(fabsf(newFrame.sizes[*it] - lastFrame.sizes[counter]) > 0 /*resizeThreshold_*/)
-						keyboard_.sendMessage("/touchkeys/resize", "iif", noteNumber_, newFrame.ids[*it],
-													 newFrame.sizes[*it], LO_ARGS_END);								
+					if(fabsf(newFrame.locs[index] - lastFrame.locs[counter]) > 0 /*moveThreshold_*/)
+						keyboard_.sendMessage("/touchkeys/move", "iiff", noteNumber_, newFrame.ids[index],
+													 newFrame.locs[index], newFrame.horizontal(index), LO_ARGS_END);
+					if(fabsf(newFrame.sizes[index] - lastFrame.sizes[counter]) > 0 /*resizeThreshold_*/)
+						keyboard_.sendMessage("/touchkeys/resize", "iif", noteNumber_, newFrame.ids[index],
+													 newFrame.sizes[index], LO_ARGS_END);								
 				}
-				
-				counter++;
 			}			
 		}
 		else if(newFrame.count < lastFrame.count) {
 			// One or more points have been removed.  Match the new points to the old ones to figure out
 			// which points have been removed, versus which moved from before.
 			
-			std::set<int> availableNewPoints;
-			for(int i = 0; i < 3; i++)		
-				availableNewPoints.insert(i);
-			
-			std::list<int> ordering(touchMatchClosestPoints(lastFrame.locs, newFrame.locs, 3, 0, availableNewPoints, 0.0).second);
+			int ordering[3];
+			touchMatchClosestPoints(lastFrame, newFrame, 3, ordering);
 			
 			// ordering tells us the index of the new point corresponding to each old index,
 			// e.g. {2, 0, 1} --> old point 0 goes to new point 2, old point 1 goes to new point 0, ...
@@ -537,27 +601,26 @@ void PianoKey::touchInsertFrame(KeyTouchFrame& newFrame, timestamp_type timestam
 			// new points are still in ascending position order, so we use this matching to assign unique IDs
 			// and send relevant "add" messages
 			
-			int counter = 0;
-			for(std::list<int>::iterator it = ordering.begin(); it != ordering.end(); ++it) {
-				if(*it < newFrame.count) {
+			for(int counter = 0; counter < 3; counter++) {
+				int index = ordering[counter];
+				
+				if(index < newFrame.count) {
 					// Old index {counter} matches a valid new touch
 					
-					newFrame.ids[*it] = lastFrame.ids[counter];	// Match IDs for currently active touches
+					newFrame.ids[index] = lastFrame.ids[counter];	// Match IDs for currently active touches
 					
 					// Send "move" messages for the points that have moved
-					if(fabsf(newFrame.locs[*it] - lastFrame.locs[counter]) > 0 /*moveThreshold_*/)
-						keyboard_.sendMessage("/touchkeys/move", "iiff", noteNumber_, newFrame.ids[*it],
-													 newFrame.locs[*it], newFrame.horizontal(*it), LO_ARGS_END);
-					if(fabsf(newFrame.sizes[*it] - lastFrame.sizes[counter]) > 0 /*resizeThreshold_*/)
-						keyboard_.sendMessage("/touchkeys/resize", "iif", noteNumber_, newFrame.ids[*it],
-													 newFrame.sizes[*it], LO_ARGS_END);											
+					if(fabsf(newFrame.locs[index] - lastFrame.locs[counter]) > 0 /*moveThreshold_*/)
+						keyboard_.sendMessage("/touchkeys/move", "iiff", noteNumber_, newFrame.ids[index],
+													 newFrame.locs[index], newFrame.horizontal(index), LO_ARGS_END);
+					if(fabsf(newFrame.sizes[index] - lastFrame.sizes[counter]) > 0 /*resizeThreshold_*/)
+						keyboard_.sendMessage("/touchkeys/resize", "iif", noteNumber_, newFrame.ids[index],
+													 newFrame.sizes[index], LO_ARGS_END);											
 				}
 				else if(lastFrame.ids[counter] >= 0) {
 					// Old index {counter} matches an invalid new index, meaning a touch has been removed.
 					touchRemove(lastFrame, lastFrame.ids[counter], newFrame.count, timestamp);
 				}
-				
-				counter++;
 			}			
 		}
 		else {
@@ -618,7 +681,7 @@ void PianoKey::touchOff(timestamp_type timestamp) {
     
 #ifdef TOUCHKEY_VIBRATO_MAPPING
     if(keyboard_.mapping(noteNumber_) != 0 && !midiNoteIsOn_) {
-        std::cout << "Note " << noteNumber_ << ": removing mapping (touch)\n";
+        TOUCHKEY_LOG(kLogLevelDebug, "Note {}: removing mapping (touch)") << noteNumber_;
         keyboard_.removeMapping(noteNumber_);
     }
 #endif
@@ -642,6 +705,7 @@ void PianoKey::touchOff(timestamp_type timestamp) {
 	keyboard_.sendMessage("/touchkeys/off", "i", noteNumber_, LO_ARGS_END);
 	touchIsActive_ = false;
 	touchBuffer_.clear();
+	keyboard_.stateTable().setTouchCount(noteNumber_, 0);
 
 	// Update GUI if it is available
 	if(keyboard_.gui() != 0) {
@@ -652,7 +716,7 @@ void PianoKey::touchOff(timestamp_type timestamp) {
 // This function is called when we time out waiting for a touch on the given note
 
 timestamp_type PianoKey::touchTimedOut() {
-	cout << "Touch timed out on note " << noteNumber_ << endl;
+	TOUCHKEY_LOG(kLogLevelDebug, "Touch timed out on note {}") << noteNumber_;
 	
 	// Do all the things we were planning to do once the touch was received.
 	midiNoteOnHelper();
@@ -660,82 +724,63 @@ timestamp_type PianoKey::touchTimedOut() {
     return 0;
 }
 
-// Recursive function for matching old and new frames of touch locations, each with up to (count) points
+// Every ordering of one, two and three touches, each group in lexicographic order
+// and padded out to three entries. kTouchMatchPermutationRange gives the first and
+// last+1 rows to try for each count.
+static const int kTouchMatchPermutations[9][3] = {
+	{0, 1, 2},
+	{0, 1, 2}, {1, 0, 2},
+	{0, 1, 2}, {0, 2, 1}, {1, 0, 2}, {1, 2, 0}, {2, 0, 1}, {2, 1, 0}
+};
+static const int kTouchMatchPermutationRange[4][2] = { {0, 1}, {0, 1}, {1, 3}, {3, 9} };
+
+// Match old and new frames of touches, the first (count) of each, by trying every ordering
+// and keeping the one with the least total distance. ordering[i] is set to the index of the
+// new touch matching old touch i.
 //
 // Example: old points 1-3, new points A-C
 //   1A  *2A*  3A
 //  *1B*  2B   3B
 //   1C   2C  *3C*
+//
+// Distance is squared difference in position plus weighted squared difference in size;
+// a missing touch on either side counts as kPianoKeyTouchMatchMissingDistance. The
+// horizontal location is one value for the whole frame, so it doesn't tell the touches
+// apart. Ties go to the earliest ordering, as the previous recursive search did.
 
-std::pair<float, std::list<int> > PianoKey::touchMatchClosestPoints(const float* oldPoints, const float *newPoints, float count,
-															   int oldIndex, std::set<int>& availableNewPoints, float currentTotalDistance) {
-	if(availableNewPoints.size() == 0)	// Shouldn't happen but prevent an infinite loop
-		throw new std::exception;
+void PianoKey::touchMatchClosestPoints(const KeyTouchFrame& oldFrame, const KeyTouchFrame& newFrame, int count, int *ordering) {
+	float distances[3][3];
 	
-	// End case: only one possible point available
-	if(availableNewPoints.size() == 1) {
-		int newIndex = *(availableNewPoints.begin());
-		
-		std::list<int> singleOrder;
-		singleOrder.push_front(newIndex);
-		
-		if(oldPoints[oldIndex] < 0.0 || newPoints[newIndex] < 0.0) {
-			//if(verbose_ >= 4)
-			//	cout << " -> [" << newIndex << "] (" << currentTotalDistance + 100.0 << ")\n";
-			
-			// Return the distance between the last old point and the only available new point
-			return std::pair<float, std::list<int> > (currentTotalDistance + 100.0, singleOrder);			
-		}
-		else {
-			//if(verbose_ >= 4)
-			//	cout << " -> [" << newIndex << "] (" << currentTotalDistance + (oldPoints[oldIndex] - newPoints[newIndex])*(oldPoints[oldIndex] - newPoints[newIndex]) << ")\n";
-			
-			// Return the distance between the last old point and the only available new point
-			return std::pair<float, std::list<int> > (currentTotalDistance + (oldPoints[oldIndex] - newPoints[newIndex])*(oldPoints[oldIndex] - newPoints[newIndex]), singleOrder);
+	if(count < 1 || count > 3)
+		count = 3;
+	
+	for(int oldIndex = 0; oldIndex < count; oldIndex++) {
+		for(int newIndex = 0; newIndex < count; newIndex++) {
+			if(oldFrame.locs[oldIndex] < 0.0 || newFrame.locs[newIndex] < 0.0)
+				distances[oldIndex][newIndex] = kPianoKeyTouchMatchMissingDistance;
+			else {
+				float locDiff = oldFrame.locs[oldIndex] - newFrame.locs[newIndex];
+				float sizeDiff = oldFrame.sizes[oldIndex] - newFrame.sizes[newIndex];
+				distances[oldIndex][newIndex] = locDiff*locDiff + kPianoKeyTouchMatchSizeWeight*sizeDiff*sizeDiff;
+			}
 		}
 	}
 	
+	int best = kTouchMatchPermutationRange[count][0];
 	float minVal = INFINITY;
-	std::set<int> newPointsCopy(availableNewPoints);
-	std::set<int>::iterator it;
-	std::list<int> order;
 	
-	// Go through all available new points
-	for(it = availableNewPoints.begin(); it != availableNewPoints.end(); ++it) {
-		// Temporarily remove (and test) one point and recursively call ourselves
-		newPointsCopy.erase(*it);
-		
-		float dist;
-		if(newPoints[*it] >= 0.0 && oldPoints[oldIndex] >= 0.0)
-			dist = (oldPoints[oldIndex] - newPoints[*it])*(oldPoints[oldIndex] - newPoints[*it]);
-		else
-			dist = 100.0;
-		
-		std::pair<float, std::list<int> > rval = touchMatchClosestPoints(oldPoints, newPoints, count, oldIndex + 1, newPointsCopy,
-														  currentTotalDistance + dist);
-		
-		//if(verbose_ >= 4)
-		//	cout << "     from " << *it << " got " << rval.first << endl;
-		
-		if(rval.first < minVal) {
-			minVal = rval.first;
-			order = rval.second;
-			order.push_front(*it);
+	for(int p = kTouchMatchPermutationRange[count][0]; p < kTouchMatchPermutationRange[count][1]; p++) {
+		float total = 0;
+		for(int oldIndex = 0; oldIndex < count; oldIndex++)
+			total += distances[oldIndex][kTouchMatchPermutations[p][oldIndex]];
+		if(total < minVal) {
+			minVal = total;
+			best = p;
 		}
-		
-		newPointsCopy.insert(*it);
 	}
 	
-	/*if(verbose_ >= 4) {
-		cout << " -> [";
-		list<int>::iterator it2;
-		
-		for(it2 = order.begin(); it2 != order.end(); ++it2)
-			cout << *it2 << ", ";
-		cout << "] (" << minVal << ")\n";
-	}*/
-	
-	return std::pair<float, std::list<int> >(minVal, order);
+	for(int i = 0; i < 3; i++)
+		ordering[i] = kTouchMatchPermutations[best][i];
 }
 
 // A new touch was added from the last frame to this one
@@ -15,6 +15,7 @@
 #include <boost/mem_fn.hpp>
 #include <boost/thread.hpp>
 #include <boost/bind.hpp>
+#include <boost/static_assert.hpp>
 #include <set>
 #include <map>
 #include <list>
@@ -34,6 +35,13 @@ const key_position kPianoKeyDefaultIdlePositionThreshold = scale_key_position(.0
 const int kPianoKeyDefaultIdleCounter = 20;
 const timestamp_diff_type kPianoKeyDefaultTouchTimeoutInterval = microseconds_to_timestamp(20000);
 const timestamp_diff_type kPianoKeyGuiUpdateInterval = microseconds_to_timestamp(15000); // How frequently to update the position display
+const float kPianoKeyTouchMatchSizeWeight = 0.25;         // Weight of contact size against position when matching touches
+const float kPianoKeyTouchMatchMissingDistance = 100.0;   // Distance to or from a touch that isn't there
+const int kPianoKeyIdleRingLength = 128;   // Samples kept for an idle key that hasn't started to move
+
+// The idle ring has to reach back as far as KeyPositionTracker looks for the start of a press
+BOOST_STATIC_ASSERT(kPianoKeyIdleRingLength > kPositionTrackerSamplesToSearchForStartLocation +
+                    kPositionTrackerSamplesToSearchBeyondStartLocation + kPositionTrackerSamplesToAverageForStartVelocity);
 
 // Possible key states
 enum {
@@ -86,6 +94,14 @@ public:
 	// ***** Access Methods *****
 	
 	Node<key_position>& buffer() { return positionBuffer_; }
+	Node<KeyTouchFrame>& touchBuffer() { return touchBuffer_; }
+	
+	// Whether the key is still or moving (kIdleDetector...)
+	int idleState() { return idleDetector_.idleState(); }
+	KeyIdleDetector& idleDetector() { return idleDetector_; }
+    
+    // State and features of the current press
+    KeyPositionTracker& positionTracker() { return positionTracker_; }
 	
 	// ***** Control Methods *****
 	//
@@ -138,6 +154,10 @@ public:
 	// is called by the scheduler.
 	timestamp_type touchTimedOut();
 	
+	// Match the first (count) touches of two frames, setting ordering[i] to the index of
+	// the new touch that old touch i became. Used by touchInsertFrame() when touches come or go.
+	static void touchMatchClosestPoints(const KeyTouchFrame& oldFrame, const KeyTouchFrame& newFrame, int count, int *ordering);
+	
 private:
 	// ***** MIDI Methods (private) *****
 	
@@ -147,8 +167,6 @@ private:
 	
 	// ***** Touch Methods (private) *****
 	
-	std::pair<float, std::list<int> > touchMatchClosestPoints(const float* oldPoints, const float *newPoints, float count,
-														 int oldIndex, std::set<int>& availableNewPoints, float currentTotalDistance); 
 	void touchAdd(const KeyTouchFrame& frame, int index, timestamp_type timestamp);
 	void touchRemove(const KeyTouchFrame& frame, int idRemoved, int remainingCount, timestamp_type timestamp);
 	void touchMultiFingerGestures(const KeyTouchFrame& lastFrame, const KeyTouchFrame& newFrame, timestamp_type timestamp);
@@ -161,6 +179,15 @@ private:
 	void changeState(key_state newState);
 	void changeState(key_state newState, timestamp_type timestamp);	
 	
+	// ***** Idle Ring Methods *****
+	//
+	// An idle key keeps its samples in a ring instead of the position buffer, checking
+	// only whether each one is past the wake threshold. When one is, the ring is copied
+	// into the buffer and the idle detector so everything downstream sees the full history.
+	
+	void idleRingInsert(key_position pos, timestamp_type ts);
+	void idleRingWake();
+	
 	void terminateActivity();
 	
 	// ***** Member Variables *****
@@ -189,6 +216,11 @@ private:
     timestamp_type timeOfLastGuiUpdate_;    // How long it's been since the last key position GUI call
     timestamp_type timeOfLastDebugPrint_;   // TESTING
     
+    bool idleRingActive_;                                       // Samples go to the ring, not the buffer
+    int idleRingStart_, idleRingCount_;                         // Oldest sample and number held
+    key_position idleRingPositions_[kPianoKeyIdleRingLength];
+    timestamp_type idleRingTimestamps_[kPianoKeyIdleRingLength];
+    
 	Node<key_state> stateBuffer_;		// State history
 	key_state state_;					// Current state of the key (see enum above)
 	boost::mutex stateMutex_;			// Use this to synchronize changes of state
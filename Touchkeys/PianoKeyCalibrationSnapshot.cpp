@@ -0,0 +1,233 @@
+//
+//  PianoKeyCalibrationSnapshot.cpp
+//  touchkeys
+//
+
+#include "PianoKeyCalibrationSnapshot.h"
+#include "Logger.h"
+#include <cstring>
+#include <cstddef>
+#include <cstdio>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <boost/thread/once.hpp>
+
+static boost::uint32_t checksumTable[256];
+static boost::once_flag checksumTableFlag = BOOST_ONCE_INIT;
+
+// Constructor
+PianoKeyCalibrationSnapshot::PianoKeyCalibrationSnapshot()
+: fileDescriptor_(-1), mappedData_(0), mappedLength_(0)
+{
+}
+
+// Destructor
+PianoKeyCalibrationSnapshot::~PianoKeyCalibrationSnapshot() {
+    close();
+}
+
+// Map a snapshot file and check it. The key records are checked here, once, so
+// that selecting a calibration later costs nothing.
+bool PianoKeyCalibrationSnapshot::open(std::string const& filename) {
+    struct stat fileStatus;
+    CalibrationSnapshotHeader header;
+
+    close();
+
+    fileDescriptor_ = ::open(filename.c_str(), O_RDONLY);
+    if(fileDescriptor_ < 0)
+        return false;
+
+    try {
+        if(fstat(fileDescriptor_, &fileStatus) != 0 || fileStatus.st_size < kCalibrationSnapshotHeaderLength)
+            throw 1;
+
+        void *mapping = mmap(0, fileStatus.st_size, PROT_READ, MAP_SHARED, fileDescriptor_, 0);
+        if(mapping == MAP_FAILED) {
+            TOUCHKEY_LOG(kLogLevelError, "PianoKeyCalibrationSnapshot: unable to map {} (errno {})") << filename << errno;
+            throw 1;
+        }
+        mappedData_ = (const char *)mapping;
+        mappedLength_ = fileStatus.st_size;
+
+        memcpy(&header, mappedData_, sizeof(header));
+        if(memcmp(header.magic, kCalibrationSnapshotMagic, 8) != 0 || header.version != kCalibrationSnapshotVersion ||
+           header.byteOrder != kCalibrationSnapshotByteOrderMark || header.keyLength != kCalibrationSnapshotKeyLength ||
+           header.count > (boost::uint32_t)kCalibrationSnapshotMaxCalibrations) {
+            TOUCHKEY_LOG(kLogLevelError, "PianoKeyCalibrationSnapshot: {} has unsupported version or layout") << filename;
+            throw 1;
+        }
+
+        size_t directoryLength = header.count * kCalibrationSnapshotEntryLength;
+        if(mappedLength_ < kCalibrationSnapshotHeaderLength + directoryLength)
+            throw 1;
+        boost::uint32_t crc = checksum(mappedData_ + kCalibrationSnapshotHeaderLength, directoryLength);
+        crc = checksum(&header, offsetof(CalibrationSnapshotHeader, checksum), crc);
+        if(crc != header.checksum) {
+            TOUCHKEY_LOG(kLogLevelError, "PianoKeyCalibrationSnapshot: {} is damaged (bad directory checksum)") << filename;
+            throw 1;
+        }
+
+        const CalibrationSnapshotEntry *entries = (const CalibrationSnapshotEntry *)(mappedData_ + kCalibrationSnapshotHeaderLength);
+        for(boost::uint32_t i = 0; i < header.count; i++) {
+            const CalibrationSnapshotEntry *entry = &entries[i];
+            size_t length = entry->keyCount * kCalibrationSnapshotKeyLength;
+
+            if(entry->keyCount > (boost::uint32_t)kCalibrationSnapshotMaxKeys || entry->offset % 4 != 0 ||
+               entry->offset > mappedLength_ || length > mappedLength_ - entry->offset ||
+               entry->name[kCalibrationSnapshotNameLength - 1] != 0) {
+                TOUCHKEY_LOG(kLogLevelWarning, "PianoKeyCalibrationSnapshot: skipping malformed calibration {} in {}") << i << filename;
+                continue;
+            }
+            if(checksum(mappedData_ + entry->offset, length) != entry->checksum) {
+                TOUCHKEY_LOG(kLogLevelWarning, "PianoKeyCalibrationSnapshot: skipping damaged calibration \"{}\" in {}") << entry->name << filename;
+                continue;
+            }
+            entries_.push_back(entry);
+        }
+    }
+    catch(...) {
+        close();
+        return false;
+    }
+
+    filename_ = filename;
+    return true;
+}
+
+// Unmap and close the file
+void PianoKeyCalibrationSnapshot::close() {
+    if(mappedData_ != 0)
+        munmap((void *)mappedData_, mappedLength_);
+    if(fileDescriptor_ >= 0)
+        ::close(fileDescriptor_);
+    mappedData_ = 0;
+    mappedLength_ = 0;
+    fileDescriptor_ = -1;
+    entries_.clear();
+    filename_.clear();
+}
+
+// Write the calibrations to a temporary file, then move it into place so that
+// readers never see a half-written file
+bool PianoKeyCalibrationSnapshot::write(std::string const& filename, std::vector<Calibration> const& calibrations) {
+    if(calibrations.size() > (size_t)kCalibrationSnapshotMaxCalibrations)
+        return false;
+
+    CalibrationSnapshotHeader header;
+    std::vector<CalibrationSnapshotEntry> entries(calibrations.size());
+    boost::uint32_t offset = kCalibrationSnapshotHeaderLength + (boost::uint32_t)entries.size() * kCalibrationSnapshotEntryLength;
+
+    for(size_t i = 0; i < calibrations.size(); i++) {
+        Calibration const& calibration = calibrations[i];
+
+        if(calibration.keys.size() > (size_t)kCalibrationSnapshotMaxKeys)
+            return false;
+        memset(&entries[i], 0, sizeof(CalibrationSnapshotEntry));
+        strncpy(entries[i].name, calibration.name.c_str(), kCalibrationSnapshotNameLength - 1);
+        entries[i].keyCount = (boost::uint32_t)calibration.keys.size();
+        entries[i].offset = offset;
+        entries[i].checksum = calibration.keys.empty() ? checksum(0, 0) :
+            checksum(&calibration.keys[0], calibration.keys.size() * kCalibrationSnapshotKeyLength);
+        offset += entries[i].keyCount * kCalibrationSnapshotKeyLength;
+    }
+
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, kCalibrationSnapshotMagic, 8);
+    header.version = kCalibrationSnapshotVersion;
+    header.byteOrder = kCalibrationSnapshotByteOrderMark;
+    header.keyLength = kCalibrationSnapshotKeyLength;
+    header.count = (boost::uint32_t)entries.size();
+    header.checksum = entries.empty() ? checksum(0, 0) : checksum(&entries[0], entries.size() * kCalibrationSnapshotEntryLength);
+    header.checksum = checksum(&header, offsetof(CalibrationSnapshotHeader, checksum), header.checksum);
+
+    std::string temporaryFilename = filename + ".tmp";
+    int fd = ::open(temporaryFilename.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if(fd < 0) {
+        TOUCHKEY_LOG(kLogLevelError, "PianoKeyCalibrationSnapshot: unable to create {} (errno {})") << temporaryFilename << errno;
+        return false;
+    }
+
+    bool written = (::write(fd, &header, sizeof(header)) == (ssize_t)sizeof(header));
+    if(written && !entries.empty()) {
+        size_t length = entries.size() * kCalibrationSnapshotEntryLength;
+        written = (::write(fd, &entries[0], length) == (ssize_t)length);
+    }
+    for(size_t i = 0; written && i < calibrations.size(); i++) {
+        if(calibrations[i].keys.empty())
+            continue;
+        size_t length = calibrations[i].keys.size() * kCalibrationSnapshotKeyLength;
+        written = (::write(fd, &calibrations[i].keys[0], length) == (ssize_t)length);
+    }
+    if(written)
+        written = (fsync(fd) == 0);
+    ::close(fd);
+
+    if(!written || rename(temporaryFilename.c_str(), filename.c_str()) != 0) {
+        TOUCHKEY_LOG(kLogLevelError, "PianoKeyCalibrationSnapshot: could not write {} (errno {})") << filename << errno;
+        unlink(temporaryFilename.c_str());
+        return false;
+    }
+
+    return true;
+}
+
+// Name of a calibration
+std::string PianoKeyCalibrationSnapshot::name(int index) {
+    if(index < 0 || index >= (int)entries_.size())
+        return "";
+    return entries_[index]->name;
+}
+
+// Find a calibration by name
+int PianoKeyCalibrationSnapshot::find(std::string const& name) {
+    for(int i = 0; i < (int)entries_.size(); i++) {
+        if(name.compare(entries_[i]->name) == 0)
+            return i;
+    }
+    return -1;
+}
+
+// Key records of a calibration, straight from the mapping
+const CalibrationSnapshotKey* PianoKeyCalibrationSnapshot::keys(int index, int& keyCount) {
+    keyCount = 0;
+    if(index < 0 || index >= (int)entries_.size())
+        return 0;
+    keyCount = (int)entries_[index]->keyCount;
+    return (const CalibrationSnapshotKey *)(mappedData_ + entries_[index]->offset);
+}
+
+// Copy out all the calibrations
+void PianoKeyCalibrationSnapshot::readAll(std::vector<Calibration>& calibrations) {
+    calibrations.resize(entries_.size());
+    for(int i = 0; i < (int)entries_.size(); i++) {
+        int keyCount;
+        const CalibrationSnapshotKey *keyRecords = keys(i, keyCount);
+
+        calibrations[i].name = entries_[i]->name;
+        calibrations[i].keys.assign(keyRecords, keyRecords + keyCount);
+    }
+}
+
+// Table-driven CRC-32 (reflected polynomial 0xEDB88320)
+boost::uint32_t PianoKeyCalibrationSnapshot::checksum(const void *data, size_t length, boost::uint32_t crc) {
+    boost::call_once(checksumTableFlag, &PianoKeyCalibrationSnapshot::createChecksumTable);
+
+    const unsigned char *bytes = (const unsigned char *)data;
+    crc = ~crc;
+    for(size_t i = 0; i < length; i++)
+        crc = checksumTable[(crc ^ bytes[i]) & 0xFF] ^ (crc >> 8);
+    return ~crc;
+}
+
+void PianoKeyCalibrationSnapshot::createChecksumTable() {
+    for(boost::uint32_t i = 0; i < 256; i++) {
+        boost::uint32_t value = i;
+        for(int j = 0; j < 8; j++)
+            value = (value & 1) ? (0xEDB88320 ^ (value >> 1)) : (value >> 1);
+        checksumTable[i] = value;
+    }
+}
@@ -0,0 +1,140 @@
+//
+//  PianoKeyCalibrationSnapshot.h
+//  touchkeys
+//
+
+#ifndef __touchkeys__PianoKeyCalibrationSnapshot__
+#define __touchkeys__PianoKeyCalibrationSnapshot__
+
+#include <iostream>
+#include <string>
+#include <vector>
+#include <boost/cstdint.hpp>
+#include <boost/static_assert.hpp>
+#include "PianoKeyCalibrator.h"
+
+// File format constants. The header is followed by a directory with one entry per
+// named calibration, then each calibration's key records. All fields are stored in
+// native byte order, which the header identifies with kCalibrationSnapshotByteOrderMark.
+
+const char kCalibrationSnapshotMagic[8] = { 'T', 'K', 'C', 'A', 'L', 'I', 'B', 0 };
+const boost::uint32_t kCalibrationSnapshotVersion = 1;
+const boost::uint32_t kCalibrationSnapshotByteOrderMark = 0x01020304;
+const int kCalibrationSnapshotHeaderLength = 32;
+const int kCalibrationSnapshotEntryLength = 64;
+const int kCalibrationSnapshotKeyLength = 96;
+const int kCalibrationSnapshotNameLength = 48;          // Including terminator
+const int kCalibrationSnapshotMaxCalibrations = 256;
+const int kCalibrationSnapshotMaxKeys = 1024;           // Per calibration
+
+// Key record flags
+enum {
+    kCalibrationSnapshotKeyHasWarp = 1
+};
+
+// The header checksum covers the rest of the header and the whole directory
+struct CalibrationSnapshotHeader {
+    char magic[8];                      // kCalibrationSnapshotMagic
+    boost::uint32_t version;            // kCalibrationSnapshotVersion
+    boost::uint32_t byteOrder;          // kCalibrationSnapshotByteOrderMark
+    boost::uint32_t keyLength;          // kCalibrationSnapshotKeyLength
+    boost::uint32_t count;              // Calibrations in the file
+    boost::uint32_t checksum;           // CRC-32 of the directory, then the fields above
+    boost::uint32_t reserved;
+};
+
+BOOST_STATIC_ASSERT(sizeof(CalibrationSnapshotHeader) == kCalibrationSnapshotHeaderLength);
+
+// One named calibration
+struct CalibrationSnapshotEntry {
+    char name[kCalibrationSnapshotNameLength];
+    boost::uint32_t keyCount;           // Key records in the calibration
+    boost::uint32_t offset;             // Bytes from the start of the file to the first
+    boost::uint32_t checksum;           // CRC-32 of the key records
+    boost::uint32_t reserved;
+};
+
+BOOST_STATIC_ASSERT(sizeof(CalibrationSnapshotEntry) == kCalibrationSnapshotEntryLength);
+
+// One key's calibration, as held by its PianoKeyCalibrator
+struct CalibrationSnapshotKey {
+    boost::int32_t status;              // kPianoKey... calibration status
+    boost::int32_t quiescent;
+    boost::int32_t press;
+    boost::uint32_t flags;              // kCalibrationSnapshotKey...
+    float warp[kPianoKeyWarpTableSize]; // Only meaningful with kCalibrationSnapshotKeyHasWarp
+    boost::uint32_t reserved[3];
+};
+
+BOOST_STATIC_ASSERT(sizeof(CalibrationSnapshotKey) == kCalibrationSnapshotKeyLength);
+
+/*
+ * PianoKeyCalibrationSnapshot
+ *
+ * Binary store for calibrations, holding any number of named calibrations (say, one
+ * per venue) in one file. Opening the file maps it into memory and checks the header
+ * and every calibration against its checksum, so afterwards switching calibration is
+ * just a matter of copying fixed-size key records into the calibrators: nothing is
+ * parsed or allocated. The file is replaced as a whole when written, so a snapshot
+ * that is already open keeps reading the old contents undisturbed.
+ *
+ * XML (see PianoKeyCalibrator::loadFromXml()) remains the format for exchanging
+ * calibrations; this is for getting a known one back quickly.
+ */
+
+class PianoKeyCalibrationSnapshot {
+public:
+    // A named calibration, for writing
+    struct Calibration {
+        std::string name;
+        std::vector<CalibrationSnapshotKey> keys;
+    };
+
+    // ***** Constructor *****
+    PianoKeyCalibrationSnapshot();
+
+    // ***** Destructor *****
+    ~PianoKeyCalibrationSnapshot();
+
+    // ***** File Methods *****
+    //
+    // open() returns false if the file isn't a snapshot this version can read, or its
+    // directory is damaged. Calibrations that fail their checksum are left out.
+    bool open(std::string const& filename);
+    void close();
+    bool isOpen() { return mappedData_ != 0; }
+    std::string const& filename() { return filename_; }
+
+    // Write a complete file. Returns true on success.
+    static bool write(std::string const& filename, std::vector<Calibration> const& calibrations);
+
+    // ***** Calibrations *****
+    //
+    // Index of the named calibration, or -1 if it isn't there
+    int count() { return (int)entries_.size(); }
+    std::string name(int index);
+    int find(std::string const& name);
+
+    // The key records of a calibration, pointing into the mapped file. Returns 0 if
+    // there is no such calibration.
+    const CalibrationSnapshotKey* keys(int index, int& keyCount);
+
+    // Copy out every calibration, for rewriting the file with one changed
+    void readAll(std::vector<Calibration>& calibrations);
+
+    // ***** Utility *****
+    //
+    // CRC-32 (as used by zip), continuing from a previous value
+    static boost::uint32_t checksum(const void *data, size_t length, boost::uint32_t crc = 0);
+
+private:
+    static void createChecksumTable();
+
+    int fileDescriptor_;
+    const char *mappedData_;
+    size_t mappedLength_;
+    std::string filename_;
+    std::vector<const CalibrationSnapshotEntry*> entries_;  // Calibrations that passed their checks
+};
+
+#endif /* defined(__touchkeys__PianoKeyCalibrationSnapshot__) */
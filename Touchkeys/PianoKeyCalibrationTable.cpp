@@ -0,0 +1,127 @@
+//
+//  PianoKeyCalibrationTable.cpp
+//  touchkeys
+//
+
+#include "PianoKeyCalibrationTable.h"
+#include "PianoKeyCalibrator.h"
+
+// Constructor
+PianoKeyCalibrationTable::PianoKeyCalibrationTable(int length)
+: length_(length > 0 ? length : 0)
+{
+    status_ = new int[length_];
+    quiescent_ = new float[length_];
+    scale_ = new float[length_];
+    clipLow_ = new float[length_];
+    clipHigh_ = new float[length_];
+    valid_ = new bool[length_];
+    warp_ = new float[length_ * kPianoKeyWarpTableSize];
+    warpCapturing_ = new bool[length_];
+
+    for(int i = 0; i < length_; i++) {
+        setKey(i, kPianoKeyNotCalibrated, 0, 0);
+        setWarpTable(i, 0);
+        warpCapturing_[i] = false;
+    }
+}
+
+// Destructor
+PianoKeyCalibrationTable::~PianoKeyCalibrationTable() {
+    delete[] status_;
+    delete[] quiescent_;
+    delete[] scale_;
+    delete[] clipLow_;
+    delete[] clipHigh_;
+    delete[] valid_;
+    delete[] warp_;
+    delete[] warpCapturing_;
+}
+
+// Set the calibration for one key. The division is done here, once,
+// rather than for every sample.
+void PianoKeyCalibrationTable::setKey(int index, int status, int quiescent, int press) {
+    if(index < 0 || index >= length_)
+        return;
+
+    status_[index] = status;
+    quiescent_[index] = 0;
+    scale_[index] = 0;
+    clipLow_[index] = kPianoKeyCalibrationClipLow;
+    clipHigh_[index] = kPianoKeyCalibrationClipHigh;
+    valid_[index] = false;
+
+    if(status != kPianoKeyCalibrated || missing_value<int>::isMissing(quiescent) ||
+       missing_value<int>::isMissing(press) || press == quiescent)
+        return;
+
+    quiescent_[index] = (float)quiescent;
+    scale_[index] = (float)scale_key_position(1) / (float)(press - quiescent);
+    clipLow_[index] = (float)scale_key_position(1) * kPianoKeyCalibrationClipLow;
+    clipHigh_[index] = (float)scale_key_position(1) * kPianoKeyCalibrationClipHigh;
+    valid_[index] = true;
+}
+
+// Set the warp table for a key; without one, use a straight line
+void PianoKeyCalibrationTable::setWarpTable(int index, const float *table) {
+    if(index < 0 || index >= length_)
+        return;
+
+    float *warp = warp_ + index * kPianoKeyWarpTableSize;
+    for(int i = 0; i < kPianoKeyWarpTableSize; i++)
+        warp[i] = (table != 0) ? table[i] : (float)i / (float)(kPianoKeyWarpTableSize - 1);
+}
+
+// Mark whether a key is capturing warp samples
+void PianoKeyCalibrationTable::setWarpCapturing(int index, bool capturing) {
+    if(index < 0 || index >= length_)
+        return;
+    warpCapturing_[index] = capturing;
+}
+
+// Calibrate a frame's worth of values. The loops do the arithmetic for every key
+// whether or not it is calibrated or warped, so they have no branches and the
+// compiler can vectorize them: first the linear map, then the warp table lookup,
+// then replacing uncalibrated keys with missing.
+void PianoKeyCalibrationTable::calibrate(int firstIndex, const int *rawValues, key_position *positions, int count) const {
+    int available = 0;
+
+    if(firstIndex >= 0 && firstIndex < length_)
+        available = (firstIndex + count <= length_) ? count : length_ - firstIndex;
+
+    const float *quiescent = quiescent_ + firstIndex;
+    const float *scale = scale_ + firstIndex;
+    const float *clipLow = clipLow_ + firstIndex;
+    const float *clipHigh = clipHigh_ + firstIndex;
+    const bool *valid = valid_ + firstIndex;
+    const float *warp = warp_ + firstIndex * kPianoKeyWarpTableSize;
+    const float unit = (float)scale_key_position(1);
+    const float lastPoint = (float)(kPianoKeyWarpTableSize - 1);
+
+    for(int i = 0; i < available; i++) {
+        float value = ((float)rawValues[i] - quiescent[i]) * scale[i];
+        value = value < clipLow[i] ? clipLow[i] : value;
+        value = value > clipHigh[i] ? clipHigh[i] : value;
+        positions[i] = (key_position)value;
+    }
+
+    // Interpolate in the warp table within [0, 1]; outside it the linear value stands
+    for(int i = 0; i < available; i++) {
+        float value = (float)positions[i] / unit;
+        float x = value * lastPoint;
+        x = x < 0 ? 0 : x;
+        x = x > lastPoint ? lastPoint : x;
+        int point = (int)x;
+        point = point > kPianoKeyWarpTableSize - 2 ? kPianoKeyWarpTableSize - 2 : point;
+        float fraction = x - (float)point;
+        const float *table = warp + i * kPianoKeyWarpTableSize;
+        float warped = table[point] + fraction * (table[point + 1] - table[point]);
+        positions[i] = (value >= 0 && value <= 1) ? (key_position)(warped * unit) : positions[i];
+    }
+
+    for(int i = 0; i < available; i++)
+        positions[i] = valid[i] ? positions[i] : missing_value<key_position>::missing();
+
+    for(int i = available; i < count; i++)
+        positions[i] = missing_value<key_position>::missing();
+}
@@ -0,0 +1,73 @@
+//
+//  PianoKeyCalibrationTable.h
+//  touchkeys
+//
+
+#ifndef __touchkeys__PianoKeyCalibrationTable__
+#define __touchkeys__PianoKeyCalibrationTable__
+
+#include <iostream>
+#include "PianoTypes.h"
+
+/*
+ * PianoKeyCalibrationTable
+ *
+ * A snapshot of the calibration of every key on a device, laid out as parallel
+ * arrays so that a whole analog frame can be calibrated in one pass with no
+ * branches and no locks. Tables are filled in once and never changed after being
+ * published; a new calibration is applied by publishing a new table in its place.
+ *
+ * Each key also has a warp table correcting the sensor's non-linearity, applied by
+ * interpolating between its points. Keys without one get a straight line, so every
+ * key goes through the same arithmetic.
+ *
+ * Keys that are in the middle of being calibrated are marked as such, so their
+ * samples can be sent to the PianoKeyCalibrator to update its history instead.
+ */
+
+class PianoKeyCalibrationTable {
+public:
+    // ***** Constructor *****
+    //
+    // All keys start uncalibrated
+    PianoKeyCalibrationTable(int length);
+
+    // ***** Destructor *****
+    ~PianoKeyCalibrationTable();
+
+    // ***** Setup *****
+    //
+    // Set one key from its calibrator's status and values. Only call before publishing.
+    void setKey(int index, int status, int quiescent, int press);
+    
+    // Set a key's warp table (kPianoKeyWarpTableSize values), or 0 for none
+    void setWarpTable(int index, const float *table);
+    
+    // Mark a key as capturing samples for a warp table
+    void setWarpCapturing(int index, bool capturing);
+
+    // ***** Evaluation *****
+    //
+    // Calibrate count raw values belonging to the keys starting at firstIndex.
+    // Keys which are not calibrated, or not in the table, come out missing.
+    void calibrate(int firstIndex, const int *rawValues, key_position *positions, int count) const;
+
+    int length() const { return length_; }
+    int status(int index) const { return (index >= 0 && index < length_) ? status_[index] : 0; }
+    bool isCalibrated(int index) const { return (index >= 0 && index < length_) ? valid_[index] : false; }
+    float quiescent(int index) const { return (index >= 0 && index < length_) ? quiescent_[index] : 0; }
+    bool warpCapturing(int index) const { return (index >= 0 && index < length_) ? warpCapturing_[index] : false; }
+
+private:
+    int length_;                // Number of keys
+    int *status_;               // kPianoKey... calibration status of each key
+    float *quiescent_;          // Resting raw value
+    float *scale_;              // Reciprocal of the press - quiescent range
+    float *clipLow_;            // Bounds for calibrated values
+    float *clipHigh_;
+    bool *valid_;               // Whether the values above give a usable calibration
+    float *warp_;               // kPianoKeyWarpTableSize points per key
+    bool *warpCapturing_;       // Whether each key's samples are needed for a warp table
+};
+
+#endif /* defined(__touchkeys__PianoKeyCalibrationTable__) */
@@ -8,18 +8,25 @@
  */
 
 #include "PianoKeyCalibrator.h"
+#include "Logger.h"
+#include <sstream>
+#include <algorithm>
 
 // Constructor
 PianoKeyCalibrator::PianoKeyCalibrator(bool pressValueGoesDown, key_position* warpTable)
 : status_(kPianoKeyNotCalibrated), prevStatus_(kPianoKeyNotCalibrated), history_(0),
-  pressValueGoesDown_(pressValueGoesDown), warpTable_(warpTable) {}
+  pressValueGoesDown_(pressValueGoesDown), quiescent_(missing_value<int>::missing()),
+  press_(missing_value<int>::missing()), newPress_(missing_value<int>::missing()), warpCaptureActive_(false)
+{
+    if(warpTable != 0)
+        warpTable_.assign(warpTable, warpTable + kPianoKeyWarpTableSize);
+}
 
 // Destructor
 PianoKeyCalibrator::~PianoKeyCalibrator() {
     if(history_ != 0)
         delete history_;
     
-	// warpTable_ is passed in externally-- don't delete it
 }
 
 // Produce the calibrated value for a raw sample
@@ -45,15 +52,14 @@ key_position PianoKeyCalibrator::evaluate(int rawValue) {
 			else {
                 // Scale the value and clip it to a sensible range (for badly calibrated sensors)
 				calibratedValue = (scale_key_position((rawValue - quiescent_))) / calibratedValueDenominator;
-                if(calibratedValue < -0.5)
-                    calibratedValue = -0.5;
-                if(calibratedValue > 1.2)
-                    calibratedValue = 1.2;
+                if(calibratedValue < kPianoKeyCalibrationClipLow)
+                    calibratedValue = kPianoKeyCalibrationClipLow;
+                if(calibratedValue > kPianoKeyCalibrationClipHigh)
+                    calibratedValue = kPianoKeyCalibrationClipHigh;
             }
 			
-			if(warpTable_ != 0) {
-				// TODO: warping
-			}
+			if(!warpTable_.empty() && !missing_value<key_position>::isMissing(calibratedValue))
+				calibratedValue = warpPosition(&warpTable_[0], calibratedValue);
 			calibrationMutex_.unlock();
 			return calibratedValue;
 		case kPianoKeyInCalibration:
@@ -95,6 +101,19 @@ key_position PianoKeyCalibrator::evaluate(int rawValue) {
 	}
 }
 
+// Read the calibration state and values under the lock
+int PianoKeyCalibrator::calibrationValues(int& quiescent, int& press) {
+    int status;
+    
+    calibrationMutex_.lock();
+    status = status_;
+    quiescent = quiescent_;
+    press = press_;
+    calibrationMutex_.unlock();
+    
+    return status;
+}
+
 // Begin the calibrating process.
 void PianoKeyCalibrator::calibrationStart() {
 	if(status_ == kPianoKeyInCalibration)	// Throw away the old results if we're already in progress
@@ -167,8 +186,10 @@ void PianoKeyCalibrator::calibrationAbort() {
 void PianoKeyCalibrator::calibrationClear() {
 	if(status_ == kPianoKeyInCalibration)
 		calibrationAbort();
+	warpCaptureAbort();
 	calibrationMutex_.lock();
 	status_ = prevStatus_ = kPianoKeyNotCalibrated;
+	warpTable_.clear();
 	calibrationMutex_.unlock();
 }
 
@@ -180,6 +201,75 @@ void PianoKeyCalibrator::calibrationUpdateQuiescent() {
 	calibrationAbort();
 }
 
+// Begin collecting samples for a warp table. The key must already be calibrated.
+void PianoKeyCalibrator::warpCaptureStart() {
+	if(status_ != kPianoKeyCalibrated)
+		return;
+	
+	historyMutex_.lock();
+	warpCapture_.clear();
+	warpCapture_.reserve(kPianoKeyWarpCaptureMaxSamples);
+	warpCaptureActive_ = true;
+	historyMutex_.unlock();
+}
+
+// Add a raw sample to the warp capture, until the buffer is full
+void PianoKeyCalibrator::warpCaptureSample(int rawValue) {
+	historyMutex_.lock();
+	if(warpCaptureActive_ && warpCapture_.size() < kPianoKeyWarpCaptureMaxSamples)
+		warpCapture_.push_back(rawValue);
+	historyMutex_.unlock();
+}
+
+// Stop capturing and fit a new warp table. The old table is kept if there
+// wasn't enough data.
+bool PianoKeyCalibrator::warpCaptureFinish() {
+	std::vector<float> table;
+	bool fitted;
+	
+	calibrationMutex_.lock();
+	historyMutex_.lock();
+	if(!warpCaptureActive_) {
+		historyMutex_.unlock();
+		calibrationMutex_.unlock();
+		return false;
+	}
+	warpCaptureActive_ = false;
+	fitted = fitWarpTable(table);
+	if(fitted)
+		warpTable_ = table;
+	warpCapture_.clear();
+	historyMutex_.unlock();
+	calibrationMutex_.unlock();
+	
+	return fitted;
+}
+
+// Stop capturing without changing the warp table
+void PianoKeyCalibrator::warpCaptureAbort() {
+	historyMutex_.lock();
+	warpCaptureActive_ = false;
+	warpCapture_.clear();
+	historyMutex_.unlock();
+}
+
+// Go back to a purely linear calibration
+void PianoKeyCalibrator::warpTableClear() {
+	calibrationMutex_.lock();
+	warpTable_.clear();
+	calibrationMutex_.unlock();
+}
+
+// Copy out the warp table
+bool PianoKeyCalibrator::warpTableValues(float *values) {
+	calibrationMutex_.lock();
+	bool hasTable = !warpTable_.empty();
+	if(hasTable)
+		std::copy(warpTable_.begin(), warpTable_.end(), values);
+	calibrationMutex_.unlock();
+	return hasTable;
+}
+
 // Load calibration data from an XML string
 void PianoKeyCalibrator::loadFromXml(TiXmlElement* baseElement) {
 	// Abort any calibration in progress and reset to default values
@@ -200,7 +290,39 @@ void PianoKeyCalibrator::loadFromXml(TiXmlElement* baseElement) {
                 changeStatus(kPianoKeyCalibrated);
             }
         }
+        
+        // The warp table is optional: a list of values separated by spaces
+        const char *warp = calibrationElement->Attribute("warp");
+        if(warp != 0) {
+            std::istringstream warpStream(warp);
+            std::vector<float> table;
+            float value;
+            
+            while(warpStream >> value)
+                table.push_back(value);
+            if(table.size() == kPianoKeyWarpTableSize)
+                warpTable_ = table;
+            else
+                TOUCHKEY_LOG(kLogLevelWarning, "PianoKeyCalibrator: ignoring warp table with {} values") << table.size();
+        }
+	}
+}
+
+// Load calibration values without going through XML
+void PianoKeyCalibrator::loadValues(int quiescent, int press, const float *warpTable) {
+	if(status_ == kPianoKeyInCalibration)
+		calibrationAbort();
+	calibrationClear();
+	
+	calibrationMutex_.lock();
+	if(!missing_value<int>::isMissing(quiescent) && !missing_value<int>::isMissing(press)) {
+		quiescent_ = quiescent;
+		press_ = press;
+		changeStatus(kPianoKeyCalibrated);
 	}
+	if(warpTable != 0)
+		warpTable_.assign(warpTable, warpTable + kPianoKeyWarpTableSize);
+	calibrationMutex_.unlock();
 }
 
 // Saves calibration data within the provided XML Element.  Child elements
@@ -213,6 +335,15 @@ bool PianoKeyCalibrator::saveToXml(TiXmlElement *baseElement) {
     newElement.SetAttribute("quiescent", quiescent_);
     newElement.SetAttribute("press", press_);
     
+    if(!warpTable_.empty()) {
+        std::ostringstream warpStream;
+        
+        warpStream.precision(5);
+        for(unsigned int i = 0; i < warpTable_.size(); i++)
+            warpStream << (i > 0 ? " " : "") << warpTable_[i];
+        newElement.SetAttribute("warp", warpStream.str());
+    }
+    
     if(baseElement->InsertEndChild(newElement) == NULL)
         return false;
 
@@ -263,4 +394,70 @@ int PianoKeyCalibrator::averagePosition(int length) {
     }
     
     return (int)(sum / count);
-}
\ No newline at end of file
+}
+// Fit a warp table from the captured samples. Each press stroke (from near the top
+// of the key's travel to near the bottom) is assumed to move at constant speed, so
+// the fraction of the stroke's duration elapsed gives the true position of each
+// sample. These are averaged for each point in the table against the linear
+// calibration, then made monotonic. Needs both locks held.
+bool PianoKeyCalibrator::fitWarpTable(std::vector<float>& table) {
+	if(missing_value<int>::isMissing(quiescent_) || missing_value<int>::isMissing(press_) || press_ == quiescent_)
+		return false;
+	
+	std::vector<double> sums(kPianoKeyWarpTableSize, 0), counts(kPianoKeyWarpTableSize, 0);
+	float range = (float)(press_ - quiescent_);
+	int strokeStart = -1, strokes = 0;
+	
+	for(int i = 0; i < (int)warpCapture_.size(); i++) {
+		float position = (float)(warpCapture_[i] - quiescent_) / range;
+		
+		if(position <= kPianoKeyWarpStrokeStart)
+			strokeStart = i;    // Latest sample at the top: the stroke starts here
+		else if(position >= kPianoKeyWarpStrokeEnd && strokeStart >= 0) {
+			// Found a complete stroke. Compare each sample's linear position to its time.
+			for(int j = strokeStart; j <= i; j++) {
+				float linear = (float)(warpCapture_[j] - quiescent_) / range;
+				int point = (int)(linear * (kPianoKeyWarpTableSize - 1) + 0.5);
+				if(point < 0 || point >= kPianoKeyWarpTableSize)
+					continue;
+				sums[point] += (double)(j - strokeStart) / (double)(i - strokeStart);
+				counts[point]++;
+			}
+			strokes++;
+			strokeStart = -1;
+		}
+	}
+	
+	if(strokes < kPianoKeyWarpMinimumStrokes) {
+		TOUCHKEY_LOG(kLogLevelWarning, "PianoKeyCalibrator: found {} strokes for warp table, need {}") << strokes << kPianoKeyWarpMinimumStrokes;
+		return false;
+	}
+	
+	// The ends are fixed so the table joins the linear calibration outside [0, 1]
+	table.assign(kPianoKeyWarpTableSize, -1);
+	table[0] = 0;
+	table[kPianoKeyWarpTableSize - 1] = 1;
+	for(int i = 1; i < kPianoKeyWarpTableSize - 1; i++) {
+		if(counts[i] > 0)
+			table[i] = (float)(sums[i] / counts[i]);
+	}
+	
+	// Fill points with no samples by interpolating their neighbours, then make
+	// sure the table never decreases
+	for(int i = 1; i < kPianoKeyWarpTableSize - 1; i++) {
+		if(table[i] >= 0)
+			continue;
+		int next = i + 1;
+		while(table[next] < 0)
+			next++;
+		table[i] = table[i - 1] + (table[next] - table[i - 1]) / (float)(next - i + 1);
+	}
+	for(int i = 1; i < kPianoKeyWarpTableSize; i++) {
+		if(table[i] < table[i - 1])
+			table[i] = table[i - 1];
+		if(table[i] > 1)
+			table[i] = 1;
+	}
+	
+	return true;
+}
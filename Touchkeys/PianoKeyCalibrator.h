@@ -11,6 +11,7 @@
 #define KEYCONTROL_PIANO_KEY_CALIBRATOR_H
 
 #include <iostream>
+#include <vector>
 #include <boost/circular_buffer.hpp>
 #include <boost/thread.hpp>
 #include "tinyxml.h"
@@ -31,6 +32,18 @@ const size_t kPianoKeyCalibrationPressLength = 10; // 10
 // Minimum amount of range between quiescent and press for a note to be calibrated
 const int kPianoKeyCalibrationMinimumRange = 64;
 
+// Range calibrated values are clipped to (for badly calibrated sensors)
+const float kPianoKeyCalibrationClipLow = -0.5;
+const float kPianoKeyCalibrationClipHigh = 1.2;
+
+// Warp table: corrects sensor non-linearity between the quiescent (0) and press (1)
+// positions. Values outside that range are left alone.
+const int kPianoKeyWarpTableSize = 17;                  // Points in the table, evenly spaced from 0 to 1
+const size_t kPianoKeyWarpCaptureMaxSamples = 60000;    // Samples kept while capturing (60s at 1kHz)
+const float kPianoKeyWarpStrokeStart = 0.05;            // A press stroke starts below here...
+const float kPianoKeyWarpStrokeEnd = 0.95;              // ...and ends above here
+const int kPianoKeyWarpMinimumStrokes = 3;              // Strokes needed for a usable table
+
 /*
  * PianoKeyboardCalibrator
  *
@@ -44,6 +57,8 @@ class PianoKeyCalibrator {
 public:
 	// ***** Constructor *****
 	
+	// warpTable, if not NULL, gives an initial warp table of kPianoKeyWarpTableSize values.
+	// It is copied, not kept.
 	PianoKeyCalibrator(bool pressValueGoesDown, key_position* warpTable);
 	
 	// ***** Destructor *****
@@ -63,6 +78,10 @@ public:
     // Return the current status
     int calibrationStatus() { return status_; }
     
+    // Return the current status along with the quiescent and press values, all
+    // read together so they are consistent
+    int calibrationValues(int& quiescent, int& press);
+    
 	// Manage the calibration state
 	
 	void calibrationStart();
@@ -75,6 +94,38 @@ public:
 	
 	void calibrationUpdateQuiescent();
 	
+	// ***** Warp Table Methods *****
+	//
+	// Learn a warp table for a calibrated key. While capturing, the key should be pressed
+	// slowly and steadily through its full travel several times: since the key moves at
+	// roughly constant speed during each stroke, the time through the stroke gives the
+	// true position, which is compared against the linear calibration.
+	
+	void warpCaptureStart();
+	void warpCaptureSample(int rawValue);   // Called by the data thread while capturing
+	bool warpCaptureFinish();               // Returns true if a new table was fitted
+	void warpCaptureAbort();
+	bool warpCaptureInProgress() { return warpCaptureActive_; }
+	
+	void warpTableClear();
+	bool hasWarpTable() { return !warpTable_.empty(); }
+	
+	// Copy the warp table (kPianoKeyWarpTableSize values) into values. Returns false if there is none.
+	bool warpTableValues(float *values);
+	
+	// Apply a warp table to a linearly calibrated position
+	static key_position warpPosition(const float *table, key_position position) {
+		float unit = (float)scale_key_position(1);
+		float x = ((float)position / unit) * (kPianoKeyWarpTableSize - 1);
+		if(x < 0 || x > kPianoKeyWarpTableSize - 1)
+			return position;
+		int index = (int)x;
+		if(index >= kPianoKeyWarpTableSize - 1)
+			index = kPianoKeyWarpTableSize - 2;
+		float fraction = x - index;
+		return (key_position)((table[index] + fraction * (table[index + 1] - table[index])) * unit);
+	}
+	
 	// ***** XML I/O Methods *****
 	//
 	// These methods load and save calibration data from an XML string.  The PianoKeyCalibrator object handles
@@ -83,6 +134,10 @@ public:
 	void loadFromXml(TiXmlElement* baseElement);
 	bool saveToXml(TiXmlElement* baseElement);
 	
+	// Load values directly, as from a binary snapshot. The key is calibrated if both values
+	// are present; warpTable (kPianoKeyWarpTableSize values) may be NULL.
+	void loadValues(int quiescent, int press, const float *warpTable);
+	
 private:
 	// ***** Helper Methods *****
 	
@@ -100,6 +155,9 @@ private:
 	// Clean up after a calibration; called by finish() and abort()
 	void cleanup();
 	
+	// Fit a warp table from the captured samples. Returns false if there weren't enough strokes.
+	bool fitWarpTable(std::vector<float>& table);
+	
 	// ***** Member Variables *****
 	
 	int status_, prevStatus_;		// Status of calibration (see enum above), and its previous value
@@ -110,8 +168,11 @@ private:
 	
 	boost::circular_buffer<int>* history_;  // Buffer holds history of raw values for calibrating
 	
-	// Table of warping values to correct for sensor non-linearity
-	key_position* warpTable_;
+	// Table of warping values to correct for sensor non-linearity (empty if none)
+	std::vector<float> warpTable_;
+	
+	std::vector<int> warpCapture_;  // Raw samples collected while learning the warp table
+	volatile bool warpCaptureActive_;
     
 	boost::mutex calibrationMutex_;	// This mutex protects access to the entire calibration structure
 	boost::mutex historyMutex_;		// This mutex is specifically tied to the history_ buffers
@@ -11,12 +11,20 @@
 #include "TouchkeyDevice.h"
 #include "Mapping.h"
 #include "MidiOutputcontroller.h"
+#include <cstring>
 
 // Constructor
 PianoKeyboard::PianoKeyboard() 
-: isInitialized_(false), isRunning_(false), isCalibrated_(false), calibrationInProgress_(false),
-  lowestMidiNote_(0), highestMidiNote_(0), gui_(0), graphGui_ (0), oscTransmitter_(0), touchkeyDevice_(0),
-  midiOutputController_(0) {
+: gestureDetector_(stateTable_), pedalEvents_(kDefaultPedalEventHistoryLength), gui_(0), graphGui_ (0),
+  midiOutputController_(0), oscTransmitter_(0), sessionLog_(0), lowestMidiNote_(0), highestMidiNote_(0),
+  isInitialized_(false), isRunning_(false), onsetPredictionEnabled_(false), isCalibrated_(false), calibrationInProgress_(false),
+  mappingPool_(*this) {
+	  for(int note = 0; note < kMappingPoolMaxNotes; note++)
+		  mappings_[note].store(0);
+	  
+	  // A pedal for each of the standard positions
+	  setNumberOfPedals(kNumPedals);
+	  
 	  // Start a thread by which we can schedule future events
 	  futureEventScheduler_.start(0);
       
@@ -35,7 +43,7 @@ void PianoKeyboard::reset() {
 	for(itKey = keys_.begin(); itKey != keys_.end(); itKey++)
 		(*itKey)->reset();
 	for(itPed = pedals_.begin(); itPed != pedals_.end(); itPed++)
-		(*itPed)->clear();
+		(*itPed)->reset();
 }
 
 // Provide a pointer to the graphical display class
@@ -66,14 +74,76 @@ void PianoKeyboard::setKeyboardRange(int lowest, int highest) {
 	if(lowestMidiNote_ > highestMidiNote_)
 		highestMidiNote_ = lowestMidiNote_;
 	
-	// Free the existing PianoKey objects
+	boost::unique_lock<boost::shared_mutex> lock(keysMutex_);
+	
+	// Free the existing PianoKey objects, and the pooled mappings that refer to them
+	mappingPool_.clear();
 	for(std::vector<PianoKey*>::iterator it = keys_.begin(); it != keys_.end(); ++it)
 		delete (*it);
 	keys_.clear();
 	
-	// Rebuild the key list
-	for(int i = lowestMidiNote_; i <= highestMidiNote_; i++)
-		keys_.push_back(new PianoKey(*this, i, kDefaultKeyHistoryLength));
+	// Rebuild the key list, with idle detection done for all keys together and
+	// a mapping ready for each key to use when it goes active
+	idleDetector_.setNumberOfKeys(highestMidiNote_ - lowestMidiNote_ + 1);
+	gestureDetector_.setKeyboardRange(lowestMidiNote_, highestMidiNote_);
+	for(int i = lowestMidiNote_; i <= highestMidiNote_; i++) {
+		PianoKey *key = new PianoKey(*this, i, kDefaultKeyHistoryLength);
+		keys_.push_back(key);
+		key->positionTracker().setOnsetPredictionEnabled(onsetPredictionEnabled_);
+		idleDetector_.attach(i - lowestMidiNote_, &key->idleDetector());
+		mappingPool_.preallocate(kMappingTypeMRP, i, &key->touchBuffer(), &key->buffer(), &key->positionTracker());
+#ifdef TOUCHKEY_VIBRATO_MAPPING
+		mappingPool_.preallocate(kMappingTypeTouchkeyVibrato, i, &key->touchBuffer(), &key->buffer(), &key->positionTracker());
+#endif
+	}
+	
+	if(gui_ != 0)
+		gui_->setKeyboardRange(lowestMidiNote_, highestMidiNote_);
+}
+
+// Widen the keyboard to cover at least the given range. Existing keys stay as they
+// are, along with anything they are doing; only the notes that are new get keys.
+void PianoKeyboard::growKeyboardRange(int lowest, int highest) {
+	if(lowest < 0)
+		lowest = 0;
+	if(highest > 127)
+		highest = 127;
+	
+	boost::unique_lock<boost::shared_mutex> lock(keysMutex_);
+	
+	if(lowest > lowestMidiNote_)
+		lowest = lowestMidiNote_;
+	if(highest < highestMidiNote_)
+		highest = highestMidiNote_;
+	if(lowest == lowestMidiNote_ && highest == highestMidiNote_)
+		return;
+	
+	std::vector<PianoKey*> keys;
+	for(int i = lowest; i <= highest; i++) {
+		if(i >= lowestMidiNote_ && i <= highestMidiNote_) {
+			keys.push_back(keys_[i - lowestMidiNote_]);
+			continue;
+		}
+		PianoKey *key = new PianoKey(*this, i, kDefaultKeyHistoryLength);
+		keys.push_back(key);
+		key->positionTracker().setOnsetPredictionEnabled(onsetPredictionEnabled_);
+		mappingPool_.preallocate(kMappingTypeMRP, i, &key->touchBuffer(), &key->buffer(), &key->positionTracker());
+#ifdef TOUCHKEY_VIBRATO_MAPPING
+		mappingPool_.preallocate(kMappingTypeTouchkeyVibrato, i, &key->touchBuffer(), &key->buffer(), &key->positionTracker());
+#endif
+	}
+	
+	// The idle detector numbers keys from the lowest note, so the existing ones move up
+	idleDetector_.growKeys(lowestMidiNote_ - lowest, highest - highestMidiNote_);
+	for(int i = lowest; i <= highest; i++) {
+		if(i < lowestMidiNote_ || i > highestMidiNote_)
+			idleDetector_.attach(i - lowest, &keys[i - lowest]->idleDetector());
+	}
+	gestureDetector_.setKeyboardRange(lowest, highest);
+	
+	keys_.swap(keys);
+	lowestMidiNote_ = lowest;
+	highestMidiNote_ = highest;
 	
 	if(gui_ != 0)
 		gui_->setKeyboardRange(lowestMidiNote_, highestMidiNote_);
@@ -113,6 +183,11 @@ void PianoKeyboard::sendMessage(const char * path, const char * type, ...) {
 	
 	pthread_mutex_unlock(&oscListenerMutex_);
     
+	// Record the message in the session log, if one is active
+	SessionLog *log = sessionLog_;
+	if(log != 0)
+		log->logOsc(schedulerCurrentTimestamp(), path, type, argv, argc);
+	
 	// Now send this message to any external OSC sources
 	if(oscTransmitter_ != 0)
 		oscTransmitter_->sendMessage(path, type, msg);
@@ -138,87 +213,215 @@ void PianoKeyboard::setNumberOfPedals(int number) {
 	
 	// Rebuild the list of pedals
 	for(int i = 0; i < numberOfPedals_; i++)
-		pedals_.push_back(new PianoPedal(kDefaultPedalHistoryLength));
+		pedals_.push_back(new PianoPedal(*this, i, kDefaultPedalHistoryLength));
+}
+
+// Broadcast a change in one of the pedals. Called by the pedal on the thread its
+// input arrived on, so mappings hear about it as soon as they next run.
+void PianoKeyboard::pedalChanged(const PianoPedalEvent& event, timestamp_type timestamp) {
+	pedalEvents_.insert(event, timestamp);
+}
+
+// ***** TouchKey Device Methods *****
+
+// Attach a new device to the keyboard. Its range is unknown until it calls
+// setTouchkeyDeviceRange(), so it doesn't yet affect the keyboard range.
+void PianoKeyboard::addTouchkeyDevice(TouchkeyDevice* device) {
+    if(device == 0)
+        return;
+    boost::mutex::scoped_lock lock(touchkeyDevicesMutex_);
+    if(touchkeyDevices_.count(device) == 0)
+        touchkeyDevices_[device] = std::pair<int, int>(missing_value<int>::missing(), missing_value<int>::missing());
+}
+
+// Detach a device. The keyboard range is left alone so that keys which
+// other devices might be feeding aren't destroyed from under them.
+void PianoKeyboard::removeTouchkeyDevice(TouchkeyDevice* device) {
+    boost::mutex::scoped_lock lock(touchkeyDevicesMutex_);
+    touchkeyDevices_.erase(device);
+}
+
+// Return a list of all attached devices
+std::vector<TouchkeyDevice*> PianoKeyboard::touchkeyDevices() {
+    boost::mutex::scoped_lock lock(touchkeyDevicesMutex_);
+    std::vector<TouchkeyDevice*> devices;
+    std::map<TouchkeyDevice*, std::pair<int, int> >::iterator it;
+    for(it = touchkeyDevices_.begin(); it != touchkeyDevices_.end(); ++it)
+        devices.push_back(it->first);
+    return devices;
+}
+
+// Record the range of notes covered by a device and resize the keyboard to the
+// union of all known device ranges, if that can be done now.
+void PianoKeyboard::setTouchkeyDeviceRange(TouchkeyDevice* device, int lowest, int highest) {
+    touchkeyDevicesMutex_.lock();
+    touchkeyDevices_[device] = std::pair<int, int>(lowest, highest);
+    touchkeyDevicesMutex_.unlock();
+    
+    updateKeyboardRange();
+}
+
+// Resize the keyboard to the union of the device ranges. A device that is gathering
+// may still be using any of the keys, so while one is, the keyboard only grows in
+// place to take in new ranges; keys are rebuilt (e.g. to shrink) only once all stop.
+void PianoKeyboard::updateKeyboardRange() {
+    int unionLowest = missing_value<int>::missing(), unionHighest = missing_value<int>::missing();
+    bool deviceIsGathering = false;
+    
+    touchkeyDevicesMutex_.lock();
+    std::map<TouchkeyDevice*, std::pair<int, int> >::iterator it;
+    for(it = touchkeyDevices_.begin(); it != touchkeyDevices_.end(); ++it) {
+        if(it->first->isAutoGathering())
+            deviceIsGathering = true;
+        if(missing_value<int>::isMissing(it->second.first))
+            continue;
+        if(missing_value<int>::isMissing(unionLowest) || it->second.first < unionLowest)
+            unionLowest = it->second.first;
+        if(missing_value<int>::isMissing(unionHighest) || it->second.second > unionHighest)
+            unionHighest = it->second.second;
+    }
+    touchkeyDevicesMutex_.unlock();
+    
+    if(missing_value<int>::isMissing(unionLowest))
+        return;
+    if(unionLowest == lowestMidiNote_ && unionHighest == highestMidiNote_ && !keys_.empty())
+        return;
+    if(!keys_.empty() && (deviceIsGathering || (unionLowest <= lowestMidiNote_ && unionHighest >= highestMidiNote_)))
+        growKeyboardRange(unionLowest, unionHighest);
+    else
+        setKeyboardRange(unionLowest, unionHighest);
 }
 
 // Set color of RGB LED for a given key. note indicates the MIDI
 // note number of the key, and color can be specified in one of two
-// formats.
+// formats. The update goes to every LED-equipped device covering the note.
 void PianoKeyboard::setKeyLEDColorRGB(const int note, const float red, const float green, const float blue) {
-    if(touchkeyDevice_ != 0) {
-        touchkeyDevice_->rgbledSetColor(note, red, green, blue);
+    boost::mutex::scoped_lock lock(touchkeyDevicesMutex_);
+    std::map<TouchkeyDevice*, std::pair<int, int> >::iterator it;
+    for(it = touchkeyDevices_.begin(); it != touchkeyDevices_.end(); ++it) {
+        if(!it->first->hasRGBLEDs() || note < it->second.first || note > it->second.second)
+            continue;
+        it->first->rgbledSetColor(note, red, green, blue);
     }
 }
 
 void PianoKeyboard::setKeyLEDColorHSV(const int note, const float hue, const float saturation, const float value) {
-    if(touchkeyDevice_ != 0) {
-        touchkeyDevice_->rgbledSetColorHSV(note, hue, saturation, value);
+    boost::mutex::scoped_lock lock(touchkeyDevicesMutex_);
+    std::map<TouchkeyDevice*, std::pair<int, int> >::iterator it;
+    for(it = touchkeyDevices_.begin(); it != touchkeyDevices_.end(); ++it) {
+        if(!it->first->hasRGBLEDs() || note < it->second.first || note > it->second.second)
+            continue;
+        it->first->rgbledSetColorHSV(note, hue, saturation, value);
     }
 }
 
 void PianoKeyboard::setAllKeyLEDsOff() {
-    if(touchkeyDevice_ != 0) {
-        touchkeyDevice_->rgbledAllOff();
+    boost::mutex::scoped_lock lock(touchkeyDevicesMutex_);
+    std::map<TouchkeyDevice*, std::pair<int, int> >::iterator it;
+    for(it = touchkeyDevices_.begin(); it != touchkeyDevices_.end(); ++it) {
+        if(it->first->hasRGBLEDs())
+            it->first->rgbledAllOff();
+    }
+}
+
+// Turn onset prediction on or off for every key
+void PianoKeyboard::setOnsetPredictionEnabled(bool enable) {
+    onsetPredictionEnabled_ = enable;
+    for(std::vector<PianoKey*>::iterator it = keys_.begin(); it != keys_.end(); ++it)
+        (*it)->positionTracker().setOnsetPredictionEnabled(enable);
+}
+
+// Sum the onset prediction statistics of all keys
+KeyPositionTracker::OnsetPredictionStatistics PianoKeyboard::onsetPredictionStatistics() {
+    KeyPositionTracker::OnsetPredictionStatistics total;
+    memset(&total, 0, sizeof(total));
+    
+    for(std::vector<PianoKey*>::iterator it = keys_.begin(); it != keys_.end(); ++it) {
+        KeyPositionTracker::OnsetPredictionStatistics const& statistics = (*it)->positionTracker().onsetPredictionStatistics();
+        
+        total.predictions += statistics.predictions;
+        total.confirmed += statistics.confirmed;
+        total.corrected += statistics.corrected;
+        total.cancelled += statistics.cancelled;
+        total.missed += statistics.missed;
+        total.totalLeadTime += statistics.totalLeadTime;
+        total.totalTimingError += statistics.totalTimingError;
+        total.totalVelocityError += statistics.totalVelocityError;
     }
+    
+    return total;
+}
+
+void PianoKeyboard::clearOnsetPredictionStatistics() {
+    for(std::vector<PianoKey*>::iterator it = keys_.begin(); it != keys_.end(); ++it)
+        (*it)->positionTracker().clearOnsetPredictionStatistics();
 }
 
 // ***** Mapping Methods *****
 
-// Add a new mapping identified by a MIDI note and an owner
+// Add a new mapping for a MIDI note, replacing any that's already there
 void PianoKeyboard::addMapping(int noteNumber, Mapping* mapping) {
-    removeMapping(noteNumber);  // Free any mapping that's already present on this note
-    mappings_[noteNumber] = mapping;
+    if(noteNumber < 0 || noteNumber >= kMappingPoolMaxNotes) {
+        mappingPool_.release(mapping);
+        return;
+    }
+    
+    boost::mutex::scoped_lock lock(mappingsMutex_);
+    removeMappingLocked(noteNumber);  // Free any mapping that's already present on this note
+    if(mapping == 0)
+        return;
+    mappings_[noteNumber].store(mapping, boost::memory_order_release);
 }
 
-// Remove an existing mapping identified by owner
+// Remove an existing mapping, returning it to the pool
 void PianoKeyboard::removeMapping(int noteNumber) {
-    if(mappings_.count(noteNumber) == 0)
+    if(noteNumber < 0 || noteNumber >= kMappingPoolMaxNotes)
         return;
-    Mapping* mapping = mappings_[noteNumber];
-    delete mapping;
-    mappings_.erase(noteNumber);
+    
+    boost::mutex::scoped_lock lock(mappingsMutex_);
+    removeMappingLocked(noteNumber);
+}
+
+// Take the mapping out of the table before releasing it. Releasing disengages it,
+// which waits for any scheduled action that's running to finish, so once this
+// returns no action can still be holding the pointer from the table.
+void PianoKeyboard::removeMappingLocked(int noteNumber) {
+    Mapping *mapping = mappings_[noteNumber].exchange(0, boost::memory_order_acq_rel);
+    if(mapping != 0)
+        mappingPool_.release(mapping);
 }
 
-// Return a specific mapping by owner and note number
+// Return the mapping on a note, if any. Doesn't lock.
 Mapping* PianoKeyboard::mapping(int noteNumber) {
-    if(mappings_.count(noteNumber) == 0)
+    if(noteNumber < 0 || noteNumber >= kMappingPoolMaxNotes)
         return 0;
-    return mappings_[noteNumber];
-    
-    return 0;
+    return mappings_[noteNumber].load(boost::memory_order_acquire);
 }
 
-// Return a list of all MIDI notes with active mappings. Some may have more than
-// one but we only want the list of active notes
+// Return a list of all MIDI notes with active mappings
 std::vector<int> PianoKeyboard::activeMappings() {
     std::vector<int> keys;
-    std::map<int, Mapping*>::iterator it = mappings_.begin();
-    while(it != mappings_.end()) {
-        int nextKey = (it++)->first;
-        keys.push_back(nextKey);
+    for(int note = 0; note < kMappingPoolMaxNotes; note++) {
+        if(mappings_[note].load(boost::memory_order_acquire) != 0)
+            keys.push_back(note);
     }
     return keys;
 }
 
+// Remove every mapping, returning each to the pool
 void PianoKeyboard::clearMappings() {
-    std::map<int, Mapping*>::iterator it = mappings_.begin();
-    
-    while(it != mappings_.end()) {
-        // Delete everybody in the container
-        Mapping *mapping = it->second;
-        delete mapping;
-    }
-    
-    // Now clear the container
-    mappings_.clear();
+    boost::mutex::scoped_lock lock(mappingsMutex_);
+    for(int note = 0; note < kMappingPoolMaxNotes; note++)
+        removeMappingLocked(note);
 }
 
 
 // Destructor
 
 PianoKeyboard::~PianoKeyboard() {
-    // Remove all mappings
+    // Remove all mappings, including the pooled ones, while the keys they refer to still exist
     clearMappings();
+    mappingPool_.clear();
     
 	// Delete any keys and pedals we've allocated
 	for(std::vector<PianoKey*>::iterator it = keys_.begin(); it != keys_.end(); ++it)
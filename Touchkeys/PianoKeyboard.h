@@ -13,14 +13,22 @@
 #include <iostream>
 #include <fstream>
 #include <map>
+#include <boost/atomic.hpp>
+#include <boost/thread/shared_mutex.hpp>
 #include "Types.h"
 #include "Node.h"
 #include "PianoKey.h"
+#include "KeyboardIdleDetector.h"
+#include "KeyboardStateTable.h"
+#include "KeyboardGestureDetector.h"
+#include "MappingPool.h"
 #include "PianoPedal.h"
 #include "KeyboardDisplay.h"
 #include "KeyPositionGraphDisplay.h"
 #include "Osc.h"
 #include "Scheduler.h"
+#include "TimestampSynchronizer.h"
+#include "SessionLog.h"
 
 #define NUM_KEYS 88
 #define NUM_PEDALS 3
@@ -34,6 +42,7 @@ enum {							// Index of each pedal in the buffers
 
 const int kDefaultKeyHistoryLength = 8192;
 const int kDefaultPedalHistoryLength = 1024;
+const int kDefaultPedalEventHistoryLength = 256;
 
 class TouchkeyDevice;
 class Mapping;
@@ -97,12 +106,42 @@ public:
 	// OSC transmitter handles the mechanics of sending messages to one or more targets
 	void setOscTransmitter(OscTransmitter* trans) { oscTransmitter_ = trans; }
     
-    // TouchkeyDevice handles communication with the touch-sensor/piano-scanner hardware
-    void setTouchkeyDevice(TouchkeyDevice* device) { touchkeyDevice_ = device; }
+    // TouchkeyDevice handles communication with the touch-sensor/piano-scanner hardware.
+    // More than one device can feed the same keyboard (e.g. a touch surface and a separate
+    // analog scanner); each one covers a range of MIDI notes, which may overlap.
+    void setTouchkeyDevice(TouchkeyDevice* device) { addTouchkeyDevice(device); }
+    void addTouchkeyDevice(TouchkeyDevice* device);
+    void removeTouchkeyDevice(TouchkeyDevice* device);
+    std::vector<TouchkeyDevice*> touchkeyDevices();
+    
+    // Called by each device once it knows which notes it covers. The keyboard range
+    // becomes the union of all device ranges. While any device is gathering data the
+    // range only grows, in place, so the keys already there carry on undisturbed; it
+    // can shrink once they have all stopped (devices call updateKeyboardRange() when
+    // they start and stop).
+    void setTouchkeyDeviceRange(TouchkeyDevice* device, int lowest, int highest);
+    void updateKeyboardRange();
+    
+    // Sources of key data (device I/O threads, MIDI input) hold this shared while they
+    // pass data to the keys; the keys are only added or removed with it held exclusively.
+    boost::shared_mutex& keysMutex() { return keysMutex_; }
+    
+    // ***** Clock Domain *****
+    //
+    // All devices report timestamps on the scheduler's timeline. Each device keeps
+    // its own TimestampSynchronizer (its frame clock drifts independently), but they
+    // are all referenced to the same starting point so frames line up across devices.
+    void synchronizeToKeyboardClock(TimestampSynchronizer& synchronizer) {
+        synchronizer.initialize(futureEventScheduler_.startTime(), 0);
+    }
 	
 	// Send a named message by OSC (and potentially by MIDI or other means if suitable listeners
 	// are enabled)
 	void sendMessage(const char * path, const char * type, ...);
+    
+    // If a session log is set, every message sent is also recorded there
+    SessionLog* sessionLog() { return sessionLog_; }
+    void setSessionLog(SessionLog* log) { sessionLog_ = log; }
 	
 	// ***** Scheduling Methods *****
 	
@@ -119,6 +158,18 @@ public:
 	
 	// Return the current timestamp associated with the scheduler
 	timestamp_type schedulerCurrentTimestamp() { return futureEventScheduler_.currentTimestamp(); }
+    
+    // Run the scheduler from a clock advanced by the caller (e.g. a replay source)
+    // rather than the system clock, or switch back to the system clock. Going back
+    // drops anything left queued on the manual timeline and keeps the original start
+    // time, which the devices' synchronizers are referenced to.
+    void useManualClock(timestamp_type startingTimestamp) { futureEventScheduler_.startManual(startingTimestamp); }
+    void useSystemClock() {
+        futureEventScheduler_.stop();
+        futureEventScheduler_.clear();
+        futureEventScheduler_.resume();
+    }
+    void advanceClock(timestamp_type timestamp) { futureEventScheduler_.advanceTo(timestamp); }
 	
 	// ***** Individual Key/Pedal Methods *****
 	
@@ -134,6 +185,22 @@ public:
 		return pedals_[pedal];
 	}
 	
+	// Changes in every pedal, in the order they happened. Mappings keep their own index
+	// into the history and read whatever is new, as with the gesture detector's events.
+	Node<PianoPedalEvent>& pedalEvents() { return pedalEvents_; }
+	void pedalChanged(const PianoPedalEvent& event, timestamp_type timestamp);
+	
+    // Idle detection for all keys together. Sources of key position data call
+    // analogFrameFinished() once each frame's samples are in.
+    KeyboardIdleDetector& idleDetector() { return idleDetector_; }
+    void analogFrameFinished() { idleDetector_.evaluate(); gestureDetector_.evaluate(); }
+    
+    // Latest state of every key, by MIDI note, readable from any thread without locking
+    KeyboardStateTable& stateTable() { return stateTable_; }
+    
+    // Chords, pitch bends, glissandi and clusters found across the keys each frame
+    KeyboardGestureDetector& gestureDetector() { return gestureDetector_; }
+	
 	// Keys and pedals are enabled by default.  If one has been disabled, reenable it so it reads data
 	// and triggers notes, as normal.
 	void enableKey(int key);
@@ -143,6 +210,13 @@ public:
 	void disableKey(int key);
 	void disablePedal(int pedal);
 	
+    // Send provisional onsets ahead of the measured press velocity on every key (see
+    // KeyPositionTracker), and collect how the predictions turned out across the keyboard
+    bool onsetPredictionEnabled() { return onsetPredictionEnabled_; }
+    void setOnsetPredictionEnabled(bool enable);
+    KeyPositionTracker::OnsetPredictionStatistics onsetPredictionStatistics();
+    void clearOnsetPredictionStatistics();
+	
 	// Leave a key enabled, but terminate any activity it has initiated and return it to the idle state.
 	// If the key is active because of a hardware problem, this may be a short-term solution at best, requiring
 	// the key to be disabled until the problem can be properly resolved.
@@ -154,19 +228,29 @@ public:
     void setAllKeyLEDsOff();
     
     // ***** Mapping Methods *****
-    // Mappings are identified by the MIDI note they affect and by
-    // their owner object.
+    // Mappings are identified by the MIDI note they affect, one per note. Lookups
+    // don't lock and can be made from scheduled actions while mappings are being
+    // added and removed on other threads.
     void addMapping(int noteNumber, Mapping* mapping);    // Add a new mapping to the container
     void removeMapping(int noteNumber);                  // Remove a mapping from the container
-    Mapping* mapping(int noteNumber);                    // Look up a mapping with the given note and owner
+    Mapping* mapping(int noteNumber);                    // Look up the mapping on the given note
     std::vector<int> activeMappings();                   // Return a list of all active note mappings
     void clearMappings();                                // Remove all mappings
+    MappingPool& mappingPool() { return mappingPool_; }  // Reusable mapping instances for each key
 	
 	// ***** Member Variables *****
 private:
+	// Extend the key list to a wider range, keeping the existing keys
+	void growKeyboardRange(int lowest, int highest);
+	
 	// Individual key and pedal data structures
 	std::vector<PianoKey*> keys_;
+	boost::shared_mutex keysMutex_;
 	std::vector<PianoPedal*> pedals_;	
+	KeyboardIdleDetector idleDetector_;
+	KeyboardStateTable stateTable_;
+	KeyboardGestureDetector gestureDetector_;
+	Node<PianoPedalEvent> pedalEvents_;
 	
 	// Reference to GUI display (if present)
 	KeyboardDisplay* gui_;
@@ -178,8 +262,13 @@ private:
 	// Reference to message transmitter class
 	OscTransmitter* oscTransmitter_;
     
-    // Reference to TouchKey hardware controller class
-    TouchkeyDevice* touchkeyDevice_;
+    // Log of outgoing messages (if enabled)
+    SessionLog* volatile sessionLog_;
+    
+    // References to TouchKey hardware controller classes, with the range of MIDI
+    // notes each one covers (missing until the device reports its range)
+    std::map<TouchkeyDevice*, std::pair<int, int> > touchkeyDevices_;
+    boost::mutex touchkeyDevicesMutex_;
 	
 	// Keyboard range, expressed in MIDI note numbers
 	int lowestMidiNote_, highestMidiNote_;
@@ -187,6 +276,7 @@ private:
 	
 	bool isInitialized_;
 	bool isRunning_;
+	bool onsetPredictionEnabled_;
 	bool isCalibrated_;
 	bool calibrationInProgress_;
 	
@@ -202,7 +292,11 @@ private:
 	Scheduler futureEventScheduler_;
     
     // Data related to mappings for active notes
-    std::map<int, Mapping*> mappings_;            // Mappings from key motion to sound
+    void removeMappingLocked(int noteNumber);
+    
+    boost::atomic<Mapping*> mappings_[kMappingPoolMaxNotes];  // Mappings from key motion to sound, by note
+    boost::mutex mappingsMutex_;                  // Serialises changes to mappings_
+    MappingPool mappingPool_;                     // Where mappings come from and go back to
 };
 
 #endif /* KEYCONTROL_PIANOKEYBOARD_H */
\ No newline at end of file
@@ -8,4 +8,170 @@
  */
 
 #include "PianoPedal.h"
+#include "PianoKeyboard.h"
+#include "Logger.h"
+#include <cstdlib>
 
+// Constructor
+PianoPedal::PianoPedal(PianoKeyboard& keyboard, int pedalNumber, int historyLength)
+: Node<key_position>(historyLength), keyboard_(keyboard), pedalNumber_(pedalNumber),
+  isCalibrated_(false), rawUp_(0), rawDown_(0), calibrationInProgress_(false), calibrationHasSamples_(false),
+  calibrationRest_(0), calibrationFarthest_(0),
+  halfPedalLower_(kPianoPedalDefaultHalfPedalLower), halfPedalUpper_(kPianoPedalDefaultHalfPedalUpper),
+  hysteresis_(kPianoPedalDefaultHysteresis), deadband_(kPianoPedalDefaultDeadband)
+{
+	reset();
+}
+
+// Calibrate a raw sensor reading and process it. While calibrating, the reading
+// only extends the range being collected.
+void PianoPedal::insertSample(int rawValue, timestamp_type timestamp) {
+	boost::mutex::scoped_lock lock(inputMutex_);
+
+	if(calibrationInProgress_) {
+		if(!calibrationHasSamples_) {
+			calibrationRest_ = calibrationFarthest_ = rawValue;
+			calibrationHasSamples_ = true;
+		}
+		else if(abs(rawValue - calibrationRest_) > abs(calibrationFarthest_ - calibrationRest_))
+			calibrationFarthest_ = rawValue;
+		return;
+	}
+	if(!isCalibrated_)
+		return;
+
+	process(scale_key_position((float)(rawValue - rawUp_) / (float)(rawDown_ - rawUp_)), timestamp);
+}
+
+// MIDI controller values go straight to positions
+void PianoPedal::insertMidiValue(int value, timestamp_type timestamp) {
+	boost::mutex::scoped_lock lock(inputMutex_);
+
+	process(scale_key_position((float)value / (float)kPianoPedalMidiControllerMax), timestamp);
+}
+
+// Set the raw readings with the pedal up and down. Either direction works, but
+// they have to be far enough apart to give a usable position.
+void PianoPedal::setCalibration(int rawUp, int rawDown) {
+	boost::mutex::scoped_lock lock(inputMutex_);
+
+	if(abs(rawDown - rawUp) < kPianoPedalMinimumCalibrationRange) {
+		TOUCHKEY_LOG(kLogLevelWarning, "Pedal {}: calibration range {} to {} is too small") << pedalNumber_ << rawUp << rawDown;
+		return;
+	}
+	rawUp_ = rawUp;
+	rawDown_ = rawDown;
+	isCalibrated_ = true;
+}
+
+void PianoPedal::calibrationStart() {
+	boost::mutex::scoped_lock lock(inputMutex_);
+
+	calibrationInProgress_ = true;
+	calibrationHasSamples_ = false;
+}
+
+// Take the first reading as the pedal up and the one farthest from it as down
+bool PianoPedal::calibrationFinish() {
+	boost::mutex::scoped_lock lock(inputMutex_);
+
+	calibrationInProgress_ = false;
+	if(!calibrationHasSamples_ || abs(calibrationFarthest_ - calibrationRest_) < kPianoPedalMinimumCalibrationRange) {
+		TOUCHKEY_LOG(kLogLevelWarning, "Pedal {}: not enough travel to calibrate") << pedalNumber_;
+		return false;
+	}
+	rawUp_ = calibrationRest_;
+	rawDown_ = calibrationFarthest_;
+	isCalibrated_ = true;
+	return true;
+}
+
+void PianoPedal::calibrationAbort() {
+	boost::mutex::scoped_lock lock(inputMutex_);
+
+	calibrationInProgress_ = false;
+}
+
+// Set the boundaries of the half-pedal zone
+void PianoPedal::setHalfPedalZone(key_position lower, key_position upper) {
+	if(upper < lower)
+		return;
+	halfPedalLower_ = lower;
+	halfPedalUpper_ = upper;
+}
+
+// Clear the history and state
+void PianoPedal::reset() {
+	boost::mutex::scoped_lock lock(inputMutex_);
+
+	clear();
+	hasSamples_ = false;
+	position_ = lastEventPosition_ = scale_key_position(0);
+	velocity_ = scale_key_velocity(0);
+	lastTimestamp_ = 0;
+	zone_ = kPedalZoneUp;
+}
+
+// Store the new position and work out the velocity and zone. Tell the keyboard
+// about it if the zone changed or the pedal moved far enough since the last event.
+void PianoPedal::process(key_position position, timestamp_type timestamp) {
+	if(position < scale_key_position(0))
+		position = scale_key_position(0);
+	if(position > scale_key_position(1.0))
+		position = scale_key_position(1.0);
+
+	insert(position, timestamp);
+
+	if(!hasSamples_)
+		velocity_ = scale_key_velocity(0);
+	else if(timestamp > lastTimestamp_) {
+		key_position diffPosition = position - position_;
+		timestamp_diff_type diffTimestamp = timestamp - lastTimestamp_;
+		key_velocity newVelocity = calculate_key_velocity(diffPosition, diffTimestamp);
+		velocity_ += kPianoPedalVelocitySmoothing * (newVelocity - velocity_);
+	}
+	position_ = position;
+	lastTimestamp_ = timestamp;
+
+	int newZone = nextZone(position);
+	bool zoneChanged = (newZone != zone_);
+	zone_ = newZone;
+
+	if(!hasSamples_ || zoneChanged || key_abs(position - lastEventPosition_) >= deadband_) {
+		PianoPedalEvent event;
+
+		event.pedal = pedalNumber_;
+		event.zone = zone_;
+		event.zoneChanged = zoneChanged;
+		event.position = position;
+		event.velocity = velocity_;
+		lastEventPosition_ = position;
+		keyboard_.pedalChanged(event, timestamp);
+	}
+	hasSamples_ = true;
+}
+
+// A zone is only left once the position is past its boundary by the hysteresis
+int PianoPedal::nextZone(key_position position) {
+	switch(zone_) {
+		case kPedalZoneUp:
+			if(position > halfPedalUpper_ + hysteresis_)
+				return kPedalZoneDown;
+			if(position > halfPedalLower_ + hysteresis_)
+				return kPedalZoneHalf;
+			return kPedalZoneUp;
+		case kPedalZoneDown:
+			if(position < halfPedalLower_ - hysteresis_)
+				return kPedalZoneUp;
+			if(position < halfPedalUpper_ - hysteresis_)
+				return kPedalZoneHalf;
+			return kPedalZoneDown;
+		case kPedalZoneHalf:
+		default:
+			if(position < halfPedalLower_ - hysteresis_)
+				return kPedalZoneUp;
+			if(position > halfPedalUpper_ + hysteresis_)
+				return kPedalZoneDown;
+			return kPedalZoneHalf;
+	}
+}
@@ -10,12 +10,123 @@
 #ifndef PIANO_PEDAL_H
 #define PIANO_PEDAL_H
 
+#include <boost/thread/mutex.hpp>
 #include "Node.h"
 #include "PianoTypes.h"
 
+const key_position kPianoPedalDefaultHalfPedalLower = scale_key_position(.25);  // Below this the pedal is up
+const key_position kPianoPedalDefaultHalfPedalUpper = scale_key_position(.75);  // Above this the pedal is down
+const key_position kPianoPedalDefaultHysteresis = scale_key_position(.04);      // How far past a boundary to change zone
+const key_position kPianoPedalDefaultDeadband = scale_key_position(.01);        // Smallest movement reported as a change
+const float kPianoPedalVelocitySmoothing = 0.2;                                 // Weight of each new velocity measurement
+const int kPianoPedalMinimumCalibrationRange = 64;                              // Raw units between up and down
+const int kPianoPedalMidiControllerMax = 127;
+
+// Which part of its travel the pedal is in
+enum {
+	kPedalZoneUp = 0,
+	kPedalZoneHalf,
+	kPedalZoneDown
+};
+
+// A change in one pedal, broadcast to mappings by the keyboard
+struct PianoPedalEvent {
+	int pedal;					// kPedal...
+	int zone;					// kPedalZone...
+	bool zoneChanged;			// Whether the pedal has just entered this zone
+	key_position position;		// 0 (up) to 1 (down)
+	key_velocity velocity;
+};
+
+class PianoKeyboard;
+
+/*
+ * PianoPedal
+ *
+ * Holds the position history of one pedal and turns its input into a calibrated
+ * position, a smoothed velocity and a zone: up, half-pedal or down. Zones have
+ * hysteresis so a pedal resting near a boundary doesn't flicker between them.
+ * Input comes either from an analog sensor, in raw units calibrated against the
+ * pedal's up and down readings, or from a MIDI controller (CC 64/66/67).
+ *
+ * Each time the zone changes or the position moves by more than the deadband, the
+ * pedal passes a PianoPedalEvent to the keyboard, which broadcasts it to mappings.
+ */
+
 class PianoPedal : public Node<key_position> {
 public:
-	PianoPedal(int historyLength) : Node<key_position>(historyLength) {}
+	// ***** Constructor *****
+
+	PianoPedal(PianoKeyboard& keyboard, int pedalNumber, int historyLength);
+
+	// ***** Input Methods *****
+
+	// New reading from an analog sensor in raw units. Ignored until the pedal is calibrated.
+	void insertSample(int rawValue, timestamp_type timestamp);
+
+	// New value of the pedal's MIDI controller (0-127), which needs no calibration
+	void insertMidiValue(int value, timestamp_type timestamp);
+
+	// ***** Calibration Methods *****
+
+	// Set the raw sensor readings with the pedal up and fully down
+	void setCalibration(int rawUp, int rawDown);
+	bool isCalibrated() { return isCalibrated_; }
+
+	// Collect the range of the sensor: start with the pedal up and press it fully down
+	// at least once. Finishing keeps the previous calibration and returns false if the
+	// range was too small.
+	void calibrationStart();
+	bool calibrationFinish();
+	void calibrationAbort();
+	bool calibrationInProgress() { return calibrationInProgress_; }
+
+	// ***** Zone Parameters *****
+
+	void setHalfPedalZone(key_position lower, key_position upper);
+	void setHysteresis(key_position hysteresis) { hysteresis_ = hysteresis; }
+	void setDeadband(key_position deadband) { deadband_ = deadband; }
+
+	// ***** State *****
+
+	int pedalNumber() { return pedalNumber_; }
+	key_position position() { return position_; }
+	key_velocity velocity() { return velocity_; }
+	int zone() { return zone_; }
+
+	// Clear the history and go back to the up zone, keeping the calibration
+	void reset();
+
+private:
+	// ***** Private Methods *****
+
+	// Bring position, velocity and zone up to date with a new calibrated position
+	void process(key_position position, timestamp_type timestamp);
+
+	// Zone for a position, given the zone we're in now
+	int nextZone(key_position position);
+
+	// ***** Member Variables *****
+
+	PianoKeyboard& keyboard_;				// Where events are broadcast
+	int pedalNumber_;						// kPedal...
+	boost::mutex inputMutex_;				// Analog and MIDI input arrive on different threads
+
+	bool isCalibrated_;
+	int rawUp_, rawDown_;					// Raw readings at either end of travel
+	bool calibrationInProgress_;
+	bool calibrationHasSamples_;
+	int calibrationRest_, calibrationFarthest_;	// Reading at the start, and the one farthest from it
+
+	key_position halfPedalLower_, halfPedalUpper_;	// Boundaries of the half-pedal zone
+	key_position hysteresis_, deadband_;
+
+	bool hasSamples_;
+	key_position position_;
+	key_velocity velocity_;
+	timestamp_type lastTimestamp_;
+	int zone_;
+	key_position lastEventPosition_;		// Position in the last event sent
 };
 
-#endif /* PIANO_PEDAL_H */
\ No newline at end of file
+#endif /* PIANO_PEDAL_H */
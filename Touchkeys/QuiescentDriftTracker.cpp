@@ -0,0 +1,163 @@
+//
+//  QuiescentDriftTracker.cpp
+//  touchkeys
+//
+
+#include "QuiescentDriftTracker.h"
+#include <cmath>
+#include <unistd.h>
+
+// Constructor
+QuiescentDriftTracker::QuiescentDriftTracker(int numberOfKeys)
+: numberOfKeys_(numberOfKeys > 0 ? numberOfKeys : 0), isRunning_(false), shouldStop_(false),
+  resetRequested_(false)
+{
+    rings_ = new SampleRing[numberOfKeys_];
+    decimationCounters_ = new int[numberOfKeys_];
+    publishedOffsets_ = new boost::atomic<int>[numberOfKeys_];
+    estimates_.resize(numberOfKeys_);
+
+    for(int i = 0; i < numberOfKeys_; i++) {
+        rings_[i].writePosition = 0;
+        rings_[i].readPosition = 0;
+        decimationCounters_[i] = 0;
+        publishedOffsets_[i] = 0;
+    }
+    clearEstimates();
+}
+
+// Destructor
+QuiescentDriftTracker::~QuiescentDriftTracker() {
+    stop();
+    delete[] rings_;
+    delete[] decimationCounters_;
+    delete[] publishedOffsets_;
+}
+
+// Keep one sample in every few, and drop it if the ring is full
+void QuiescentDriftTracker::addIdleSample(int index, int residual) {
+    if(index < 0 || index >= numberOfKeys_)
+        return;
+    if(++decimationCounters_[index] < kDriftTrackerDecimation)
+        return;
+    decimationCounters_[index] = 0;
+
+    SampleRing& ring = rings_[index];
+    unsigned int writePosition = ring.writePosition.load(boost::memory_order_relaxed);
+    if(writePosition - ring.readPosition.load(boost::memory_order_acquire) >= (unsigned int)kDriftTrackerRingSize)
+        return;
+    ring.samples[writePosition & (kDriftTrackerRingSize - 1)] = residual;
+    ring.writePosition.store(writePosition + 1, boost::memory_order_release);
+}
+
+// Start the background thread
+void QuiescentDriftTracker::start() {
+    if(isRunning_)
+        return;
+    shouldStop_ = false;
+    isRunning_ = true;
+    trackerThread_ = boost::thread(&QuiescentDriftTracker::runLoop, this);
+}
+
+// Stop the background thread. The offsets stay as they were.
+void QuiescentDriftTracker::stop() {
+    if(!isRunning_)
+        return;
+    shouldStop_ = true;
+    trackerThread_.join();
+    isRunning_ = false;
+}
+
+// Zero the offsets now, and have the tracker thread start its estimates again
+void QuiescentDriftTracker::reset() {
+    resetRequested_ = true;
+    for(int i = 0; i < numberOfKeys_; i++)
+        publishedOffsets_[i].store(0, boost::memory_order_relaxed);
+    if(!isRunning_)
+        clearEstimates();
+}
+
+// Get the state of one key's estimate
+QuiescentDriftTracker::KeyReport QuiescentDriftTracker::report(int index) {
+    boost::mutex::scoped_lock lock(reportMutex_);
+
+    if(index < 0 || index >= numberOfKeys_) {
+        KeyReport empty = { 0, 0, 0, 0, 0, false };
+        return empty;
+    }
+    return estimates_[index];
+}
+
+// Tracker thread: update the estimates periodically until told to stop
+void QuiescentDriftTracker::runLoop() {
+    while(!shouldStop_) {
+        update();
+        usleep(kDriftTrackerUpdateMicroseconds);
+    }
+}
+
+// Drain each key's ring into its estimate and publish the new offsets
+void QuiescentDriftTracker::update() {
+    if(resetRequested_.exchange(false)) {
+        // Discard samples taken against the old calibration. The offsets are zeroed
+        // again in case a previous update published over reset()'s zeroing.
+        for(int i = 0; i < numberOfKeys_; i++) {
+            rings_[i].readPosition.store(rings_[i].writePosition.load(boost::memory_order_acquire), boost::memory_order_release);
+            publishedOffsets_[i].store(0, boost::memory_order_relaxed);
+        }
+        clearEstimates();
+        return;
+    }
+
+    boost::mutex::scoped_lock lock(reportMutex_);
+
+    for(int i = 0; i < numberOfKeys_; i++) {
+        SampleRing& ring = rings_[i];
+        KeyReport& estimate = estimates_[i];
+        unsigned int readPosition = ring.readPosition.load(boost::memory_order_relaxed);
+        unsigned int writePosition = ring.writePosition.load(boost::memory_order_acquire);
+
+        if(readPosition == writePosition)
+            continue;
+
+        // Step towards each sample: this converges on the median, and a single
+        // sample can't move the estimate far however wrong it is
+        while(readPosition != writePosition) {
+            float difference = (float)ring.samples[readPosition & (kDriftTrackerRingSize - 1)] - estimate.offset;
+
+            if(difference > 0)
+                estimate.offset += kDriftTrackerStep;
+            else if(difference < 0)
+                estimate.offset -= kDriftTrackerStep;
+            estimate.spread += kDriftTrackerSpreadRate * (fabsf(difference) - estimate.spread);
+            estimate.samples++;
+            readPosition++;
+        }
+        ring.readPosition.store(readPosition, boost::memory_order_release);
+
+        float sampleConfidence = (float)estimate.samples / (float)kDriftTrackerMinimumSamples;
+        if(sampleConfidence > 1.0)
+            sampleConfidence = 1.0;
+        estimate.confidence = sampleConfidence / (1.0 + estimate.spread / kDriftTrackerSpreadScale);
+        estimate.saturated = (fabsf(estimate.offset) > kDriftTrackerMaximumOffset);
+
+        if(estimate.samples >= (unsigned long)kDriftTrackerMinimumSamples && !estimate.saturated) {
+            estimate.publishedOffset = (int)floorf(estimate.offset + 0.5);
+            publishedOffsets_[i].store(estimate.publishedOffset, boost::memory_order_relaxed);
+        }
+    }
+}
+
+// Start every estimate from no drift
+void QuiescentDriftTracker::clearEstimates() {
+    boost::mutex::scoped_lock lock(reportMutex_);
+
+    for(int i = 0; i < numberOfKeys_; i++) {
+        estimates_[i].offset = 0;
+        estimates_[i].publishedOffset = 0;
+        estimates_[i].spread = 0;
+        estimates_[i].confidence = 0;
+        estimates_[i].samples = 0;
+        estimates_[i].saturated = false;
+    }
+}
@@ -0,0 +1,107 @@
+//
+//  QuiescentDriftTracker.h
+//  touchkeys
+//
+
+#ifndef __touchkeys__QuiescentDriftTracker__
+#define __touchkeys__QuiescentDriftTracker__
+
+#include <iostream>
+#include <vector>
+#include <boost/atomic.hpp>
+#include <boost/thread.hpp>
+
+const int kDriftTrackerRingSize = 256;              // Samples buffered per key (power of 2)
+const int kDriftTrackerDecimation = 10;             // Use one idle sample in this many per key
+const int kDriftTrackerUpdateMicroseconds = 250000; // How often the estimates are updated and published
+const float kDriftTrackerStep = 0.05;               // How far (raw units) each sample moves the estimate
+const float kDriftTrackerSpreadRate = 0.01;         // Adaptation rate of the spread estimate
+const float kDriftTrackerSpreadScale = 4.0;         // Spread (raw units) at which confidence halves
+const int kDriftTrackerMinimumSamples = 200;        // Samples before a key's offset is used
+const int kDriftTrackerMaximumOffset = 200;         // Largest correction (raw units); beyond this, recalibrate
+
+/*
+ * QuiescentDriftTracker
+ *
+ * Follows the slow drift of each key's resting sensor value (e.g. with temperature)
+ * and publishes a correcting offset. The data thread passes in the difference between
+ * the raw value and the calibrated quiescent value whenever a key is idle; these go
+ * into a lock-free ring per key and never block. A background thread drains the rings
+ * and updates a running median estimate of each key's offset, which moves a small step
+ * towards each sample so occasional outliers (a resting finger) have little effect.
+ * Offsets are published as atomic integers that the data thread subtracts from raw
+ * values before calibrating.
+ */
+
+class QuiescentDriftTracker {
+public:
+    // State of the estimate for one key
+    class KeyReport {
+    public:
+        float offset;               // Current estimate of the drift (raw units)
+        int publishedOffset;        // Correction being applied
+        float spread;               // Running mean absolute deviation of idle samples
+        float confidence;           // 0-1, from the number of samples and their spread
+        unsigned long samples;      // Idle samples used since the last reset
+        bool saturated;             // Drift beyond kDriftTrackerMaximumOffset: recalibration needed
+    };
+
+public:
+    // ***** Constructor *****
+    QuiescentDriftTracker(int numberOfKeys);
+
+    // ***** Destructor *****
+    ~QuiescentDriftTracker();
+
+    // ***** Data Thread Methods *****
+    //
+    // Offer an idle sample for a key, as raw value minus calibrated quiescent.
+    // Only some are kept (see kDriftTrackerDecimation). Never blocks.
+    void addIdleSample(int index, int residual);
+
+    // Correction to subtract from a key's raw value
+    int offset(int index) {
+        if(index < 0 || index >= numberOfKeys_)
+            return 0;
+        return publishedOffsets_[index].load(boost::memory_order_relaxed);
+    }
+
+    // ***** Control Methods *****
+
+    void start();
+    void stop();
+    bool isRunning() { return isRunning_; }
+
+    // Forget all estimates, e.g. after recalibration. Offsets go to 0 at once.
+    void reset();
+
+    int numberOfKeys() { return numberOfKeys_; }
+    KeyReport report(int index);
+
+private:
+    // Single-producer, single-consumer ring of samples for one key
+    struct SampleRing {
+        boost::atomic<unsigned int> writePosition;
+        boost::atomic<unsigned int> readPosition;
+        int samples[kDriftTrackerRingSize];
+    };
+
+    void runLoop();
+    void update();
+    void clearEstimates();
+
+    int numberOfKeys_;
+    SampleRing *rings_;                                 // Samples from the data thread
+    int *decimationCounters_;                           // Data thread only
+    boost::atomic<int> *publishedOffsets_;              // Read by the data thread
+
+    std::vector<KeyReport> estimates_;                  // Updated by the tracker thread
+    boost::mutex reportMutex_;                          // Protects estimates_ against report()
+
+    boost::thread trackerThread_;
+    volatile bool isRunning_;
+    volatile bool shouldStop_;
+    boost::atomic<bool> resetRequested_;
+};
+
+#endif /* defined(__touchkeys__QuiescentDriftTracker__) */
@@ -0,0 +1,878 @@
+//
+//  SessionLog.cpp
+//  touchkeys
+//
+
+#include "SessionLog.h"
+#include "SessionLogCodec.h"
+#include "Logger.h"
+#include <cstring>
+#include <algorithm>
+#include <cstdlib>
+#include <errno.h>
+#include <cfloat>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+// Constructor
+SessionLog::SessionLog(int ringSize)
+: enqueuePosition_(0), dequeuePosition_(0), fileDescriptor_(-1), writerShouldStop_(false),
+  writeFailed_(false), encoding_(kSessionLogEncodingRaw), fileEncoding_(kSessionLogEncodingRaw),
+  currentBlockOffset_(0), blockIsOpen_(false), recordsInFile_(0),
+  recordsWritten_(0), recordsDropped_(0), bytesWritten_(0)
+{
+    // Round the ring size up to a power of 2 so positions can be masked. The ring
+    // itself is only allocated when a log is first opened.
+    boost::uint64_t size = 2;
+    while(size < (boost::uint64_t)ringSize)
+        size <<= 1;
+    ringMask_ = size - 1;
+    ring_ = 0;
+    writeBuffer_ = 0;
+
+    codec_ = new SessionLogCodec;
+}
+
+// Destructor
+SessionLog::~SessionLog() {
+    close();
+    delete[] ring_;
+    free(writeBuffer_);
+    delete codec_;
+}
+
+// Open a new log file and start the thread that writes to it. If bypassCache
+// is set, ask the OS not to keep the log data in its buffer cache, since it
+// will not be read back during the session.
+bool SessionLog::open(std::string const& filename, bool bypassCache) {
+    if(isOpen())
+        close();
+    if(!allocateBuffers())
+        return false;
+
+    fileDescriptor_ = ::open(filename.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if(fileDescriptor_ < 0) {
+        TOUCHKEY_LOG(kLogLevelError, "SessionLog: unable to open {} (errno {})") << filename << errno;
+        return false;
+    }
+
+#ifdef F_NOCACHE
+    if(bypassCache)
+        fcntl(fileDescriptor_, F_NOCACHE, 1);
+#endif
+
+    // Throw away anything left in the ring from a previous file
+    while(drain(writeBuffer_, kSessionLogWriteBatchSize) > 0) {}
+
+    if(!writeHeader()) {
+        ::close(fileDescriptor_);
+        fileDescriptor_ = -1;
+        return false;
+    }
+
+    recordsWritten_ = 0;
+    recordsDropped_ = 0;
+    bytesWritten_ = 0;
+    recordsInFile_ = 0;
+    blockIsOpen_ = false;
+    writeFailed_ = false;
+    fileEncoding_ = encoding_;
+    blockIndex_.clear();
+    pendingBlock_.clear();
+    writerShouldStop_ = false;
+    writerThread_ = boost::thread(&SessionLog::writerLoop, this);
+
+    return true;
+}
+
+// Allocate the ring and write buffer the first time a log is opened. They are kept
+// until the SessionLog is destroyed, since producers may still be looking at the
+// ring after close().
+bool SessionLog::allocateBuffers() {
+    if(ring_ != 0 && writeBuffer_ != 0)
+        return true;
+
+    if(writeBuffer_ == 0) {
+        // Page-aligned so the writes can bypass the cache where supported
+        void *buffer = 0;
+        if(posix_memalign(&buffer, 4096, kSessionLogWriteBatchSize * sizeof(SessionLogRecord)) != 0)
+            return false;
+        writeBuffer_ = (SessionLogRecord *)buffer;
+    }
+
+    if(ring_ == 0) {
+        boost::uint64_t size = ringMask_ + 1;
+        Slot *ring = new Slot[size];
+        for(boost::uint64_t i = 0; i < size; i++)
+            ring[i].sequence.store(i, boost::memory_order_relaxed);
+        enqueuePosition_.store(0, boost::memory_order_relaxed);
+        dequeuePosition_ = 0;
+        ring_ = ring;
+    }
+
+    return true;
+}
+
+// Stop the writer thread, flush anything still in the ring and close the file
+void SessionLog::close() {
+    if(!isOpen())
+        return;
+
+    writerShouldStop_ = true;
+    writerThread_.join();
+
+    ::close(fileDescriptor_);
+    fileDescriptor_ = -1;
+}
+
+// Add a frame of touch data for a key
+void SessionLog::logTouch(timestamp_type timestamp, int frame, int midiNote, KeyTouchFrame const& touchFrame, int source) {
+    SessionLogRecord record;
+
+    memset(&record, 0, sizeof(record));
+    record.timestamp = timestamp;
+    record.type = kSessionLogRecordTouch;
+    record.source = source;
+    record.frame = frame;
+    record.note = midiNote;
+    record.touch.count = touchFrame.count;
+    for(int i = 0; i < 3; i++) {
+        record.touch.locs[i] = touchFrame.locs[i];
+        record.touch.sizes[i] = touchFrame.sizes[i];
+    }
+    record.touch.locH = touchFrame.locH;
+    record.touch.white = touchFrame.white ? 1 : 0;
+
+    append(record);
+}
+
+// Record that all touches have ended on a key
+void SessionLog::logTouchOff(timestamp_type timestamp, int frame, int midiNote, bool white, int source) {
+    KeyTouchFrame emptyFrame;
+
+    emptyFrame.white = white;
+    logTouch(timestamp, frame, midiNote, emptyFrame, source);
+}
+
+// Add a calibrated key position sample
+void SessionLog::logAnalog(timestamp_type timestamp, int frame, int midiNote, float position, int rawValue, int source) {
+    SessionLogRecord record;
+
+    memset(&record, 0, sizeof(record));
+    record.timestamp = timestamp;
+    record.type = kSessionLogRecordAnalog;
+    record.source = source;
+    record.frame = frame;
+    record.note = midiNote;
+    record.analog.position = position;
+    record.analog.rawValue = rawValue;
+
+    append(record);
+}
+
+// Add a MIDI message. The note field holds the second byte where present.
+void SessionLog::logMidi(timestamp_type timestamp, const unsigned char *bytes, int length, int source) {
+    SessionLogRecord record;
+
+    if(bytes == 0 || length <= 0)
+        return;
+    if(length > 3)
+        length = 3;
+
+    memset(&record, 0, sizeof(record));
+    record.timestamp = timestamp;
+    record.type = kSessionLogRecordMidi;
+    record.source = source;
+    record.frame = 0;
+    record.note = (length > 1) ? bytes[1] : -1;
+    record.midi.length = length;
+    for(int i = 0; i < length; i++)
+        record.midi.bytes[i] = bytes[i];
+
+    append(record);
+}
+
+// Add an OSC message. Paths are truncated to fit, and only the first few
+// int or float arguments are kept; other types are stored as type only.
+void SessionLog::logOsc(timestamp_type timestamp, const char *path, const char *types, lo_arg **argv, int argc, int source) {
+    SessionLogRecord record;
+
+    if(path == 0)
+        return;
+
+    memset(&record, 0, sizeof(record));
+    record.timestamp = timestamp;
+    record.type = kSessionLogRecordOsc;
+    record.source = source;
+    record.frame = 0;
+    record.note = -1;
+    strncpy(record.osc.path, path, kSessionLogOscPathLength - 1);
+
+    for(int i = 0; i < argc && i < kSessionLogOscMaxArguments && types != 0 && types[i] != 0; i++) {
+        record.osc.types[i] = types[i];
+        if(types[i] == 'i')
+            record.osc.args[i].i = argv[i]->i;
+        else if(types[i] == 'f')
+            record.osc.args[i].f = argv[i]->f;
+    }
+
+    append(record);
+}
+
+// Copy a record into the ring. Several producers can call this at once: each
+// claims a slot by advancing the enqueue position, then publishes the record
+// by updating the slot's sequence number. Never blocks.
+bool SessionLog::append(SessionLogRecord const& record) {
+    if(!isOpen())
+        return false;
+
+    boost::uint64_t position = enqueuePosition_.load(boost::memory_order_relaxed);
+    Slot *slot;
+
+    while(true) {
+        slot = &ring_[position & ringMask_];
+        boost::uint64_t sequence = slot->sequence.load(boost::memory_order_acquire);
+
+        if(sequence == position) {
+            // Slot is free: try to claim it
+            if(enqueuePosition_.compare_exchange_weak(position, position + 1, boost::memory_order_relaxed))
+                break;
+        }
+        else if(sequence < position) {
+            // Writer hasn't caught up: the ring is full
+            recordsDropped_.fetch_add(1, boost::memory_order_relaxed);
+            return false;
+        }
+        else
+            position = enqueuePosition_.load(boost::memory_order_relaxed);
+    }
+
+    slot->record = record;
+    slot->sequence.store(position + 1, boost::memory_order_release);
+    return true;
+}
+
+// Copy up to maxRecords published records out of the ring. Writer thread only.
+int SessionLog::drain(SessionLogRecord *buffer, int maxRecords) {
+    int count = 0;
+
+    while(count < maxRecords) {
+        Slot *slot = &ring_[dequeuePosition_ & ringMask_];
+        if(slot->sequence.load(boost::memory_order_acquire) != dequeuePosition_ + 1)
+            break;
+
+        buffer[count++] = slot->record;
+        slot->sequence.store(dequeuePosition_ + ringMask_ + 1, boost::memory_order_release);
+        dequeuePosition_++;
+    }
+
+    return count;
+}
+
+// Writer thread: collect records in batches and write each batch with
+// a single call. Runs until close(), then writes whatever is left along
+// with the block index.
+void SessionLog::writerLoop() {
+    while(true) {
+        bool stopping = writerShouldStop_.load(boost::memory_order_acquire);
+        int count = drain(writeBuffer_, kSessionLogWriteBatchSize);
+
+        if(count > 0) {
+            writeToBlocks(writeBuffer_, count);
+
+            // A full batch suggests more is waiting; go straight back for it
+            if(count == kSessionLogWriteBatchSize)
+                continue;
+        }
+        else if(stopping)
+            break;
+
+        if(!stopping)
+            usleep(kSessionLogWriterIdleMicroseconds);
+    }
+
+    if(blockIsOpen_)
+        finishBlock();
+    if(!writeFailed_)
+        writeIndex();
+}
+
+// Write a batch of records, starting and finishing blocks as needed and
+// keeping the current block's header up to date. Writer thread only.
+void SessionLog::writeToBlocks(const SessionLogRecord *records, int count) {
+    while(count > 0) {
+        if(writeFailed_ || (!blockIsOpen_ && !startBlock())) {
+            recordsDropped_.fetch_add(count, boost::memory_order_relaxed);
+            return;
+        }
+
+        int space = kSessionLogRecordsPerBlock - currentBlock_.recordCount;
+        int length = (count < space) ? count : space;
+
+        for(int i = 0; i < length; i++) {
+            SessionLogRecord const& record = records[i];
+
+            if(record.timestamp < currentBlock_.firstTimestamp)
+                currentBlock_.firstTimestamp = record.timestamp;
+            if(record.timestamp > currentBlock_.lastTimestamp)
+                currentBlock_.lastTimestamp = record.timestamp;
+            if(record.type < 32)
+                currentBlock_.typeMask |= (1U << record.type);
+            if(record.note >= 0 && record.note < kSessionLogNumKeys)
+                currentBlock_.keys[record.note >> 6] |= (1ULL << (record.note & 63));
+        }
+
+        if(fileEncoding_ != kSessionLogEncodingRaw)
+            pendingBlock_.insert(pendingBlock_.end(), records, records + length);
+        else if(!writeBytes(records, length * sizeof(SessionLogRecord))) {
+            writeFailed_ = true;
+            recordsDropped_.fetch_add(count, boost::memory_order_relaxed);
+            return;
+        }
+        recordsWritten_.fetch_add(length, boost::memory_order_relaxed);
+        recordsInFile_ += length;
+        currentBlock_.recordCount += length;
+
+        if(currentBlock_.recordCount == kSessionLogRecordsPerBlock)
+            finishBlock();
+
+        records += length;
+        count -= length;
+    }
+}
+
+// Write to the end of the file, retrying short writes
+bool SessionLog::writeBytes(const void *bytes, size_t length) {
+    const char *data = (const char *)bytes;
+    size_t remaining = length;
+
+    while(remaining > 0) {
+        ssize_t written = write(fileDescriptor_, data, remaining);
+        if(written < 0) {
+            if(errno == EINTR)
+                continue;
+            TOUCHKEY_LOG(kLogLevelError, "SessionLog: write failed (errno {})") << errno;
+            return false;
+        }
+        data += written;
+        remaining -= written;
+    }
+
+    bytesWritten_.fetch_add(length, boost::memory_order_relaxed);
+    return true;
+}
+
+// Start a new block. Raw blocks reserve space for the header, written with a record
+// count of 0 which marks the block as unfinished until finishBlock() fills it in.
+// Encoded blocks are written in one go when they are finished.
+bool SessionLog::startBlock() {
+    memset(&currentBlock_, 0, sizeof(currentBlock_));
+    memcpy(currentBlock_.magic, kSessionLogBlockMagic, 8);
+    currentBlock_.firstTimestamp = DBL_MAX;
+    currentBlock_.lastTimestamp = -DBL_MAX;
+    currentBlock_.firstRecord = recordsInFile_;
+    currentBlock_.encoding = fileEncoding_;
+
+    if(fileEncoding_ != kSessionLogEncodingRaw) {
+        blockIsOpen_ = true;
+        return true;
+    }
+
+    currentBlockOffset_ = lseek(fileDescriptor_, 0, SEEK_CUR);
+    if(currentBlockOffset_ < 0 || !writeBytes(&currentBlock_, sizeof(currentBlock_))) {
+        writeFailed_ = true;
+        return false;
+    }
+
+    blockIsOpen_ = true;
+    return true;
+}
+
+// Write the completed header over the placeholder, or encode and write the whole
+// block, then add the header to the index
+void SessionLog::finishBlock() {
+    blockIsOpen_ = false;
+    if(currentBlock_.recordCount == 0)
+        return;
+
+    if(fileEncoding_ == kSessionLogEncodingRaw) {
+        currentBlock_.storedLength = currentBlock_.recordCount * kSessionLogRecordLength;
+        if(pwrite(fileDescriptor_, &currentBlock_, sizeof(currentBlock_), currentBlockOffset_) != sizeof(currentBlock_)) {
+            TOUCHKEY_LOG(kLogLevelError, "SessionLog: unable to update block header (errno {})") << errno;
+            writeFailed_ = true;
+            return;
+        }
+    }
+    else {
+        codec_->encode(&pendingBlock_[0], currentBlock_.recordCount,
+                       fileEncoding_ == kSessionLogEncodingDeltaLZ, encodedBlock_);
+        pendingBlock_.clear();
+        currentBlock_.storedLength = (boost::uint32_t)encodedBlock_.size();
+
+        if(!writeBytes(&currentBlock_, sizeof(currentBlock_)) ||
+           !writeBytes(&encodedBlock_[0], encodedBlock_.size())) {
+            recordsDropped_.fetch_add(currentBlock_.recordCount, boost::memory_order_relaxed);
+            writeFailed_ = true;
+            return;
+        }
+    }
+
+    blockIndex_.push_back(currentBlock_);
+}
+
+// Write a copy of every block header at the end of the file, followed by a trailer
+// giving the index location. Readers check the trailer first.
+bool SessionLog::writeIndex() {
+    char trailer[kSessionLogTrailerLength];
+    boost::uint64_t indexOffset = lseek(fileDescriptor_, 0, SEEK_CUR);
+    boost::uint32_t blockCount = (boost::uint32_t)blockIndex_.size();
+
+    if(!blockIndex_.empty() &&
+       !writeBytes(&blockIndex_[0], blockIndex_.size() * sizeof(SessionLogBlockHeader)))
+        return false;
+
+    memset(trailer, 0, kSessionLogTrailerLength);
+    memcpy(trailer, &indexOffset, 8);
+    memcpy(&trailer[8], &blockCount, 4);
+    memcpy(&trailer[16], kSessionLogIndexMagic, 8);
+
+    return (write(fileDescriptor_, trailer, kSessionLogTrailerLength) == kSessionLogTrailerLength);
+}
+
+// Write the file header: magic, version, byte order, record length, number of
+// record types, records per block, then a fixed-length name and field layout for
+// each record type so that the file can be interpreted without this source code.
+bool SessionLog::writeHeader() {
+    const int headerLength = kSessionLogFixedHeaderLength + kSessionLogNumRecordTypes * kSessionLogTypeDescriptionLength;
+    char header[headerLength];
+    boost::uint32_t value;
+
+    memset(header, 0, headerLength);
+    memcpy(header, kSessionLogMagic, 8);
+    value = kSessionLogVersion;
+    memcpy(&header[8], &value, 4);
+    value = kSessionLogByteOrderMark;
+    memcpy(&header[12], &value, 4);
+    value = kSessionLogRecordLength;
+    memcpy(&header[16], &value, 4);
+    value = kSessionLogNumRecordTypes;
+    memcpy(&header[20], &value, 4);
+    value = kSessionLogRecordsPerBlock;
+    memcpy(&header[24], &value, 4);
+
+    for(int type = 1; type <= kSessionLogNumRecordTypes; type++) {
+        char *description = &header[kSessionLogFixedHeaderLength + (type - 1) * kSessionLogTypeDescriptionLength];
+        value = type;
+        memcpy(description, &value, 4);
+        strncpy(description + 4, recordTypeName(type), 11);
+        strncpy(description + 16, recordTypeLayout(type), kSessionLogTypeDescriptionLength - 17);
+    }
+
+    return (write(fileDescriptor_, header, headerLength) == headerLength);
+}
+
+// Names for each record type
+const char* SessionLog::recordTypeName(int type) {
+    switch(type) {
+        case kSessionLogRecordTouch:    return "touch";
+        case kSessionLogRecordAnalog:   return "analog";
+        case kSessionLogRecordMidi:     return "midi";
+        case kSessionLogRecordOsc:      return "osc";
+        default:                        return "unknown";
+    }
+}
+
+// Field layouts for each record type. The first 20 bytes are common to all.
+const char* SessionLog::recordTypeLayout(int type) {
+    switch(type) {
+        case kSessionLogRecordTouch:
+            return "f64 timestamp;u16 type;u16 source;i32 frame;i32 note;i32 count;f32 locs[3];f32 sizes[3];f32 locH;u8 white";
+        case kSessionLogRecordAnalog:
+            return "f64 timestamp;u16 type;u16 source;i32 frame;i32 note;f32 position;i32 raw";
+        case kSessionLogRecordMidi:
+            return "f64 timestamp;u16 type;u16 source;i32 frame;i32 note;u8 length;u8 bytes[3]";
+        case kSessionLogRecordOsc:
+            return "f64 timestamp;u16 type;u16 source;i32 frame;i32 note;c path[28];c types[4];i32|f32 args[3]";
+        default:
+            return "";
+    }
+}
+
+// ***** SessionLogReader *****
+
+// Constructor
+SessionLogReader::SessionLogReader()
+: fileDescriptor_(-1), mappedData_(0), mappedLength_(0), version_(0), dataOffset_(0), recordCount_(0),
+  startTimestamp_(0), endTimestamp_(0), timeRangeIsSet_(false), keyFilterIsSet_(false),
+  currentBlock_(0), lastBlock_(-1), currentRecord_(0), currentRecords_(0)
+{
+    keyFilter_[0] = keyFilter_[1] = 0;
+    codec_ = new SessionLogCodec;
+}
+
+// Destructor
+SessionLogReader::~SessionLogReader() {
+    close();
+    delete codec_;
+}
+
+// Open and map a log file, check that its header matches what we can read,
+// then load (or rebuild) the block index
+bool SessionLogReader::open(std::string const& filename) {
+    struct stat fileStatus;
+    boost::uint32_t byteOrder, recordLength, numTypes, recordsPerBlock = 0;
+
+    close();
+
+    fileDescriptor_ = ::open(filename.c_str(), O_RDONLY);
+    if(fileDescriptor_ < 0) {
+        TOUCHKEY_LOG(kLogLevelError, "SessionLogReader: unable to open {} (errno {})") << filename << errno;
+        return false;
+    }
+
+    try {
+        if(fstat(fileDescriptor_, &fileStatus) != 0 || fileStatus.st_size < kSessionLogFixedHeaderLength)
+            throw 1;
+
+        void *mapping = mmap(0, fileStatus.st_size, PROT_READ, MAP_SHARED, fileDescriptor_, 0);
+        if(mapping == MAP_FAILED) {
+            TOUCHKEY_LOG(kLogLevelError, "SessionLogReader: unable to map {} (errno {})") << filename << errno;
+            throw 1;
+        }
+        mappedData_ = (const char *)mapping;
+        mappedLength_ = fileStatus.st_size;
+
+        if(memcmp(mappedData_, kSessionLogMagic, 8) != 0)
+            throw 1;
+        memcpy(&version_, &mappedData_[8], 4);
+        memcpy(&byteOrder, &mappedData_[12], 4);
+        memcpy(&recordLength, &mappedData_[16], 4);
+        memcpy(&numTypes, &mappedData_[20], 4);
+
+        if((version_ != kSessionLogVersion && version_ != kSessionLogFlatVersion) ||
+           byteOrder != kSessionLogByteOrderMark || recordLength != kSessionLogRecordLength) {
+            TOUCHKEY_LOG(kLogLevelError, "SessionLogReader: {} has unsupported version or layout") << filename;
+            throw 1;
+        }
+
+        if(version_ == kSessionLogFlatVersion) {
+            // No blocks: treat all the records as one block and scan them for its header
+            SessionLogBlockHeader header;
+
+            dataOffset_ = kSessionLogFlatFixedHeaderLength + numTypes * kSessionLogTypeDescriptionLength;
+            if((off_t)mappedLength_ < dataOffset_)
+                throw 1;
+            const SessionLogRecord *records = (const SessionLogRecord *)(mappedData_ + dataOffset_);
+            boost::uint32_t count = (boost::uint32_t)((mappedLength_ - dataOffset_) / kSessionLogRecordLength);
+
+            memset(&header, 0, sizeof(header));
+            memcpy(header.magic, kSessionLogBlockMagic, 8);
+            scanBlock(header, records, count);
+            if(count > 0) {
+                blocks_.push_back(header);
+                blockData_.push_back((const char *)records);
+            }
+        }
+        else {
+            memcpy(&recordsPerBlock, &mappedData_[24], 4);
+            dataOffset_ = kSessionLogFixedHeaderLength + numTypes * kSessionLogTypeDescriptionLength;
+            if((off_t)mappedLength_ < dataOffset_ || recordsPerBlock == 0)
+                throw 1;
+
+            if(!loadIndex(recordsPerBlock)) {
+                TOUCHKEY_LOG(kLogLevelWarning, "SessionLogReader: {} has no index; rebuilding from block headers") << filename;
+                if(!rebuildIndex(recordsPerBlock))
+                    throw 1;
+            }
+        }
+    }
+    catch(...) {
+        close();
+        return false;
+    }
+
+    // Running extremes of the block timestamps, so a time range can be found
+    // by binary search even though blocks overlap slightly in time
+    int numBlocks = (int)blocks_.size();
+    latestUpTo_.resize(numBlocks);
+    earliestFrom_.resize(numBlocks);
+    recordCount_ = 0;
+    for(int i = 0; i < numBlocks; i++) {
+        recordCount_ += blocks_[i].recordCount;
+        latestUpTo_[i] = blocks_[i].lastTimestamp;
+        if(i > 0 && latestUpTo_[i - 1] > latestUpTo_[i])
+            latestUpTo_[i] = latestUpTo_[i - 1];
+    }
+    for(int i = numBlocks - 1; i >= 0; i--) {
+        earliestFrom_[i] = blocks_[i].firstTimestamp;
+        if(i < numBlocks - 1 && earliestFrom_[i + 1] < earliestFrom_[i])
+            earliestFrom_[i] = earliestFrom_[i + 1];
+    }
+
+    rewind();
+    return true;
+}
+
+// Unmap and close the file
+void SessionLogReader::close() {
+    if(mappedData_ != 0)
+        munmap((void *)mappedData_, mappedLength_);
+    mappedData_ = 0;
+    mappedLength_ = 0;
+    if(fileDescriptor_ >= 0)
+        ::close(fileDescriptor_);
+    fileDescriptor_ = -1;
+
+    blocks_.clear();
+    blockData_.clear();
+    latestUpTo_.clear();
+    earliestFrom_.clear();
+    recordCount_ = 0;
+    currentBlock_ = 0;
+    lastBlock_ = -1;
+    currentRecord_ = 0;
+}
+
+// Go back to the first block that can hold records in the time range
+void SessionLogReader::rewind() {
+    currentRecord_ = 0;
+
+    if(!timeRangeIsSet_) {
+        currentBlock_ = 0;
+        lastBlock_ = (int)blocks_.size() - 1;
+        return;
+    }
+
+    currentBlock_ = (int)(std::lower_bound(latestUpTo_.begin(), latestUpTo_.end(), startTimestamp_) - latestUpTo_.begin());
+    lastBlock_ = (int)(std::upper_bound(earliestFrom_.begin(), earliestFrom_.end(), endTimestamp_) - earliestFrom_.begin()) - 1;
+}
+
+// Return the next record that passes the filters. Blocks whose header rules
+// them out are skipped without reading their records.
+bool SessionLogReader::next(SessionLogRecord& record) {
+    while(currentBlock_ <= lastBlock_) {
+        if(currentRecord_ == 0) {
+            if(!blockMatches(currentBlock_)) {
+                currentBlock_++;
+                continue;
+            }
+            if(!enterBlock(currentBlock_)) {
+                currentBlock_++;
+                continue;
+            }
+        }
+
+        boost::uint32_t count = blocks_[currentBlock_].recordCount;
+
+        while(currentRecord_ < count) {
+            SessionLogRecord const& candidate = currentRecords_[currentRecord_++];
+            if(recordMatches(candidate)) {
+                record = candidate;
+                return true;
+            }
+        }
+
+        currentBlock_++;
+        currentRecord_ = 0;
+    }
+
+    return false;
+}
+
+// Restrict reading to a time range and go to its start
+void SessionLogReader::setTimeRange(timestamp_type startTimestamp, timestamp_type endTimestamp) {
+    startTimestamp_ = startTimestamp;
+    endTimestamp_ = endTimestamp;
+    timeRangeIsSet_ = true;
+    rewind();
+}
+
+// Read the whole file again
+void SessionLogReader::clearTimeRange() {
+    timeRangeIsSet_ = false;
+    rewind();
+}
+
+// Add a key to the set of keys returned
+void SessionLogReader::addKeyFilter(int midiNote) {
+    if(midiNote < 0 || midiNote >= kSessionLogNumKeys)
+        return;
+    keyFilter_[midiNote >> 6] |= (1ULL << (midiNote & 63));
+    keyFilterIsSet_ = true;
+}
+
+// Return records for all keys
+void SessionLogReader::clearKeyFilter() {
+    keyFilter_[0] = keyFilter_[1] = 0;
+    keyFilterIsSet_ = false;
+}
+
+// Earliest timestamp in the file
+timestamp_type SessionLogReader::firstTimestamp() {
+    if(earliestFrom_.empty())
+        return 0;
+    return earliestFrom_.front();
+}
+
+// Latest timestamp in the file
+timestamp_type SessionLogReader::lastTimestamp() {
+    if(latestUpTo_.empty())
+        return 0;
+    return latestUpTo_.back();
+}
+
+// Load the block index from the end of the file. Returns false if there is no
+// valid trailer, e.g. if the log was not closed.
+bool SessionLogReader::loadIndex(size_t recordsPerBlock) {
+    boost::uint64_t indexOffset;
+    boost::uint32_t blockCount;
+
+    if(mappedLength_ < (size_t)dataOffset_ + kSessionLogTrailerLength)
+        return false;
+
+    const char *trailer = mappedData_ + mappedLength_ - kSessionLogTrailerLength;
+    if(memcmp(&trailer[16], kSessionLogIndexMagic, 8) != 0)
+        return false;
+    memcpy(&indexOffset, trailer, 8);
+    memcpy(&blockCount, &trailer[8], 4);
+
+    if(indexOffset + (boost::uint64_t)blockCount * kSessionLogRecordLength + kSessionLogTrailerLength != mappedLength_)
+        return false;
+
+    // Blocks follow one another, so each one's position comes from the lengths before it
+    const SessionLogBlockHeader *index = (const SessionLogBlockHeader *)(mappedData_ + indexOffset);
+    boost::uint64_t offset = dataOffset_;
+    for(boost::uint32_t i = 0; i < blockCount; i++) {
+        boost::uint64_t length = storedLength(index[i]);
+        if(memcmp(index[i].magic, kSessionLogBlockMagic, 8) != 0 || index[i].recordCount > recordsPerBlock ||
+           offset + kSessionLogRecordLength + length > indexOffset) {
+            blocks_.clear();
+            blockData_.clear();
+            return false;
+        }
+        blocks_.push_back(index[i]);
+        blockData_.push_back(mappedData_ + offset + kSessionLogRecordLength);
+        offset += kSessionLogRecordLength + length;
+    }
+
+    return true;
+}
+
+// Walk the block headers from the start of the file. A raw block left unfinished
+// (record count 0) takes whatever records follow it and is scanned to fill in its
+// header. An encoded block that was cut short is discarded.
+bool SessionLogReader::rebuildIndex(size_t recordsPerBlock) {
+    size_t offset = dataOffset_;
+
+    while(offset + kSessionLogRecordLength <= mappedLength_) {
+        SessionLogBlockHeader header;
+        const char *data = mappedData_ + offset + kSessionLogRecordLength;
+        size_t available = mappedLength_ - offset - kSessionLogRecordLength;
+
+        memcpy(&header, mappedData_ + offset, sizeof(header));
+        if(memcmp(header.magic, kSessionLogBlockMagic, 8) != 0)
+            break;
+
+        if(header.encoding == kSessionLogEncodingRaw) {
+            size_t availableRecords = available / kSessionLogRecordLength;
+            if(header.recordCount == 0 || header.recordCount > availableRecords) {
+                scanBlock(header, (const SessionLogRecord *)data,
+                          (boost::uint32_t)(availableRecords < recordsPerBlock ? availableRecords : recordsPerBlock));
+                if(header.recordCount == 0)
+                    break;
+            }
+        }
+        else if(header.recordCount == 0 || header.recordCount > recordsPerBlock || header.storedLength > available)
+            break;
+
+        blocks_.push_back(header);
+        blockData_.push_back(data);
+        offset += kSessionLogRecordLength + storedLength(header);
+    }
+
+    return true;
+}
+
+// Fill in a block header from the records themselves
+void SessionLogReader::scanBlock(SessionLogBlockHeader& header, const SessionLogRecord *records, boost::uint32_t count) {
+    header.recordCount = count;
+    header.typeMask = 0;
+    header.firstTimestamp = DBL_MAX;
+    header.lastTimestamp = -DBL_MAX;
+    header.keys[0] = header.keys[1] = 0;
+
+    for(boost::uint32_t i = 0; i < count; i++) {
+        SessionLogRecord const& record = records[i];
+
+        if(record.timestamp < header.firstTimestamp)
+            header.firstTimestamp = record.timestamp;
+        if(record.timestamp > header.lastTimestamp)
+            header.lastTimestamp = record.timestamp;
+        if(record.type < 32)
+            header.typeMask |= (1U << record.type);
+        if(record.note >= 0 && record.note < kSessionLogNumKeys)
+            header.keys[record.note >> 6] |= (1ULL << (record.note & 63));
+    }
+}
+
+// Whether a block can contain anything passing the filters
+bool SessionLogReader::blockMatches(int block) {
+    SessionLogBlockHeader const& header = blocks_[block];
+
+    if(timeRangeIsSet_ && (header.lastTimestamp < startTimestamp_ || header.firstTimestamp > endTimestamp_))
+        return false;
+    if(keyFilterIsSet_ && (header.keys[0] & keyFilter_[0]) == 0 && (header.keys[1] & keyFilter_[1]) == 0)
+        return false;
+    return true;
+}
+
+// Whether a record passes the filters
+bool SessionLogReader::recordMatches(SessionLogRecord const& record) {
+    if(timeRangeIsSet_ && (record.timestamp < startTimestamp_ || record.timestamp > endTimestamp_))
+        return false;
+    if(keyFilterIsSet_) {
+        if(record.note < 0 || record.note >= kSessionLogNumKeys)
+            return false;
+        if((keyFilter_[record.note >> 6] & (1ULL << (record.note & 63))) == 0)
+            return false;
+    }
+    return true;
+}
+
+// Get a block ready to read: ask the OS to start reading it from the file, and
+// decode it if it is compressed. Returns false if the block can't be decoded.
+bool SessionLogReader::enterBlock(int block) {
+    static const size_t pageSize = (size_t)sysconf(_SC_PAGESIZE);
+
+    SessionLogBlockHeader const& header = blocks_[block];
+    const char *start = blockData_[block];
+    const char *end = start + storedLength(header);
+    const char *alignedStart = mappedData_ + ((start - mappedData_) / pageSize) * pageSize;
+
+    posix_madvise((void *)alignedStart, end - alignedStart, POSIX_MADV_WILLNEED);
+
+    if(header.encoding == kSessionLogEncodingRaw) {
+        currentRecords_ = (const SessionLogRecord *)start;
+        return true;
+    }
+
+    if(decodedRecords_.size() < header.recordCount)
+        decodedRecords_.resize(header.recordCount);
+    if(!codec_->decode((const unsigned char *)start, header.storedLength, header.encoding == kSessionLogEncodingDeltaLZ,
+                       &decodedRecords_[0], header.recordCount)) {
+        TOUCHKEY_LOG(kLogLevelError, "SessionLogReader: block {} is corrupt") << block;
+        return false;
+    }
+
+    currentRecords_ = &decodedRecords_[0];
+    return true;
+}
+
+// Bytes following a block header. The length of raw blocks follows from their record count.
+size_t SessionLogReader::storedLength(SessionLogBlockHeader const& header) {
+    if(header.encoding == kSessionLogEncodingRaw)
+        return (size_t)header.recordCount * kSessionLogRecordLength;
+    return header.storedLength;
+}
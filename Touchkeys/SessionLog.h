@@ -0,0 +1,319 @@
+//
+//  SessionLog.h
+//  touchkeys
+//
+
+#ifndef __touchkeys__SessionLog__
+#define __touchkeys__SessionLog__
+
+#include <iostream>
+#include <string>
+#include <vector>
+#include <sys/types.h>
+#include <boost/atomic.hpp>
+#include <boost/thread.hpp>
+#include <boost/cstdint.hpp>
+#include <boost/static_assert.hpp>
+#include "lo/lo.h"
+#include "Types.h"
+#include "KeyTouchFrame.h"
+
+// File format constants. The header is followed by fixed-size blocks of records,
+// each starting with a block header summarising its time span and which keys it
+// contains. A copy of every block header is written as an index at the end of the
+// file, so a reader can find any time range or key without scanning the records.
+
+const char kSessionLogMagic[8] = { 'T', 'K', 'S', 'L', 'O', 'G', 0, 0 };
+const char kSessionLogBlockMagic[8] = { 'T', 'K', 'B', 'L', 'O', 'C', 'K', 0 };
+const char kSessionLogIndexMagic[8] = { 'T', 'K', 'I', 'N', 'D', 'E', 'X', 0 };
+const boost::uint32_t kSessionLogVersion = 2;
+const boost::uint32_t kSessionLogFlatVersion = 1;       // Earlier format: records only, no blocks
+const boost::uint32_t kSessionLogByteOrderMark = 0x01020304;
+const int kSessionLogFixedHeaderLength = 32;            // Bytes before the record type descriptions
+const int kSessionLogFlatFixedHeaderLength = 24;        // Same, for version 1
+const int kSessionLogRecordLength = 64;                 // Bytes per record
+const int kSessionLogRecordsPerBlock = 4096;            // Records in each full block
+const int kSessionLogTrailerLength = 24;                // Bytes after the index
+const int kSessionLogTypeDescriptionLength = 128;       // Bytes per record type description in the header
+const int kSessionLogDefaultRingSize = 65536;           // Records buffered between producers and writer (power of 2)
+const int kSessionLogWriteBatchSize = 4096;             // Records written per write() call at most
+const int kSessionLogWriterIdleMicroseconds = 5000;     // How long the writer sleeps when there's nothing to do
+const int kSessionLogOscPathLength = 28;                // Longest OSC path stored (including terminator)
+const int kSessionLogOscMaxArguments = 3;               // OSC arguments stored per message
+const int kSessionLogNumKeys = 128;                     // Notes covered by the block key bitmap
+
+// Record types
+enum {
+    kSessionLogRecordTouch = 1,         // One frame of touch data for a key
+    kSessionLogRecordAnalog = 2,        // One calibrated key position sample
+    kSessionLogRecordMidi = 3,          // A MIDI message (up to 3 bytes)
+    kSessionLogRecordOsc = 4,           // An OSC message with up to 3 numeric arguments
+    kSessionLogNumRecordTypes = 4
+};
+
+// How the records in a block are stored
+enum {
+    kSessionLogEncodingRaw = 0,         // Records as they are in memory
+    kSessionLogEncodingDelta = 1,       // Delta and varint encoded (see SessionLogCodec)
+    kSessionLogEncodingDeltaLZ = 2      // Delta encoded then LZ compressed
+};
+
+// One fixed-length record. All fields are stored in native byte order, which the
+// header identifies with kSessionLogByteOrderMark.
+
+struct SessionLogRecord {
+    double timestamp;                   // Timestamp in seconds on the keyboard timeline
+    boost::uint16_t type;               // kSessionLogRecord...
+    boost::uint16_t source;             // Which producer wrote it (e.g. device index)
+    boost::int32_t frame;               // Device frame number, where relevant
+    boost::int32_t note;                // MIDI note number, where relevant
+    union {
+        struct {
+            boost::int32_t count;       // Touches (0-3); 0 means touch off
+            float locs[3];
+            float sizes[3];
+            float locH;
+            boost::uint8_t white;
+        } touch;
+        struct {
+            float position;             // Calibrated key position
+            boost::int32_t rawValue;    // Uncalibrated sensor reading
+        } analog;
+        struct {
+            boost::uint8_t length;
+            boost::uint8_t bytes[3];
+        } midi;
+        struct {
+            char path[kSessionLogOscPathLength];
+            char types[kSessionLogOscMaxArguments + 1];
+            union {
+                boost::int32_t i;
+                float f;
+            } args[kSessionLogOscMaxArguments];
+        } osc;
+        unsigned char padding[44];
+    };
+};
+
+BOOST_STATIC_ASSERT(sizeof(SessionLogRecord) == kSessionLogRecordLength);
+
+// Header at the start of each block, the same length as a record. A raw block whose
+// recordCount is 0 was still being written when the log stopped; its records run
+// to the end of the file. Encoded blocks are written whole once complete.
+
+struct SessionLogBlockHeader {
+    char magic[8];                      // kSessionLogBlockMagic
+    boost::uint32_t recordCount;        // Records in this block
+    boost::uint32_t typeMask;           // Bit (1 << type) set for each record type present
+    double firstTimestamp;              // Earliest and latest timestamp in the block. Records
+    double lastTimestamp;               // arrive from several threads so are not strictly sorted.
+    boost::uint64_t keys[2];            // Bit set for each MIDI note with a record in the block
+    boost::uint64_t firstRecord;        // Number of records in the file before this block
+    boost::uint32_t storedLength;       // Bytes between this header and the next
+    boost::uint16_t encoding;           // kSessionLogEncoding...
+    boost::uint16_t reserved;
+};
+
+BOOST_STATIC_ASSERT(sizeof(SessionLogBlockHeader) == kSessionLogRecordLength);
+
+/*
+ * SessionLog
+ *
+ * Binary log of everything the keyboard sees and does during a session: touch frames,
+ * key positions, MIDI input and OSC output. Logging methods may be called from any
+ * thread and never block; they copy a fixed-size record into a lock-free ring. A
+ * background thread drains the ring and writes records in large batches, so disk
+ * access never happens on the device I/O threads. If the ring fills up, records are
+ * dropped (and counted) rather than stalling the caller.
+ *
+ * Records are grouped into blocks of kSessionLogRecordsPerBlock. Each block header is
+ * reserved when the block starts and filled in when it is complete; the index of all
+ * block headers is written when the log is closed. Optionally, blocks are compressed
+ * by the writer thread before they are written, at the cost of losing the block in
+ * progress if the program stops without closing the log.
+ */
+
+class SessionLogCodec;
+
+class SessionLog {
+public:
+    // ***** Constructor *****
+    //
+    // ringSize is rounded up to a power of 2. Note: not copy-constructable.
+    SessionLog(int ringSize = kSessionLogDefaultRingSize);
+
+    // ***** Destructor *****
+    ~SessionLog();
+
+    // ***** File Methods *****
+    //
+    // Open a new log file (truncating any existing one) and start the writer thread.
+    // Returns true on success. close() writes anything still buffered.
+    bool open(std::string const& filename, bool bypassCache = false);
+    void close();
+    bool isOpen() { return fileDescriptor_ >= 0; }
+
+    // How to store blocks (kSessionLogEncoding...). Takes effect at the next open().
+    void setEncoding(int encoding) { encoding_ = encoding; }
+    int encoding() { return encoding_; }
+
+    // ***** Logging Methods *****
+
+    void logTouch(timestamp_type timestamp, int frame, int midiNote, KeyTouchFrame const& touchFrame, int source = 0);
+    void logTouchOff(timestamp_type timestamp, int frame, int midiNote, bool white, int source = 0);
+    void logAnalog(timestamp_type timestamp, int frame, int midiNote, float position, int rawValue, int source = 0);
+    void logMidi(timestamp_type timestamp, const unsigned char *bytes, int length, int source = 0);
+    void logOsc(timestamp_type timestamp, const char *path, const char *types, lo_arg **argv, int argc, int source = 0);
+
+    // Append a pre-built record. Returns false if it had to be dropped.
+    bool append(SessionLogRecord const& record);
+
+    // ***** Statistics *****
+
+    unsigned long recordsWritten() { return recordsWritten_.load(boost::memory_order_relaxed); }
+    unsigned long recordsDropped() { return recordsDropped_.load(boost::memory_order_relaxed); }
+    unsigned long long bytesWritten() { return bytesWritten_.load(boost::memory_order_relaxed); }
+
+    // ***** Header Description *****
+    //
+    // Human-readable field layout for each record type, as stored in the file header.
+    static const char* recordTypeName(int type);
+    static const char* recordTypeLayout(int type);
+
+private:
+    // Allocate the ring and write buffer on the first open()
+    bool allocateBuffers();
+
+    // Writer thread
+    void writerLoop();
+    int drain(SessionLogRecord *buffer, int maxRecords);
+    bool writeHeader();
+    bool writeBytes(const void *data, size_t length);
+    void writeToBlocks(const SessionLogRecord *records, int count);
+    bool startBlock();
+    void finishBlock();
+    bool writeIndex();
+
+    // One slot in the ring. The sequence number tells producers and the consumer
+    // whether the slot is free to write or ready to read.
+    struct Slot {
+        boost::atomic<boost::uint64_t> sequence;
+        SessionLogRecord record;
+    };
+
+    Slot *ring_;                                    // Buffer between producers and the writer (allocated on open)
+    boost::uint64_t ringMask_;                      // Ring size - 1
+    boost::atomic<boost::uint64_t> enqueuePosition_; // Next slot producers will claim
+    boost::uint64_t dequeuePosition_;               // Next slot the writer will read (writer only)
+
+    int fileDescriptor_;                            // Log file
+    boost::thread writerThread_;                    // Thread that drains the ring to disk
+    boost::atomic<bool> writerShouldStop_;
+    SessionLogRecord *writeBuffer_;                 // Batch of records for each write()
+    bool writeFailed_;                              // Stop writing after an error so blocks stay aligned
+    int encoding_;                                  // How blocks are stored
+    int fileEncoding_;                              // Encoding of the file currently open (writer only)
+    SessionLogCodec *codec_;                        // Encoder for compressed blocks
+    std::vector<SessionLogRecord> pendingBlock_;    // Records of a compressed block not yet written
+    std::vector<unsigned char> encodedBlock_;       // Compressed block ready to write
+
+    SessionLogBlockHeader currentBlock_;            // Header of the block being written (writer only)
+    off_t currentBlockOffset_;                      // Where it starts in the file
+    bool blockIsOpen_;                              // Whether a block has been started but not finished
+    boost::uint64_t recordsInFile_;                 // Records written so far
+    std::vector<SessionLogBlockHeader> blockIndex_; // Headers of all finished blocks
+
+    boost::atomic<unsigned long> recordsWritten_;
+    boost::atomic<unsigned long> recordsDropped_;
+    boost::atomic<unsigned long long> bytesWritten_;
+};
+
+/*
+ * SessionLogReader
+ *
+ * Reads back a file written by SessionLog. The file is memory-mapped and the block
+ * index loaded on open (or rebuilt from the block headers if the log was not closed
+ * cleanly), so restricting the reader to a time range or a set of keys skips straight
+ * to the blocks that can contain them without touching the rest of the file. Within
+ * the selected blocks, records are returned in the order they were written.
+ * Compressed blocks are decoded one at a time as they are reached.
+ */
+
+class SessionLogReader {
+public:
+    // ***** Constructor *****
+    SessionLogReader();
+
+    // ***** Destructor *****
+    ~SessionLogReader();
+
+    // ***** File Methods *****
+    //
+    // open() checks the header and returns false if the file isn't a session log
+    // this version can read. Version 1 (unblocked) logs are read as a single block.
+    bool open(std::string const& filename);
+    void close();
+    bool isOpen() { return mappedData_ != 0; }
+
+    // Go back to the first record in the current time range
+    void rewind();
+
+    // Read the next record that passes the filters. Returns false at the end.
+    bool next(SessionLogRecord& record);
+
+    // ***** Filters *****
+    //
+    // Only return records with startTimestamp <= timestamp <= endTimestamp. Setting
+    // the range also rewinds to its start.
+    void setTimeRange(timestamp_type startTimestamp, timestamp_type endTimestamp);
+    void clearTimeRange();
+
+    // Only return records for the given MIDI notes. With no keys added, all records
+    // are returned, including those (e.g. OSC) that aren't associated with a key.
+    void addKeyFilter(int midiNote);
+    void clearKeyFilter();
+
+    // ***** File Information *****
+    boost::uint32_t version() { return version_; }
+    boost::uint64_t recordCount() { return recordCount_; }
+    int blockCount() { return (int)blocks_.size(); }
+    timestamp_type firstTimestamp();
+    timestamp_type lastTimestamp();
+
+private:
+    bool loadIndex(size_t recordsPerBlock);
+    bool rebuildIndex(size_t recordsPerBlock);
+    void scanBlock(SessionLogBlockHeader& header, const SessionLogRecord *records, boost::uint32_t count);
+    bool blockMatches(int block);
+    bool recordMatches(SessionLogRecord const& record);
+    bool enterBlock(int block);
+    static size_t storedLength(SessionLogBlockHeader const& header);
+
+    int fileDescriptor_;                    // Log file
+    const char *mappedData_;                // Whole file, mapped read-only
+    size_t mappedLength_;
+    boost::uint32_t version_;               // Version from the header
+    off_t dataOffset_;                      // Where the first block starts
+    boost::uint64_t recordCount_;           // Total records in the file
+
+    std::vector<SessionLogBlockHeader> blocks_;         // Header of each block
+    std::vector<const char*> blockData_;                // Where each block's records start
+    std::vector<timestamp_type> latestUpTo_;            // Latest timestamp in blocks 0..i
+    std::vector<timestamp_type> earliestFrom_;          // Earliest timestamp in blocks i..end
+
+    timestamp_type startTimestamp_;         // Time range filter
+    timestamp_type endTimestamp_;
+    bool timeRangeIsSet_;
+    boost::uint64_t keyFilter_[2];          // Key filter bitmap
+    bool keyFilterIsSet_;
+
+    int currentBlock_;                      // Block being read
+    int lastBlock_;                         // Last block that can be in the time range
+    boost::uint32_t currentRecord_;         // Next record within the block
+    const SessionLogRecord *currentRecords_; // Records of the current block, in the file or decoded
+
+    SessionLogCodec *codec_;                // Decoder for compressed blocks
+    std::vector<SessionLogRecord> decodedRecords_;
+};
+
+#endif /* defined(__touchkeys__SessionLog__) */
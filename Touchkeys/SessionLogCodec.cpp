@@ -0,0 +1,340 @@
+//
+//  SessionLogCodec.cpp
+//  touchkeys
+//
+
+#include "SessionLogCodec.h"
+#include <cstring>
+
+namespace {
+    // Bit patterns of floats and doubles, for lossless differencing
+    inline boost::uint32_t floatBits(float value) {
+        boost::uint32_t bits;
+        memcpy(&bits, &value, 4);
+        return bits;
+    }
+
+    inline float bitsToFloat(boost::uint32_t bits) {
+        float value;
+        memcpy(&value, &bits, 4);
+        return value;
+    }
+
+    inline boost::uint64_t doubleBits(double value) {
+        boost::uint64_t bits;
+        memcpy(&bits, &value, 8);
+        return bits;
+    }
+
+    inline double bitsToDouble(boost::uint64_t bits) {
+        double value;
+        memcpy(&value, &bits, 8);
+        return value;
+    }
+}
+
+// Constructor
+SessionLogCodec::SessionLogCodec() {
+    reset();
+}
+
+// Encode a block of records
+void SessionLogCodec::encode(const SessionLogRecord *records, int count, bool useLZ, std::vector<unsigned char>& output) {
+    std::vector<unsigned char>& deltas = useLZ ? deltaBuffer_ : output;
+
+    reset();
+    deltas.clear();
+    deltas.reserve(count * 16);
+
+    for(int i = 0; i < count; i++) {
+        SessionLogRecord const& record = records[i];
+
+        deltas.push_back((unsigned char)record.type);
+        putVarint(deltas, record.source);
+        putVarint(deltas, zigzag((boost::int64_t)(doubleBits(record.timestamp) - doubleBits(previous_.timestamp))));
+        putVarint(deltas, zigzag((boost::int64_t)record.frame - previous_.frame));
+        putVarint(deltas, zigzag((boost::int64_t)record.note - previous_.note));
+
+        if(record.type == kSessionLogRecordTouch) {
+            SessionLogRecord& previous = previousTouch_[contextForNote(record.note)];
+
+            putVarint(deltas, zigzag(record.touch.count));
+            deltas.push_back(record.touch.white);
+            for(int j = 0; j < 3; j++)
+                putDelta32(deltas, floatBits(record.touch.locs[j]), floatBits(previous.touch.locs[j]));
+            for(int j = 0; j < 3; j++)
+                putDelta32(deltas, floatBits(record.touch.sizes[j]), floatBits(previous.touch.sizes[j]));
+            putDelta32(deltas, floatBits(record.touch.locH), floatBits(previous.touch.locH));
+            previous = record;
+        }
+        else if(record.type == kSessionLogRecordAnalog) {
+            SessionLogRecord& previous = previousAnalog_[contextForNote(record.note)];
+
+            putDelta32(deltas, floatBits(record.analog.position), floatBits(previous.analog.position));
+            putDelta32(deltas, (boost::uint32_t)record.analog.rawValue, (boost::uint32_t)previous.analog.rawValue);
+            previous = record;
+        }
+        else if(record.type == kSessionLogRecordMidi) {
+            deltas.push_back(record.midi.length);
+            deltas.insert(deltas.end(), record.midi.bytes, record.midi.bytes + 3);
+        }
+        else {
+            // OSC and anything else: store the payload as it is
+            deltas.insert(deltas.end(), record.padding, record.padding + sizeof(record.padding));
+        }
+
+        previous_ = record;
+    }
+
+    if(useLZ)
+        lzCompress(deltas.empty() ? 0 : &deltas[0], deltas.size(), output);
+}
+
+// Decode a block of records
+bool SessionLogCodec::decode(const unsigned char *data, size_t length, bool usedLZ, SessionLogRecord *records, int count) {
+    if(usedLZ) {
+        if(!lzDecompress(data, length, (size_t)count * kSessionLogRecordLength * 2, deltaBuffer_))
+            return false;
+        data = deltaBuffer_.empty() ? 0 : &deltaBuffer_[0];
+        length = deltaBuffer_.size();
+    }
+
+    const unsigned char *end = data + length;
+    boost::uint64_t value;
+
+    reset();
+
+    for(int i = 0; i < count; i++) {
+        SessionLogRecord& record = records[i];
+
+        memset(&record, 0, sizeof(record));
+        if(data >= end)
+            return false;
+        record.type = *data++;
+
+        if(!getVarint(data, end, value))
+            return false;
+        record.source = (boost::uint16_t)value;
+        if(!getVarint(data, end, value))
+            return false;
+        record.timestamp = bitsToDouble(doubleBits(previous_.timestamp) + (boost::uint64_t)unzigzag(value));
+        if(!getVarint(data, end, value))
+            return false;
+        record.frame = (boost::int32_t)(previous_.frame + unzigzag(value));
+        if(!getVarint(data, end, value))
+            return false;
+        record.note = (boost::int32_t)(previous_.note + unzigzag(value));
+
+        if(record.type == kSessionLogRecordTouch) {
+            SessionLogRecord& previous = previousTouch_[contextForNote(record.note)];
+            boost::uint32_t bits;
+
+            if(!getVarint(data, end, value) || data >= end)
+                return false;
+            record.touch.count = (boost::int32_t)unzigzag(value);
+            record.touch.white = *data++;
+            for(int j = 0; j < 3; j++) {
+                if(!getDelta32(data, end, bits, floatBits(previous.touch.locs[j])))
+                    return false;
+                record.touch.locs[j] = bitsToFloat(bits);
+            }
+            for(int j = 0; j < 3; j++) {
+                if(!getDelta32(data, end, bits, floatBits(previous.touch.sizes[j])))
+                    return false;
+                record.touch.sizes[j] = bitsToFloat(bits);
+            }
+            if(!getDelta32(data, end, bits, floatBits(previous.touch.locH)))
+                return false;
+            record.touch.locH = bitsToFloat(bits);
+            previous = record;
+        }
+        else if(record.type == kSessionLogRecordAnalog) {
+            SessionLogRecord& previous = previousAnalog_[contextForNote(record.note)];
+            boost::uint32_t bits;
+
+            if(!getDelta32(data, end, bits, floatBits(previous.analog.position)))
+                return false;
+            record.analog.position = bitsToFloat(bits);
+            if(!getDelta32(data, end, bits, (boost::uint32_t)previous.analog.rawValue))
+                return false;
+            record.analog.rawValue = (boost::int32_t)bits;
+            previous = record;
+        }
+        else if(record.type == kSessionLogRecordMidi) {
+            if(end - data < 4)
+                return false;
+            record.midi.length = *data++;
+            memcpy(record.midi.bytes, data, 3);
+            data += 3;
+        }
+        else {
+            if(end - data < (int)sizeof(record.padding))
+                return false;
+            memcpy(record.padding, data, sizeof(record.padding));
+            data += sizeof(record.padding);
+        }
+
+        previous_ = record;
+    }
+
+    return (data == end);
+}
+
+// Start a new block with everything zeroed
+void SessionLogCodec::reset() {
+    memset(&previous_, 0, sizeof(previous_));
+    memset(previousTouch_, 0, sizeof(previousTouch_));
+    memset(previousAnalog_, 0, sizeof(previousAnalog_));
+}
+
+// Append an unsigned variable-length integer
+void SessionLogCodec::putVarint(std::vector<unsigned char>& output, boost::uint64_t value) {
+    while(value >= 0x80) {
+        output.push_back((unsigned char)(value | 0x80));
+        value >>= 7;
+    }
+    output.push_back((unsigned char)value);
+}
+
+// Read an unsigned variable-length integer
+bool SessionLogCodec::getVarint(const unsigned char*& data, const unsigned char *end, boost::uint64_t& value) {
+    int shift = 0;
+
+    value = 0;
+    while(data < end && shift < 64) {
+        unsigned char byte = *data++;
+        value |= (boost::uint64_t)(byte & 0x7F) << shift;
+        if(!(byte & 0x80))
+            return true;
+        shift += 7;
+    }
+
+    return false;
+}
+
+// Append the signed difference between two 32-bit patterns
+void SessionLogCodec::putDelta32(std::vector<unsigned char>& output, boost::uint32_t value, boost::uint32_t previous) {
+    putVarint(output, zigzag((boost::int32_t)(value - previous)));
+}
+
+// Read a difference and apply it to the previous 32-bit pattern
+bool SessionLogCodec::getDelta32(const unsigned char*& data, const unsigned char *end, boost::uint32_t& value, boost::uint32_t previous) {
+    boost::uint64_t delta;
+
+    if(!getVarint(data, end, delta))
+        return false;
+    value = previous + (boost::uint32_t)unzigzag(delta);
+    return true;
+}
+
+// Compress with a single-entry hash table of recent 4-byte sequences. Each
+// sequence is a token (literal count, match length), the literals, then a
+// 2-byte offset back to the match. The last sequence has literals only.
+void SessionLogCodec::lzCompress(const unsigned char *input, size_t length, std::vector<unsigned char>& output) {
+    std::vector<int> table(1 << kSessionLogCodecHashBits, -1);
+    size_t position = 0, anchor = 0;
+
+    output.clear();
+    output.reserve(length / 2 + 16);
+
+    while(position + kSessionLogCodecMinMatch <= length) {
+        boost::uint32_t sequence;
+        memcpy(&sequence, input + position, 4);
+        boost::uint32_t hash = (sequence * 2654435761U) >> (32 - kSessionLogCodecHashBits);
+        int candidate = table[hash];
+        table[hash] = (int)position;
+
+        if(candidate < 0 || position - candidate > (size_t)kSessionLogCodecMaxOffset ||
+           memcmp(input + candidate, input + position, kSessionLogCodecMinMatch) != 0) {
+            position++;
+            continue;
+        }
+
+        size_t matchLength = kSessionLogCodecMinMatch;
+        while(position + matchLength < length && input[candidate + matchLength] == input[position + matchLength])
+            matchLength++;
+
+        size_t literalLength = position - anchor;
+        size_t extraMatch = matchLength - kSessionLogCodecMinMatch;
+        output.push_back((unsigned char)(((literalLength < 15 ? literalLength : 15) << 4) | (extraMatch < 15 ? extraMatch : 15)));
+        if(literalLength >= 15)
+            putLength(output, literalLength - 15);
+        output.insert(output.end(), input + anchor, input + position);
+
+        size_t offset = position - candidate;
+        output.push_back((unsigned char)(offset & 0xFF));
+        output.push_back((unsigned char)(offset >> 8));
+        if(extraMatch >= 15)
+            putLength(output, extraMatch - 15);
+
+        position += matchLength;
+        anchor = position;
+    }
+
+    size_t literalLength = length - anchor;
+    output.push_back((unsigned char)((literalLength < 15 ? literalLength : 15) << 4));
+    if(literalLength >= 15)
+        putLength(output, literalLength - 15);
+    output.insert(output.end(), input + anchor, input + length);
+}
+
+// Reverse lzCompress(), refusing to produce more than maxOutput bytes
+bool SessionLogCodec::lzDecompress(const unsigned char *input, size_t length, size_t maxOutput, std::vector<unsigned char>& output) {
+    const unsigned char *end = input + length;
+
+    output.clear();
+
+    while(input < end) {
+        unsigned char token = *input++;
+        size_t literalLength = token >> 4;
+
+        if(literalLength == 15 && !getLength(input, end, literalLength))
+            return false;
+        if((size_t)(end - input) < literalLength || output.size() + literalLength > maxOutput)
+            return false;
+        output.insert(output.end(), input, input + literalLength);
+        input += literalLength;
+
+        if(input == end)
+            break;
+
+        if(end - input < 2)
+            return false;
+        size_t offset = input[0] | (input[1] << 8);
+        input += 2;
+        size_t matchLength = token & 0x0F;
+        if(matchLength == 15 && !getLength(input, end, matchLength))
+            return false;
+        matchLength += kSessionLogCodecMinMatch;
+
+        if(offset == 0 || offset > output.size() || output.size() + matchLength > maxOutput)
+            return false;
+
+        // Matches may overlap what they produce, so copy a byte at a time
+        size_t from = output.size() - offset;
+        for(size_t i = 0; i < matchLength; i++)
+            output.push_back(output[from + i]);
+    }
+
+    return true;
+}
+
+// Lengths of 15 or more continue in bytes of 255 plus a final remainder
+void SessionLogCodec::putLength(std::vector<unsigned char>& output, size_t length) {
+    while(length >= 255) {
+        output.push_back(255);
+        length -= 255;
+    }
+    output.push_back((unsigned char)length);
+}
+
+// Read the continuation of a length, adding it to the 15 already in the token
+bool SessionLogCodec::getLength(const unsigned char*& data, const unsigned char *end, size_t& length) {
+    while(data < end) {
+        unsigned char byte = *data++;
+        length += byte;
+        if(byte != 255)
+            return true;
+    }
+    return false;
+}
@@ -0,0 +1,71 @@
+//
+//  SessionLogCodec.h
+//  touchkeys
+//
+
+#ifndef __touchkeys__SessionLogCodec__
+#define __touchkeys__SessionLogCodec__
+
+#include <vector>
+#include <boost/cstdint.hpp>
+#include "SessionLog.h"
+
+const int kSessionLogCodecContexts = kSessionLogNumKeys + 1;   // One per key plus one for records with no key
+const int kSessionLogCodecHashBits = 12;                        // Size of the LZ match table
+const int kSessionLogCodecMinMatch = 4;                         // Shortest LZ match
+const int kSessionLogCodecMaxOffset = 65535;                    // Furthest back an LZ match can reach
+
+/*
+ * SessionLogCodec
+ *
+ * Lossless compression for one block of session log records. Each record is stored
+ * as the difference from the previous record: timestamp, frame and note against the
+ * record before it, and the sensor values against the previous record of the same
+ * type for the same key. Differences are zig-zag encoded into variable-length
+ * integers, so unchanged or slightly changed values take a single byte; floats are
+ * differenced as their bit patterns so nothing is lost. An optional LZ stage then
+ * removes repeated byte sequences (e.g. idle keys sending the same frame).
+ *
+ * Blocks are independent: the codec state is reset at the start of every block so
+ * any block can be decoded on its own.
+ */
+
+class SessionLogCodec {
+public:
+    // ***** Constructor *****
+    SessionLogCodec();
+
+    // ***** Encoding and Decoding *****
+    //
+    // Encode count records, replacing the contents of output.
+    void encode(const SessionLogRecord *records, int count, bool useLZ, std::vector<unsigned char>& output);
+
+    // Decode exactly count records. Returns false if the data is corrupt.
+    bool decode(const unsigned char *data, size_t length, bool usedLZ, SessionLogRecord *records, int count);
+
+private:
+    void reset();
+    int contextForNote(int note) { return (note >= 0 && note < kSessionLogNumKeys) ? note : kSessionLogNumKeys; }
+
+    // Variable-length integers, 7 bits per byte, low bits first
+    static void putVarint(std::vector<unsigned char>& output, boost::uint64_t value);
+    static bool getVarint(const unsigned char*& data, const unsigned char *end, boost::uint64_t& value);
+    static void putDelta32(std::vector<unsigned char>& output, boost::uint32_t value, boost::uint32_t previous);
+    static bool getDelta32(const unsigned char*& data, const unsigned char *end, boost::uint32_t& value, boost::uint32_t previous);
+    static boost::uint64_t zigzag(boost::int64_t value) { return ((boost::uint64_t)value << 1) ^ (boost::uint64_t)(value >> 63); }
+    static boost::int64_t unzigzag(boost::uint64_t value) { return (boost::int64_t)(value >> 1) ^ -(boost::int64_t)(value & 1); }
+
+    // LZ stage, in the style of LZ4: runs of literals followed by (offset, length) matches
+    static void lzCompress(const unsigned char *input, size_t length, std::vector<unsigned char>& output);
+    static bool lzDecompress(const unsigned char *input, size_t length, size_t maxOutput, std::vector<unsigned char>& output);
+    static void putLength(std::vector<unsigned char>& output, size_t length);
+    static bool getLength(const unsigned char*& data, const unsigned char *end, size_t& length);
+
+    SessionLogRecord previous_;                             // Previous record of any type
+    SessionLogRecord previousTouch_[kSessionLogCodecContexts];  // Previous touch record for each key
+    SessionLogRecord previousAnalog_[kSessionLogCodecContexts]; // Previous analog record for each key
+
+    std::vector<unsigned char> deltaBuffer_;                // Delta-encoded block before/after LZ
+};
+
+#endif /* defined(__touchkeys__SessionLogCodec__) */
@@ -0,0 +1,256 @@
+//
+//  SessionReplay.cpp
+//  touchkeys
+//
+
+#include "SessionReplay.h"
+#include "MidiInputController.h"
+
+// Constructor
+SessionReplay::SessionReplay(PianoKeyboard& keyboard)
+: keyboard_(keyboard), midiInputController_(0), outputLog_(0),
+  mode_(kSessionReplayModeAsFastAsPossible), speed_(1.0), startTimestamp_(0), endTimestamp_(0),
+  timeRangeIsSet_(false), isRunning_(false), shouldStop_(false)
+{
+    memset(&statistics_, 0, sizeof(statistics_));
+}
+
+// Destructor
+SessionReplay::~SessionReplay() {
+    stop();
+    clearLogFiles();
+}
+
+// Open a log file to be included in the replay
+bool SessionReplay::addLogFile(std::string const& filename) {
+    if(isRunning_)
+        return false;
+
+    SessionLogReader *reader = new SessionLogReader;
+    if(!reader->open(filename)) {
+        delete reader;
+        return false;
+    }
+
+    logs_.push_back(reader);
+    return true;
+}
+
+// Close and remove all log files
+void SessionReplay::clearLogFiles() {
+    if(isRunning_)
+        return;
+    for(std::vector<SessionLogReader*>::iterator it = logs_.begin(); it != logs_.end(); ++it)
+        delete *it;
+    logs_.clear();
+}
+
+// Limit the replay to a range of recorded time
+void SessionReplay::setTimeRange(timestamp_type startTimestamp, timestamp_type endTimestamp) {
+    startTimestamp_ = startTimestamp;
+    endTimestamp_ = endTimestamp;
+    timeRangeIsSet_ = true;
+}
+
+// Replay every log from the beginning (or the start of the time range), in this thread
+bool SessionReplay::run() {
+    if(logs_.empty())
+        return false;
+
+    isRunning_ = true;
+    memset(&statistics_, 0, sizeof(statistics_));
+
+    // Prime the merge with the first record of each log
+    pendingRecords_.resize(logs_.size());
+    pendingValid_.resize(logs_.size());
+    for(unsigned int i = 0; i < logs_.size(); i++) {
+        if(timeRangeIsSet_)
+            logs_[i]->setTimeRange(startTimestamp_, endTimestamp_);
+        else
+            logs_[i]->clearTimeRange();
+        pendingValid_[i] = logs_[i]->next(pendingRecords_[i]);
+    }
+
+    int index = nextLogIndex();
+    if(index < 0) {
+        isRunning_ = false;
+        return false;
+    }
+
+    // Drive the keyboard from a logical clock that starts at the first record
+    timestamp_type startTimestamp = pendingRecords_[index].timestamp;
+    boost::posix_time::ptime startTime = boost::posix_time::microsec_clock::universal_time();
+    SessionLog *previousLog = keyboard_.sessionLog();
+
+    keyboard_.useManualClock(startTimestamp);
+    keyboard_.clearOnsetPredictionStatistics();
+    if(outputLog_ != 0)
+        keyboard_.setSessionLog(outputLog_);
+    statistics_.firstTimestamp = statistics_.lastTimestamp = startTimestamp;
+
+    while(index >= 0 && !shouldStop_) {
+        SessionLogRecord& record = pendingRecords_[index];
+
+        if(mode_ != kSessionReplayModeAsFastAsPossible)
+            waitForTimestamp(record.timestamp, startTimestamp, startTime);
+
+        // Anything scheduled up to now (mapping updates, timeouts) happens before this record
+        keyboard_.advanceClock(record.timestamp);
+        injectRecord(record);
+        if(record.timestamp > statistics_.lastTimestamp)
+            statistics_.lastTimestamp = record.timestamp;
+
+        int type = record.type;
+        timestamp_type timestamp = record.timestamp;
+        pendingValid_[index] = logs_[index]->next(pendingRecords_[index]);
+        index = nextLogIndex();
+
+        // Analog samples of one frame share a timestamp; the frame ends where they stop
+        if(type == kSessionLogRecordAnalog &&
+           (index < 0 || pendingRecords_[index].type != kSessionLogRecordAnalog || pendingRecords_[index].timestamp != timestamp))
+            keyboard_.analogFrameFinished();
+    }
+
+    // Let anything still scheduled play out
+    if(!shouldStop_) {
+        timestamp_type endTimestamp = statistics_.lastTimestamp + kSessionReplayTailLength;
+        if(mode_ != kSessionReplayModeAsFastAsPossible)
+            waitForTimestamp(endTimestamp, startTimestamp, startTime);
+        keyboard_.advanceClock(endTimestamp);
+    }
+
+    keyboard_.setSessionLog(previousLog);
+    keyboard_.useSystemClock();
+    statistics_.onsetPrediction = keyboard_.onsetPredictionStatistics();
+
+    statistics_.wallClockSeconds = ptime_to_timestamp(boost::posix_time::microsec_clock::universal_time() - startTime);
+    isRunning_ = false;
+    return true;
+}
+
+// Start replay in its own thread
+bool SessionReplay::start() {
+    if(isRunning_ || logs_.empty())
+        return false;
+    shouldStop_ = false;
+    isRunning_ = true;
+    replayThread_ = boost::thread(&SessionReplay::runLoop, this);
+    return true;
+}
+
+// Stop a replay in progress and wait for it to finish
+void SessionReplay::stop() {
+    shouldStop_ = true;
+    if(replayThread_.joinable())
+        replayThread_.join();
+    shouldStop_ = false;
+}
+
+// Choose the log whose pending record is earliest. Ties go to the lowest index
+// so the merge order is the same every time.
+int SessionReplay::nextLogIndex() {
+    int best = -1;
+
+    for(unsigned int i = 0; i < logs_.size(); i++) {
+        if(!pendingValid_[i])
+            continue;
+        if(best < 0 || pendingRecords_[i].timestamp < pendingRecords_[best].timestamp)
+            best = i;
+    }
+
+    return best;
+}
+
+// Send one record to the keyboard, mirroring what TouchkeyDevice and
+// MidiInputController do with live data
+void SessionReplay::injectRecord(SessionLogRecord const& record) {
+    if(record.type == kSessionLogRecordMidi) {
+        injectMidi(record);
+        statistics_.midiRecords++;
+        return;
+    }
+
+    PianoKey *key = keyboard_.key(record.note);
+    if(key == 0) {
+        statistics_.skippedRecords++;
+        return;
+    }
+
+    if(record.type == kSessionLogRecordTouch) {
+        if(record.touch.count == 0) {
+            if(key->touchIsActive())
+                key->touchOff(record.timestamp);
+        }
+        else {
+            float locs[3], sizes[3];
+            for(int i = 0; i < 3; i++) {
+                locs[i] = record.touch.locs[i];
+                sizes[i] = record.touch.sizes[i];
+            }
+            KeyTouchFrame frame(record.touch.count, locs, sizes, record.touch.locH, record.touch.white != 0);
+            key->touchInsertFrame(frame, record.timestamp);
+        }
+        statistics_.touchRecords++;
+    }
+    else if(record.type == kSessionLogRecordAnalog) {
+        key->insertSample(record.analog.position, record.timestamp);
+        statistics_.analogRecords++;
+    }
+    else {
+        // OSC records are output, not input
+        statistics_.skippedRecords++;
+    }
+}
+
+// Pass a MIDI message through the input controller, or directly to the key
+void SessionReplay::injectMidi(SessionLogRecord const& record) {
+    if(record.midi.length == 0)
+        return;
+
+    if(midiInputController_ != 0) {
+        vector<unsigned char> message(record.midi.bytes, record.midi.bytes + record.midi.length);
+        midiInputController_->rtMidiCallback(0, &message, 0);
+        return;
+    }
+
+    if(record.midi.length < 3)
+        return;
+
+    unsigned char command = record.midi.bytes[0] & 0xF0;
+    int channel = record.midi.bytes[0] & 0x0F;
+    PianoKey *key = keyboard_.key(record.midi.bytes[1]);
+    if(key == 0)
+        return;
+
+    if(command == kMidiMessageNoteOn && record.midi.bytes[2] > 0)
+        key->midiNoteOn(record.midi.bytes[2], channel, record.timestamp);
+    else if(command == kMidiMessageNoteOff || command == kMidiMessageNoteOn)
+        key->midiNoteOff(record.timestamp);
+    else if(command == kMidiMessageAftertouchPoly)
+        key->midiAftertouch(record.midi.bytes[2], record.timestamp);
+}
+
+// Sleep until the wall clock catches up with the given logical timestamp, advancing
+// the keyboard clock in small steps on the way so scheduled events happen on time
+void SessionReplay::waitForTimestamp(timestamp_type timestamp, timestamp_type startTimestamp,
+                                     boost::posix_time::ptime startTime) {
+    using namespace boost::posix_time;
+
+    double speed = (mode_ == kSessionReplayModeScaled ? speed_ : 1.0);
+    timestamp_type current = keyboard_.schedulerCurrentTimestamp();
+
+    while(current < timestamp && !shouldStop_) {
+        timestamp_type step = current + kSessionReplayClockStep;
+        if(step > timestamp)
+            step = timestamp;
+
+        ptime target = startTime + timestamp_to_ptime((step - startTimestamp) / speed);
+        ptime now = microsec_clock::universal_time();
+        if(target > now)
+            boost::this_thread::sleep(target - now);
+
+        if(step < timestamp)
+            keyboard_.advanceClock(step);
+        current = step;
+    }
+}
@@ -0,0 +1,138 @@
+//
+//  SessionReplay.h
+//  touchkeys
+//
+
+#ifndef __touchkeys__SessionReplay__
+#define __touchkeys__SessionReplay__
+
+#include <iostream>
+#include <vector>
+#include <string>
+#include <boost/thread.hpp>
+#include "PianoKeyboard.h"
+#include "SessionLog.h"
+
+class MidiInputController;
+
+// Replay speed
+enum {
+    kSessionReplayModeRealTime = 0,         // Records are injected at the rate they were recorded
+    kSessionReplayModeScaled,               // Real time multiplied by a speed factor
+    kSessionReplayModeAsFastAsPossible      // No waiting between records
+};
+
+const timestamp_diff_type kSessionReplayClockStep = 0.001;  // Clock resolution when pacing to real time
+const timestamp_diff_type kSessionReplayTailLength = 1.0;   // Time to keep running after the last record
+
+/*
+ * SessionReplay
+ *
+ * Reads one or more session logs and injects their contents into a PianoKeyboard the
+ * same way TouchkeyDevice and MidiInputController would have done live: touch frames go
+ * to touchInsertFrame()/touchOff(), key positions go to insertSample(), and MIDI messages
+ * go through the MidiInputController (if given) or directly to the keys.
+ *
+ * The recorded timestamps are used as-is rather than passing through a
+ * TimestampSynchronizer. The keyboard's scheduler is switched to a manual clock which
+ * replay advances record by record, so mappings and timeouts run at the same logical
+ * times on every run. The same input therefore produces the same OSC output at any
+ * replay speed, which makes replay usable as a regression and performance harness.
+ */
+
+class SessionReplay {
+public:
+    // Summary of a replay run
+    class Statistics {
+    public:
+        unsigned long touchRecords;         // Records injected by type
+        unsigned long analogRecords;
+        unsigned long midiRecords;
+        unsigned long skippedRecords;       // Records with no matching key, or OSC output
+        timestamp_type firstTimestamp;      // Span of recorded time replayed
+        timestamp_type lastTimestamp;
+        double wallClockSeconds;            // How long the replay took
+        
+        // How onset prediction did over the replay, if the keyboard has it enabled. The
+        // lead time divided by (confirmed + corrected) is the average latency gained.
+        KeyPositionTracker::OnsetPredictionStatistics onsetPrediction;
+    };
+
+public:
+    // ***** Constructor *****
+    SessionReplay(PianoKeyboard& keyboard);
+
+    // ***** Destructor *****
+    ~SessionReplay();
+
+    // ***** Setup *****
+
+    // Add a log to replay. Records from several logs (e.g. a touch log and a MIDI log)
+    // are merged in timestamp order; ties go to the log added first.
+    bool addLogFile(std::string const& filename);
+    void clearLogFiles();
+
+    // If set, MIDI records are passed through this controller as if they came from a
+    // MIDI device. Otherwise note on/off and aftertouch go straight to the keys.
+    void setMidiInputController(MidiInputController* controller) { midiInputController_ = controller; }
+
+    // Replay speed. speed only matters in kSessionReplayModeScaled (2.0 = twice as fast).
+    void setMode(int mode) { mode_ = mode; }
+    void setSpeed(double speed) { speed_ = (speed > 0 ? speed : 1.0); }
+
+    // Replay only the records between these timestamps. The log index is used to
+    // start at the right place, so replaying a short excerpt of a long log is fast.
+    void setTimeRange(timestamp_type startTimestamp, timestamp_type endTimestamp);
+    void clearTimeRange() { timeRangeIsSet_ = false; }
+
+    // If set, all OSC output during the replay is written here, for comparing runs
+    void setOutputLog(SessionLog* log) { outputLog_ = log; }
+
+    // ***** Replay Control *****
+
+    // Replay everything in the calling thread. Returns false if there was nothing to replay.
+    bool run();
+
+    // Replay in a separate thread
+    bool start();
+    void stop();
+    bool isRunning() { return isRunning_; }
+
+    Statistics statistics() { return statistics_; }
+
+private:
+    // Find the log holding the earliest pending record; -1 when all are finished
+    int nextLogIndex();
+
+    // Pass one record to the keyboard
+    void injectRecord(SessionLogRecord const& record);
+    void injectMidi(SessionLogRecord const& record);
+
+    // Wait until the wall clock reaches the time for this logical timestamp
+    void waitForTimestamp(timestamp_type timestamp, timestamp_type startTimestamp,
+                          boost::posix_time::ptime startTime);
+
+    void runLoop() { run(); }
+
+    PianoKeyboard& keyboard_;                       // Keyboard receiving the data
+    MidiInputController* midiInputController_;      // Optional MIDI processing path
+    SessionLog* outputLog_;                         // Optional OSC output log
+
+    std::vector<SessionLogReader*> logs_;           // Logs to merge
+    std::vector<SessionLogRecord> pendingRecords_;  // Next record from each log
+    std::vector<bool> pendingValid_;                // Whether each log still has a record
+
+    int mode_;
+    double speed_;
+    timestamp_type startTimestamp_;                 // Optional range of records to replay
+    timestamp_type endTimestamp_;
+    bool timeRangeIsSet_;
+
+    boost::thread replayThread_;
+    volatile bool isRunning_;
+    volatile bool shouldStop_;
+
+    Statistics statistics_;
+};
+
+#endif /* defined(__touchkeys__SessionReplay__) */
@@ -8,13 +8,15 @@
  */
 
 #include "TimestampSynchronizer.h"
+#include "Logger.h"
 
 // Constructor
 TimestampSynchronizer::TimestampSynchronizer()
-: history_(kTimestampSynchronizerHistoryLength), nominalSampleInterval_(0), currentSampleInterval_(0),
-startingTimestamp_(0), startingClockTime_(boost::posix_time::microsec_clock::universal_time()), frameModulus_(0),
-bufferLengthCounter_(0)
+: nominalSampleInterval_(0), currentSampleInterval_(0), frameModulus_(0),
+startingClockTime_(boost::posix_time::microsec_clock::universal_time()), startingTimestamp_(0),
+hasFrames_(false), lastRawFrame_(0), lastFrame_(0), lastTimestamp_(0), jitter_(0), drift_(0)
 {
+	resetModel(0);
 }
 
 // Clear the accumulated timestamp history and reset the current
@@ -25,119 +27,135 @@ bufferLengthCounter_(0)
 
 void TimestampSynchronizer::initialize(boost::posix_time::ptime clockTime, 
 									   timestamp_type startingTimestamp) {
-	history_.clear();
 	currentSampleInterval_ = nominalSampleInterval_;
 	startingClockTime_ = clockTime;
 	startingTimestamp_ = startingTimestamp;
-	
-	//cout << "initialize(): startingTimestamp = " << startingTimestamp_ << ", interval = " << nominalSampleInterval_ << endl;
+	hasFrames_ = false;
+	jitter_ = drift_ = 0;
 }
 
 // Given a frame number, calculate a current timestamp
 timestamp_type TimestampSynchronizer::synchronizedTimestamp(int rawFrameNumber) {
 	using namespace boost::posix_time;
 	
+	// Several keys or streams often ask about the same frame: no need to look any further
+	if(hasFrames_ && rawFrameNumber == lastRawFrame_)
+		return lastTimestamp_;
+	
 	// Calculate the current system clock-related timestamp
-	timestamp_type clockTime = startingTimestamp_ + ptime_to_timestamp(microsec_clock::universal_time() - startingClockTime_);	
-	timestamp_type frameTime;
-
-	// Retrieve the timestamp of the previous frame
-	// Need at least 2 samples in the buffer for the calculations that follow
-	if(history_.empty()) {
-		frameTime = clockTime;
+	timestamp_type clockTime = startingTimestamp_ + ptime_to_timestamp(microsec_clock::universal_time() - startingClockTime_);
+	
+	if(!hasFrames_) {
+		hasFrames_ = true;
+		lastRawFrame_ = rawFrameNumber;
+		lastFrame_ = 0;
+		resetModel(clockTime);
+		return (lastTimestamp_ = clockTime);
 	}
-	else if(history_.size() < 2) {
-		// One sample in buffer: make sure the new sample is new before
-		// storing it in the buffer.
-		
-		int lastFrame = history_.latest().first;
-		
-		frameTime = clockTime;
-		
-		if(lastFrame == rawFrameNumber) // Don't reprocess identical frames
-			return frameTime;		
+	
+	// Unwrap the counter. Differences of more than half the range are taken to be
+	// frames arriving late rather than far in the future.
+	long long difference;
+	if(frameModulus_ > 0) {
+		difference = ((long long)rawFrameNumber - (long long)lastRawFrame_) % frameModulus_;
+		if(difference < 0)
+			difference += frameModulus_;
+		if(difference >= frameModulus_ / 2)
+			difference -= frameModulus_;
 	}
-	else {
-		int totalHistoryFrames;		
-		int lastFrame = history_.latest().first;
-		frameTime = history_.latest().second;
-		
-		if(lastFrame == rawFrameNumber) // Don't reprocess identical frames
-			return frameTime;
-			
-		if(frameModulus_ == 0) {
-			// No modulus, just compare the raw frame number to the last frame number
-			frameTime += currentSampleInterval_ * (timestamp_type)(rawFrameNumber - lastFrame);
-			
-			totalHistoryFrames = (history_.latest().first - history_.earliest().first);
-			if(totalHistoryFrames <= 0) {
-				cout << "Warning: TimestampSynchronizer history buffer has a difference of " << totalHistoryFrames << " frames.\n";
-				cout << "Size = " << history_.size() << " first = " << history_.earliest().first << " last = " << history_.latest().first << endl;
-				totalHistoryFrames = 1;
-			}
-		}
-		else {
-			// Use mod arithmetic to handle wraparounds in the frame number
-			frameTime += currentSampleInterval_ * (timestamp_type)((rawFrameNumber + frameModulus_ - lastFrame) % frameModulus_);
-			
-			totalHistoryFrames = (history_.latest().first - history_.earliest().first + frameModulus_) % frameModulus_;
-			if(totalHistoryFrames <= 0) {
-				cout << "Warning: TimestampSynchronizer history buffer has a difference of " << totalHistoryFrames << " frames.\n";
-				cout << "Size = " << history_.size() << " first = " << history_.earliest().first << " last = " << history_.latest().first << endl;
-
-				totalHistoryFrames = 1;
-			}			
-		}
-		
-		// Recalculate the nominal sample interval by examining the difference in times
-		// between first and last frames in the buffer.
-		
-		currentSampleInterval_ = (history_.latestTimestamp() - history_.earliestTimestamp()) / (timestamp_diff_type)totalHistoryFrames;
-		
-		// The frame time was just incremented by the current sample period.  Check whether
-		// this puts the frame time ahead of the clock time.  Don't allow the frame time to get
-		// ahead of the system clock (this will also push future frame timestamps back).
-		
-		if(frameTime > clockTime) {
-			//cout << "CLIP " << 100.0 * (frameTime - clockTime) / currentSampleInterval_ << "%: frame=" << frameTime << " to clock=" << clockTime << endl;
-			frameTime = clockTime;			
-		}
-		
-		bufferLengthCounter_++;
-		
-		if(bufferLengthCounter_ >= kTimestampSynchronizerHistoryLength) {
-			timestamp_diff_type currentLatency = clockTime - frameTime;
-			timestamp_diff_type maxLatency = 0, minLatency = 1000000.0;
-			
-			Node<pair<int, timestamp_type> >::iterator it;
-			
-			for(it = history_.begin(); it != history_.end(); ++it) {
-				timestamp_diff_type l = (it.timestamp() - it->second);
-				if(l > maxLatency)
-					maxLatency = l;
-				if(l < minLatency)
-					minLatency = l;
-			}
-			
-			//cout << "frame " << rawFrameNumber << ": rate = " << currentSampleInterval_ << " clock = " << clockTime << " frame = " << frameTime << " latency = " 
-			//	<< currentLatency << " max = " << maxLatency << " min = " << minLatency << endl;
-			
-			timestamp_diff_type targetMinLatency = (maxLatency - minLatency) * 2.0 / sqrt(kTimestampSynchronizerHistoryLength);
-			
-			/*if(minLatency > targetMinLatency) {
-				cout << "ADDING " << 50.0 * (minLatency - targetMinLatency) / (currentSampleInterval_) << "%: (target " << targetMinLatency << ")\n";
-				frameTime += (minLatency - targetMinLatency) / 2.0;
-			}*/
-			//frameTime += minLatency / 4.0;
-			
-			bufferLengthCounter_ = 0;
-		}
+	else
+		difference = (int)((unsigned int)rawFrameNumber - (unsigned int)lastRawFrame_);
+	
+	if(difference < 0) {
+		// An older frame (e.g. from another board) goes on the line without moving it
+		return modelTimestamp(difference);
 	}
 	
-	// Insert the new frame time and clock times into the buffer
-	history_.insert(pair<int, timestamp_type>(rawFrameNumber, frameTime), clockTime);
-
+	long long frame = lastFrame_ + difference;
+	double residual = (double)clockTime - (double)modelTimestamp(difference);
+	
+	if(residual > (double)kTimestampSynchronizerResetThreshold || residual < -(double)kTimestampSynchronizerResetThreshold) {
+		// Too far off to be jitter (e.g. the device stopped for a while): start again
+		TOUCHKEY_LOG(kLogLevelDebug, "TimestampSynchronizer: restarting after a difference of {} seconds") << residual;
+		resetModel(clockTime);
+	}
+	else
+		addToModel(frame, clockTime);
+	
+	timestamp_type frameTime = modelTimestamp(0);
+	
+	// Timestamps never go backwards as the frame number advances
+	if(frameTime < lastTimestamp_)
+		frameTime = lastTimestamp_;
+	
+	lastRawFrame_ = rawFrameNumber;
+	lastFrame_ = frame;
+	
 	// The timestamp we return is associated with the frame, not the clock (which is potentially much
 	// higher jitter)
-	return frameTime;
+	return (lastTimestamp_ = frameTime);
+}
+
+// Start the fit again from one frame
+void TimestampSynchronizer::resetModel(timestamp_type clockTime) {
+	referenceClockTime_ = clockTime;
+	sumWeights_ = 1.0;
+	sumX_ = sumY_ = sumXX_ = sumXY_ = sumYY_ = 0;
+	framesInModel_ = 1;
+	minimumResidual_ = 0;
+	currentSampleInterval_ = nominalSampleInterval_;
+	lastTimestamp_ = 0;
+}
+
+// Add a frame to the weighted least-squares fit. The sums are kept relative to the newest
+// frame, so moving the reference each time keeps the numbers small however long it runs.
+void TimestampSynchronizer::addToModel(long long frame, timestamp_type clockTime) {
+	double dx = (double)(frame - lastFrame_);
+	double dy = (double)clockTime - (double)referenceClockTime_;
+	double decay = 1.0 - 1.0 / (double)kTimestampSynchronizerWindowFrames;
+	
+	// Shift the origin to the new frame
+	sumXX_ = sumXX_ - 2.0 * dx * sumX_ + sumWeights_ * dx * dx;
+	sumXY_ = sumXY_ - dx * sumY_ - dy * sumX_ + sumWeights_ * dx * dy;
+	sumYY_ = sumYY_ - 2.0 * dy * sumY_ + sumWeights_ * dy * dy;
+	sumX_ -= sumWeights_ * dx;
+	sumY_ -= sumWeights_ * dy;
+	referenceClockTime_ = clockTime;
+	
+	// Age the old frames and add the new one, which sits at the origin
+	sumWeights_ = sumWeights_ * decay + 1.0;
+	sumX_ *= decay;
+	sumY_ *= decay;
+	sumXX_ *= decay;
+	sumXY_ *= decay;
+	sumYY_ *= decay;
+	framesInModel_++;
+	
+	// Slope of the line is the frame interval; until there are enough frames use the nominal one
+	double denominator = sumWeights_ * sumXX_ - sumX_ * sumX_;
+	if(framesInModel_ >= kTimestampSynchronizerMinimumFrames && denominator > 0)
+		currentSampleInterval_ = (sumWeights_ * sumXY_ - sumX_ * sumY_) / denominator;
+	
+	double slope = currentSampleInterval_;
+	double intercept = (sumY_ - slope * sumX_) / sumWeights_;
+	double variance = (sumYY_ - 2.0 * intercept * sumY_ - 2.0 * slope * sumXY_ + intercept * intercept * sumWeights_
+					   + 2.0 * intercept * slope * sumX_ + slope * slope * sumXX_) / sumWeights_;
+	
+	// The new frame's delay relative to the line; the smallest recent one sets the offset,
+	// creeping up slowly so a single early frame doesn't hold it down for good
+	double residual = -intercept;
+	minimumResidual_ += (double)kTimestampSynchronizerLatencyRise * dx / 1000.0;
+	if(residual < minimumResidual_)
+		minimumResidual_ = residual;
+	
+	jitter_ = (variance > 0) ? sqrt(variance) : 0;
+	if(nominalSampleInterval_ > 0)
+		drift_ = (currentSampleInterval_ / nominalSampleInterval_ - 1.0) * 1000000.0;
+}
+
+// Place a frame on the fitted line, offset by the smallest recent delay
+timestamp_type TimestampSynchronizer::modelTimestamp(long long frameOffset) {
+	double intercept = (sumY_ - currentSampleInterval_ * sumX_) / sumWeights_;
+	
+	return (timestamp_type)((double)referenceClockTime_ + intercept + minimumResidual_ + currentSampleInterval_ * (double)frameOffset);
 }
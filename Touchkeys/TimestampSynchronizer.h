@@ -13,9 +13,11 @@
 #include <iostream>
 #include <boost/date_time.hpp>
 #include "Types.h"
-#include "Node.h"
 
-const int kTimestampSynchronizerHistoryLength = 100;
+const int kTimestampSynchronizerWindowFrames = 2000;            // Effective length of the fitting window
+const int kTimestampSynchronizerMinimumFrames = 20;             // Frames before the fitted interval is used
+const timestamp_diff_type kTimestampSynchronizerLatencyRise = microseconds_to_timestamp(200);        // Per 1000 frames
+const timestamp_diff_type kTimestampSynchronizerResetThreshold = microseconds_to_timestamp(500000);  // Residual that restarts the model
 
 /* TimestampSynchronizer
  *
@@ -26,11 +28,14 @@ const int kTimestampSynchronizerHistoryLength = 100;
  * with respect to the system clock.
  *
  * In this class, the self-reported frame number is compared to the current
- * system time.  In any multitasking OS, the system time when we receive a
- * frame may jitter around, but in the long-term average, we want system clock
- * and frame clock to stay in sync.  Thus we use the low-pass-filtered difference
- * between system clock and frame clock to adjust the reported frame rate, keeping
- * the two locked together.
+ * system time. The frame counter is first unwrapped into a continuous count,
+ * then a line is fitted through (frame count, clock time) by least squares,
+ * with older frames weighted exponentially less. The slope of the line is the
+ * frame interval and its residuals measure the jitter of the system clock. Since
+ * scheduling only ever delays the arrival of a frame, the line is shifted down to
+ * the smallest recent residual, so timestamps follow the least-delayed frames
+ * rather than the average. The fit is updated once per new frame in constant time;
+ * asking again for a frame already seen doesn't read the clock at all.
  */
 
 using namespace std;
@@ -55,20 +60,32 @@ public:
 	timestamp_type currentSampleInterval() { return currentSampleInterval_; }
 	
 	// Return or set the frame modulus (at what number the frame counter wraps
-	// around to 0, since it can't increase forever).
+	// around to 0, since it can't increase forever). 0 means a 32-bit counter.
 	int frameModulus() { return frameModulus_; }
 	void setFrameModulus(int modulus) { frameModulus_ = modulus; }
 	
 	// Process a new timestamp value and return the value synchronized to the
-	// system clock
+	// system clock. Frames older than the newest one are placed on the current
+	// fit without changing it.
 	timestamp_type synchronizedTimestamp(int rawFrameNumber);
+	
+	// ***** Statistics *****
+	//
+	// RMS deviation of the clock time from the fitted line
+	float jitter() { return jitter_; }
+	
+	// How far the fitted interval is from the nominal one, in parts per million
+	float drift() { return drift_; }
 
 private:
-	// History buffer of clock time vs. frame time.  The Node has a data type
-	// (frame number and frame timestamp, respectively) and a timestamp (clock timestamp);
-	// in other words, two different times are held within the buffer as well as the frame numbers.
+	// Restart the fit with a single frame, received at clockTime
+	void resetModel(timestamp_type clockTime);
+	
+	// Add a frame to the fit, making it the new reference point
+	void addToModel(long long frame, timestamp_type clockTime);
 	
-	Node<pair<int, timestamp_type> > history_;
+	// Place a frame (relative to the reference frame) on the fitted line
+	timestamp_type modelTimestamp(long long frameOffset);
 	
 	// Expected and currently calculated frame intervals
 	
@@ -84,7 +101,20 @@ private:
 	boost::posix_time::ptime startingClockTime_;
 	timestamp_type startingTimestamp_;
 	
-	int bufferLengthCounter_;
+	// Unwrapping of the frame counter
+	bool hasFrames_;
+	int lastRawFrame_;
+	long long lastFrame_;					// Continuous count for lastRawFrame_
+	timestamp_type lastTimestamp_;			// What was returned for it
+	
+	// Weighted sums for the fit, in coordinates relative to the newest frame and its clock time
+	timestamp_type referenceClockTime_;
+	double sumWeights_, sumX_, sumY_, sumXX_, sumXY_, sumYY_;
+	int framesInModel_;
+	double minimumResidual_;				// Smallest recent clock delay relative to the fit
+	
+	volatile float jitter_;
+	volatile float drift_;
 };
 
 #endif /* TIMESTAMP_SYNCHRONIZER_H */
\ No newline at end of file
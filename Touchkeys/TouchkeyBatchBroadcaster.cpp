@@ -0,0 +1,189 @@
+//
+//  TouchkeyBatchBroadcaster.cpp
+//  touchkeys
+//
+
+#include "TouchkeyBatchBroadcaster.h"
+#include <unistd.h>
+
+// Constructor
+TouchkeyBatchBroadcaster::TouchkeyBatchBroadcaster()
+: subscribers_(new SubscriberList), subscribersInUse_(0), subscriberCount_(0), nextId_(1) {}
+
+// Destructor: stop every delivery thread
+TouchkeyBatchBroadcaster::~TouchkeyBatchBroadcaster() {
+    unsubscribeAll();
+    delete subscribers_.load(boost::memory_order_relaxed);
+}
+
+// Add a subscriber, starting its thread if it wants one
+int TouchkeyBatchBroadcaster::subscribe(TouchkeyAnalogBatchCallback analogCallback,
+                                        TouchkeyCentroidBatchCallback centroidCallback,
+                                        void *userData, bool threaded, int queueLength) {
+    if(analogCallback == 0 && centroidCallback == 0)
+        return 0;
+    if(queueLength < 1)
+        queueLength = 1;
+
+    // Inline subscribers never use their queues
+    Subscriber *subscriber = new Subscriber(threaded ? queueLength : 1);
+    subscriber->analogCallback = analogCallback;
+    subscriber->centroidCallback = centroidCallback;
+    subscriber->userData = userData;
+    subscriber->threaded = threaded;
+    if(threaded)
+        subscriber->thread = boost::thread(&TouchkeyBatchBroadcaster::deliveryLoop, this, subscriber);
+
+    boost::mutex::scoped_lock lock(subscribersMutex_);
+    SubscriberList *subscribers = new SubscriberList(*subscribers_.load(boost::memory_order_relaxed));
+    subscriber->id = nextId_++;
+    subscribers->push_back(subscriber);
+    publishSubscribers(subscribers);
+    return subscriber->id;
+}
+
+// Remove a subscriber. Once the list without it is published the I/O thread can't
+// reach it, so its thread can be stopped without holding the lock.
+void TouchkeyBatchBroadcaster::unsubscribe(int id) {
+    Subscriber *subscriber = 0;
+
+    {
+        boost::mutex::scoped_lock lock(subscribersMutex_);
+        SubscriberList *subscribers = new SubscriberList(*subscribers_.load(boost::memory_order_relaxed));
+        for(SubscriberList::iterator it = subscribers->begin(); it != subscribers->end(); ++it) {
+            if((*it)->id == id) {
+                subscriber = *it;
+                subscribers->erase(it);
+                break;
+            }
+        }
+        if(subscriber == 0) {
+            delete subscribers;
+            return;
+        }
+        publishSubscribers(subscribers);
+    }
+
+    stop(subscriber);
+}
+
+// Remove every subscriber
+void TouchkeyBatchBroadcaster::unsubscribeAll() {
+    SubscriberList subscribers;
+
+    {
+        boost::mutex::scoped_lock lock(subscribersMutex_);
+        subscribers = *subscribers_.load(boost::memory_order_relaxed);
+        publishSubscribers(new SubscriberList);
+    }
+
+    for(SubscriberList::iterator it = subscribers.begin(); it != subscribers.end(); ++it)
+        stop(*it);
+}
+
+unsigned long TouchkeyBatchBroadcaster::droppedBatches(int id) {
+    boost::mutex::scoped_lock lock(subscribersMutex_);
+    SubscriberList *subscribers = subscribers_.load(boost::memory_order_relaxed);
+
+    for(SubscriberList::iterator it = subscribers->begin(); it != subscribers->end(); ++it) {
+        if((*it)->id == id)
+            return (*it)->dropped.load(boost::memory_order_relaxed);
+    }
+    return 0;
+}
+
+// Send an analog batch to everyone who wants one, calling inline subscribers
+// directly and queueing for the rest
+void TouchkeyBatchBroadcaster::broadcast(TouchkeyAnalogBatch const& batch) {
+    SubscriberList *subscribers = acquireSubscribers();
+
+    for(SubscriberList::iterator it = subscribers->begin(); it != subscribers->end(); ++it) {
+        Subscriber *subscriber = *it;
+        if(subscriber->analogCallback == 0)
+            continue;
+        if(!subscriber->threaded)
+            subscriber->analogCallback(batch, subscriber->userData);
+        else if(!subscriber->analogQueue.push(batch))
+            subscriber->dropped.fetch_add(1, boost::memory_order_relaxed);
+    }
+
+    releaseSubscribers();
+}
+
+// Same for centroid batches
+void TouchkeyBatchBroadcaster::broadcast(TouchkeyCentroidBatch const& batch) {
+    SubscriberList *subscribers = acquireSubscribers();
+
+    for(SubscriberList::iterator it = subscribers->begin(); it != subscribers->end(); ++it) {
+        Subscriber *subscriber = *it;
+        if(subscriber->centroidCallback == 0)
+            continue;
+        if(!subscriber->threaded)
+            subscriber->centroidCallback(batch, subscriber->userData);
+        else if(!subscriber->centroidQueue.push(batch))
+            subscriber->dropped.fetch_add(1, boost::memory_order_relaxed);
+    }
+
+    releaseSubscribers();
+}
+
+// Make a new list current and free the old one. Called with subscribersMutex_ held.
+void TouchkeyBatchBroadcaster::publishSubscribers(SubscriberList *subscribers) {
+    subscriberCount_.store((int)subscribers->size(), boost::memory_order_relaxed);
+    SubscriberList *oldSubscribers = subscribers_.exchange(subscribers, boost::memory_order_seq_cst);
+
+    // The I/O thread finishes with a list within one broadcast
+    while(subscribersInUse_.load(boost::memory_order_seq_cst) == oldSubscribers)
+        usleep(100);
+    delete oldSubscribers;
+}
+
+// Mark the current list as in use, checking it didn't change in between
+// so it can't be freed under us
+TouchkeyBatchBroadcaster::SubscriberList* TouchkeyBatchBroadcaster::acquireSubscribers() {
+    SubscriberList *subscribers = subscribers_.load(boost::memory_order_acquire);
+
+    while(true) {
+        subscribersInUse_.store(subscribers, boost::memory_order_seq_cst);
+        SubscriberList *current = subscribers_.load(boost::memory_order_seq_cst);
+        if(current == subscribers)
+            return subscribers;
+        subscribers = current;
+    }
+}
+
+// Finished with the list for this broadcast
+void TouchkeyBatchBroadcaster::releaseSubscribers() {
+    subscribersInUse_.store(0, boost::memory_order_release);
+}
+
+// Delivery thread for one subscriber: pass on whatever has been queued, then wait a
+// little for more. Polling keeps the I/O thread from ever having to wake anyone.
+void TouchkeyBatchBroadcaster::deliveryLoop(Subscriber *subscriber) {
+    while(!subscriber->shouldStop) {
+        bool delivered = false;
+
+        while(TouchkeyAnalogBatch const *batch = subscriber->analogQueue.front()) {
+            subscriber->analogCallback(*batch, subscriber->userData);
+            subscriber->analogQueue.pop();
+            delivered = true;
+        }
+        while(TouchkeyCentroidBatch const *batch = subscriber->centroidQueue.front()) {
+            subscriber->centroidCallback(*batch, subscriber->userData);
+            subscriber->centroidQueue.pop();
+            delivered = true;
+        }
+
+        if(!delivered)
+            usleep(kTouchkeyBatchDeliveryIntervalMicroseconds);
+    }
+}
+
+// Stop a subscriber's thread if it has one, and free it
+void TouchkeyBatchBroadcaster::stop(Subscriber *subscriber) {
+    if(subscriber->threaded) {
+        subscriber->shouldStop = true;
+        subscriber->thread.join();
+    }
+    delete subscriber;
+}
@@ -0,0 +1,163 @@
+//
+//  TouchkeyBatchBroadcaster.h
+//  touchkeys
+//
+
+#ifndef __touchkeys__TouchkeyBatchBroadcaster__
+#define __touchkeys__TouchkeyBatchBroadcaster__
+
+#include <iostream>
+#include <vector>
+#include <boost/atomic.hpp>
+#include <boost/thread.hpp>
+#include "Types.h"
+
+const int kTouchkeyBatchMaxKeys = 25;               // Keys in one frame from one board
+const int kTouchkeyBatchDefaultQueueLength = 64;    // Batches held for a subscriber on its own thread
+const int kTouchkeyBatchDeliveryIntervalMicroseconds = 1000;
+
+// The calibrated analog values of one frame from one board, as parallel arrays
+struct TouchkeyAnalogBatch {
+    int frame;                                      // Frame number from the device
+    int octave;                                     // Lowest octave of the board
+    int count;                                      // Keys in the arrays
+    int midiNotes[kTouchkeyBatchMaxKeys];
+    timestamp_type timestamps[kTouchkeyBatchMaxKeys];
+    float positions[kTouchkeyBatchMaxKeys];         // Missing if the key isn't calibrated
+    int rawValues[kTouchkeyBatchMaxKeys];
+};
+
+// The touches of one centroid frame from one board, as parallel arrays. Keys whose
+// touches have ended appear with a count of 0.
+struct TouchkeyCentroidBatch {
+    int frame;
+    int octave;
+    int count;
+    int midiNotes[kTouchkeyBatchMaxKeys];
+    timestamp_type timestamps[kTouchkeyBatchMaxKeys];
+    int touchCounts[kTouchkeyBatchMaxKeys];         // Active touches (0-3)
+    float locations[3][kTouchkeyBatchMaxKeys];      // Vertical location of each touch, -1 if none
+    float sizes[3][kTouchkeyBatchMaxKeys];          // Contact area of each touch
+    float horizontalLocations[kTouchkeyBatchMaxKeys];   // -1 if none
+    bool white[kTouchkeyBatchMaxKeys];
+};
+
+// Subscriber callbacks, each receiving a whole frame at a time
+typedef void (*TouchkeyAnalogBatchCallback)(TouchkeyAnalogBatch const& batch, void *userData);
+typedef void (*TouchkeyCentroidBatchCallback)(TouchkeyCentroidBatch const& batch, void *userData);
+
+/*
+ * TouchkeyBatchBroadcaster
+ *
+ * Passes each frame of data from a TouchkeyDevice to any number of subscribers, one
+ * call per frame rather than one per key. A subscriber is either called directly on
+ * the I/O thread, which is quickest but must return promptly, or given its own thread
+ * and a bounded queue of batches. A subscriber on its own thread can fall behind
+ * without holding up the I/O thread: when its queue is full, new batches are dropped
+ * and counted.
+ */
+
+class TouchkeyBatchBroadcaster {
+private:
+    // Single-producer, single-consumer queue of batches for one threaded subscriber
+    template<typename BatchType>
+    class BatchQueue {
+    public:
+        BatchQueue(int length) : batches_(length), writePosition_(0), readPosition_(0) {}
+
+        // I/O thread: copy a batch in, or return false if the queue is full
+        bool push(BatchType const& batch) {
+            unsigned int writePosition = writePosition_.load(boost::memory_order_relaxed);
+            if(writePosition - readPosition_.load(boost::memory_order_acquire) >= batches_.size())
+                return false;
+            batches_[writePosition % batches_.size()] = batch;
+            writePosition_.store(writePosition + 1, boost::memory_order_release);
+            return true;
+        }
+
+        // Delivery thread: the oldest batch, or 0 if empty. Call pop() when finished with it.
+        BatchType const* front() {
+            unsigned int readPosition = readPosition_.load(boost::memory_order_relaxed);
+            if(readPosition == writePosition_.load(boost::memory_order_acquire))
+                return 0;
+            return &batches_[readPosition % batches_.size()];
+        }
+        void pop() {
+            readPosition_.store(readPosition_.load(boost::memory_order_relaxed) + 1, boost::memory_order_release);
+        }
+
+    private:
+        std::vector<BatchType> batches_;
+        boost::atomic<unsigned int> writePosition_;
+        boost::atomic<unsigned int> readPosition_;
+    };
+
+    struct Subscriber {
+        Subscriber(int queueLength) : analogQueue(queueLength), centroidQueue(queueLength),
+          shouldStop(false), dropped(0) {}
+
+        int id;
+        TouchkeyAnalogBatchCallback analogCallback;
+        TouchkeyCentroidBatchCallback centroidCallback;
+        void *userData;
+        bool threaded;                              // Whether delivered on its own thread
+
+        BatchQueue<TouchkeyAnalogBatch> analogQueue;
+        BatchQueue<TouchkeyCentroidBatch> centroidQueue;
+        boost::thread thread;
+        volatile bool shouldStop;
+        boost::atomic<unsigned long> dropped;       // Batches lost to a full queue
+    };
+
+    typedef std::vector<Subscriber*> SubscriberList;
+
+public:
+    // ***** Constructor *****
+    TouchkeyBatchBroadcaster();
+
+    // ***** Destructor *****
+    ~TouchkeyBatchBroadcaster();
+
+    // ***** Subscription *****
+    //
+    // Add a subscriber, returning an ID for unsubscribe(). Either callback may be 0 if that
+    // stream isn't wanted. With threaded false, callbacks run on the I/O thread and must not
+    // subscribe or unsubscribe; with it true, they run on a thread of their own, with up to
+    // queueLength batches of each kind waiting.
+    int subscribe(TouchkeyAnalogBatchCallback analogCallback, TouchkeyCentroidBatchCallback centroidCallback,
+                  void *userData, bool threaded = false, int queueLength = kTouchkeyBatchDefaultQueueLength);
+
+    // Remove a subscriber. Any batches still queued for it are discarded.
+    void unsubscribe(int id);
+    void unsubscribeAll();
+
+    // Whether anyone is listening, so the device can skip gathering batches
+    bool hasSubscribers() { return subscriberCount_.load(boost::memory_order_relaxed) > 0; }
+
+    // Batches dropped for a threaded subscriber which fell behind
+    unsigned long droppedBatches(int id);
+
+    // ***** I/O Thread Methods *****
+    //
+    // Send a batch to every subscriber. These don't lock, but only one thread may call them.
+    void broadcast(TouchkeyAnalogBatch const& batch);
+    void broadcast(TouchkeyCentroidBatch const& batch);
+
+private:
+    void deliveryLoop(Subscriber *subscriber);
+    void stop(Subscriber *subscriber);
+
+    // The list of subscribers is never changed in place. Each change publishes a new
+    // copy and frees the old one once the I/O thread is no longer broadcasting to it.
+    void publishSubscribers(SubscriberList *subscribers);
+    SubscriberList* acquireSubscribers();
+    void releaseSubscribers();
+
+    boost::atomic<SubscriberList*> subscribers_;        // Current list
+    boost::atomic<SubscriberList*> subscribersInUse_;   // List being broadcast to, if any
+    boost::mutex subscribersMutex_;                     // Serialises changes to the list
+    boost::atomic<int> subscriberCount_;
+    int nextId_;
+};
+
+#endif /* defined(__touchkeys__TouchkeyBatchBroadcaster__) */
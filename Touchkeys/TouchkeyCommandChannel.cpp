@@ -0,0 +1,322 @@
+//
+//  TouchkeyCommandChannel.cpp
+//  touchkeys
+//
+
+#include "TouchkeyCommandChannel.h"
+#include "TouchkeyDevice.h"
+#include "Logger.h"
+#include <algorithm>
+#include <unistd.h>
+#include <termios.h>
+#include <errno.h>
+
+using namespace boost::posix_time;
+
+// Constructor
+TouchkeyCommandChannel::TouchkeyCommandChannel()
+: device_(-1), shouldStop_(false), writeSequence_(0), responseSequence_(0), resynchronize_(false),
+  nextId_(1), window_(kTouchkeyCommandDefaultWindow),
+  timeoutMilliseconds_(kTouchkeyCommandDefaultTimeoutMilliseconds), reading_(false), readControlSequence_(false)
+{
+}
+
+// Destructor
+TouchkeyCommandChannel::~TouchkeyCommandChannel() {
+    close();
+}
+
+// Start the channel thread for a newly opened device. The channel reads its own
+// responses until told otherwise.
+void TouchkeyCommandChannel::open(int device) {
+    close();
+
+    device_ = device;
+    shouldStop_ = false;
+    writeSequence_ = responseSequence_ = 0;
+    resynchronize_ = false;
+    quietUntil_ = ptime(not_a_date_time);
+    setReading(true);
+    thread_ = boost::thread(&TouchkeyCommandChannel::runLoop, this);
+}
+
+// Stop the channel thread once the queue has drained, or after a short wait if it
+// doesn't (e.g. the device has stopped answering). Commands that haven't completed fail.
+void TouchkeyCommandChannel::close() {
+    if(device_ < 0)
+        return;
+
+    {
+        boost::system_time deadline = boost::get_system_time() + milliseconds(kTouchkeyCommandCloseTimeoutMilliseconds);
+        boost::mutex::scoped_lock lock(mutex_);
+
+        while(!queue_.empty() || !inFlight_.empty()) {
+            if(!condition_.timed_wait(lock, deadline))
+                break;
+        }
+    }
+
+    shouldStop_ = true;
+    condition_.notify_all();
+    thread_.join();
+    setReading(false);
+    failAll();
+    device_ = -1;
+}
+
+// Start or stop reading responses from the device. Taking the read mutex means
+// any read in progress has finished by the time this returns.
+void TouchkeyCommandChannel::setReading(bool reading) {
+    boost::mutex::scoped_lock lock(readMutex_);
+
+    reading_ = reading;
+    readControlSequence_ = false;
+}
+
+// Queue a command for the channel thread to write
+int TouchkeyCommandChannel::send(const unsigned char *data, int length, bool expectsAck,
+                                 TouchkeyCommandCallback callback, void *userData, int delayAfterMicroseconds) {
+    if(device_ < 0 || data == 0 || length <= 0)
+        return 0;
+
+    Command *command = new Command;
+    command->data.assign(data, data + length);
+    command->expectsAck = expectsAck;
+    command->delayAfterMicroseconds = delayAfterMicroseconds;
+    command->callback = callback;
+    command->userData = userData;
+    command->result = kTouchkeyCommandPending;
+
+    boost::mutex::scoped_lock lock(mutex_);
+    command->id = nextId_++;
+    queue_.push_back(command);
+    condition_.notify_all();
+    return command->id;
+}
+
+// Result of a command, or pending if it hasn't completed (or is too old to remember)
+int TouchkeyCommandChannel::commandResult(int id) {
+    boost::mutex::scoped_lock lock(mutex_);
+
+    std::map<int, int>::iterator it = results_.find(id);
+    if(it == results_.end())
+        return kTouchkeyCommandPending;
+    return it->second;
+}
+
+// Wait for a command to complete, for callers that can't go on without the answer
+int TouchkeyCommandChannel::waitForCommand(int id, int timeoutMilliseconds) {
+    boost::system_time deadline = boost::get_system_time() + milliseconds(timeoutMilliseconds);
+    boost::mutex::scoped_lock lock(mutex_);
+
+    while(true) {
+        std::map<int, int>::iterator it = results_.find(id);
+        if(it != results_.end())
+            return it->second;
+        if(!condition_.timed_wait(lock, deadline)) {
+            it = results_.find(id);
+            return (it != results_.end()) ? it->second : kTouchkeyCommandPending;
+        }
+    }
+}
+
+// The device has responded to the next command in sequence. Called by the device's
+// I/O thread while it runs, or the channel thread otherwise.
+void TouchkeyCommandChannel::acknowledged(bool ack) {
+    std::vector<Command*> completed;
+
+    {
+        boost::mutex::scoped_lock lock(mutex_);
+
+        if(responseSequence_ == writeSequence_) {
+            TOUCHKEY_LOG(kLogLevelDebug, "Received {} with no command outstanding") << (ack ? "ACK" : "NAK");
+            return;
+        }
+        
+        // A command that timed out has left inFlight_, but still takes its response
+        unsigned int sequence = responseSequence_++;
+        Command *command = 0;
+        for(std::deque<Command*>::iterator it = inFlight_.begin(); it != inFlight_.end(); ++it) {
+            if((*it)->sequence == sequence) {
+                command = *it;
+                inFlight_.erase(it);
+                break;
+            }
+        }
+        if(command == 0) {
+            TOUCHKEY_LOG(kLogLevelDebug, "Received {} for a command that already timed out") << (ack ? "ACK" : "NAK");
+            return;
+        }
+
+        if(!ack)
+            TOUCHKEY_LOG(kLogLevelWarning, "Warning: received NAK for command {}") << command->id;
+        completeCommand(command, ack ? kTouchkeyCommandAcknowledged : kTouchkeyCommandRejected, completed);
+    }
+
+    finishCommands(completed);
+}
+
+// Channel thread: time out commands the device hasn't answered, write the next command
+// when the window and the device allow, and otherwise wait for something to happen
+void TouchkeyCommandChannel::runLoop() {
+    while(!shouldStop_) {
+        std::vector<Command*> completed;
+        Command *nextCommand = 0;       // Ours until written, unless it is awaiting an ACK
+        Command outgoing;               // What to write; an ACK can free nextCommand at any time
+
+        {
+            boost::mutex::scoped_lock lock(mutex_);
+            ptime currentTime = microsec_clock::universal_time();
+
+            while(!inFlight_.empty() && (currentTime - inFlight_.front()->sentTime).total_milliseconds() >= timeoutMilliseconds_) {
+                Command *command = inFlight_.front();
+                inFlight_.pop_front();
+
+                TOUCHKEY_LOG(kLogLevelError, "Error: timeout waiting for ACK to command {}") << command->id;
+                completeCommand(command, kTouchkeyCommandTimedOut, completed);
+                
+                // Give a late response time to arrive before writing anything else
+                quietUntil_ = currentTime + milliseconds(timeoutMilliseconds_);
+                resynchronize_ = true;
+            }
+            
+            bool quiet = (quietUntil_.is_not_a_date_time() || currentTime >= quietUntil_);
+            
+            // Any response still owed by now isn't coming, so start counting afresh
+            if(resynchronize_ && inFlight_.empty() && quiet) {
+                responseSequence_ = writeSequence_;
+                resynchronize_ = false;
+            }
+
+            if(!queue_.empty() && (int)inFlight_.size() < window_ && quiet) {
+                nextCommand = queue_.front();
+                queue_.pop_front();
+
+                // Outstanding before it's written, in case the response comes back quickly
+                nextCommand->sentTime = currentTime;
+                if(nextCommand->expectsAck) {
+                    nextCommand->sequence = writeSequence_++;
+                    inFlight_.push_back(nextCommand);
+                }
+                outgoing = *nextCommand;
+            }
+            else
+                condition_.timed_wait(lock, microseconds(kTouchkeyCommandPollMicroseconds));
+        }
+
+        finishCommands(completed);
+
+        if(nextCommand != 0)
+            writeCommand(outgoing, outgoing.expectsAck ? 0 : nextCommand);
+        readResponses();
+    }
+}
+
+// Write one command to the device, from a copy taken when it left the queue. The
+// command itself is passed only if it isn't awaiting an ACK, as otherwise it belongs
+// to whichever thread sees the response. Commands not expecting an ACK are complete
+// once written.
+void TouchkeyCommandChannel::writeCommand(Command const& outgoing, Command *command) {
+    std::vector<Command*> completed;
+    int frameType = (outgoing.data.size() > 2) ? (int)outgoing.data[2] : -1;
+    
+    bool written = (write(device_, (char*)&outgoing.data[0], outgoing.data.size()) >= 0);
+
+    if(!written)
+        TOUCHKEY_LOG(kLogLevelError, "ERROR: unable to write command {} (frame type {}).  errno = {}") << outgoing.id << frameType << errno;
+    tcdrain(device_);
+
+    if(outgoing.delayAfterMicroseconds > 0)
+        quietUntil_ = microsec_clock::universal_time() + microseconds(outgoing.delayAfterMicroseconds);
+    else
+        quietUntil_ = ptime(not_a_date_time);
+
+    if(written && outgoing.expectsAck)
+        return;
+
+    {
+        boost::mutex::scoped_lock lock(mutex_);
+
+        if(outgoing.expectsAck) {
+            // No response is coming for a command that was never written
+            resynchronize_ = true;
+            for(std::deque<Command*>::iterator it = inFlight_.begin(); it != inFlight_.end(); ++it) {
+                if((*it)->id == outgoing.id) {
+                    command = *it;
+                    inFlight_.erase(it);
+                    break;
+                }
+            }
+            if(command == 0)
+                return;     // Already answered or timed out
+        }
+        completeCommand(command, written ? kTouchkeyCommandAcknowledged : kTouchkeyCommandFailed, completed);
+    }
+
+    finishCommands(completed);
+}
+
+// When nobody else is reading the device, look for ACK and NAK ourselves. Anything
+// else that arrives is thrown away, as no data is expected while the device isn't running.
+void TouchkeyCommandChannel::readResponses() {
+    boost::mutex::scoped_lock lock(readMutex_);
+    unsigned char buffer[256];
+
+    if(!reading_)
+        return;
+
+    long count = read(device_, (char *)buffer, sizeof(buffer));
+    if(count < 0 && errno != EAGAIN)
+        TOUCHKEY_LOG(kLogLevelError, "Unable to read from device while waiting for ACK (error {}).") << errno;
+
+    for(long i = 0; i < count; i++) {
+        if(readControlSequence_) {
+            readControlSequence_ = false;
+            if(buffer[i] == kControlCharacterAck)
+                acknowledged(true);
+            else if(buffer[i] == kControlCharacterNak)
+                acknowledged(false);
+        }
+        else if(buffer[i] == ESCAPE_CHARACTER)
+            readControlSequence_ = true;
+    }
+}
+
+// Fail everything queued or outstanding
+void TouchkeyCommandChannel::failAll() {
+    std::vector<Command*> completed;
+
+    {
+        boost::mutex::scoped_lock lock(mutex_);
+
+        for(std::deque<Command*>::iterator it = inFlight_.begin(); it != inFlight_.end(); ++it)
+            completeCommand(*it, kTouchkeyCommandFailed, completed);
+        for(std::deque<Command*>::iterator it = queue_.begin(); it != queue_.end(); ++it)
+            completeCommand(*it, kTouchkeyCommandFailed, completed);
+        inFlight_.clear();
+        queue_.clear();
+    }
+
+    finishCommands(completed);
+}
+
+// Note a command's result and wake anyone waiting for it. Mutex must be held.
+void TouchkeyCommandChannel::completeCommand(Command *command, int result, std::vector<Command*>& completed) {
+    command->result = result;
+    results_[command->id] = result;
+    while(results_.size() > (size_t)kTouchkeyCommandMaxResults)
+        results_.erase(results_.begin());
+
+    completed.push_back(command);
+    condition_.notify_all();
+}
+
+// Run the callbacks of completed commands, without the mutex held, and free them
+void TouchkeyCommandChannel::finishCommands(std::vector<Command*>& completed) {
+    for(std::vector<Command*>::iterator it = completed.begin(); it != completed.end(); ++it) {
+        if((*it)->callback != 0)
+            (*it)->callback((*it)->id, (*it)->result, (*it)->userData);
+        delete *it;
+    }
+    completed.clear();
+}
@@ -0,0 +1,138 @@
+//
+//  TouchkeyCommandChannel.h
+//  touchkeys
+//
+
+#ifndef __touchkeys__TouchkeyCommandChannel__
+#define __touchkeys__TouchkeyCommandChannel__
+
+#include <iostream>
+#include <vector>
+#include <deque>
+#include <map>
+#include <boost/thread.hpp>
+#include <boost/date_time/posix_time/posix_time.hpp>
+
+const int kTouchkeyCommandDefaultWindow = 4;            // Commands awaiting ACK at once
+const int kTouchkeyCommandDefaultTimeoutMilliseconds = 250;
+const int kTouchkeyCommandPollMicroseconds = 1000;      // How often the channel thread checks in
+const int kTouchkeyCommandMaxResults = 256;             // Results kept for waitForCommand()
+const int kTouchkeyCommandCloseTimeoutMilliseconds = 500;   // Time close() allows for the queue to drain
+
+// Outcome of a command
+enum {
+    kTouchkeyCommandPending = 0,        // Queued or awaiting ACK
+    kTouchkeyCommandAcknowledged,       // ACK received, or written if no ACK is expected
+    kTouchkeyCommandRejected,           // NAK received
+    kTouchkeyCommandTimedOut,           // No response in time
+    kTouchkeyCommandFailed              // Couldn't be written, or the device was closed
+};
+
+// Called when a command completes, on the channel thread or the device's I/O thread
+typedef void (*TouchkeyCommandCallback)(int commandId, int result, void *userData);
+
+/*
+ * TouchkeyCommandChannel
+ *
+ * Sends configuration commands to a TouchkeyDevice without the caller waiting on
+ * the device. Commands are queued and written in order by the channel's own thread,
+ * with up to a set number awaiting ACK at once. The device answers each command that
+ * expects it with an ACK or NAK, in order, but the response carries no ID. Each
+ * command is numbered in sequence as it is written, and responses are counted, so the
+ * n-th response belongs to the n-th command even if that one has since timed out.
+ * While the device's I/O thread is running it spots the responses in the data stream
+ * and passes them on with acknowledged(); otherwise the channel reads them from the
+ * device itself.
+ *
+ * Each command gets an ID. Callers can supply a callback, poll commandResult(), or
+ * block in waitForCommand() if they really do need the answer before going on.
+ */
+
+class TouchkeyCommandChannel {
+private:
+    struct Command {
+        int id;
+        unsigned int sequence;                  // Position among commands expecting an ACK
+        std::vector<unsigned char> data;
+        bool expectsAck;
+        int delayAfterMicroseconds;             // Quiet time the device needs before the next command
+        TouchkeyCommandCallback callback;
+        void *userData;
+        boost::posix_time::ptime sentTime;
+        int result;
+    };
+
+public:
+    // ***** Constructor *****
+    TouchkeyCommandChannel();
+
+    // ***** Destructor *****
+    ~TouchkeyCommandChannel();
+
+    // ***** Device *****
+    //
+    // Start sending to an open device, or stop and fail anything outstanding. Closing
+    // gives queued commands a short time to be written and answered first.
+    void open(int device);
+    void close();
+
+    // Whether the channel reads ACKs from the device itself. Turn off while another
+    // thread reads the device; on return, the channel has stopped reading.
+    void setReading(bool reading);
+    bool reading() { return reading_; }
+
+    // ***** Commands *****
+    //
+    // Queue a complete frame to be written. Returns its ID, or 0 if the channel is closed.
+    int send(const unsigned char *data, int length, bool expectsAck,
+             TouchkeyCommandCallback callback = 0, void *userData = 0, int delayAfterMicroseconds = 0);
+
+    // Result of a command: pending until complete. Results are kept for the most recent commands.
+    int commandResult(int id);
+
+    // Block until a command completes or the timeout expires, returning its result
+    int waitForCommand(int id, int timeoutMilliseconds);
+
+    // How many commands may await ACK at once, and how long to wait for each
+    void setWindow(int commands) { window_ = (commands < 1) ? 1 : commands; }
+    int window() { return window_; }
+    void setTimeout(int milliseconds) { timeoutMilliseconds_ = milliseconds; }
+
+    // ***** Responses *****
+    //
+    // An ACK (or NAK) has arrived: complete the command it answers, if still outstanding
+    void acknowledged(bool ack);
+
+private:
+    void runLoop();
+    void writeCommand(Command const& outgoing, Command *command);
+    void readResponses();
+    void failAll();
+    
+    // Record a result with the mutex held; the callback runs later from finishCommands()
+    void completeCommand(Command *command, int result, std::vector<Command*>& completed);
+    void finishCommands(std::vector<Command*>& completed);
+
+    int device_;
+    boost::thread thread_;
+    volatile bool shouldStop_;
+
+    std::deque<Command*> queue_;            // Waiting to be written
+    std::deque<Command*> inFlight_;         // Written and awaiting ACK, oldest first
+    std::map<int, int> results_;            // Completed commands
+    unsigned int writeSequence_;            // Sequence of the next command written expecting an ACK
+    unsigned int responseSequence_;         // Sequence the next response belongs to
+    bool resynchronize_;                    // A command timed out, so its response may never come
+    boost::mutex mutex_;                    // Protects the above
+    boost::condition_variable condition_;   // Signalled on new commands and completions
+    int nextId_;
+    int window_;
+    int timeoutMilliseconds_;
+    boost::posix_time::ptime quietUntil_;   // No writes before this (channel thread only)
+
+    volatile bool reading_;
+    bool readControlSequence_;
+    boost::mutex readMutex_;                // Held while the channel reads the device
+};
+
+#endif /* defined(__touchkeys__TouchkeyCommandChannel__) */
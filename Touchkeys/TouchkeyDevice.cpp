@@ -12,6 +12,7 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include "TouchkeyDevice.h"
+#include "Logger.h"
 
 
 const char* kKeyNames[13] = {"C ", "C#", "D ", "D#", "E ", "F ", "F#", "G ", "G#", "A ", "A#", "B ", "c "};
@@ -22,26 +23,49 @@ TouchkeyDevice::TouchkeyDevice(PianoKeyboard& keyboard)
 : keyboard_(keyboard), autoGathering_(false), shouldStop_(false),
   device_(-1), verbose_(4), numOctaves_(0), lowestMidiNote_(0), lowestKeyPresentMidiNote_(0),
   deviceSoftwareVersion_(-1), isCalibrated_(false), calibrationInProgress_(false),
-  keyCalibrators_(0), keyCalibratorsLength_(0), sensorDisplay_(0),
+  keyCalibrators_(0), keyCalibratorsLength_(0), calibrationTable_(0), calibrationTableInUse_(0),
+  driftTracker_(0), driftTrackingEnabled_(true), sensorDisplay_(0),
   expectedLengthWhite_(kTransmissionLengthWhiteNewHardware),
   expectedLengthBlack_(kTransmissionLengthBlackNewHardware),
-  deviceHasRGBLEDs_(false), usingCentroidCallback_(false), usingAnalogCallback_(false)
+  deviceHasRGBLEDs_(false), ledShouldStop_(false),
+  ledUpdateIntervalMicroseconds_(1000000 / kRGBLEDDefaultFrameRate), ledMaxUpdatesPerFrame_(kRGBLEDDefaultUpdatesPerFrame),
+  ledAllOffRequested_(false), ledNextFrame_(0), ledRequestCount_(0), ledUpdatesSentCount_(0), ledFramesSentCount_(0),
+  ledUpdatesPerSecond_(0), ledFramesPerSecond_(0), telemetryPublishing_(false),
+  usingCentroidCallback_(false), usingAnalogCallback_(false)
 {
     // Tell the piano keyboard class how to call us back
-    keyboard_.setTouchkeyDevice(this);
+    keyboard_.addTouchkeyDevice(this);
     
 	pthread_mutex_init(&ioMutex_, 0);
 	
 	// Initialize the frame -> timestamp synchronization.  Frame interval is nominally 1ms,
 	// but this class helps us find the actual rate which might drift slightly, and it keeps
-	// the time stamps of each data point in sync with other streams.
-	timestampSynchronizer_.initialize(boost::posix_time::microsec_clock::universal_time(), keyboard_.schedulerCurrentTimestamp());
+	// the time stamps of each data point in sync with other streams, including other
+	// devices attached to the same keyboard.
+	keyboard_.synchronizeToKeyboardClock(timestampSynchronizer_);
 	timestampSynchronizer_.setNominalSampleInterval(.001);
 	timestampSynchronizer_.setFrameModulus(65536);
     
-    for(int i = 0; i < 4; i++)
+    for(int i = 0; i < kTelemetryMaxBoards; i++)
         analogLastFrame_[i] = 0;
     
+    // All LEDs start off, with nothing waiting to be sent
+    for(int i = 0; i < kRGBLEDNumberOfNotes; i++) {
+        ledRequestedColors_[i] = 0;
+        ledSentColors_[i] = 0;
+    }
+    for(int i = 0; i < kRGBLEDNumberOfNotes / 64; i++) {
+        ledDirtyMask_[i] = 0;
+        ledResendMask_[i] = 0;
+    }
+    for(int i = 0; i < kRGBLEDFramesInFlight; i++) {
+        ledFrames_[i].device = this;
+        ledFrames_[i].count = 0;
+        ledFrames_[i].inFlight = false;
+    }
+    
+    // Sensor data compresses well, and these logs can run for hours
+    sessionLog_.setEncoding(kSessionLogEncodingDeltaLZ);
     logFileCreated_ = false;
     loggingActive_ = false;
 }
@@ -58,39 +82,40 @@ void TouchkeyDevice::createLogFile(string keyTouchLogFilename, string path)
     
     keyTouchLogFilename = path + keyTouchLogFilename;
     
-    char *fileName = (char*)keyTouchLogFilename.c_str();
-    
-    // create output file
-    keyTouchLog_.open (fileName, ios::out | ios::binary);
-    keyTouchLog_.seekp(0);
-    
-    // indicate that we have created a log file (so we can close it later)
-    logFileCreated_ = true;
+    // create output file; indicate that we have created a log file (so we can close it later)
+    logFileCreated_ = sessionLog_.open(keyTouchLogFilename);
 }
 
 // ------------------------------------------------------
 // close the log file
 void TouchkeyDevice::closeLogFile()
 {
+    stopLogging();
     if (logFileCreated_)
     {
-        keyTouchLog_.close();
+        sessionLog_.close();
         logFileCreated_ = false;
     }
-    loggingActive_ = false;
 }
 
 // ------------------------------------------------------
 // start logging midi data
 void TouchkeyDevice::startLogging()
 {
+    if (!logFileCreated_)
+        return;
     loggingActive_ = true;
+    
+    // Also capture whatever the keyboard sends out
+    keyboard_.setSessionLog(&sessionLog_);
 }
 
 // ------------------------------------------------------
 // stop logging midi data
 void TouchkeyDevice::stopLogging()
 {
+    if (loggingActive_ && keyboard_.sessionLog() == &sessionLog_)
+        keyboard_.setSessionLog(0);
     loggingActive_ = false;
 }
 
@@ -106,6 +131,7 @@ bool TouchkeyDevice::openDevice(const char * inputDevicePath) {
 	
 	if(device_ < 0)
 		return false;
+    commandChannel_.open(device_);
 	return true;
 }
 
@@ -115,6 +141,7 @@ void TouchkeyDevice::closeDevice() {
 		return;
 	
 	stopAutoGathering();
+    commandChannel_.close();
 	keysPresent_.clear();
 	close(device_);
     device_ = -1;
@@ -124,18 +151,32 @@ void TouchkeyDevice::closeDevice() {
 // controller status information.
 
 bool TouchkeyDevice::checkIfDevicePresent(int millisecondsToWait) {
+    // The status reply has to be read here, so keep the command channel off the device meanwhile
+    bool channelWasReading = commandChannel_.reading();
+    
+    if(channelWasReading)
+        commandChannel_.setReading(false);
+    bool present = queryDeviceStatus(millisecondsToWait);
+    if(channelWasReading)
+        commandChannel_.setReading(true);
+    return present;
+}
+
+bool TouchkeyDevice::queryDeviceStatus(int millisecondsToWait) {
 	struct timeval startTime, currentTime;
 	unsigned char ch;
 	bool controlSeq = false, startingFrame = false;
     
 	if(device_ < 0)
 		return false;
-	tcflush(device_, TCIFLUSH);							// Flush device input
-	if(write(device_, (char*)kCommandStatus, 5) < 0) {	// Write status command
-		cout << "ERROR: unable to write status command.  errno = " << errno << endl;
+	
+	// Write the status command in turn with anything else queued. Input isn't flushed,
+	// as it may hold responses to those; they are passed on to the channel below.
+	int commandId = commandChannel_.send(kCommandStatus, 5, false);
+	if(commandChannel_.waitForCommand(commandId, millisecondsToWait) != kTouchkeyCommandAcknowledged) {
+		TOUCHKEY_LOG(kLogLevelError, "ERROR: unable to write status command.");
 		return false;
-	}	
-	tcdrain(device_);									// Force output reach device
+	}
 	
 	// Wait the specified amount of time for a response before giving up
 	gettimeofday(&startTime, 0);
@@ -146,7 +187,7 @@ bool TouchkeyDevice::checkIfDevicePresent(int millisecondsToWait) {
 
 		if(count < 0) {				// Check if an error occurred on read
 			if(errno != EAGAIN) {
-				cout << "Unable to read from device (error " << errno << ").  Aborting.\n";
+				TOUCHKEY_LOG(kLogLevelError, "Unable to read from device (error {}).  Aborting.") << errno;
 				return false;
 			}
 		}
@@ -158,8 +199,13 @@ bool TouchkeyDevice::checkIfDevicePresent(int millisecondsToWait) {
 				controlSeq = false;
 				if(ch == kControlCharacterFrameBegin)
 					startingFrame = true;
-                else
+                else {
                     startingFrame = false;
+                    if(ch == kControlCharacterAck)
+                        commandChannel_.acknowledged(true);
+                    else if(ch == kControlCharacterNak)
+                        commandChannel_.acknowledged(false);
+                }
 			}
 			else {
 				if(ch == ESCAPE_CHARACTER) {
@@ -181,7 +227,7 @@ bool TouchkeyDevice::checkIfDevicePresent(int millisecondsToWait) {
 								continue;
 							if(count < 0) {
 								if(errno != EAGAIN && verbose_ >= 1) {	// EAGAIN just means no data was available
-									cout << "Unable to read from device (error " << errno << ").  Aborting.\n";
+									TOUCHKEY_LOG(kLogLevelError, "Unable to read from device (error {}).  Aborting.") << errno;
 									return false;
 								}
 								
@@ -203,7 +249,7 @@ bool TouchkeyDevice::checkIfDevicePresent(int millisecondsToWait) {
 									}				
 								}
 								else if(ch == kControlCharacterNak && verbose_ >= 1) {
-									cout << "Warning: received NAK\n";
+									TOUCHKEY_LOG(kLogLevelWarning, "Warning: received NAK");
 								}			
 							}
 							else {
@@ -223,7 +269,7 @@ bool TouchkeyDevice::checkIfDevicePresent(int millisecondsToWait) {
 						
 						if(frameError) {
                             if(verbose_ >= 1)
-                                cout << "Warning: device present, but frame error received trying to get status.\n";
+                                TOUCHKEY_LOG(kLogLevelWarning, "Warning: device present, but frame error received trying to get status.");
 						}
 						else if(processStatusFrame(statusBuf, statusBufLength, &status)) {
 							// Clear keys present in preparation to read new list of keys
@@ -231,33 +277,37 @@ bool TouchkeyDevice::checkIfDevicePresent(int millisecondsToWait) {
 							
 							numOctaves_ = status.octaves;
                             deviceSoftwareVersion_ = status.softwareVersionMajor;
+                            
+                            // Older devices count frames in 16 bits, newer ones in 32
+                            timestampSynchronizer_.setFrameModulus(deviceSoftwareVersion_ > 0 ? 0 : 65536);
                             deviceHasRGBLEDs_ = status.hasRGBLEDs;
                             lowestKeyPresentMidiNote_ = 127;
 							
 							if(verbose_ >= 1) {
-								cout << endl << "Found Device: Hardware Version " << status.hardwareVersion;
-								cout << " Software Version " << status.softwareVersionMajor << "." << status.softwareVersionMinor;
-								cout << endl << "  " << status.octaves << " octaves connected" << endl;
+								TOUCHKEY_LOG(kLogLevelInfo, "Found Device: Hardware Version {} Software Version {}.{}") << status.hardwareVersion
+									<< status.softwareVersionMajor << status.softwareVersionMinor;
+								TOUCHKEY_LOG(kLogLevelInfo, "  {} octaves connected") << status.octaves;
 							}
 							for(int i = 0; i < status.octaves; i++) {
 								bool foundKey = false;
+								std::string keyNames;
 								
-								if(verbose_ >= 1) cout << "  Octave " << i << ": ";
 								for(int j = 0; j < 13; j++) {
 									if(status.connectedKeys[i] & (1<<j)) {
-										if(verbose_ >= 1) cout << kKeyNames[j] << " ";
+										keyNames += std::string(kKeyNames[j]) + " ";
 										keysPresent_.insert(octaveNoteToIndex(i, j));
 										foundKey = true;
                                         if(octaveKeyToMidi(i, j) < lowestKeyPresentMidiNote_)
                                             lowestKeyPresentMidiNote_ = octaveKeyToMidi(i, j);
 									}
 									else {
-										if(verbose_ >= 1) cout << "-  ";
+										keyNames += "-  ";
 									}
 
 								}
 
-								cout << endl;
+								if(verbose_ >= 1)
+									TOUCHKEY_LOG(kLogLevelInfo, "  Octave {}: {}") << i << keyNames;
 							}
                             
                             // Hardware version determines whether all keys have XY or not
@@ -287,11 +337,11 @@ bool TouchkeyDevice::checkIfDevicePresent(int millisecondsToWait) {
                             else if(lowestKeyPresentMidiNote_ == 127) // No keys found and old device software
                                 lowestKeyPresentMidiNote_ = lowestMidiNote_;
    
-                            keyboard_.setKeyboardRange(lowestKeyPresentMidiNote_, lowestMidiNote_ + 12*numOctaves_);
+                            keyboard_.setTouchkeyDeviceRange(this, lowestKeyPresentMidiNote_, lowestMidiNote_ + 12*numOctaves_);
                             calibrationInit(12*numOctaves_ + 1); // One more for the top C
 						}
 						else {
-							if(verbose_ >= 1) cout << "Warning: device present, but received invalid status frame.\n";
+							if(verbose_ >= 1) TOUCHKEY_LOG(kLogLevelWarning, "Warning: device present, but received invalid status frame.");
 							tcflush(device_, TCIOFLUSH);	// Throw away anything else in the buffer
 							return false;					// Yes... found the device
 						}
@@ -325,22 +375,35 @@ bool TouchkeyDevice::startAutoGathering() {
     ledShouldStop_ = false;
 	
 	if(verbose_ >= 1)
-		cout << "Starting auto centroid collection\n";
+		TOUCHKEY_LOG(kLogLevelInfo, "Starting auto centroid collection");
+    
+    // Throw away any frame history from a previous run and lock the frame clock
+    // back onto the keyboard's shared timeline
+    keyboard_.synchronizeToKeyboardClock(timestampSynchronizer_);
+    
+    // Apply any change to the keyboard range while no data is flowing from this device
+    keyboard_.updateKeyboardRange();
+    
+    // Counters start again with each run, as does the frame sequence on each board
+    telemetry_.reset();
+    for(int i = 0; i < kTelemetryMaxBoards; i++)
+        analogLastFrame_[i] = 0;
 	
-    // Make the thread that actually does the data collection
-	if(pthread_create(&ioThread_, NULL, staticRunLoop, (void*)this) != 0)
+    // Make the thread that actually does the data collection. From here on it reads
+    // the device, passing ACKs on to the command channel.
+    commandChannel_.setReading(false);
+	if(pthread_create(&ioThread_, NULL, staticRunLoop, (void*)this) != 0) {
+        commandChannel_.setReading(true);
 		return false;
+    }
 	if(pthread_create(&ledThread_, NULL, staticLedUpdateLoop, (void*)this) != 0)
 		return false;
 	autoGathering_ = true;
     
     // Tell the device to start scanning for new data
-	if(write(device_, (char*)kCommandStartScanning, 5) < 0) {
-		cout << "ERROR: unable to write startAutoGather command.  errno = " << errno << endl;
-	}
-	tcdrain(device_);
+	commandChannel_.send(kCommandStartScanning, 5, false);
 	
-	keyboard_.sendMessage("/touchkeys/allnotesoff", "", LO_ARGS_END);
+	sendAllNotesOff();
 	if(keyboard_.gui() != 0) {
 		// Update display: touch sensing enabled, which keys connected, no current touches
 		keyboard_.gui()->setTouchSensingEnabled(true);
@@ -362,30 +425,32 @@ void TouchkeyDevice::stopAutoGathering() {
     // Stop any calibration in progress
     calibrationAbort();	
     
-    // Tell device to stop scanning
-	if(write(device_, (char*)kCommandStopScanning, 5) < 0) {
-		cout << "ERROR: unable to write stopAutoGather command.  errno = " << errno << endl;
-	}		
-	tcdrain(device_);
+    // Tell device to stop scanning, giving it time to settle before the next command
+	commandChannel_.send(kCommandStopScanning, 5, false, 0, 0, kCommandSettleMicroseconds);
 	
     // Setting this to true tells the run loop to exit what it's doing
 	shouldStop_ = true;
     ledShouldStop_ = true;
 	
 	if(verbose_ >= 1)
-		cout << "Stopping auto centroid collection\n";
+		TOUCHKEY_LOG(kLogLevelInfo, "Stopping auto centroid collection");
 	
     // Wait for run loop thread to finish
 	pthread_join(ioThread_, NULL);
     pthread_join(ledThread_, NULL);
+    commandChannel_.setReading(true);
 	
-    // Stop any currently playing notes
-	keyboard_.sendMessage("/touchkeys/allnotesoff", "", LO_ARGS_END);
+    // Stop any currently playing notes on this device
+	sendAllNotesOff();
 	
-	// Clear touch for all keys
-	std::pair<int, int> keyboardRange = keyboard_.keyboardRange();
-	for(int i = keyboardRange.first; i <= keyboardRange.second; i++)
-		keyboard_.key(i)->touchOff(lastTimestamp_);
+	// Clear touch for all keys on this device. Other devices attached to the
+	// keyboard may still be running, so leave their keys alone.
+	keyboard_.keysMutex().lock_shared();
+	for(int i = lowestKeyPresentMidiNote_; i <= highestMidiNote(); i++) {
+        if(keyboard_.key(i) != 0)
+            keyboard_.key(i)->touchOff(lastTimestamp_);
+    }
+	keyboard_.keysMutex().unlock_shared();
 								   
 	if(keyboard_.gui() != 0) {
 		// Update display: touch sensing disabled
@@ -395,29 +460,51 @@ void TouchkeyDevice::stopAutoGathering() {
 	}
 	
 	if(verbose_ >= 2)
-		cout << "...done.\n";
+		TOUCHKEY_LOG(kLogLevelDebug, "...done.");
 
 	autoGathering_ = false;
+	
+	// The keyboard range can shrink now if this was the last device running
+	keyboard_.updateKeyboardRange();
+}
+
+// Tell listeners to stop any notes on this device's keys. /touchkeys/allnotesoff/range
+// carries the range of notes the device covers. The plain /touchkeys/allnotesoff that
+// existing listeners know is still sent, but only when no other device attached to the
+// keyboard is running, as it stops every note.
+void TouchkeyDevice::sendAllNotesOff() {
+	std::vector<TouchkeyDevice*> devices = keyboard_.touchkeyDevices();
+	bool otherDeviceRunning = false;
+	
+	for(std::vector<TouchkeyDevice*>::iterator it = devices.begin(); it != devices.end(); ++it) {
+		if(*it != this && (*it)->isAutoGathering())
+			otherDeviceRunning = true;
+	}
+	
+	if(!otherDeviceRunning)
+		keyboard_.sendMessage("/touchkeys/allnotesoff", "", LO_ARGS_END);
+	keyboard_.sendMessage("/touchkeys/allnotesoff/range", "ii", lowestKeyPresentMidiNote_, highestMidiNote(), LO_ARGS_END);
 }
 
 // Begin raw data collection from a given single key
 
 bool TouchkeyDevice::startRawDataCollection(int octave, int key, int mode, int scaler) {
-    cout << "startRawDataCollection()\n";
+    TOUCHKEY_LOG(kLogLevelDebug, "startRawDataCollection()");
     
 	if(!isOpen())
 		return false;
 	
 	stopAutoGathering();	// Stop the thread if it's running	
 	
-    cout << "preparing\n";
+    TOUCHKEY_LOG(kLogLevelDebug, "preparing");
     
 	//unsigned char command[] = {ESCAPE_CHARACTER, kControlCharacterFrameBegin,
 	//	kFrameTypeMonitorRawFromKey, (unsigned char)octave, (unsigned char)key,
     //    (unsigned char)mode, (unsigned char)scaler,
 	//	ESCAPE_CHARACTER, kControlCharacterFrameEnd};
     
-    usleep(10000);
+    // Each command is passed on to the key over I2C, which needs a moment before the next
+    // one. The channel holds off for that long after writing each.
     
     // Command to set the mode of the key
     unsigned char commandSetMode[] = {ESCAPE_CHARACTER, kControlCharacterFrameBegin,
@@ -425,12 +512,7 @@ bool TouchkeyDevice::startRawDataCollection(int octave, int key, int mode, int s
         3 /* xmit */, 0 /* response */, 0 /* command offset */, 1 /* mode */, (unsigned char)mode,
         ESCAPE_CHARACTER, kControlCharacterFrameEnd};
 	
-	if(write(device_, (char*)commandSetMode, 12) < 0) {
-		cout << "ERROR: unable to write setMode command.  errno = " << errno << endl;
-	}
-	tcdrain(device_);
-    
-    usleep(10000);
+	commandChannel_.send(commandSetMode, 12, false, 0, 0, kCommandSettleMicroseconds);
     
     // Command to set the scaler of the key
     unsigned char commandSetScaler[] = {ESCAPE_CHARACTER, kControlCharacterFrameBegin,
@@ -438,40 +520,33 @@ bool TouchkeyDevice::startRawDataCollection(int octave, int key, int mode, int s
         3 /* xmit */, 0 /* response */, 0 /* command offset */, 3 /* raw scaler */, (unsigned char)scaler,
         ESCAPE_CHARACTER, kControlCharacterFrameEnd};
 	
-	if(write(device_, (char*)commandSetScaler, 12) < 0) {
-		cout << "ERROR: unable to write setMode command.  errno = " << errno << endl;
-	}
-	tcdrain(device_);
-    
-    usleep(10000);
+	commandChannel_.send(commandSetScaler, 12, false, 0, 0, kCommandSettleMicroseconds);
     
     unsigned char commandPrepareRead[] = {ESCAPE_CHARACTER, kControlCharacterFrameBegin,
         kFrameTypeSendI2CCommand, (unsigned char)octave, (unsigned char)key,
         1 /* xmit */, 0 /* response */, 6 /* data offset */,
         ESCAPE_CHARACTER, kControlCharacterFrameEnd};
     
-	if(write(device_, (char*)commandPrepareRead, 10) < 0) {
-		cout << "ERROR: unable to write prepareRead command.  errno = " << errno << endl;
-	}
-	tcdrain(device_);
-    
-    usleep(10000);
+	commandChannel_.send(commandPrepareRead, 10, false, 0, 0, kCommandSettleMicroseconds);
     
     rawDataCurrentOctave_ = octave;
     rawDataCurrentKey_ = key;
     
 	shouldStop_ = false;
-	if(pthread_create(&ioThread_, NULL, staticRawDataRunLoop, (void*)this) != 0)
+    commandChannel_.setReading(false);
+	if(pthread_create(&ioThread_, NULL, staticRawDataRunLoop, (void*)this) != 0) {
+        commandChannel_.setReading(true);
 		return false;
+    }
 	
 	if(verbose_ >= 1)
-		cout << "Starting raw data collection from octave " << octave << ", key " << key << endl;
+		TOUCHKEY_LOG(kLogLevelInfo, "Starting raw data collection from octave {}, key {}") << octave << key;
 	
 	autoGathering_ = true;
     
-    cout << "running\n";
+    TOUCHKEY_LOG(kLogLevelDebug, "running");
 	/*if(write(device_, (char*)command, 9) < 0) {
-		cout << "ERROR: unable to write startRawDataCollection command.  errno = " << errno << endl;
+		TOUCHKEY_LOG(kLogLevelError, "ERROR: unable to write startRawDataCollection command.  errno = {}") << errno;
 	}
 	tcdrain(device_);*/
 
@@ -481,45 +556,42 @@ bool TouchkeyDevice::startRawDataCollection(int octave, int key, int mode, int s
 	return true;
 }
 
-// Set the scan interval in milliseconds.  Returns true on success.
+// Set the scan interval in milliseconds.  Returns the ID of the queued command, or 0
+// if it couldn't be sent.
 
-bool TouchkeyDevice::setScanInterval(int intervalMilliseconds) {
+int TouchkeyDevice::setScanInterval(int intervalMilliseconds, TouchkeyCommandCallback callback, void *userData) {
 	if(!isOpen())
-		return false;	
+		return 0;	
 	if(intervalMilliseconds <= 0 || intervalMilliseconds > 255)
-		return false;
+		return 0;
 	
 	unsigned char command[] = {ESCAPE_CHARACTER, kControlCharacterFrameBegin,
 		kFrameTypeScanRate, (unsigned char)(intervalMilliseconds & 0xFF), ESCAPE_CHARACTER, kControlCharacterFrameEnd};
 	
-	// Send command
-	if(write(device_, (char*)command, 6) < 0) {
-		cout << "ERROR: unable to write startRawDataCollection command.  errno = " << errno << endl;
-	}
-	tcdrain(device_);
+	// Queue command; the result arrives with the ACK or NAK
+	int commandId = commandChannel_.send(command, 6, true, callback, userData);
 	
 	if(verbose_ >= 2)
-		cout << "Setting scan interval to " << intervalMilliseconds << endl;
+		TOUCHKEY_LOG(kLogLevelDebug, "Setting scan interval to {}") << intervalMilliseconds;
 	
-	// Return value depends on ACK or NAK received
-	return checkForAck(250);
+	return commandId;
 }
 
 // Key parameters.  Setting octave or key to -1 means all octaves or all keys, respectively.
 // This controls the sensitivity of the capacitive touch sensing system on each key.
 // It is a balance between achieving the best range of data and not saturating the sensors
 // for the largest touches.
-bool TouchkeyDevice::setKeySensitivity(int octave, int key, int value) {
+int TouchkeyDevice::setKeySensitivity(int octave, int key, int value, TouchkeyCommandCallback callback, void *userData) {
 	unsigned char chOctave, chKey, chVal;
 	
 	if(!isOpen())
-		return false;
+		return 0;
 	if(octave > 255)
-		return false;
+		return 0;
 	if(key > 12)
-		return false;
+		return 0;
 	if(value > 255 || value < 0)
-		return false;
+		return 0;
 	if(octave < 0)
 		chOctave = 0xFF;
 	else 
@@ -533,32 +605,28 @@ bool TouchkeyDevice::setKeySensitivity(int octave, int key, int value) {
 	unsigned char command[] = {ESCAPE_CHARACTER, kControlCharacterFrameBegin, kFrameTypeSensitivity,
 		chOctave, chKey, chVal, ESCAPE_CHARACTER, kControlCharacterFrameEnd};
 	
-	// Send command
-	if(write(device_, (char*)command, 8) < 0) {
-		cout << "ERROR: unable to write setKeySensitivity command.  errno = " << errno << endl;
-	}
-	tcdrain(device_);
+	// Queue command; the result arrives with the ACK or NAK
+	int commandId = commandChannel_.send(command, 8, true, callback, userData);
 	
 	if(verbose_ >= 2)
-		cout << "Setting sensitivity to " << value << endl;
+		TOUCHKEY_LOG(kLogLevelDebug, "Setting sensitivity to {}") << value;
 	
-	// Return value depends on ACK or NAK received
-	return checkForAck(250);	
+	return commandId;
 }
 
 // Change how the calculated centroids are scaled to fit in a single byte. They
 // will be right-shifted by the indicated number of bits before being transmitted.
-bool TouchkeyDevice::setKeyCentroidScaler(int octave, int key, int value) {
+int TouchkeyDevice::setKeyCentroidScaler(int octave, int key, int value, TouchkeyCommandCallback callback, void *userData) {
 	unsigned char chOctave, chKey, chVal;
 	
 	if(!isOpen())
-		return false;	
+		return 0;	
 	if(octave > 255)
-		return false;
+		return 0;
 	if(key > 12)
-		return false;
+		return 0;
 	if(value > 7 || value < 0)
-		return false;
+		return 0;
 	if(octave < 0)
 		chOctave = 0xFF;
 	else 
@@ -572,32 +640,28 @@ bool TouchkeyDevice::setKeyCentroidScaler(int octave, int key, int value) {
 	unsigned char command[] = {ESCAPE_CHARACTER, kControlCharacterFrameBegin, kFrameTypeSizeScaler,
 		chOctave, chKey, chVal, ESCAPE_CHARACTER, kControlCharacterFrameEnd};
 	
-	// Send command
-	if(write(device_, (char*)command, 8) < 0) {
-		cout << "ERROR: unable to write setKeyCentroidScaler command.  errno = " << errno << endl;
-	}
-	tcdrain(device_);
+	// Queue command; the result arrives with the ACK or NAK
+	int commandId = commandChannel_.send(command, 8, true, callback, userData);
 	
 	if(verbose_ >= 2)
-		cout << "Setting size scaler to " << value << endl;
+		TOUCHKEY_LOG(kLogLevelDebug, "Setting size scaler to {}") << value;
 	
-	// Return value depends on ACK or NAK received
-	return checkForAck(250);
+	return commandId;
 }
 
 // Set the minimum size of a centroid calculated on the key which is considered
 // "real" and not noise.
-bool TouchkeyDevice::setKeyMinimumCentroidSize(int octave, int key, int value) {
+int TouchkeyDevice::setKeyMinimumCentroidSize(int octave, int key, int value, TouchkeyCommandCallback callback, void *userData) {
 	unsigned char chOctave, chKey, chValHi, chValLo;
 	
 	if(!isOpen())
-		return false;	
+		return 0;	
 	if(octave > 255)
-		return false;
+		return 0;
 	if(key > 12)
-		return false;
+		return 0;
 	if(value > 0xFFFF || value < 0)
-		return false;
+		return 0;
 	if(octave < 0)
 		chOctave = 0xFF;
 	else 
@@ -612,30 +676,26 @@ bool TouchkeyDevice::setKeyMinimumCentroidSize(int octave, int key, int value) {
 	unsigned char command[] = {ESCAPE_CHARACTER, kControlCharacterFrameBegin, kFrameTypeMinimumSize,
 		chOctave, chKey, chValHi, chValLo, ESCAPE_CHARACTER, kControlCharacterFrameEnd};
 	
-	// Send command
-	if(write(device_, (char*)command, 9) < 0) {
-		cout << "ERROR: unable to write setKeyMinimumCentroidSize command.  errno = " << errno << endl;
-	}
-	tcdrain(device_);
+	// Queue command; the result arrives with the ACK or NAK
+	int commandId = commandChannel_.send(command, 9, true, callback, userData);
 	
 	if(verbose_ >= 2)
-		cout << "Setting minimum centroid size to " << value << endl;
+		TOUCHKEY_LOG(kLogLevelDebug, "Setting minimum centroid size to {}") << value;
 	
-	// Return value depends on ACK or NAK received
-	return checkForAck(250);	
+	return commandId;
 }
 
 // Set the noise threshold for individual sensor pads: the reading must exceed
 // the background value by this amount to be considered an actual touch.
-bool TouchkeyDevice::setKeyNoiseThreshold(int octave, int key, int value) {
+int TouchkeyDevice::setKeyNoiseThreshold(int octave, int key, int value, TouchkeyCommandCallback callback, void *userData) {
 	unsigned char chOctave, chKey, chVal;
 	
 	if(octave > 255)
-		return false;
+		return 0;
 	if(key > 12)
-		return false;
+		return 0;
 	if(value > 255 || value < 0)
-		return false;
+		return 0;
 	if(octave < 0)
 		chOctave = 0xFF;
 	else 
@@ -649,34 +709,30 @@ bool TouchkeyDevice::setKeyNoiseThreshold(int octave, int key, int value) {
 	unsigned char command[] = {ESCAPE_CHARACTER, kControlCharacterFrameBegin, kFrameTypeNoiseThreshold,
 		chOctave, chKey, chVal, ESCAPE_CHARACTER, kControlCharacterFrameEnd};
 	
-	// Send command
-	if(write(device_, (char*)command, 8) < 0) {
-		cout << "ERROR: unable to write setKeyNoiseThreshold command.  errno = " << errno << endl;
-	}
-	tcdrain(device_);
+	// Queue command; the result arrives with the ACK or NAK
+	int commandId = commandChannel_.send(command, 8, true, callback, userData);
 	
 	if(verbose_ >= 2)
-		cout << "Setting noise threshold to " << value << endl;
+		TOUCHKEY_LOG(kLogLevelDebug, "Setting noise threshold to {}") << value;
 	
-	// Return value depends on ACK or NAK received
-	return checkForAck(250);	
+	return commandId;
 }
 
 // Set the LED color for the given MIDI note (if RGB LEDs are present). This method
-// does not directly communicate with the device, but it schedules an update to take
-// place in the relevant thread.
+// does not directly communicate with the device. It records the latest colour for the
+// key, which the LED thread sends on its next frame. Safe to call from any thread.
 void TouchkeyDevice::rgbledSetColor(const int midiNote, const float red, const float green, const float blue) {
-    RGBLEDUpdate updateStructure;
-    
-    updateStructure.allLedsOff = false;
-    updateStructure.midiNote = midiNote;
+    if(midiNote < 0 || midiNote >= kRGBLEDNumberOfNotes)
+        return;
     
-    // Convert 0-1 floating point range to 0-255
-    updateStructure.red = (int)(red * 4095.0);
-    updateStructure.green = (int)(green * 4095.0);
-    updateStructure.blue = (int)(blue * 4095.0);
+    // Convert 0-1 floating point range to 0-4095
+    boost::uint64_t r = (boost::uint64_t)(red < 0 ? 0 : (red > 1.0 ? 1.0 : red) * 4095.0);
+    boost::uint64_t g = (boost::uint64_t)(green < 0 ? 0 : (green > 1.0 ? 1.0 : green) * 4095.0);
+    boost::uint64_t b = (boost::uint64_t)(blue < 0 ? 0 : (blue > 1.0 ? 1.0 : blue) * 4095.0);
     
-    ledUpdateQueue_.push_front(updateStructure);
+    ledRequestedColors_[midiNote].store((r << 24) | (g << 12) | b, boost::memory_order_relaxed);
+    ledDirtyMask_[midiNote / 64].fetch_or((boost::uint64_t)1 << (midiNote % 64), boost::memory_order_release);
+    ledRequestCount_.fetch_add(1, boost::memory_order_relaxed);
 }
 
 // Same as rgbledSetColor() but uses HSV format color instead of RGB
@@ -724,86 +780,238 @@ void TouchkeyDevice::rgbledSetColorHSV(const int midiNote, const float hue, cons
 
 // Set all RGB LEDs off (if RGB LEDs are present). This method does not
 // directly communicate with the device, but it schedules an update to take
-// place in the relevant thread.
+// place in the relevant thread. Colours set after this call are sent after
+// the all-off command.
 void TouchkeyDevice::rgbledAllOff() {
-    RGBLEDUpdate updateStructure;
+    for(int i = 0; i < kRGBLEDNumberOfNotes; i++)
+        ledRequestedColors_[i].store(0, boost::memory_order_relaxed);
+    ledAllOffRequested_.store(true, boost::memory_order_release);
+    ledRequestCount_.fetch_add(1, boost::memory_order_relaxed);
+}
+
+// Set how many LED frames per second are sent to the device. Changes to any
+// key in between frames are coalesced so only the latest colour goes out.
+void TouchkeyDevice::setRGBLEDFrameRate(int framesPerSecond) {
+    if(framesPerSecond < 1)
+        framesPerSecond = 1;
+    if(framesPerSecond > 1000)
+        framesPerSecond = 1000;
+    ledUpdateIntervalMicroseconds_ = 1000000 / framesPerSecond;
+}
+
+// Set how many LEDs are packed into each kFrameTypeRGBLEDSetColors frame. 1 gives
+// one frame per LED for controllers that only accept a single entry.
+void TouchkeyDevice::setRGBLEDMaxUpdatesPerFrame(int updates) {
+    if(updates < 1)
+        updates = 1;
+    if(updates > kRGBLEDMaxUpdatesPerFrame)
+        updates = kRGBLEDMaxUpdatesPerFrame;
+    ledMaxUpdatesPerFrame_ = updates;
+}
+
+// Return the current state of the LED pipeline
+TouchkeyDevice::RGBLEDStatistics TouchkeyDevice::rgbledStatistics() {
+    RGBLEDStatistics stats;
     
-    updateStructure.allLedsOff = true;
-    updateStructure.midiNote = 0;
-    updateStructure.red = 0;
-    updateStructure.green = 0;
-    updateStructure.blue = 0;
+    stats.pendingUpdates = 0;
+    for(int i = 0; i < kRGBLEDNumberOfNotes / 64; i++) {
+        boost::uint64_t dirty = ledDirtyMask_[i].load(boost::memory_order_relaxed);
+        while(dirty != 0) {
+            dirty &= dirty - 1;
+            stats.pendingUpdates++;
+        }
+    }
+    stats.requests = ledRequestCount_.load(boost::memory_order_relaxed);
+    stats.updatesSent = ledUpdatesSentCount_.load(boost::memory_order_relaxed);
+    stats.framesSent = ledFramesSentCount_.load(boost::memory_order_relaxed);
+    stats.updatesPerSecond = ledUpdatesPerSecond_;
+    stats.framesPerSecond = ledFramesPerSecond_;
     
-    ledUpdateQueue_.push_front(updateStructure);
+    return stats;
 }
 
 // Set the color of a given RGB LED (piano scanner boards only). LEDs are numbered from 0-24
 // starting at left. Boards are numbered 0-3 starting at left.
 bool TouchkeyDevice::internalRGBLEDSetColor(const int device, const int led, const int red, const int green, const int blue) {
+    RGBLEDUpdate update;
+    
+    update.board = device;
+    update.led = led;
+    update.red = red;
+    update.green = green;
+    update.blue = blue;
+    
+    return internalRGBLEDSetColors(&update, 1);
+}
+
+// Set the color of several RGB LEDs in a single frame. Each LED takes 6 bytes:
+// board and LED number, then 12 bits each of red, green and blue. The frame is
+// queued on the command channel; the callback, if given, hears whether it was ACKed.
+bool TouchkeyDevice::internalRGBLEDSetColors(const RGBLEDUpdate* updates, const int count,
+                                             TouchkeyCommandCallback callback, void *userData) {
 	if(!isOpen())
 		return false;
     if(!deviceHasRGBLEDs_)
         return false;
-    if(device < 0 || device > 3)
+    if(count < 1 || count > kRGBLEDMaxUpdatesPerFrame)
         return false;
-    if(led < 0 || led > 24)
-        return false;
-    if(red < 0 || red > 4095)
-        return false;
-    if(green < 0 || green > 4095)
-        return false;
-    if(blue < 0 || blue > 4095)
-        return false;
-    
-    unsigned char command[17]; // 11 bytes + possibly 6 doubled characters
     
-    // There's a chance that one of the bytes will come out to ESCAPE_CHARACTER (0xFE) depending
-    // on LED color. We need to double up any bytes that come in that way.
+    // 5 bytes of framing + each data byte possibly doubled
+    unsigned char command[5 + 2 * kRGBLEDBytesPerUpdate * kRGBLEDMaxUpdatesPerFrame];
     
     command[0] = ESCAPE_CHARACTER;
     command[1] = kControlCharacterFrameBegin;
     command[2] = kFrameTypeRGBLEDSetColors;
     
-    int byte, location = 3;
-    
-    byte = (((unsigned char)device & 0xFF) << 6) | (unsigned char)led;
-    command[location++] = byte;
-    if(byte == ESCAPE_CHARACTER)
-        command[location++] = byte;
-    byte = (red >> 4) & 0xFF;
-    command[location++] = byte;
-    if(byte == ESCAPE_CHARACTER)
-        command[location++] = byte;
-    byte = ((red << 4) & 0xF0) | ((green >> 8) & 0x0F);
-    command[location++] = byte;
-    if(byte == ESCAPE_CHARACTER)
-        command[location++] = byte;
-    byte = (green & 0xFF);
-    command[location++] = byte;
-    if(byte == ESCAPE_CHARACTER)
-        command[location++] = byte;
-    byte = (blue >> 4) & 0xFF;
-    command[location++] = byte;
-    if(byte == ESCAPE_CHARACTER)
-        command[location++] = byte;
-    byte = (blue << 4) & 0xF0;
-    command[location++] = byte;
-    if(byte == ESCAPE_CHARACTER)
-        command[location++] = byte;
+    int location = 3, sent = 0;
+    
+    for(int i = 0; i < count; i++) {
+        const RGBLEDUpdate& u = updates[i];
+        
+        if(u.board < 0 || u.board > 3)
+            continue;
+        if(u.led < 0 || u.led > 24)
+            continue;
+        if(u.red < 0 || u.red > 4095 || u.green < 0 || u.green > 4095 || u.blue < 0 || u.blue > 4095)
+            continue;
+        
+        unsigned char bytes[kRGBLEDBytesPerUpdate];
+        
+        bytes[0] = (((unsigned char)u.board & 0xFF) << 6) | (unsigned char)u.led;
+        bytes[1] = (u.red >> 4) & 0xFF;
+        bytes[2] = ((u.red << 4) & 0xF0) | ((u.green >> 8) & 0x0F);
+        bytes[3] = (u.green & 0xFF);
+        bytes[4] = (u.blue >> 4) & 0xFF;
+        bytes[5] = (u.blue << 4) & 0xF0;
+        
+        // There's a chance that one of the bytes will come out to ESCAPE_CHARACTER (0xFE) depending
+        // on LED color. We need to double up any bytes that come in that way.
+        for(int j = 0; j < kRGBLEDBytesPerUpdate; j++) {
+            command[location++] = bytes[j];
+            if(bytes[j] == ESCAPE_CHARACTER)
+                command[location++] = bytes[j];
+        }
+        sent++;
+        
+        if(verbose_ >= 3)
+            TOUCHKEY_LOG(kLogLevelTrace, "Setting RGB LED color for device {}, led {}") << u.board << u.led;
+    }
+    
+    if(sent == 0)
+        return false;
+    
     command[location++] = ESCAPE_CHARACTER;
     command[location++] = kControlCharacterFrameEnd;
     
-	// Send command
-	if(write(device_, (char*)command, location) < 0) {
-		cout << "ERROR: unable to write setRGBLEDColor command.  errno = " << errno << endl;
-	}
-	tcdrain(device_);
-	
-	if(verbose_ >= 3)
-		cout << "Setting RGB LED color for device " << device << ", led " << led << endl;
+	// Queue command; the device answers with ACK or NAK
+	if(commandChannel_.send(command, location, true, callback, userData) == 0)
+        return false;
+    
+    ledUpdatesSentCount_.fetch_add(sent, boost::memory_order_relaxed);
+    ledFramesSentCount_.fetch_add(1, boost::memory_order_relaxed);
+    
+	return true;
+}
+
+// Send every key whose colour has changed since the last call, packing as many
+// as allowed into each frame. Called from the LED thread. Returns the number of
+// LEDs updated.
+int TouchkeyDevice::internalRGBLEDSendPending() {
+    RGBLEDUpdate updates[kRGBLEDMaxUpdatesPerFrame];
+    int notes[kRGBLEDMaxUpdatesPerFrame];
+    boost::uint64_t colors[kRGBLEDMaxUpdatesPerFrame];
+    int count = 0, sent = 0;
+    
+    if(ledAllOffRequested_.exchange(false, boost::memory_order_acquire)) {
+        internalRGBLEDAllOff();
+        for(int i = 0; i < kRGBLEDNumberOfNotes; i++)
+            ledSentColors_[i] = 0;
+    }
+    
+    for(int word = 0; word < kRGBLEDNumberOfNotes / 64; word++) {
+        // Keys whose last frame wasn't ACKed are in an unknown state: send them again
+        boost::uint64_t resend = ledResendMask_[word].exchange(0, boost::memory_order_acquire);
+        for(boost::uint64_t bits = resend; bits != 0; bits &= bits - 1)
+            ledSentColors_[word * 64 + __builtin_ctzll(bits)] = kRGBLEDColorUnknown;
         
-	// Return value depends on ACK or NAK received
-	return true; //checkForAck(20);
+        boost::uint64_t dirty = ledDirtyMask_[word].exchange(0, boost::memory_order_acquire) | resend;
+        
+        while(dirty != 0) {
+            int midiNote = word * 64 + __builtin_ctzll(dirty);
+            dirty &= dirty - 1;
+            
+            // Skip keys which changed and changed back since the last frame
+            boost::uint64_t color = ledRequestedColors_[midiNote].load(boost::memory_order_relaxed);
+            if(color == ledSentColors_[midiNote])
+                continue;
+            
+            // Convert MIDI note number to board/LED pair. If valid, send to device.
+            int board = internalRGBLEDMIDIToBoardNumber(midiNote);
+            int led = internalRGBLEDMIDIToLEDNumber(midiNote);
+            if(board < 0 || board > 3 || led < 0)
+                continue;
+            
+            updates[count].board = board;
+            updates[count].led = led;
+            updates[count].red = (int)((color >> 24) & 0xFFF);
+            updates[count].green = (int)((color >> 12) & 0xFFF);
+            updates[count].blue = (int)(color & 0xFFF);
+            notes[count] = midiNote;
+            colors[count] = color;
+            
+            if(++count >= ledMaxUpdatesPerFrame_) {
+                sent += internalRGBLEDCommitSent(updates, notes, colors, count);
+                count = 0;
+            }
+        }
+    }
+    
+    if(count > 0)
+        sent += internalRGBLEDCommitSent(updates, notes, colors, count);
+    
+    return sent;
+}
+
+// Queue one frame of LED updates. The colours count as sent once the frame is queued;
+// if it is never ACKed, internalRGBLEDFrameDone() has the keys sent again. If the frame
+// can't be queued, or too many are still outstanding, the keys are marked changed again
+// so the next frame retries them.
+int TouchkeyDevice::internalRGBLEDCommitSent(const RGBLEDUpdate* updates, const int* notes,
+                                             const boost::uint64_t* colors, const int count) {
+    RGBLEDFrame& frame = ledFrames_[ledNextFrame_];
+    
+    if(!frame.inFlight.load(boost::memory_order_acquire)) {
+        frame.count = count;
+        for(int i = 0; i < count; i++)
+            frame.notes[i] = notes[i];
+        frame.inFlight.store(true, boost::memory_order_relaxed);
+        
+        if(internalRGBLEDSetColors(updates, count, internalRGBLEDFrameDone, &frame)) {
+            for(int i = 0; i < count; i++)
+                ledSentColors_[notes[i]] = colors[i];
+            ledNextFrame_ = (ledNextFrame_ + 1) % kRGBLEDFramesInFlight;
+            return count;
+        }
+        frame.inFlight.store(false, boost::memory_order_relaxed);
+    }
+    
+    for(int i = 0; i < count; i++)
+        ledDirtyMask_[notes[i] / 64].fetch_or(1ULL << (notes[i] % 64), boost::memory_order_release);
+    return 0;
+}
+
+// A frame of LED updates has been answered, or failed. Called on the command channel
+// or I/O thread, so the keys are only flagged here for the LED thread to resend.
+void TouchkeyDevice::internalRGBLEDFrameDone(int commandId, int result, void *userData) {
+    RGBLEDFrame *frame = (RGBLEDFrame*)userData;
+    
+    if(result != kTouchkeyCommandAcknowledged) {
+        for(int i = 0; i < frame->count; i++) {
+            int note = frame->notes[i];
+            frame->device->ledResendMask_[note / 64].fetch_or(1ULL << (note % 64), boost::memory_order_release);
+        }
+    }
+    frame->inFlight.store(false, boost::memory_order_release);
 }
 
 // Turn off all RGB LEDs on a given board
@@ -821,17 +1029,14 @@ bool TouchkeyDevice::internalRGBLEDAllOff() {
     command[3] = ESCAPE_CHARACTER;
     command[4] = kControlCharacterFrameEnd;
 	
-	// Send command
-	if(write(device_, (char*)command, 5) < 0) {
-		cout << "ERROR: unable to write setRGBLEDAllOff command.  errno = " << errno << endl;
-	}
-	tcdrain(device_);
+	// Queue command; the device answers with ACK or NAK
+	if(commandChannel_.send(command, 5, true) == 0)
+        return false;
 	
 	if(verbose_ >= 3)
-		cout << "Turning off all RGB LEDs" << endl;
+		TOUCHKEY_LOG(kLogLevelTrace, "Turning off all RGB LEDs");
     
-	// Return value depends on ACK or NAK received
-	return true; //checkForAck(20);
+	return true;
 }
 
 // Get board number for MIDI note
@@ -898,6 +1103,9 @@ void TouchkeyDevice::calibrationStart(std::vector<int>* keysToCalibrate) {
 	}
 	
 	calibrationInProgress_ = true;
+    calibrationPublishTable();
+    if(driftTracker_ != 0)
+        driftTracker_->reset();
 }
 
 // Finish the current calibration in progress.  Pass it on to all Calibrators, and the ones that weren't
@@ -918,6 +1126,11 @@ void TouchkeyDevice::calibrationFinish() {
 	
 	calibrationInProgress_ = false;
 	isCalibrated_ = calibratedAtLeastOneKey;
+    calibrationPublishTable();
+    
+    // Drift is measured from the new quiescent values from here on
+    if(driftTracker_ != 0)
+        driftTracker_->reset();
 }
 
 // Abort a calibration in progress, without saving its results. Pass it on to all Calibrators.
@@ -926,6 +1139,7 @@ void TouchkeyDevice::calibrationAbort() {
 		keyCalibrators_[i]->calibrationAbort();
 	
 	calibrationInProgress_ = false;
+    calibrationPublishTable();
 }
 
 // Clear the existing calibration, reverting to an uncalibrated state.
@@ -939,6 +1153,53 @@ void TouchkeyDevice::calibrationClear() {
 
 	calibrationInProgress_ = false;
 	isCalibrated_ = false;
+    calibrationPublishTable();
+    if(driftTracker_ != 0)
+        driftTracker_->reset();
+}
+
+// Start capturing warp table data on selected keys, or all keys if the argument is NULL
+void TouchkeyDevice::calibrationWarpStart(std::vector<int>* keysToCalibrate) {
+	if(keysToCalibrate == 0) {
+		for(int i = 0; i < keyCalibratorsLength_; i++)
+			keyCalibrators_[i]->warpCaptureStart();
+	}
+	else {
+		std::vector<int>::iterator it;
+		for(it = keysToCalibrate->begin(); it != keysToCalibrate->end(); it++) {
+			if(*it >= 0 && *it < keyCalibratorsLength_)
+				keyCalibrators_[*it]->warpCaptureStart();
+		}
+	}
+    
+    calibrationPublishTable();
+}
+
+// Fit warp tables from the data captured. Keys without enough data keep their old table.
+int TouchkeyDevice::calibrationWarpFinish() {
+    int keysWarped = 0;
+    
+	for(int i = 0; i < keyCalibratorsLength_; i++) {
+		if(keyCalibrators_[i]->warpCaptureInProgress() && keyCalibrators_[i]->warpCaptureFinish())
+            keysWarped++;
+    }
+    
+    calibrationPublishTable();
+    return keysWarped;
+}
+
+// Stop capturing warp table data without using it
+void TouchkeyDevice::calibrationWarpAbort() {
+	for(int i = 0; i < keyCalibratorsLength_; i++)
+		keyCalibrators_[i]->warpCaptureAbort();
+    calibrationPublishTable();
+}
+
+// Remove all warp tables, going back to linear calibration
+void TouchkeyDevice::calibrationWarpClear() {
+	for(int i = 0; i < keyCalibratorsLength_; i++)
+		keyCalibrators_[i]->warpTableClear();
+    calibrationPublishTable();
 }
 
 // Save calibration data to a file
@@ -946,7 +1207,7 @@ bool TouchkeyDevice::calibrationSaveToFile(std::string const& filename) {
 	int i;
 	
 	if(!isCalibrated()) {
-		std::cerr << "TouchKeys not calibrated, so can't save calibration data.\n";
+		TOUCHKEY_LOG(kLogLevelError, "TouchKeys not calibrated, so can't save calibration data.");
 		return false;
 	}
 	
@@ -967,7 +1228,7 @@ bool TouchkeyDevice::calibrationSaveToFile(std::string const& filename) {
 		}
 		
 		if(!savedValidData) {
-			std::cerr << "TouchkeyDevice: unable to find valid calibration data to save.\n";
+			TOUCHKEY_LOG(kLogLevelError, "TouchkeyDevice: unable to find valid calibration data to save.");
 			throw 1;
 		}
 		
@@ -975,7 +1236,7 @@ bool TouchkeyDevice::calibrationSaveToFile(std::string const& filename) {
 		TiXmlDocument doc;
 		doc.InsertEndChild(baseElement);
 		if(!doc.SaveFile(filename)) {
-			std::cerr << "TouchkeyDevice: could not write calibration file " << filename << "\n";
+			TOUCHKEY_LOG(kLogLevelError, "TouchkeyDevice: could not write calibration file {}") << filename;
 			throw 1;
 		}
 		
@@ -1000,22 +1261,22 @@ bool TouchkeyDevice::calibrationLoadFromFile(std::string const& filename) {
 		TiXmlElement *baseElement, *calibratorElement;
 		
 		if(!doc.LoadFile()) {
-			std::cerr << "TouchkeyDevice: unable to load patch table file: \"" << filename << "\". Error was:\n";
-			std::cerr << doc.ErrorDesc() << " (Row " << doc.ErrorRow() << ", Col " << doc.ErrorCol() << ")\n";
+			TOUCHKEY_LOG(kLogLevelError, "TouchkeyDevice: unable to load patch table file: \"{}\". Error was:") << filename;
+			TOUCHKEY_LOG(kLogLevelError, "{} (Row {}, Col {})") << doc.ErrorDesc() << doc.ErrorRow() << doc.ErrorCol();
 			throw 1;
 		}
 		
 		// All calibration data is encapsulated within the root element <PianoBarCalibration>
 		baseElement = doc.FirstChildElement("TouchkeyDeviceCalibration");
 		if(baseElement == NULL) {
-			std::cerr << "TouchkeyDevice: malformed calibration file, aborting.\n";
+			TOUCHKEY_LOG(kLogLevelError, "TouchkeyDevice: malformed calibration file, aborting.");
 			throw 1;
 		}
 		
 		// Go through and find each key's calibration information
 		calibratorElement = baseElement->FirstChildElement("Key");
 		if(calibratorElement == NULL) {
-			std::cerr << "TouchkeyDevice: warning: no keys found\n";
+			TOUCHKEY_LOG(kLogLevelWarning, "TouchkeyDevice: warning: no keys found");
 		}
 		else {
 			while(calibratorElement != NULL) {
@@ -1029,22 +1290,144 @@ bool TouchkeyDevice::calibrationLoadFromFile(std::string const& filename) {
 			}
 		}
         
-        calibrationInProgress_ = false;
-        isCalibrated_ = true;
-        if(keyboard_.gui() != 0) {
-            for(int i = lowestMidiNote_; i <  lowestMidiNote_ + 12*numOctaves_; i++) {
-                keyboard_.gui()->setAnalogCalibrationStatusForKey(i, true);
-            }
-        }
 		//lastCalibrationFile_ = filename;
 	}
 	catch(...) {
 		return false;
 	}
 	
+    return calibrationLoaded();
+}
+
+// Save the current calibration under a name in a snapshot file, keeping the
+// file's other calibrations
+bool TouchkeyDevice::calibrationSaveSnapshot(std::string const& filename, std::string const& name) {
+	if(!isCalibrated()) {
+		TOUCHKEY_LOG(kLogLevelError, "TouchKeys not calibrated, so can't save calibration data.");
+		return false;
+	}
+    if(name.empty() || name.length() >= (size_t)kCalibrationSnapshotNameLength) {
+        TOUCHKEY_LOG(kLogLevelError, "TouchkeyDevice: invalid calibration name \"{}\"") << name;
+        return false;
+    }
+    
+    // Start from whatever is in the file already
+    std::vector<PianoKeyCalibrationSnapshot::Calibration> calibrations;
+    PianoKeyCalibrationSnapshot existing;
+    if(existing.open(filename))
+        existing.readAll(calibrations);
+    existing.close();
+    
+    PianoKeyCalibrationSnapshot::Calibration calibration;
+    calibration.name = name;
+    calibration.keys.resize(keyCalibratorsLength_);
+    for(int i = 0; i < keyCalibratorsLength_; i++) {
+        CalibrationSnapshotKey& key = calibration.keys[i];
+        
+        memset(&key, 0, sizeof(key));
+        key.status = keyCalibrators_[i]->calibrationValues(key.quiescent, key.press);
+        if(keyCalibrators_[i]->warpTableValues(key.warp))
+            key.flags |= kCalibrationSnapshotKeyHasWarp;
+    }
+    
+    bool replaced = false;
+    for(unsigned int i = 0; i < calibrations.size(); i++) {
+        if(calibrations[i].name == name) {
+            calibrations[i] = calibration;
+            replaced = true;
+        }
+    }
+    if(!replaced)
+        calibrations.push_back(calibration);
+    
+    if(!PianoKeyCalibrationSnapshot::write(filename, calibrations))
+        return false;
+    
+    // Pick up the new contents if this is the file we have open
+    if(calibrationSnapshot_.isOpen() && calibrationSnapshot_.filename() == filename)
+        calibrationSnapshot_.open(filename);
+    return true;
+}
+
+// Open a snapshot file and apply one of its calibrations
+bool TouchkeyDevice::calibrationLoadSnapshot(std::string const& filename, std::string const& name) {
+    if(!calibrationSnapshot_.open(filename)) {
+        TOUCHKEY_LOG(kLogLevelWarning, "TouchkeyDevice: unable to load calibration snapshot {}") << filename;
+        return false;
+    }
+    if(name.empty())
+        return calibrationApplySnapshot(0);
+    return calibrationSelectSnapshot(name);
+}
+
+// Switch to another calibration from the open snapshot file
+bool TouchkeyDevice::calibrationSelectSnapshot(std::string const& name) {
+    int index = calibrationSnapshot_.find(name);
+    
+    if(index < 0) {
+        TOUCHKEY_LOG(kLogLevelWarning, "TouchkeyDevice: no calibration \"{}\" in snapshot") << name;
+        return false;
+    }
+    return calibrationApplySnapshot(index);
+}
+
+// Names of the calibrations in the open snapshot file
+std::vector<std::string> TouchkeyDevice::calibrationSnapshotNames() {
+    std::vector<std::string> names;
+    
+    for(int i = 0; i < calibrationSnapshot_.count(); i++)
+        names.push_back(calibrationSnapshot_.name(i));
+    return names;
+}
+
+// Copy a calibration from the snapshot into the calibrators. The records were
+// checked when the file was opened, so this is only a copy.
+bool TouchkeyDevice::calibrationApplySnapshot(int index) {
+    int keyCount;
+    const CalibrationSnapshotKey *keys = calibrationSnapshot_.keys(index, keyCount);
+    
+    if(keys == 0 || keyCalibrators_ == 0)
+        return false;
+    if(keyCount != keyCalibratorsLength_)
+        TOUCHKEY_LOG(kLogLevelWarning, "TouchkeyDevice: snapshot \"{}\" has {} keys; device has {}") << calibrationSnapshot_.name(index)
+            << keyCount << keyCalibratorsLength_;
+    
+    // The data thread only sees the published table, so the calibrators can be
+    // filled in first and the whole calibration made live in one go
+    for(int i = 0; i < keyCalibratorsLength_; i++) {
+        keyCalibrators_[i]->calibrationClear();
+        if(i >= keyCount || keys[i].status != kPianoKeyCalibrated)
+            continue;
+        keyCalibrators_[i]->loadValues(keys[i].quiescent, keys[i].press,
+                                       (keys[i].flags & kCalibrationSnapshotKeyHasWarp) ? keys[i].warp : 0);
+    }
+    
+    return calibrationLoaded();
+}
+
+// Common to all ways of loading a calibration: find which keys are calibrated and
+// make the new values live. Returns whether any key was calibrated.
+bool TouchkeyDevice::calibrationLoaded() {
+    bool calibratedAtLeastOneKey = false;
+    
+    for(int i = 0; i < keyCalibratorsLength_; i++) {
+        int quiescent, press;
+        bool calibrated = (keyCalibrators_[i]->calibrationValues(quiescent, press) == kPianoKeyCalibrated);
+        
+        if(calibrated)
+            calibratedAtLeastOneKey = true;
+        if(keyboard_.gui() != 0)
+            keyboard_.gui()->setAnalogCalibrationStatusForKey(i + lowestMidiNote_, calibrated);
+    }
+    
+    calibrationInProgress_ = false;
+    isCalibrated_ = calibratedAtLeastOneKey;
+    calibrationPublishTable();
+    if(driftTracker_ != 0)
+        driftTracker_->reset();
+    
 	// TODO: reset key states?
-	
-	return true;
+    return calibratedAtLeastOneKey;
 }
 
 // Initialize the calibrators
@@ -1062,6 +1445,10 @@ void TouchkeyDevice::calibrationInit(int numberOfCalibrators) {
 		keyCalibrators_[i] = new PianoKeyCalibrator(true, 0);
 	}
     
+    driftTracker_ = new QuiescentDriftTracker(keyCalibratorsLength_);
+    if(driftTrackingEnabled_)
+        driftTracker_->start();
+    
     calibrationClear();
 }
 
@@ -1070,6 +1457,15 @@ void TouchkeyDevice::calibrationDeinit() {
     if(keyCalibrators_ == 0)
         return;
     
+    // Make sure the data thread has stopped using them first. With no table
+    // published it won't touch the drift tracker either.
+    calibrationPublishTable(true);
+    
+    if(driftTracker_ != 0) {
+        delete driftTracker_;
+        driftTracker_ = 0;
+    }
+    
 	for(int i = 0; i < keyCalibratorsLength_; i++) {
         if(keyCalibrators_[i] != 0)
             delete keyCalibrators_[i];
@@ -1081,34 +1477,117 @@ void TouchkeyDevice::calibrationDeinit() {
     isCalibrated_ = calibrationInProgress_ = false;
 }
 
+// Turn background drift tracking on or off. Turning it off removes any correction.
+void TouchkeyDevice::setDriftTrackingEnabled(bool enable) {
+    driftTrackingEnabled_ = enable;
+    if(driftTracker_ == 0)
+        return;
+    if(enable)
+        driftTracker_->start();
+    else {
+        driftTracker_->stop();
+        driftTracker_->reset();
+    }
+}
+
+// Get the state of the drift estimate for a key. Returns false if there isn't one.
+bool TouchkeyDevice::driftTrackingReport(int midiNote, QuiescentDriftTracker::KeyReport& report) {
+    if(driftTracker_ == 0)
+        return false;
+    int index = midiNote - lowestMidiNote_;
+    if(index < 0 || index >= driftTracker_->numberOfKeys())
+        return false;
+    report = driftTracker_->report(index);
+    return true;
+}
+
+// Snapshot the state of every calibrator into a new table and make it current.
+// If empty is set, remove the table altogether so no keys are processed.
+void TouchkeyDevice::calibrationPublishTable(bool empty) {
+    boost::mutex::scoped_lock lock(calibrationPublishMutex_);
+    PianoKeyCalibrationTable *table = 0;
+    
+    if(!empty && keyCalibrators_ != 0) {
+        table = new PianoKeyCalibrationTable(keyCalibratorsLength_);
+        for(int i = 0; i < keyCalibratorsLength_; i++) {
+            int quiescent, press;
+            float warpTable[kPianoKeyWarpTableSize];
+            int status = keyCalibrators_[i]->calibrationValues(quiescent, press);
+            table->setKey(i, status, quiescent, press);
+            if(keyCalibrators_[i]->warpTableValues(warpTable))
+                table->setWarpTable(i, warpTable);
+            table->setWarpCapturing(i, keyCalibrators_[i]->warpCaptureInProgress());
+        }
+    }
+    
+    PianoKeyCalibrationTable *oldTable = calibrationTable_.exchange(table, boost::memory_order_seq_cst);
+    
+    // The data thread finishes with a table within one frame
+    while(oldTable != 0 && calibrationTableInUse_.load(boost::memory_order_seq_cst) == oldTable)
+        usleep(100);
+    delete oldTable;
+}
+
+// Mark the current table as in use, checking it didn't change in between
+// so the publisher can't free it under us
+PianoKeyCalibrationTable* TouchkeyDevice::calibrationAcquireTable() {
+    PianoKeyCalibrationTable *table = calibrationTable_.load(boost::memory_order_acquire);
+    
+    while(true) {
+        calibrationTableInUse_.store(table, boost::memory_order_seq_cst);
+        PianoKeyCalibrationTable *current = calibrationTable_.load(boost::memory_order_seq_cst);
+        if(current == table)
+            return table;
+        table = current;
+    }
+}
+
+// Finished with the table for this frame
+void TouchkeyDevice::calibrationReleaseTable() {
+    calibrationTableInUse_.store(0, boost::memory_order_release);
+}
+
 // Loop for sending LED updates to the device, which must happen
 // in a separate thread from data collection so the device's capacity
 // to process incoming data doesn't gate its transmission of sensor data
 void* TouchkeyDevice::ledUpdateLoop() {
+    struct timeval rateStartTime, currentTime;
+    unsigned long rateStartUpdates = ledUpdatesSentCount_.load(boost::memory_order_relaxed);
+    unsigned long rateStartFrames = ledFramesSentCount_.load(boost::memory_order_relaxed);
+    
+    gettimeofday(&rateStartTime, 0);
     
-    // Run until told to stop, looking for updates to send to the board
+    // Run until told to stop, sending whatever changed once per frame interval
     while(!shouldStop_ && !ledShouldStop_) {
-        while(!ledUpdateQueue_.empty()) {
-            // Get the update
-            RGBLEDUpdate& updateStructure = ledUpdateQueue_.back();
+        internalRGBLEDSendPending();
+        
+        // Recalculate the send rates once per second
+        gettimeofday(&currentTime, 0);
+        long elapsed = (currentTime.tv_sec - rateStartTime.tv_sec) * 1000000 + (currentTime.tv_usec - rateStartTime.tv_usec);
+        if(elapsed >= 1000000) {
+            unsigned long updates = ledUpdatesSentCount_.load(boost::memory_order_relaxed);
+            unsigned long frames = ledFramesSentCount_.load(boost::memory_order_relaxed);
             
-            if(updateStructure.allLedsOff) {
-                internalRGBLEDAllOff();
-            }
-            else {
-                // Convert MIDI note number to board/LED pair. If valid, send to device.
-                int board = internalRGBLEDMIDIToBoardNumber(updateStructure.midiNote);
-                int led = internalRGBLEDMIDIToLEDNumber(updateStructure.midiNote);
+            ledUpdatesPerSecond_ = (float)(updates - rateStartUpdates) * 1000000.0 / (float)elapsed;
+            ledFramesPerSecond_ = (float)(frames - rateStartFrames) * 1000000.0 / (float)elapsed;
+            rateStartUpdates = updates;
+            rateStartFrames = frames;
+            rateStartTime = currentTime;
+            
+            // Telemetry from the I/O thread goes out at the same interval
+            telemetry_.updateRates();
+            if(telemetryPublishing_) {
+                telemetry_.publish(keyboard_);
                 
-                if(board >= 0 && board <= 3 && led >= 0)
-                    internalRGBLEDSetColor(board, led, updateStructure.red, updateStructure.green, updateStructure.blue);
+                // Frame clock: fitted interval (s), drift (ppm) and jitter (us)
+                keyboard_.sendMessage("/touchkeys/stats/clock", "fff",
+                                      (float)timestampSynchronizer_.currentSampleInterval(),
+                                      timestampSynchronizer_.drift(),
+                                      timestampSynchronizer_.jitter() * 1000000.0f, LO_ARGS_END);
             }
-            
-            // Remove the update we just transmitted
-            ledUpdateQueue_.pop_back();
         }
         
-        usleep(20000);  // Wait 20ms to check again
+        usleep(ledUpdateIntervalMicroseconds_);
     }
     
     return 0;
@@ -1155,7 +1634,7 @@ void* TouchkeyDevice::runLoop() {
 		}
 		if(count < 0) {
 			if(errno != EAGAIN) {	// EAGAIN just means no data was available
-				cout << "Unable to read from device (error " << errno << ").  Aborting.\n";
+				TOUCHKEY_LOG(kLogLevelError, "Unable to read from device (error {}).  Aborting.") << errno;
 				shouldStop_ = true;
 			}
 			
@@ -1163,6 +1642,8 @@ void* TouchkeyDevice::runLoop() {
 			continue;
 		}	
 		
+		telemetry_.countBytes(count);
+		
 		// Process the received data
 		
 		for(int i = 0; i < count; i++) {
@@ -1177,22 +1658,22 @@ void* TouchkeyDevice::runLoop() {
 						inFrame = false;
 						processFrame(frame, frameLength);
 					}
-					else if(ch == kControlCharacterFrameError) { // device telling us about an internal comm error
-						if(verbose_ >= 1)
-							cout << "Warning: received frame error, continuing anyway.\n";
+					else if(ch == kControlCharacterFrameError) { // device telling us about an internal comm error; continue anyway
+						telemetry_.countError(kTelemetryErrorFrameError);
 						frameError = true;
 					}
 					else if(ch == ESCAPE_CHARACTER) {			// double-escape means a literal escape character
 						frame[frameLength++] = ch;
 						if(frameLength >= TOUCHKEY_MAX_FRAME_LENGTH) {
 							inFrame = false;
-							if(verbose_ >= 1)
-								cout << "Warning: ignoring frame exceeding length limit " << (int)TOUCHKEY_MAX_FRAME_LENGTH << endl;
+							telemetry_.countError(kTelemetryErrorOversizeFrame);
 						}				
 					}
-					else if(ch == kControlCharacterNak && verbose_ >= 1) {
-                        // TODO: pass this on to a checkForAck() call
-						cout << "Warning: received NAK (while receiving frame)\n";
+					else if(ch == kControlCharacterAck)			// response to a command
+						commandChannel_.acknowledged(true);
+					else if(ch == kControlCharacterNak) {
+						telemetry_.countError(kTelemetryErrorNak);
+						commandChannel_.acknowledged(false);
 					}			
 				}
 				else {
@@ -1202,8 +1683,7 @@ void* TouchkeyDevice::runLoop() {
 						frame[frameLength++] = ch;
 						if(frameLength >= TOUCHKEY_MAX_FRAME_LENGTH) {
 							inFrame = false;
-							if(verbose_ >= 1)
-								cout << "Warning: ignoring frame exceeding length limit " << (int)TOUCHKEY_MAX_FRAME_LENGTH << endl;
+							telemetry_.countError(kTelemetryErrorOversizeFrame);
 						}
 					}
 				}				
@@ -1218,9 +1698,11 @@ void* TouchkeyDevice::runLoop() {
 						frameLength = 0;
 						frameError = false;
 					}
-					else if(ch == kControlCharacterNak && verbose_ >= 1) {
-                        // TODO: pass this on to a checkForAck() call
-						cout << "Warning: received NAK (while waiting for frame)\n";
+					else if(ch == kControlCharacterAck)			// response to a command
+						commandChannel_.acknowledged(true);
+					else if(ch == kControlCharacterNak) {
+						telemetry_.countError(kTelemetryErrorNak);
+						commandChannel_.acknowledged(false);
 					}
 				}
 				else {
@@ -1262,11 +1744,8 @@ void* TouchkeyDevice::rawDataRunLoop() {
         if(currentTicks - lastTicks > 100000ULL) {
             lastTicks = currentTicks;
             // Request data
-            if(write(device_, (char*)gatherDataCommand, 9) < 0) {
-                cout << "ERROR: unable to write setMode command.  errno = " << errno << endl;
-            }
-            tcdrain(device_);
-            cout << "wrote to device\n";
+            commandChannel_.send(gatherDataCommand, 9, false);
+            TOUCHKEY_LOG(kLogLevelDebug, "requested raw data");
         }
         
  		long count = read(device_, (char *)buffer, 1024);
@@ -1277,7 +1756,7 @@ void* TouchkeyDevice::rawDataRunLoop() {
 		}
 		if(count < 0) {
 			if(errno != EAGAIN) {	// EAGAIN just means no data was available
-				cout << "Unable to read from device (error " << errno << ").  Aborting.\n";
+				TOUCHKEY_LOG(kLogLevelError, "Unable to read from device (error {}).  Aborting.") << errno;
 				shouldStop_ = true;
 			}
 			
@@ -1285,6 +1764,8 @@ void* TouchkeyDevice::rawDataRunLoop() {
 			continue;
 		}
 		
+		telemetry_.countBytes(count);
+		
 		// Process the received data
 		
 		for(int i = 0; i < count; i++) {
@@ -1299,22 +1780,22 @@ void* TouchkeyDevice::rawDataRunLoop() {
 						inFrame = false;
 						processFrame(frame, frameLength);
 					}
-					else if(ch == kControlCharacterFrameError) { // device telling us about an internal comm error
-						if(verbose_ >= 1)
-							cout << "Warning: received frame error, continuing anyway.\n";
+					else if(ch == kControlCharacterFrameError) { // device telling us about an internal comm error; continue anyway
+						telemetry_.countError(kTelemetryErrorFrameError);
 						frameError = true;
 					}
 					else if(ch == ESCAPE_CHARACTER) {			// double-escape means a literal escape character
 						frame[frameLength++] = ch;
 						if(frameLength >= TOUCHKEY_MAX_FRAME_LENGTH) {
 							inFrame = false;
-							if(verbose_ >= 1)
-								cout << "Warning: ignoring frame exceeding length limit " << (int)TOUCHKEY_MAX_FRAME_LENGTH << endl;
+							telemetry_.countError(kTelemetryErrorOversizeFrame);
 						}
 					}
-					else if(ch == kControlCharacterNak && verbose_ >= 1) {
-                        // TODO: pass this on to a checkForAck() call
-						cout << "Warning: received NAK (while receiving frame)\n";
+					else if(ch == kControlCharacterAck)			// response to a command
+						commandChannel_.acknowledged(true);
+					else if(ch == kControlCharacterNak) {
+						telemetry_.countError(kTelemetryErrorNak);
+						commandChannel_.acknowledged(false);
 					}
 				}
 				else {
@@ -1324,8 +1805,7 @@ void* TouchkeyDevice::rawDataRunLoop() {
 						frame[frameLength++] = ch;
 						if(frameLength >= TOUCHKEY_MAX_FRAME_LENGTH) {
 							inFrame = false;
-							if(verbose_ >= 1)
-								cout << "Warning: ignoring frame exceeding length limit " << (int)TOUCHKEY_MAX_FRAME_LENGTH << endl;
+							telemetry_.countError(kTelemetryErrorOversizeFrame);
 						}
 					}
 				}
@@ -1340,9 +1820,11 @@ void* TouchkeyDevice::rawDataRunLoop() {
 						frameLength = 0;
 						frameError = false;
 					}
-					else if(ch == kControlCharacterNak && verbose_ >= 1) {
-                        // TODO: pass this on to a checkForAck() call
-						cout << "Warning: received NAK (while waiting for frame)\n";
+					else if(ch == kControlCharacterAck)			// response to a command
+						commandChannel_.acknowledged(true);
+					else if(ch == kControlCharacterNak) {
+						telemetry_.countError(kTelemetryErrorNak);
+						commandChannel_.acknowledged(false);
 					}
 				}
 				else {
@@ -1361,38 +1843,42 @@ void TouchkeyDevice::processFrame(unsigned char * const frame, int length) {
 	if(length == 0)	// Empty frame --> nothing to do here
 		return;
 	
+	telemetry_.beginFrame();
+	
 	switch(frame[0]) { // First character gives frame type
 		case kFrameTypeCentroid:
 			if(verbose_ >= 3)
-				cout << "Received centroid data\n";
+				TOUCHKEY_LOG(kLogLevelTrace, "Received centroid data");
 			processCentroidFrame(&frame[1], length - 1);
 			break;
 		case kFrameTypeRawKeyData:
 			if(verbose_ >= 3)
-				cout << "Received raw key data\n";
+				TOUCHKEY_LOG(kLogLevelTrace, "Received raw key data");
 			processRawDataFrame(&frame[1], length - 1);
 			break;
         case kFrameTypeAnalog:
 			if(verbose_ >= 3)
-				cout << "Received analog data\n";
+				TOUCHKEY_LOG(kLogLevelTrace, "Received analog data");
             processAnalogFrame(&frame[1], length - 1);
             break;
         case kFrameTypeErrorMessage:
             if(verbose_ >= 3)
-				cout << "Received error data\n";
+				TOUCHKEY_LOG(kLogLevelTrace, "Received error data");
             processErrorMessageFrame(&frame[1], length-1);
             break;
         case kFrameTypeI2CResponse:
             if(verbose_ >= 3)
-                cout << "Received I2C response\n";
+                TOUCHKEY_LOG(kLogLevelTrace, "Received I2C response");
             processI2CResponseFrame(&frame[1], length - 1);
             break;
 		case kFrameTypeStatus:
 		default:
 			if(verbose_ >= 3)
-				cout << "Received frame type " << (int)frame[0] << endl;			
+				TOUCHKEY_LOG(kLogLevelTrace, "Received frame type {}") << (int)frame[0];
 			break;
 	}	
+	
+	telemetry_.endFrame();
 }
 
 // Process a frame of data containing centroid values (the default mode of scanning)
@@ -1401,20 +1887,15 @@ void TouchkeyDevice::processCentroidFrame(unsigned char * const buffer, const in
     
     // Old and new generation devices structure the frame differently. 
 	if((deviceSoftwareVersion_ <= 0 && bufferLength < 3) || (deviceSoftwareVersion_ > 0 && bufferLength < 5)) {
-		if(verbose_ >= 1)
-			cout << "Warning: ignoring malformed centroid frame of " << bufferLength << " bytes, less than minimum 3\n";
+		telemetry_.countError(kTelemetryErrorMalformedCentroid);
 		if(verbose_ >= 2) {
-			cout << "  Contents: ";
-			hexDump(cout, buffer, bufferLength);
-			cout << endl;
+			TOUCHKEY_LOG(kLogLevelDebug, "  Contents: {}") << LogBytes(buffer, bufferLength);
 		}
 		return;
 	}
 	
 	if(verbose_ >= 4) {
-		cout << "Centroid frame contents:  ";
-		hexDump(cout, buffer, bufferLength);
-		cout << endl;		
+		TOUCHKEY_LOG(kLogLevelTrace, "Centroid frame contents:  {}") << LogBytes(buffer, bufferLength);
 	}
 	
     // Parse the octave and timestamp differently depending on hardware version
@@ -1426,19 +1907,25 @@ void TouchkeyDevice::processCentroidFrame(unsigned char * const buffer, const in
         bufferIndex = 5;
         
         if(verbose_ >= 3)
-            cout << "Centroid frame octave " << octave << " timestamp " << frame << endl;
+            TOUCHKEY_LOG(kLogLevelTrace, "Centroid frame octave {} timestamp {}") << octave << frame;
     }
     else {
         frame = (buffer[0] << 8) + buffer[1];	// First two bytes give us the timestamp in milliseconds (mod 2^16)
         octave = buffer[2];	// Third byte tells us which octave of keys is being addressed
         bufferIndex = 3;
 	}
+    telemetry_.countFrame(kTelemetryStreamCentroid, octave / 2);
     
 	// Convert from device frame number (expressed in USB 1ms SOF intervals) to a system
 	// timestamp that can be synchronized with other data streams
 	lastTimestamp_ = timestampSynchronizer_.synchronizedTimestamp(frame);
 	
+    centroidBatch_.frame = frame;
+    centroidBatch_.octave = octave;
+    centroidBatch_.count = 0;
+    
 	pthread_mutex_lock(&ioMutex_);
+	keyboard_.keysMutex().lock_shared();
 	
 	while(bufferIndex < bufferLength) {
 		// First byte tells us the number of the key (0-12); next bytes hold the data frame
@@ -1446,13 +1933,11 @@ void TouchkeyDevice::processCentroidFrame(unsigned char * const buffer, const in
 		int bytesParsed = processKeyCentroid(frame,octave, key, lastTimestamp_, &buffer[bufferIndex], bufferLength - bufferIndex);
 		
 		if(bytesParsed < 0)  {
-			if(verbose_ >= 1)
-				cout << "Warning: malformed data frame (parsing key " << key << " at byte " << bufferIndex << ")\n";
+			telemetry_.countError(kTelemetryErrorMalformedKeyData, octave / 2);
 			
 			if(verbose_ >= 2) {
-				cout << "--> Data: ";
-				hexDump(cout, buffer, bufferLength);
-				cout << endl;
+				TOUCHKEY_LOG(kLogLevelDebug, "Malformed data frame (parsing key {} at byte {})") << key << bufferIndex;
+				TOUCHKEY_LOG(kLogLevelDebug, "--> Data: {}") << LogBytes(buffer, bufferLength);
 			}
 			
 			break;
@@ -1461,7 +1946,11 @@ void TouchkeyDevice::processCentroidFrame(unsigned char * const buffer, const in
 		bufferIndex += bytesParsed;
 	}
 	
+	keyboard_.keysMutex().unlock_shared();
 	pthread_mutex_unlock(&ioMutex_); 
+    
+    if(centroidBatch_.count > 0)
+        batchBroadcaster_.broadcast(centroidBatch_);
 }
 
 // Process a frame containing raw key data, whose configuration was set with startRawDataCollection()
@@ -1471,12 +1960,10 @@ void TouchkeyDevice::processRawDataFrame(unsigned char * const buffer, const int
 	int octave = buffer[0];
 	
 	if(verbose_ >= 3)
-		cout << "Raw data frame from octave " << octave << " contains " << bufferLength - 1 << " samples\n";
+		TOUCHKEY_LOG(kLogLevelTrace, "Raw data frame from octave {} contains {} samples") << octave << bufferLength - 1;
 	
 	if(verbose_ >= 4) {
-		cout << "  ";
-		hexDump(cout, &buffer[1], bufferLength - 1);
-		cout << endl;		
+		TOUCHKEY_LOG(kLogLevelTrace, "  {}") << LogBytes(&buffer[1], bufferLength - 1);
 	}
 
 	// Send raw data as an OSC blob
@@ -1508,7 +1995,7 @@ int TouchkeyDevice::processKeyCentroid(int frame,int octave, int key, timestamp_
 	// since it will never be part of a valid centroid.
 	
 	if(buffer[0] == 0x88) {
-		cout << "Warning: octave " << octave << " key " << key << " data is not ready.  Check scan rate.\n";
+		telemetry_.countError(kTelemetryErrorDataNotReady, octave / 2);
         if(deviceSoftwareVersion_ >= 1)
             return white ? expectedLengthWhite_ : expectedLengthBlack_;
         else
@@ -1524,7 +2011,7 @@ int TouchkeyDevice::processKeyCentroid(int frame,int octave, int key, timestamp_
 		sliderPositionH = -1.0;
 		
 		if(verbose_ >= 4) {
-			cout << "Octave " << octave << " Key " << key << " (TS " << timestamp << "): ff\n";
+			TOUCHKEY_LOG(kLogLevelTrace, "Octave {} Key {} (TS {}): ff") << octave << key << timestamp;
 		}			
 	}
 	else {		
@@ -1615,16 +2102,15 @@ int TouchkeyDevice::processKeyCentroid(int frame,int octave, int key, timestamp_
 			sliderPositionH = -1.0;
 		
 		if(verbose_ >= 4) {
-			cout << "Octave " << octave << " Key " << key << ": ";
-			hexDump(cout, buffer, white ? expectedLengthWhite_ : expectedLengthBlack_);
-			cout << endl;
+			TOUCHKEY_LOG(kLogLevelTrace, "Octave {} Key {}: {}") << octave << key
+				<< LogBytes(buffer, white ? expectedLengthWhite_ : expectedLengthBlack_);
 		}	
 	}
 	
 	// Sanity check: do we have the PianoKey structure available to receive this data?
 	// If not, no need to proceed further.
 	if(keyboard_.key(midiNote) == 0) {
-		cout << "Warning: No PianoKey available for touchkey MIDI note " << midiNote << endl;
+		telemetry_.countError(kTelemetryErrorUnknownKey, octave / 2);
 		return bytesParsed;
 	}
 
@@ -1636,20 +2122,9 @@ int TouchkeyDevice::processKeyCentroid(int frame,int octave, int key, timestamp_
             KeyTouchFrame newFrame(0, sliderPosition, sliderSize, sliderPositionH, white);
             
             if (loggingActive_)
-            {
-                ////////////////////////////////////////////////////////
-                ////////////////////////////////////////////////////////
-                //////////////////// BEGIN LOGGING /////////////////////
-                
-                keyTouchLog_.write((char*)&timestamp, sizeof(timestamp_type));
-                keyTouchLog_.write((char*)&frame, sizeof(int));
-                keyTouchLog_.write((char*)&midiNote, sizeof(int));
-                keyTouchLog_.write((char*)&newFrame, sizeof(KeyTouchFrame));
-                
-                ///////////////////// END LOGGING //////////////////////
-                ////////////////////////////////////////////////////////
-                ////////////////////////////////////////////////////////
-            }
+                sessionLog_.logTouchOff(timestamp, frame, midiNote, white);
+            
+            addToCentroidBatch(midiNote, timestamp, newFrame);
             
             // Send raw OSC message if enabled
             if(sendRawOscMessages_) {
@@ -1678,21 +2153,10 @@ int TouchkeyDevice::processKeyCentroid(int frame,int octave, int key, timestamp_
         callback(timestamp, midiNote, newFrame, centroidUserData_);
     }
     
+    addToCentroidBatch(midiNote, timestamp, newFrame);
+    
     if (loggingActive_)
-    {
-        ////////////////////////////////////////////////////////
-        ////////////////////////////////////////////////////////
-        //////////////////// BEGIN LOGGING /////////////////////
-        
-        keyTouchLog_.write((char*)&timestamp, sizeof(timestamp_type));
-        keyTouchLog_.write((char*)&frame, sizeof(int));
-        keyTouchLog_.write((char*)&midiNote, sizeof(int));
-        keyTouchLog_.write((char*)&newFrame, sizeof(KeyTouchFrame));
-        
-        ///////////////////// END LOGGING //////////////////////
-        ////////////////////////////////////////////////////////
-        ////////////////////////////////////////////////////////
-    }
+        sessionLog_.logTouch(timestamp, frame, midiNote, newFrame);
 	
 	// Send raw OSC message if enabled
 	if(sendRawOscMessages_) {
@@ -1710,15 +2174,31 @@ int TouchkeyDevice::processKeyCentroid(int frame,int octave, int key, timestamp_
 	
 	// Verbose logging of key info
 	if(verbose_ >= 3) {
-		cout << "Octave " << octave << " Key " << key << " (TS " << timestamp << "): ";
-		cout << sliderPositionH << " ";
-		cout << sliderPosition[0] << " " << sliderPosition[1] << " " << sliderPosition[2] << " ";
-		cout << sliderSize[0] << " " << sliderSize[1] << " " << sliderSize[2] << endl;
+		TOUCHKEY_LOG(kLogLevelTrace, "Octave {} Key {} (TS {}): {} {} {} {} {} {} {}") << octave << key << timestamp
+			<< sliderPositionH << sliderPosition[0] << sliderPosition[1] << sliderPosition[2]
+			<< sliderSize[0] << sliderSize[1] << sliderSize[2];
 	}	
 	
 	return bytesParsed;
 }
 
+// Add one key's touches to the batch for the current centroid frame
+void TouchkeyDevice::addToCentroidBatch(int midiNote, timestamp_type timestamp, KeyTouchFrame const& touchFrame) {
+    if(!batchBroadcaster_.hasSubscribers() || centroidBatch_.count >= kTouchkeyBatchMaxKeys)
+        return;
+    
+    int index = centroidBatch_.count++;
+    centroidBatch_.midiNotes[index] = midiNote;
+    centroidBatch_.timestamps[index] = timestamp;
+    centroidBatch_.touchCounts[index] = touchFrame.count;
+    for(int i = 0; i < 3; i++) {
+        centroidBatch_.locations[i][index] = touchFrame.locs[i];
+        centroidBatch_.sizes[i][index] = touchFrame.sizes[i];
+    }
+    centroidBatch_.horizontalLocations[index] = touchFrame.locH;
+    centroidBatch_.white[index] = touchFrame.white;
+}
+
 // Process a frame of data containing analog values (i.e. key angle, Z-axis). These
 // always come as a group for a whole board, and should be parsed apart into individual keys
 void TouchkeyDevice::processAnalogFrame(unsigned char * const buffer, const int bufferLength) {
@@ -1727,8 +2207,7 @@ void TouchkeyDevice::processAnalogFrame(unsigned char * const buffer, const int
     //                  [TS0] [TS1] [TS2] [TS3] [Key0L] [Key0H] [Key1L] [Key1H] ... [Key24L] [Key24H]
     
     if(bufferLength < 1) {
-		if(verbose_ >= 1)
-			cout << "Warning: ignoring malformed analog frame of " << bufferLength << " bytes, less than minimum 1\n";
+        telemetry_.countError(kTelemetryErrorMalformedAnalog);
         return;
     }
     
@@ -1738,12 +2217,19 @@ void TouchkeyDevice::processAnalogFrame(unsigned char * const buffer, const int
     int bufferIndex = 1;
     int midiNote, value;
     
-    // Parse the buffer one frame at a time
+    if(board >= kTelemetryMaxBoards) {
+        telemetry_.countError(kTelemetryErrorMalformedAnalog);
+        return;
+    }
+    
+    // Parse the buffer one frame at a time. The keyboard can't add keys while a frame is
+    // passed to them.
     while(bufferIndex < bufferLength) {
+        boost::shared_lock<boost::shared_mutex> keysLock(keyboard_.keysMutex());
+        
         if(bufferLength - bufferIndex < 54) {
             // This condition indicates a malformed analog frame (not enough data)
-            if(verbose_ >= 1)
-                cout << "Warning: ignoring extra analog data of " << bufferLength - bufferIndex << " bytes, less than full frame 54 (total " << bufferLength << ")\n";
+            telemetry_.countError(kTelemetryErrorMalformedAnalog, board);
             break;
         }
         
@@ -1752,13 +2238,13 @@ void TouchkeyDevice::processAnalogFrame(unsigned char * const buffer, const int
                 ((int)buffer[bufferIndex+2] << 16) + ((int)buffer[bufferIndex+3] << 24);
         
         // Check the timestamp against the last frame from this board to see if any frames have been dropped
-        if(frame > analogLastFrame_[board] + 1) {
-            cout << "WARNING: dropped frame(s) on board " << board << " at " << frame << " (last was " << analogLastFrame_[board] << ")" << endl;
-        }
-        else if(frame < analogLastFrame_[board] + 1) {
-            cout << "WARNING: repeat frame(s) on board " << board << " at " << frame << " (last was " << analogLastFrame_[board] << ")" << endl;            
-        }
+        unsigned int expectedFrame = analogLastFrame_[board] + 1;
+        if(analogLastFrame_[board] != 0 && (unsigned int)frame > expectedFrame)
+            telemetry_.countError(kTelemetryErrorDroppedFrame, board, (unsigned int)frame - expectedFrame);
+        else if(analogLastFrame_[board] != 0 && (unsigned int)frame < expectedFrame)
+            telemetry_.countError(kTelemetryErrorRepeatedFrame, board);
         analogLastFrame_[board] = frame;
+        telemetry_.countFrame(kTelemetryStreamAnalog, board);
         
         // TESTING
 //        if(verbose_ >= 3 || (frame % 500 == 0))
@@ -1771,6 +2257,39 @@ void TouchkeyDevice::processAnalogFrame(unsigned char * const buffer, const int
 //            cout << endl;
 //        }
         
+        // Unpack the raw values (little endian 16 bit) and calibrate the whole frame at once.
+        // The table stays valid until it is released at the end of the frame, so calibration
+        // changes only ever take effect between frames.
+        int rawValues[25], correctedValues[25];
+        key_position calibratedPositions[25];
+        
+        for(int key = 0; key < 25; key++)
+            rawValues[key] = (((signed char)buffer[bufferIndex + key*2 + 5])*256 + buffer[bufferIndex + key*2 + 4]);
+        
+        PianoKeyCalibrationTable *calibrationTable = calibrationAcquireTable();
+        if(calibrationTable == 0) {
+            calibrationReleaseTable();
+            bufferIndex += 54;
+            continue;
+        }
+        
+        // Take out any drift in the resting values found by the tracker thread. The tracker
+        // is only deleted once no table is in use, so it is safe to use until the release.
+        QuiescentDriftTracker *driftTracker = driftTracker_;
+        for(int key = 0; key < 25; key++)
+            correctedValues[key] = rawValues[key] - (driftTracker != 0 ? driftTracker->offset(octave*12 + key) : 0);
+        
+        calibrationTable->calibrate(octave*12, correctedValues, calibratedPositions, 25);
+        
+        // One timestamp for the whole frame
+        timestamp_type timestamp = timestampSynchronizer_.synchronizedTimestamp(frame);
+        
+        TouchkeyAnalogBatch analogBatch;
+        bool batching = batchBroadcaster_.hasSubscribers();
+        analogBatch.frame = frame;
+        analogBatch.octave = octave;
+        analogBatch.count = 0;
+        
         // Process key values individually and add them to the keyboard data structure
         for(int key = 0; key < 25; key++) {
             // Every analog frame contains 25 values, however only the top board actually uses all 25
@@ -1782,37 +2301,32 @@ void TouchkeyDevice::processAnalogFrame(unsigned char * const buffer, const int
             midiNote = octaveKeyToMidi(octave, key);
             
             // Check that this note is in range to the available calibrators and keys.
-            if(midiNote < keyboard_.keyboardRange().first || midiNote > keyboard_.keyboardRange().second || (octave*12 + key) >= keyCalibratorsLength_
+            if(midiNote < keyboard_.keyboardRange().first || midiNote > keyboard_.keyboardRange().second || (octave*12 + key) >= calibrationTable->length()
                || midiNote < 21)
                 continue;
             
-            // Pull the value out from the packed buffer (little endian 16 bit)
-            value = (((signed char)buffer[key*2 + 6])*256 + buffer[key*2 + 5]);
+            value = rawValues[key];
+            key_position calibratedPosition = calibratedPositions[key];
+            int calibrationStatus = calibrationTable->status(octave*12 + key);
+            
+            // Keys being calibrated go through their calibrator, which collects the samples
+            if(calibrationStatus == kPianoKeyInCalibration)
+                calibratedPosition = keyCalibrators_[octave*12 + key]->evaluate(value);
+            else if(calibrationTable->warpCapturing(octave*12 + key))
+                keyCalibrators_[octave*12 + key]->warpCaptureSample(value);
             
-            // Calibrate the value, assuming the calibrator is ready and running
-            key_position calibratedPosition = keyCalibrators_[octave*12 + key]->evaluate(value);
-            timestamp_type timestamp = timestampSynchronizer_.synchronizedTimestamp(frame);
             if(!missing_value<key_position>::isMissing(calibratedPosition)) {
                 
                 keyboard_.key(midiNote)->insertSample(calibratedPosition, timestamp);
                 
-                if (loggingActive_ && calibratedPosition > 0.05)
-                {
-                    ////////////////////////////////////////////////////////
-                    ////////////////////////////////////////////////////////
-                    //////////////////// BEGIN LOGGING /////////////////////
-                    
-                    keyTouchLog_ << "/rawp ";
-                    keyTouchLog_ << setw(10) << timestamp;
-                    keyTouchLog_ << setw(4) << midiNote;
-                    keyTouchLog_ << setw(10) << calibratedPosition << endl;
-                    
-                    ///////////////////// END LOGGING //////////////////////
-                    ////////////////////////////////////////////////////////
-                    ////////////////////////////////////////////////////////
-                }
-                
+                // Resting keys show where the quiescent value has drifted to
+                if(driftTrackingEnabled_ && driftTracker != 0 && calibrationStatus == kPianoKeyCalibrated &&
+                   keyboard_.key(midiNote)->idleState() == kIdleDetectorIdle)
+                    driftTracker->addIdleSample(octave*12 + key, value - (int)calibrationTable->quiescent(octave*12 + key));
                 
+                // Log every calibrated sample so the session can be replayed
+                if (loggingActive_)
+                    sessionLog_.logAnalog(timestamp, frame, midiNote, calibratedPosition, value);
             }
             else if(keyboard_.gui() != 0){
                 
@@ -1821,8 +2335,8 @@ void TouchkeyDevice::processAnalogFrame(unsigned char * const buffer, const int
                 // Update the GUI but don't actually save the value since it's uncalibrated
                 keyboard_.gui()->setAnalogValueForKey(midiNote, (float)value / kTouchkeyAnalogValueMax);
                 
-                if(keyCalibrators_[octave*12 + key]->calibrationStatus() == kPianoKeyCalibrated)
-                    cout << "key " << midiNote << " calibrated but missing (raw value " << value << ")\n";
+                if(calibrationStatus == kPianoKeyCalibrated)
+                    TOUCHKEY_LOG(kLogLevelDebug, "key {} calibrated but missing (raw value {})") << midiNote << value;
             }
             
 #pragma mark JG Edit (send key data to analog callback)
@@ -1831,8 +2345,24 @@ void TouchkeyDevice::processAnalogFrame(unsigned char * const buffer, const int
                 AnalogCallback callback = (AnalogCallback)analogCallback_;
                 callback(timestamp, midiNote, calibratedPosition, analogUserData_);
             }
+            
+            if(batching) {
+                analogBatch.midiNotes[analogBatch.count] = midiNote;
+                analogBatch.timestamps[analogBatch.count] = timestamp;
+                analogBatch.positions[analogBatch.count] = calibratedPosition;
+                analogBatch.rawValues[analogBatch.count] = value;
+                analogBatch.count++;
+            }
         }
         
+        calibrationReleaseTable();
+        
+        // Idle detection for the whole frame at once
+        keyboard_.analogFrameFinished();
+        
+        if(analogBatch.count > 0)
+            batchBroadcaster_.broadcast(analogBatch);
+        
         // Skip to next frame
         bufferIndex += 54;
     }
@@ -1844,9 +2374,11 @@ void TouchkeyDevice::processErrorMessageFrame(unsigned char * const buffer, cons
     char msg[256];
     int len = bufferLength - 5;
     
+    telemetry_.countError(kTelemetryErrorDeviceMessage);
+    
     // Error on error message frame!
     if(bufferLength < 5) {
-        cout << "Warning: received error message frame of " << bufferLength << " bytes, less than minimum 5\n";
+        TOUCHKEY_LOG(kLogLevelWarning, "Warning: received error message frame of {} bytes, less than minimum 5") << bufferLength;
         return;
     }
     
@@ -1857,13 +2389,11 @@ void TouchkeyDevice::processErrorMessageFrame(unsigned char * const buffer, cons
     msg[len - 1] = '\0';
     
     // Print the error
-    cout << "Error frame received: " << msg << endl;
+    TOUCHKEY_LOG(kLogLevelWarning, "Error frame received: {}") << msg;
     
     // Dump the buffer containing error coding information
     if(verbose_ >= 2) {
-        cout << "Contents: ";
-        hexDump(cout, buffer, 5);
-        cout << endl;
+        TOUCHKEY_LOG(kLogLevelDebug, "Contents: {}") << LogBytes(buffer, 5);
     }
 }
 
@@ -1873,7 +2403,7 @@ void TouchkeyDevice::processI2CResponseFrame(unsigned char * const buffer, const
     // Format: [octave] [key] [length] <data>
     
     if(bufferLength < 3) {
-        cout << "Warning: received I2C response frame of " << bufferLength << " bytes, less than minimum 3\n";
+        TOUCHKEY_LOG(kLogLevelWarning, "Warning: received I2C response frame of {} bytes, less than minimum 3") << bufferLength;
         return;
     }
     
@@ -1882,14 +2412,14 @@ void TouchkeyDevice::processI2CResponseFrame(unsigned char * const buffer, const
     int responseLength = buffer[2];
     
     if(bufferLength < responseLength + 3) {
-        cout << "Warning: received malformed I2C response (octave " << octave << ", key " << key << ", length " << responseLength;
-        cout << ") but only " << bufferLength - 3 << " bytes of data\n";
+        TOUCHKEY_LOG(kLogLevelWarning, "Warning: received malformed I2C response (octave {}, key {}, length {}) but only {} bytes of data")
+            << octave << key << responseLength << bufferLength - 3;
         
         responseLength = bufferLength - 3;
     }
     else {
         if(verbose_ >= 3) {
-            cout << "I2C response from octave " << octave << ", key " << key << ", length " << responseLength << endl;
+            TOUCHKEY_LOG(kLogLevelTrace, "I2C response from octave {}, key {}, length {}") << octave << key << responseLength;
         }
     }
     
@@ -1911,9 +2441,7 @@ void TouchkeyDevice::processI2CResponseFrame(unsigned char * const buffer, const
 
 bool TouchkeyDevice::processStatusFrame(unsigned char * buffer, int maxLength, TouchkeyDevice::ControllerStatus *status) {
 	if((status == 0 || maxLength < 5) && verbose_ >= 1) {
-		cout << "Invalid status frame: ";
-		hexDump(cout, buffer, maxLength);
-		cout << endl;
+		TOUCHKEY_LOG(kLogLevelWarning, "Invalid status frame: {}") << LogBytes(buffer, maxLength);
 		return false;
 	}
 	
@@ -1948,62 +2476,13 @@ bool TouchkeyDevice::processStatusFrame(unsigned char * buffer, int maxLength, T
 	}
 	
 	if(oct < status->octaves && verbose_ >= 1) {
-		cout << "Invalid status frame: ";
-		hexDump(cout, buffer, maxLength);	
-		cout << endl;
+		TOUCHKEY_LOG(kLogLevelWarning, "Invalid status frame: {}") << LogBytes(buffer, maxLength);
 		return false;
 	}
 	
 	return true;
 }
 
-// Check for an ACK response from the device.  Returns true if found.  Returns
-// false if NAK received, or if a timeout occurs.
-// TODO: this implementation needs to change to not chew up other data coming in.
-
-bool TouchkeyDevice::checkForAck(int timeoutMilliseconds) {
-	struct timeval startTime, currentTime;
-	bool controlSeq = false;
-	unsigned char ch;
-	
-	gettimeofday(&startTime, 0);
-	gettimeofday(&currentTime, 0);
-	
-	while((currentTime.tv_sec - startTime.tv_sec)*1000000L + (currentTime.tv_usec - startTime.tv_usec) < timeoutMilliseconds * 1000) {
-		long count = read(device_, (char *)&ch, 1);
-		
-		if(count < 0) {				// Check if an error occurred on read
-			if(errno != EAGAIN) {
-				cout << "Unable to read from device while waiting for ACK (error " << errno << ").  Aborting.\n";
-				return false;
-			}
-		}
-		else if(count > 0) {		// Data received
-			// Wait for a sequence {ESCAPE_CHARACTER, ACK} or {ESCAPE_CHARACTER, NAK}
-			if(controlSeq) {
-				controlSeq = false;
-				if(ch == kControlCharacterAck) {
-					if(verbose_ >= 2)
-						cout << "Received ACK\n";
-					return true;
-				}
-				else if(ch == kControlCharacterNak) {
-					if(verbose_ >= 1)
-						cout << "Warning: received NAK\n";
-					return false;
-				}
-			}
-			else if(ch == ESCAPE_CHARACTER)
-				controlSeq = true;
-		}
-		
-		gettimeofday(&currentTime, 0);		
-	}
-	
-	cout << "Error: timeout waiting for ACK\n";
-	return false;
-}
-
 // Convenience method to dump hexadecimal output
 void TouchkeyDevice::hexDump(ostream& str, unsigned char * buffer, int length) {
 	if(length <= 0)
@@ -2016,13 +2495,11 @@ void TouchkeyDevice::hexDump(ostream& str, unsigned char * buffer, int length) {
 }
 
 TouchkeyDevice::~TouchkeyDevice() {
-    if (logFileCreated_)
-    {
-        keyTouchLog_.close();
-    }
+    closeLogFile();
     
 	closeDevice();
     calibrationDeinit();
+    keyboard_.removeTouchkeyDevice(this);
 	pthread_mutex_destroy(&ioMutex_);
 }
 
@@ -2033,7 +2510,7 @@ void TouchkeyDevice::setCentroidCallback(CentroidCallback callback, void *userDa
     if (!usingCentroidCallback_) {
         /* Make sure the passed method is valid */
         if (!callback) {
-            printf("TouchkeyDevice::setCentroidCallback: invalid callback method\n");
+            TOUCHKEY_LOG(kLogLevelWarning, "TouchkeyDevice::setCentroidCallback: invalid callback method");
             return;
         }
         
@@ -2042,7 +2519,7 @@ void TouchkeyDevice::setCentroidCallback(CentroidCallback callback, void *userDa
         usingCentroidCallback_ = true;
     }
     else {
-        printf("TouchkeyDevice::setCentroidCallback: callback already set\n");
+        TOUCHKEY_LOG(kLogLevelWarning, "TouchkeyDevice::setCentroidCallback: callback already set");
     }
 }
 
@@ -2052,7 +2529,7 @@ void TouchkeyDevice::setAnalogCallback(AnalogCallback callback, void *userData)
     if (!usingAnalogCallback_) {
         /* Make sure the passed method is valid */
         if (!callback) {
-            printf("TouchkeyDevice::setAnalogCallback: invalid callback method\n");
+            TOUCHKEY_LOG(kLogLevelWarning, "TouchkeyDevice::setAnalogCallback: invalid callback method");
             return;
         }
         
@@ -2061,7 +2538,7 @@ void TouchkeyDevice::setAnalogCallback(AnalogCallback callback, void *userData)
         usingAnalogCallback_ = true;
     }
     else {
-        printf("TouchkeyDevice::setAnalogCallback: callback already set\n");
+        TOUCHKEY_LOG(kLogLevelWarning, "TouchkeyDevice::setAnalogCallback: callback already set");
     }
 }
 
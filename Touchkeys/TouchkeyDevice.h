@@ -25,11 +25,20 @@
 #include <sys/time.h>
 #include <limits>
 #include <list>
+#include <boost/atomic.hpp>
+#include <boost/cstdint.hpp>
 #include "PianoKeyboard.h"
 #include "Osc.h"
 #include "TimestampSynchronizer.h"
 #include "PianoKeyCalibrator.h"
+#include "PianoKeyCalibrationTable.h"
+#include "PianoKeyCalibrationSnapshot.h"
+#include "QuiescentDriftTracker.h"
+#include "TouchkeyTelemetry.h"
+#include "TouchkeyBatchBroadcaster.h"
+#include "TouchkeyCommandChannel.h"
 #include "RawSensorDisplay.h"
+#include "SessionLog.h"
 
 using namespace std;
 
@@ -130,12 +139,22 @@ const unsigned char kCommandStartScanning[] = { ESCAPE_CHARACTER, kControlCharac
 const unsigned char kCommandStopScanning[] = { ESCAPE_CHARACTER, kControlCharacterFrameBegin, kFrameTypeStopScanning,
 	ESCAPE_CHARACTER, kControlCharacterFrameEnd };
 
+const int kCommandSettleMicroseconds = 10000;   // Time the device needs after stopping or passing on an I2C command
+
 #define octaveNoteToIndex(octave, note) (100*octave + note)	// Generate indices for containers
 #define indexToOctave(index) (int)(index / 100)
 #define indexToNote(index) (index % 100)
 
 const float kTouchkeyAnalogValueMax = 4095.0; // Maximum value any analog sample can take
 
+const int kRGBLEDNumberOfNotes = 128;               // One colour slot per MIDI note
+const int kRGBLEDDefaultFrameRate = 50;             // How often (Hz) pending LED changes are sent
+const int kRGBLEDMaxUpdatesPerFrame = 16;           // Most LED entries packed into one kFrameTypeRGBLEDSetColors frame
+const int kRGBLEDDefaultUpdatesPerFrame = 1;        // Firmware is only known to accept one entry per frame
+const int kRGBLEDBytesPerUpdate = 6;                // Board/LED byte plus 3 x 12-bit colour
+const int kRGBLEDFramesInFlight = 16;               // LED frames queued or awaiting ACK at once
+const boost::uint64_t kRGBLEDColorUnknown = ~0ULL;  // Never a real colour, so the key is sent again
+
 // This class implements device access to the touchkey hardware.
 
 class TouchkeyDevice /*: public OscHandler*/
@@ -177,12 +196,23 @@ public:
     // Structure to hold changes to RGB LEDs on relevant hardware
     class RGBLEDUpdate {
     public:
-        bool allLedsOff;        // Set to true if all LEDs should turn off on indicated board
-        int midiNote;           // MIDI note number to change
-        int red;                // RGB color
+        int board;              // Which board the LED is on
+        int led;                // LED index within the board
+        int red;                // RGB color (0-4095)
         int green;
         int blue;
     };
+    
+    // Counters describing the LED update pipeline
+    class RGBLEDStatistics {
+    public:
+        int pendingUpdates;             // Keys changed but not yet sent (queue depth)
+        unsigned long requests;         // Colour changes requested by callers
+        unsigned long updatesSent;      // Individual LED updates sent to the device
+        unsigned long framesSent;       // Serial frames carrying those updates
+        float updatesPerSecond;         // Send rates, measured over the last second
+        float framesPerSecond;
+    };
 	
 public:
 	// ***** Constructor *****
@@ -205,6 +235,7 @@ public:
 	bool isOpen() { return device_ >= 0; }
 	bool isAutoGathering() { return autoGathering_; }
 	int numberOfOctaves() { return numOctaves_; }
+    bool hasRGBLEDs() { return deviceHasRGBLEDs_; }
     
 	// Ping the device, to see if it is ready to respond
 	bool checkIfDevicePresent(int millisecondsToWait);
@@ -217,16 +248,38 @@ public:
     void rgbledSetColorHSV(const int midiNote, const float hue, const float saturation, const float value);
     void rgbledAllOff();
     
+    // Rate at which pending LED changes are sent, and how many LEDs are packed into
+    // each frame. Changes to the same key between frames are coalesced. Frames carry
+    // one LED by default; raise it only for firmware that accepts several.
+    void setRGBLEDFrameRate(int framesPerSecond);
+    void setRGBLEDMaxUpdatesPerFrame(int updates);
+    RGBLEDStatistics rgbledStatistics();
+    
+    // ***** Telemetry *****
+    //
+    // Counts of bytes, frames and errors on the I/O thread, readable at any time.
+    // When publishing is on, they are also sent once a second under /touchkeys/stats.
+    TouchkeyTelemetry& telemetry() { return telemetry_; }
+    void setTelemetryPublishing(bool publish) { telemetryPublishing_ = publish; }
+    bool telemetryPublishing() { return telemetryPublishing_; }
+    
     // ***** Device Parameters *****
+    //
+    // These queue the command and return at once, giving the command's ID (or 0 if
+    // the parameters are invalid). The callback, if given, is called with the result
+    // when the device ACKs or NAKs; commandChannel() can also wait for the result.
     
 	// Set the scan interval in milliseconds
-	bool setScanInterval(int intervalMilliseconds);
+	int setScanInterval(int intervalMilliseconds, TouchkeyCommandCallback callback = 0, void *userData = 0);
 	
 	// Key parameters.  Setting octave or key to -1 means all octaves or all keys, respectively.
-	bool setKeySensitivity(int octave, int key, int value);
-	bool setKeyCentroidScaler(int octave, int key, int value);
-	bool setKeyMinimumCentroidSize(int octave, int key, int value);
-	bool setKeyNoiseThreshold(int octave, int key, int value);
+	int setKeySensitivity(int octave, int key, int value, TouchkeyCommandCallback callback = 0, void *userData = 0);
+	int setKeyCentroidScaler(int octave, int key, int value, TouchkeyCommandCallback callback = 0, void *userData = 0);
+	int setKeyMinimumCentroidSize(int octave, int key, int value, TouchkeyCommandCallback callback = 0, void *userData = 0);
+	int setKeyNoiseThreshold(int octave, int key, int value, TouchkeyCommandCallback callback = 0, void *userData = 0);
+    
+    // Queue of commands to the device, with their results and the pipelining window
+    TouchkeyCommandChannel& commandChannel() { return commandChannel_; }
     
     // ***** Calibration Methods *****
     
@@ -240,15 +293,49 @@ public:
 	void calibrationAbort();
 	void calibrationClear();
 	
+	// Learn warp tables for keys that are already calibrated. Between start and finish, press
+	// each key slowly and steadily through its full travel a few times.
+	void calibrationWarpStart(std::vector<int>* keysToCalibrate);
+	int calibrationWarpFinish();   // Returns the number of keys with new warp tables
+	void calibrationWarpAbort();
+	void calibrationWarpClear();
+	
+	// Background tracking of each key's resting value, correcting slow drift while
+	// the keys are idle. Enabled by default; disabling it removes all corrections.
+	void setDriftTrackingEnabled(bool enable);
+	bool driftTrackingEnabled() { return driftTrackingEnabled_; }
+	bool driftTrackingReport(int midiNote, QuiescentDriftTracker::KeyReport& report);
+	
+	// XML calibration files, for import and export
 	bool calibrationSaveToFile(std::string const& filename);
 	bool calibrationLoadFromFile(std::string const& filename);
+	
+	// Binary snapshots, holding several named calibrations in one file. Saving replaces
+	// any calibration of the same name and keeps the rest. Loading maps the file and
+	// applies the named calibration (or the first, if name is empty); the file stays
+	// open so calibrationSelectSnapshot() can switch to another of its calibrations.
+	// Loading either kind returns false if no key ends up calibrated.
+	bool calibrationSaveSnapshot(std::string const& filename, std::string const& name);
+	bool calibrationLoadSnapshot(std::string const& filename, std::string const& name = "");
+	bool calibrationSelectSnapshot(std::string const& name);
+	std::vector<std::string> calibrationSnapshotNames();
     
     // ***** Data Logging *****
+    //
+    // Touch frames, key positions, MIDI notes and the keyboard's OSC output are
+    // written to a binary SessionLog. Writing happens on the log's own thread.
     void createLogFile(string keyTouchLog_filename, string path);
     void closeLogFile();
     void startLogging();
     void stopLogging();
     bool isLogging()    { return loggingActive_; }
+    SessionLog& sessionLog() { return sessionLog_; }
+    
+    // ***** Batch Subscriptions *****
+    //
+    // Subscribers receiving a whole frame of analog or centroid data per call. Any
+    // number can subscribe, each either on the I/O thread or on a thread of its own.
+    TouchkeyBatchBroadcaster& batchBroadcaster() { return batchBroadcaster_; }
 
     // ***** Debugging and Utility *****
     
@@ -265,7 +352,7 @@ public:
         lowestKeyPresentMidiNote_ += (note - lowestMidiNote_);
 		lowestMidiNote_ = note;
 		if(isOpen())
-			keyboard_.setKeyboardRange(lowestMidiNote_, lowestMidiNote_ + 12*numOctaves_);
+			keyboard_.setTouchkeyDeviceRange(this, lowestKeyPresentMidiNote_, lowestMidiNote_ + 12*numOctaves_);
 		pthread_mutex_unlock(&ioMutex_);
 	}
 	int octaveKeyToMidi(int octave, int key) { return lowestMidiNote_ + octave*12 + key; }
@@ -300,8 +387,6 @@ public:
     
     void cancelCentroidCallback();
     void cancelAnalogCallback();
-    void logMidiNoteOn(int midiNote, int velocity);
-    void logMidiNoteOff(int midiNote);
     
 	
 private:
@@ -311,6 +396,7 @@ private:
 	// Specific data type parsing
 	void processCentroidFrame(unsigned char * const buffer, const int bufferLength);
 	int processKeyCentroid(int frame,int octave, int key, timestamp_type timestamp, unsigned char * buffer, int maxLength);
+    void addToCentroidBatch(int midiNote, timestamp_type timestamp, KeyTouchFrame const& touchFrame);
     void processAnalogFrame(unsigned char * const buffer, const int bufferLength);
 	void processRawDataFrame(unsigned char * const buffer, const int bufferLength);
 	bool processStatusFrame(unsigned char * buffer, int maxLength, ControllerStatus *status);
@@ -326,8 +412,11 @@ private:
 	// Utility method for parsing multi-key gestures
 	pair<int, int> whiteKeyAbove(int octave, int note);
 	
-	// After writing a command, check whether it was acknolwedged by the controller
-	bool checkForAck(int timeoutMilliseconds);
+	// Stop notes on the keys this device covers
+	void sendAllNotesOff();
+	
+	// Send the status command and parse the reply, for checkIfDevicePresent()
+	bool queryDeviceStatus(int millisecondsToWait);
 	
 	// Utility method for debugging
 	void hexDump(ostream& str, unsigned char * buffer, int length);
@@ -335,9 +424,25 @@ private:
     // Internal calibration methods
     void calibrationInit(int numberOfCalibrators);
     void calibrationDeinit();
+    bool calibrationApplySnapshot(int index);
+    bool calibrationLoaded();
+    
+    // Build a new calibration table from the calibrators and swap it in. The old
+    // table is freed once the data thread has finished with it.
+    void calibrationPublishTable(bool empty = false);
+    
+    // Get the current table for the data thread, and mark it in use until released
+    PianoKeyCalibrationTable* calibrationAcquireTable();
+    void calibrationReleaseTable();
     
     // Set RGB LED color (for piano scanner boards)
     bool internalRGBLEDSetColor(const int device, const int led, const int red, const int green, const int blue);
+    bool internalRGBLEDSetColors(const RGBLEDUpdate* updates, const int count,
+                                 TouchkeyCommandCallback callback = 0, void *userData = 0);    // Several LEDs in one frame
+    int  internalRGBLEDSendPending();                   // Send all changed keys; returns number sent
+    int  internalRGBLEDCommitSent(const RGBLEDUpdate* updates, const int* notes,
+                                  const boost::uint64_t* colors, const int count);   // Send one frame, retrying later on failure
+    static void internalRGBLEDFrameDone(int commandId, int result, void *userData);   // ACK, NAK or failure of a frame
     bool internalRGBLEDAllOff();                        // RGB LEDs off
     int  internalRGBLEDMIDIToBoardNumber(const int midiNote);   // Get board number for MIDI note
     int  internalRGBLEDMIDIToLEDNumber(const int midiNote);     // Get LED number for MIDI note
@@ -363,7 +468,7 @@ private:
     float blackMaxX_, blackMaxY_;   // Maximum sensor values for black keys
     
     // Frame counter for analog data, to detect dropped frames
-    unsigned int analogLastFrame_[4];    // Max 4 boards
+    unsigned int analogLastFrame_[kTelemetryMaxBoards];    // 0 until the first frame from each board
 	
 	// Synchronization between frame time and system timestamp, allowing interaction
 	// with other simultaneous streams using different clocks.  Also save the last timestamp
@@ -371,6 +476,10 @@ private:
 	TimestampSynchronizer timestampSynchronizer_;	
 	timestamp_type lastTimestamp_;
     
+    // Commands to the device, written by the channel's own thread. ACKs and NAKs seen
+    // by the run loops are passed on to it.
+    TouchkeyCommandChannel commandChannel_;
+    
     // For raw data collection, this information keeps track of which key we're reading
     int rawDataCurrentOctave_, rawDataCurrentKey_;
     
@@ -378,7 +487,39 @@ private:
     bool deviceHasRGBLEDs_;                 // Whether the device has RGB LEDs
     pthread_t ledThread_;                   // Thread that handles LED updates (communication to the device)
     volatile bool ledShouldStop_;           // testing
-    deque<RGBLEDUpdate> ledUpdateQueue_;    // Queue that holds new LED messages to be sent to device
+    int ledUpdateIntervalMicroseconds_;     // Time between LED frames
+    int ledMaxUpdatesPerFrame_;             // How many LEDs to pack into each frame
+    
+    // Latest colour requested for each MIDI note, packed as 3 x 12 bits. Callers on any
+    // thread overwrite the slot and set the note's bit in the dirty mask; the LED thread
+    // claims the mask with an atomic exchange and sends only what changed.
+    boost::atomic<boost::uint64_t> ledRequestedColors_[kRGBLEDNumberOfNotes];
+    boost::atomic<boost::uint64_t> ledDirtyMask_[kRGBLEDNumberOfNotes / 64];
+    boost::atomic<bool> ledAllOffRequested_;
+    boost::uint64_t ledSentColors_[kRGBLEDNumberOfNotes];  // What the device is showing (LED thread only)
+    
+    // LED frames go through the command channel so they can't interleave with other
+    // commands, and the device ACKs each one. A frame that isn't ACKed puts its keys in
+    // the resend mask, which the LED thread claims along with the dirty mask.
+    struct RGBLEDFrame {
+        TouchkeyDevice *device;
+        int count;
+        int notes[kRGBLEDMaxUpdatesPerFrame];
+        boost::atomic<bool> inFlight;       // Queued or awaiting ACK; the slot can't be reused yet
+    };
+    RGBLEDFrame ledFrames_[kRGBLEDFramesInFlight];
+    int ledNextFrame_;                      // Next slot to use (LED thread only)
+    boost::atomic<boost::uint64_t> ledResendMask_[kRGBLEDNumberOfNotes / 64];
+    
+    // LED statistics
+    boost::atomic<unsigned long> ledRequestCount_;
+    boost::atomic<unsigned long> ledUpdatesSentCount_;
+    boost::atomic<unsigned long> ledFramesSentCount_;
+    volatile float ledUpdatesPerSecond_, ledFramesPerSecond_;
+    
+    // ***** Telemetry *****
+    TouchkeyTelemetry telemetry_;           // Updated by the I/O thread, rates and OSC from the LED thread
+    volatile bool telemetryPublishing_;     // Whether to send the figures by OSC
     
     // ***** Calibration *****
     bool isCalibrated_;
@@ -387,8 +528,16 @@ private:
     PianoKeyCalibrator** keyCalibrators_;	// Calibration information for each key
     int keyCalibratorsLength_;              // How many calibrators
     
+    boost::atomic<PianoKeyCalibrationTable*> calibrationTable_;      // Current table, used by the data thread
+    boost::atomic<PianoKeyCalibrationTable*> calibrationTableInUse_; // Table the data thread is reading, if any
+    boost::mutex calibrationPublishMutex_;                          // Only one thread publishes at a time
+    PianoKeyCalibrationSnapshot calibrationSnapshot_;               // Snapshot file last loaded, kept mapped
+    
+    QuiescentDriftTracker *driftTracker_;   // Corrections for drift in each key's resting value
+    bool driftTrackingEnabled_;
+    
     // ***** Logging *****
-    ofstream keyTouchLog_;
+    SessionLog sessionLog_;
     bool logFileCreated_;
     bool loggingActive_;
     
@@ -402,6 +551,9 @@ private:
     void *analogCallback_;
     void *centroidUserData_;
     void *analogUserData_;
+    
+    TouchkeyBatchBroadcaster batchBroadcaster_;
+    TouchkeyCentroidBatch centroidBatch_;   // Filled key by key while parsing a centroid frame (I/O thread only)
 };
 
 #endif /* TOUCHKEY_DEVICE_H */
\ No newline at end of file
@@ -0,0 +1,216 @@
+//
+//  TouchkeyTelemetry.cpp
+//  touchkeys
+//
+
+#include "TouchkeyTelemetry.h"
+#include "PianoKeyboard.h"
+#include <string>
+#include <boost/static_assert.hpp>
+
+using namespace boost::posix_time;
+
+// The OSC type strings in publish() have one argument per board and per bucket
+BOOST_STATIC_ASSERT(kTelemetryMaxBoards == 4 && kTelemetryIntervalBuckets == 8);
+
+// Names used for the OSC paths, in the order of the error enum
+static const char *kTelemetryErrorNames[kTelemetryNumberOfErrors] = {
+    "dropped", "repeated", "malformedcentroid", "malformedkeydata", "malformedanalog",
+    "notready", "unknownkey", "nak", "frameerror", "oversize", "devicemessage"
+};
+
+static const char *kTelemetryStreamNames[kTelemetryNumberOfStreams] = {
+    "centroid", "analog"
+};
+
+// Constructor
+TouchkeyTelemetry::TouchkeyTelemetry() {
+    reset();
+}
+
+// Note the time processing of a frame started
+void TouchkeyTelemetry::beginFrame() {
+    frameStartTime_ = microsec_clock::universal_time();
+}
+
+// Add the time taken by the frame to the processing statistics
+void TouchkeyTelemetry::endFrame() {
+    unsigned long elapsed = (unsigned long)(microsec_clock::universal_time() - frameStartTime_).total_microseconds();
+
+    framesReceived_.fetch_add(1, boost::memory_order_relaxed);
+    processFrames_.fetch_add(1, boost::memory_order_relaxed);
+    processTotal_.fetch_add(elapsed, boost::memory_order_relaxed);
+
+    unsigned long max = processMax_.load(boost::memory_order_relaxed);
+    while(elapsed > max && !processMax_.compare_exchange_weak(max, elapsed, boost::memory_order_relaxed))
+        ;
+}
+
+// Count a frame from a board, and add the time since its last one to the histogram
+void TouchkeyTelemetry::countFrame(int stream, int board) {
+    int slot = boardSlot(board);
+
+    boardFrames_[slot].fetch_add(1, boost::memory_order_relaxed);
+    if(stream < 0 || stream >= kTelemetryNumberOfStreams || slot == kTelemetryMaxBoards)
+        return;
+
+    ptime& lastTime = lastFrameTime_[stream][slot];
+    if(!lastTime.is_not_a_date_time()) {
+        long interval = (long)(frameStartTime_ - lastTime).total_microseconds();
+        int bucket = 0;
+
+        while(bucket < kTelemetryIntervalBuckets - 1 && interval >= intervalBucketLimit(bucket))
+            bucket++;
+        intervals_[stream][slot][bucket].fetch_add(1, boost::memory_order_relaxed);
+    }
+    lastTime = frameStartTime_;
+}
+
+// Count one or more errors
+void TouchkeyTelemetry::countError(int type, int board, unsigned long count) {
+    if(type < 0 || type >= kTelemetryNumberOfErrors)
+        return;
+    errors_[boardSlot(board)][type].fetch_add(count, boost::memory_order_relaxed);
+}
+
+// Frames received from one board, or -1 for frames not belonging to a board
+unsigned long TouchkeyTelemetry::framesReceived(int board) {
+    return boardFrames_[boardSlot(board)].load(boost::memory_order_relaxed);
+}
+
+// Errors of a type, on every board and the device
+unsigned long TouchkeyTelemetry::errorCount(int type) {
+    unsigned long total = 0;
+
+    if(type < 0 || type >= kTelemetryNumberOfErrors)
+        return 0;
+    for(int i = 0; i <= kTelemetryMaxBoards; i++)
+        total += errors_[i][type].load(boost::memory_order_relaxed);
+    return total;
+}
+
+// Errors of a type on one board
+unsigned long TouchkeyTelemetry::errorCount(int type, int board) {
+    if(type < 0 || type >= kTelemetryNumberOfErrors)
+        return 0;
+    return errors_[boardSlot(board)][type].load(boost::memory_order_relaxed);
+}
+
+// Number of intervals in one bucket of a board's histogram
+unsigned long TouchkeyTelemetry::intervalCount(int stream, int board, int bucket) {
+    if(stream < 0 || stream >= kTelemetryNumberOfStreams || board < 0 || board >= kTelemetryMaxBoards ||
+       bucket < 0 || bucket >= kTelemetryIntervalBuckets)
+        return 0;
+    return intervals_[stream][board][bucket].load(boost::memory_order_relaxed);
+}
+
+// Mean and maximum processing time since the last call
+TouchkeyTelemetry::ProcessTime TouchkeyTelemetry::processTime() {
+    ProcessTime result;
+
+    result.frames = processFrames_.exchange(0, boost::memory_order_relaxed);
+    unsigned long total = processTotal_.exchange(0, boost::memory_order_relaxed);
+    result.maxMicroseconds = (float)processMax_.exchange(0, boost::memory_order_relaxed);
+    result.meanMicroseconds = (result.frames > 0) ? (float)total / (float)result.frames : 0;
+
+    return result;
+}
+
+// Upper edge of a histogram bucket in microseconds
+long TouchkeyTelemetry::intervalBucketLimit(int bucket) {
+    if(bucket < 0 || bucket >= kTelemetryIntervalBuckets - 1)
+        return -1;
+    return (long)kTelemetryFirstBucketMicroseconds << bucket;
+}
+
+// Name of an error type
+const char* TouchkeyTelemetry::errorName(int type) {
+    if(type < 0 || type >= kTelemetryNumberOfErrors)
+        return "";
+    return kTelemetryErrorNames[type];
+}
+
+// Recalculate bytes and frames per second
+void TouchkeyTelemetry::updateRates() {
+    ptime currentTime = microsec_clock::universal_time();
+    long elapsed = (long)(currentTime - rateStartTime_).total_microseconds();
+    unsigned long bytes = bytesReceived_.load(boost::memory_order_relaxed);
+    unsigned long frames = framesReceived_.load(boost::memory_order_relaxed);
+
+    if(elapsed <= 0)
+        return;
+
+    bytesPerSecond_ = (float)(bytes - rateStartBytes_) * 1000000.0 / (float)elapsed;
+    framesPerSecond_ = (float)(frames - rateStartFrames_) * 1000000.0 / (float)elapsed;
+    rateStartBytes_ = bytes;
+    rateStartFrames_ = frames;
+    rateStartTime_ = currentTime;
+}
+
+// Send the figures as OSC:
+//   /touchkeys/stats/rates               bytes/sec, frames/sec
+//   /touchkeys/stats/frames              total, then one per board
+//   /touchkeys/stats/errors/[name]       total, one per board, then the device
+//   /touchkeys/stats/intervals/[stream]  board, then one count per bucket
+//   /touchkeys/stats/process             frames, mean and max microseconds since the last publish
+void TouchkeyTelemetry::publish(PianoKeyboard& keyboard) {
+    keyboard.sendMessage("/touchkeys/stats/rates", "ff", bytesPerSecond_, framesPerSecond_, LO_ARGS_END);
+    keyboard.sendMessage("/touchkeys/stats/frames", "iiiii", (int)framesReceived(),
+                         (int)framesReceived(0), (int)framesReceived(1), (int)framesReceived(2), (int)framesReceived(3),
+                         LO_ARGS_END);
+
+    for(int type = 0; type < kTelemetryNumberOfErrors; type++) {
+        std::string path = std::string("/touchkeys/stats/errors/") + kTelemetryErrorNames[type];
+        keyboard.sendMessage(path.c_str(), "iiiiii", (int)errorCount(type),
+                             (int)errorCount(type, 0), (int)errorCount(type, 1), (int)errorCount(type, 2),
+                             (int)errorCount(type, 3), (int)errorCount(type, -1), LO_ARGS_END);
+    }
+
+    for(int stream = 0; stream < kTelemetryNumberOfStreams; stream++) {
+        std::string path = std::string("/touchkeys/stats/intervals/") + kTelemetryStreamNames[stream];
+        for(int board = 0; board < kTelemetryMaxBoards; board++) {
+            int counts[kTelemetryIntervalBuckets];
+            bool any = false;
+
+            for(int bucket = 0; bucket < kTelemetryIntervalBuckets; bucket++) {
+                counts[bucket] = (int)intervalCount(stream, board, bucket);
+                if(counts[bucket] != 0)
+                    any = true;
+            }
+            if(!any)
+                continue;
+            keyboard.sendMessage(path.c_str(), "iiiiiiiii", board, counts[0], counts[1], counts[2], counts[3],
+                                 counts[4], counts[5], counts[6], counts[7], LO_ARGS_END);
+        }
+    }
+
+    ProcessTime process = processTime();
+    keyboard.sendMessage("/touchkeys/stats/process", "iff", (int)process.frames, process.meanMicroseconds,
+                         process.maxMicroseconds, LO_ARGS_END);
+}
+
+// Zero all the counters
+void TouchkeyTelemetry::reset() {
+    bytesReceived_ = 0;
+    framesReceived_ = 0;
+    for(int i = 0; i <= kTelemetryMaxBoards; i++) {
+        boardFrames_[i] = 0;
+        for(int j = 0; j < kTelemetryNumberOfErrors; j++)
+            errors_[i][j] = 0;
+    }
+    for(int i = 0; i < kTelemetryNumberOfStreams; i++) {
+        for(int j = 0; j < kTelemetryMaxBoards; j++) {
+            for(int k = 0; k < kTelemetryIntervalBuckets; k++)
+                intervals_[i][j][k] = 0;
+            lastFrameTime_[i][j] = ptime(boost::posix_time::not_a_date_time);
+        }
+    }
+    processFrames_ = 0;
+    processTotal_ = 0;
+    processMax_ = 0;
+
+    frameStartTime_ = microsec_clock::universal_time();
+    rateStartTime_ = frameStartTime_;
+    rateStartBytes_ = rateStartFrames_ = 0;
+    bytesPerSecond_ = framesPerSecond_ = 0;
+}
@@ -0,0 +1,138 @@
+//
+//  TouchkeyTelemetry.h
+//  touchkeys
+//
+
+#ifndef __touchkeys__TouchkeyTelemetry__
+#define __touchkeys__TouchkeyTelemetry__
+
+#include <iostream>
+#include <boost/atomic.hpp>
+#include <boost/date_time/posix_time/posix_time.hpp>
+
+class PianoKeyboard;
+
+const int kTelemetryMaxBoards = 4;              // Boards on one device; see TouchkeyDevice::analogLastFrame_
+const int kTelemetryIntervalBuckets = 8;        // Inter-frame interval histogram: < 0.5ms, then doubling up to >= 32ms
+const int kTelemetryFirstBucketMicroseconds = 500;
+
+// Problems counted on the I/O thread
+enum {
+    kTelemetryErrorDroppedFrame = 0,    // Analog frames missing from the sequence
+    kTelemetryErrorRepeatedFrame,       // Analog frames arriving again or out of order
+    kTelemetryErrorMalformedCentroid,   // Centroid frame too short to parse
+    kTelemetryErrorMalformedKeyData,    // Key data within a centroid frame couldn't be parsed
+    kTelemetryErrorMalformedAnalog,     // Analog frame too short, or with leftover bytes
+    kTelemetryErrorDataNotReady,        // Key data left over from a previous scan
+    kTelemetryErrorUnknownKey,          // Data for a key the keyboard doesn't have
+    kTelemetryErrorNak,                 // NAK received from the device
+    kTelemetryErrorFrameError,          // Device reported an internal communication error
+    kTelemetryErrorOversizeFrame,       // Frame exceeding TOUCHKEY_MAX_FRAME_LENGTH
+    kTelemetryErrorDeviceMessage,       // Error message frame sent by the device
+    kTelemetryNumberOfErrors
+};
+
+// Streams whose inter-frame intervals are measured
+enum {
+    kTelemetryStreamCentroid = 0,
+    kTelemetryStreamAnalog,
+    kTelemetryNumberOfStreams
+};
+
+/*
+ * TouchkeyTelemetry
+ *
+ * Counts what happens on a TouchkeyDevice's I/O thread: bytes and frames received,
+ * errors of each type on each board, how far apart frames arrive and how long each
+ * takes to process. Everything the I/O thread touches is either its own or a relaxed
+ * atomic, so counting costs next to nothing and never blocks. Other threads read the
+ * counters at any time; once a second the device's LED thread calls updateRates() and
+ * optionally publish(), which sends the figures as OSC messages under /touchkeys/stats.
+ * Errors which can't be put down to a board are counted against the device as a whole.
+ */
+
+class TouchkeyTelemetry {
+public:
+    // Processing time of frames since the last call to processTime()
+    struct ProcessTime {
+        unsigned long frames;
+        float meanMicroseconds;
+        float maxMicroseconds;
+    };
+
+public:
+    // ***** Constructor *****
+    TouchkeyTelemetry();
+
+    // ***** I/O Thread Methods *****
+    //
+    // Bytes read from the device
+    void countBytes(long bytes) { bytesReceived_.fetch_add(bytes, boost::memory_order_relaxed); }
+
+    // Bracket the processing of each frame. beginFrame() also gives the arrival time
+    // used for the interval histograms.
+    void beginFrame();
+    void endFrame();
+
+    // A centroid or analog frame from a given board
+    void countFrame(int stream, int board);
+
+    // An error of the given type; board -1 if it isn't known
+    void countError(int type, int board = -1, unsigned long count = 1);
+
+    // ***** Reading Methods *****
+    //
+    // Counters are totals since the last reset()
+    unsigned long bytesReceived() { return bytesReceived_.load(boost::memory_order_relaxed); }
+    unsigned long framesReceived() { return framesReceived_.load(boost::memory_order_relaxed); }
+    unsigned long framesReceived(int board);
+    unsigned long errorCount(int type);                 // All boards and the device
+    unsigned long errorCount(int type, int board);      // One board, or -1 for the device
+    unsigned long intervalCount(int stream, int board, int bucket);
+
+    // Rates as of the last updateRates()
+    float bytesPerSecond() { return bytesPerSecond_; }
+    float framesPerSecond() { return framesPerSecond_; }
+
+    // Resets the mean and maximum each time it's called
+    ProcessTime processTime();
+
+    // Upper edge of a histogram bucket in microseconds; the last bucket has none (-1)
+    static long intervalBucketLimit(int bucket);
+    static const char* errorName(int type);
+
+    // ***** Housekeeping Methods *****
+    //
+    // Recalculate the rates from the counts since the last call
+    void updateRates();
+
+    // Send the current figures as OSC through the keyboard
+    void publish(PianoKeyboard& keyboard);
+
+    // Zero everything. Should not be called while the I/O thread is running.
+    void reset();
+
+private:
+    int boardSlot(int board) { return (board >= 0 && board < kTelemetryMaxBoards) ? board : kTelemetryMaxBoards; }
+
+    boost::atomic<unsigned long> bytesReceived_;
+    boost::atomic<unsigned long> framesReceived_;
+    boost::atomic<unsigned long> boardFrames_[kTelemetryMaxBoards + 1];
+    boost::atomic<unsigned long> errors_[kTelemetryMaxBoards + 1][kTelemetryNumberOfErrors];
+    boost::atomic<unsigned long> intervals_[kTelemetryNumberOfStreams][kTelemetryMaxBoards][kTelemetryIntervalBuckets];
+
+    boost::atomic<unsigned long> processFrames_;        // Since the last processTime()
+    boost::atomic<unsigned long> processTotal_;         // Microseconds
+    boost::atomic<unsigned long> processMax_;
+
+    // I/O thread only
+    boost::posix_time::ptime frameStartTime_;
+    boost::posix_time::ptime lastFrameTime_[kTelemetryNumberOfStreams][kTelemetryMaxBoards];
+
+    // Housekeeping thread only
+    boost::posix_time::ptime rateStartTime_;
+    unsigned long rateStartBytes_, rateStartFrames_;
+    volatile float bytesPerSecond_, framesPerSecond_;
+};
+
+#endif /* defined(__touchkeys__TouchkeyTelemetry__) */
@@ -14,6 +14,7 @@
 #include <exception>
 #include <vector>
 #include "Node.h"
+#include "Logger.h"
 
 /*
  * IIRFilter
@@ -131,7 +132,7 @@ public:
         typename Node<DataType>::size_type index = lastInputIndex_;
         
         if(maximumLookback >= 0 && index < input_.endIndex() - 1 - maximumLookback) {
-            std::cout << "IIRFilter: clearing history at index " << index << std::endl;
+            TOUCHKEY_LOG(kLogLevelDebug, "IIRFilter: clearing history at index {}") << index;
             // More samples gone by than we want to calculate... clear input
             clearInputOutputHistory();
             index = input_.endIndex() - 1 - maximumLookback;
@@ -140,7 +141,7 @@ public:
         }
         else if(index < input_.beginIndex()) {
             // More samples gone by than are now available... clear input
-            std::cout << "IIRFilter: clearing history at index " << index << std::endl;
+            TOUCHKEY_LOG(kLogLevelDebug, "IIRFilter: clearing history at index {}") << index;
             clearInputOutputHistory();
             index = input_.beginIndex();
         }
@@ -152,7 +153,7 @@ public:
         lastInputIndex_ = index;
         if(!this->empty())
             return this->latest();
-        std::cout << "IIRFilter: empty\n";
+        TOUCHKEY_LOG(kLogLevelTrace, "IIRFilter: empty");
         return missing_value<DataType>::missing();
     }
 
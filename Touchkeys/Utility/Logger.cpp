@@ -0,0 +1,309 @@
+//
+//  Logger.cpp
+//  touchkeys
+//
+
+#include "Logger.h"
+#include <algorithm>
+#include <cstdlib>
+#include <cstring>
+#include <iomanip>
+#include <sstream>
+#include <unistd.h>
+
+int Logger::level_ = kLogLevelInfo;
+Logger* Logger::instance_ = 0;
+boost::once_flag Logger::instanceFlag_ = BOOST_ONCE_INIT;
+
+// Order records by when they were logged
+static bool compareSequence(LogRecord const* a, LogRecord const* b) {
+    return a->sequence < b->sequence;
+}
+
+// ***** LogMessage *****
+
+// Start a message with no arguments
+LogMessage::LogMessage(int level, const char *format) {
+    record_.format = format;
+    record_.level = (unsigned char)level;
+    record_.argumentCount = 0;
+    record_.textLength = 0;
+}
+
+// The statement is finished: queue the message
+LogMessage::~LogMessage() {
+    Logger::instance().enqueue(record_);
+}
+
+LogMessage& LogMessage::operator<<(bool value) {
+    LogRecord::Argument *argument = nextArgument(LogRecord::kArgumentBool);
+    if(argument != 0)
+        argument->integer = value ? 1 : 0;
+    return *this;
+}
+
+LogMessage& LogMessage::operator<<(char value) {
+    LogRecord::Argument *argument = nextArgument(LogRecord::kArgumentCharacter);
+    if(argument != 0)
+        argument->integer = value;
+    return *this;
+}
+
+LogMessage& LogMessage::operator<<(const void *value) {
+    LogRecord::Argument *argument = nextArgument(LogRecord::kArgumentPointer);
+    if(argument != 0)
+        argument->pointer = value;
+    return *this;
+}
+
+// Strings are copied, since they may not outlive the statement
+LogMessage& LogMessage::operator<<(const char *value) {
+    if(value == 0)
+        value = "(null)";
+    addText(LogRecord::kArgumentString, value, (int)strlen(value));
+    return *this;
+}
+
+LogMessage& LogMessage::operator<<(LogBytes const& value) {
+    int length = value.length;
+    if(length > kLogMaxBytesArgument)
+        length = kLogMaxBytesArgument;
+    if(length < 0 || value.data == 0)
+        length = 0;
+    addText(LogRecord::kArgumentBytes, (const char *)value.data, length);
+    return *this;
+}
+
+LogMessage& LogMessage::integer(long long value) {
+    LogRecord::Argument *argument = nextArgument(LogRecord::kArgumentInteger);
+    if(argument != 0)
+        argument->integer = value;
+    return *this;
+}
+
+LogMessage& LogMessage::unsignedInteger(unsigned long long value) {
+    LogRecord::Argument *argument = nextArgument(LogRecord::kArgumentUnsigned);
+    if(argument != 0)
+        argument->unsignedInteger = value;
+    return *this;
+}
+
+LogMessage& LogMessage::real(double value) {
+    LogRecord::Argument *argument = nextArgument(LogRecord::kArgumentDouble);
+    if(argument != 0)
+        argument->real = value;
+    return *this;
+}
+
+// Claim the next argument slot, if there is one
+LogRecord::Argument* LogMessage::nextArgument(int type) {
+    if(record_.argumentCount >= kLogMaxArguments)
+        return 0;
+    record_.types[record_.argumentCount] = (unsigned char)type;
+    return &record_.arguments[record_.argumentCount++];
+}
+
+// Copy a string or buffer into the record, truncating it if there isn't room
+void LogMessage::addText(int type, const char *data, int length) {
+    LogRecord::Argument *argument = nextArgument(type);
+    if(argument == 0)
+        return;
+    if(length > kLogTextLength - record_.textLength)
+        length = kLogTextLength - record_.textLength;
+
+    memcpy(&record_.text[record_.textLength], data, length);
+    argument->text.offset = record_.textLength;
+    argument->text.length = (unsigned short)length;
+    record_.textLength += length;
+}
+
+// ***** Logger *****
+
+// Constructor: start the writer thread
+Logger::Logger()
+: threadRing_(&Logger::abandonRing), sequence_(0), dropped_(0), output_(&std::cout), errorOutput_(&std::cerr),
+  shouldStop_(false)
+{
+    writerThread_ = boost::thread(&Logger::writerLoop, this);
+}
+
+// Stop the writer thread, writing everything still queued. The logger itself stays,
+// since other threads may still be logging while the program exits.
+void Logger::shutdown() {
+    if(shouldStop_)
+        return;
+    shouldStop_ = true;
+    writerThread_.join();
+    writeQueued();
+}
+
+// Set where messages are written
+void Logger::setOutput(std::ostream *output, std::ostream *errorOutput) {
+    Logger& logger = instance();
+    boost::mutex::scoped_lock lock(logger.writeMutex_);
+
+    logger.output_ = output;
+    logger.errorOutput_ = errorOutput;
+}
+
+// Write out whatever is queued now, rather than waiting for the writer thread
+void Logger::flush() {
+    instance().writeQueued();
+}
+
+unsigned long Logger::droppedMessages() {
+    return instance().dropped_.load(boost::memory_order_relaxed);
+}
+
+// Substitute the arguments into the format, in order
+std::string Logger::format(LogRecord const& record) {
+    std::ostringstream stream;
+    int argument = 0;
+
+    for(const char *c = record.format; *c != '\0'; c++) {
+        if(c[0] != '{' || c[1] != '}') {
+            stream << *c;
+            continue;
+        }
+        c++;
+        if(argument >= record.argumentCount) {
+            stream << "{}";
+            continue;
+        }
+
+        LogRecord::Argument const& value = record.arguments[argument];
+        switch(record.types[argument]) {
+            case LogRecord::kArgumentInteger:
+                stream << value.integer;
+                break;
+            case LogRecord::kArgumentUnsigned:
+                stream << value.unsignedInteger;
+                break;
+            case LogRecord::kArgumentDouble:
+                stream << value.real;
+                break;
+            case LogRecord::kArgumentBool:
+                stream << (value.integer != 0 ? "true" : "false");
+                break;
+            case LogRecord::kArgumentCharacter:
+                stream << (char)value.integer;
+                break;
+            case LogRecord::kArgumentPointer:
+                stream << value.pointer;
+                break;
+            case LogRecord::kArgumentString:
+                stream.write(&record.text[value.text.offset], value.text.length);
+                break;
+            case LogRecord::kArgumentBytes:
+                for(int i = 0; i < value.text.length; i++) {
+                    stream << std::hex << std::setw(2) << std::setfill('0')
+                           << (int)(unsigned char)record.text[value.text.offset + i] << " ";
+                }
+                stream << std::dec << std::setfill(' ');
+                break;
+        }
+        argument++;
+    }
+
+    return stream.str();
+}
+
+// Get the logger, creating it the first time
+Logger& Logger::instance() {
+    boost::call_once(&Logger::createInstance, instanceFlag_);
+    return *instance_;
+}
+
+void Logger::createInstance() {
+    instance_ = new Logger;
+    atexit(&Logger::shutdownInstance);
+}
+
+void Logger::shutdownInstance() {
+    instance_->shutdown();
+}
+
+// A thread with a ring has exited. The writer frees the ring once it's empty.
+void Logger::abandonRing(Ring *ring) {
+    ring->abandoned.store(true, boost::memory_order_release);
+}
+
+// Put a message in this thread's ring. Called from any thread; never blocks
+// except to register a thread's ring the first time it logs.
+void Logger::enqueue(LogRecord& record) {
+    Ring *ring = threadRing_.get();
+
+    if(ring == 0) {
+        ring = new Ring;
+        threadRing_.reset(ring);
+
+        boost::mutex::scoped_lock lock(ringsMutex_);
+        rings_.push_back(ring);
+    }
+
+    unsigned int writePosition = ring->writePosition.load(boost::memory_order_relaxed);
+    if(writePosition - ring->readPosition.load(boost::memory_order_acquire) >= (unsigned int)kLogRingSize) {
+        dropped_.fetch_add(1, boost::memory_order_relaxed);
+        return;
+    }
+
+    record.sequence = sequence_.fetch_add(1, boost::memory_order_relaxed);
+    ring->records[writePosition & (kLogRingSize - 1)] = record;
+    ring->writePosition.store(writePosition + 1, boost::memory_order_release);
+}
+
+// Writer thread: write out the queued messages periodically until told to stop
+void Logger::writerLoop() {
+    while(!shouldStop_) {
+        writeQueued();
+        usleep(kLogWriterIntervalMicroseconds);
+    }
+}
+
+// Take everything from the rings, and write it in the order it was logged
+void Logger::writeQueued() {
+    boost::mutex::scoped_lock lock(writeMutex_);
+    std::vector<Ring*> rings;
+    std::vector<LogRecord const*> records;
+    std::vector<unsigned int> writePositions;
+
+    {
+        boost::mutex::scoped_lock ringsLock(ringsMutex_);
+        rings = rings_;
+    }
+
+    // Note how far each ring has been written; anything later waits for next time
+    for(std::vector<Ring*>::iterator it = rings.begin(); it != rings.end(); ++it) {
+        Ring *ring = *it;
+        unsigned int readPosition = ring->readPosition.load(boost::memory_order_relaxed);
+        unsigned int writePosition = ring->writePosition.load(boost::memory_order_acquire);
+
+        for(unsigned int i = readPosition; i != writePosition; i++)
+            records.push_back(&ring->records[i & (kLogRingSize - 1)]);
+        writePositions.push_back(writePosition);
+    }
+
+    std::sort(records.begin(), records.end(), compareSequence);
+
+    for(std::vector<LogRecord const*>::iterator it = records.begin(); it != records.end(); ++it) {
+        std::ostream *stream = ((*it)->level == kLogLevelError) ? errorOutput_ : output_;
+        if(stream != 0)
+            (*stream) << format(**it) << "\n";
+    }
+    if(output_ != 0)
+        output_->flush();
+    if(errorOutput_ != 0)
+        errorOutput_->flush();
+
+    // Hand the space back to the threads, and free the rings of threads which have gone
+    for(unsigned int i = 0; i < rings.size(); i++) {
+        bool abandoned = rings[i]->abandoned.load(boost::memory_order_acquire);
+        rings[i]->readPosition.store(writePositions[i], boost::memory_order_release);
+
+        if(abandoned && rings[i]->writePosition.load(boost::memory_order_acquire) == writePositions[i]) {
+            boost::mutex::scoped_lock ringsLock(ringsMutex_);
+            rings_.erase(std::find(rings_.begin(), rings_.end(), rings[i]));
+            delete rings[i];
+        }
+    }
+}
@@ -0,0 +1,209 @@
+//
+//  Logger.h
+//  touchkeys
+//
+
+#ifndef __touchkeys__Logger__
+#define __touchkeys__Logger__
+
+#include <iostream>
+#include <string>
+#include <vector>
+#include <boost/atomic.hpp>
+#include <boost/cstdint.hpp>
+#include <boost/thread.hpp>
+
+// Levels, from most to least important
+enum {
+    kLogLevelError = 0,
+    kLogLevelWarning,
+    kLogLevelInfo,
+    kLogLevelDebug,
+    kLogLevelTrace
+};
+
+// Messages above this level are compiled out altogether. Define it as kLogLevelTrace
+// to get the per-sample and per-byte messages.
+#ifndef TOUCHKEY_LOG_MAX_LEVEL
+#define TOUCHKEY_LOG_MAX_LEVEL kLogLevelDebug
+#endif
+
+const int kLogMaxArguments = 8;             // Arguments per message; any more are ignored
+const int kLogTextLength = 96;              // Space for copies of string and byte arguments
+const int kLogRingSize = 1024;              // Messages buffered per thread (power of 2)
+const int kLogWriterIntervalMicroseconds = 5000;
+const int kLogMaxBytesArgument = 24;        // Longest buffer a LogBytes argument shows
+
+// Log a message: the format is a string literal with {} wherever an argument goes,
+// and the arguments follow with <<, e.g.
+//
+//     TOUCHKEY_LOG(kLogLevelWarning, "dropped frame on board {} at {}") << board << frame;
+//
+// Disabled levels cost one branch, and nothing after the level is evaluated. The
+// macro is a single expression, so it is safe as the body of an unbraced if.
+#define TOUCHKEY_LOG(logLevel, logFormat) \
+    ((logLevel) > TOUCHKEY_LOG_MAX_LEVEL || (logLevel) > Logger::level()) ? (void)0 : \
+        LogVoidify() & LogMessage((logLevel), (logFormat))
+
+// A buffer to be logged in hex
+struct LogBytes {
+    LogBytes(const unsigned char *data, int length) : data(data), length(length) {}
+    const unsigned char *data;
+    int length;
+};
+
+// One message, as queued: the format pointer identifies it, and the arguments are
+// kept raw until the writer thread formats them
+struct LogRecord {
+    enum {
+        kArgumentInteger = 0,
+        kArgumentUnsigned,
+        kArgumentDouble,
+        kArgumentBool,
+        kArgumentCharacter,
+        kArgumentPointer,
+        kArgumentString,            // Copied into text
+        kArgumentBytes              // Copied into text
+    };
+
+    union Argument {
+        long long integer;
+        unsigned long long unsignedInteger;
+        double real;
+        const void *pointer;
+        struct {
+            unsigned short offset;
+            unsigned short length;
+        } text;
+    };
+
+    const char *format;
+    boost::uint64_t sequence;       // Orders messages from different threads
+    unsigned char level;
+    unsigned char argumentCount;
+    unsigned short textLength;
+    unsigned char types[kLogMaxArguments];
+    Argument arguments[kLogMaxArguments];
+    char text[kLogTextLength];
+};
+
+/*
+ * LogMessage
+ *
+ * Collects the arguments of one message on the stack, and queues it when it goes
+ * out of scope at the end of the statement. Only used through TOUCHKEY_LOG.
+ */
+
+class LogMessage {
+public:
+    LogMessage(int level, const char *format);
+    ~LogMessage();
+
+    LogMessage& operator<<(int value) { return integer(value); }
+    LogMessage& operator<<(long value) { return integer(value); }
+    LogMessage& operator<<(long long value) { return integer(value); }
+    LogMessage& operator<<(unsigned int value) { return unsignedInteger(value); }
+    LogMessage& operator<<(unsigned long value) { return unsignedInteger(value); }
+    LogMessage& operator<<(unsigned long long value) { return unsignedInteger(value); }
+    LogMessage& operator<<(unsigned char value) { return unsignedInteger(value); }
+    LogMessage& operator<<(float value) { return real(value); }
+    LogMessage& operator<<(double value) { return real(value); }
+    LogMessage& operator<<(bool value);
+    LogMessage& operator<<(char value);
+    LogMessage& operator<<(const void *value);
+    LogMessage& operator<<(const char *value);
+    LogMessage& operator<<(std::string const& value) { return (*this) << value.c_str(); }
+    LogMessage& operator<<(LogBytes const& value);
+
+private:
+    LogMessage& integer(long long value);
+    LogMessage& unsignedInteger(unsigned long long value);
+    LogMessage& real(double value);
+    LogRecord::Argument* nextArgument(int type);
+    void addText(int type, const char *data, int length);
+
+    LogRecord record_;
+};
+
+// Turns the message into void so both sides of the ?: in TOUCHKEY_LOG match.
+// & binds more loosely than <<, so all the arguments are added first.
+struct LogVoidify {
+    void operator&(LogMessage const&) {}
+};
+
+/*
+ * Logger
+ *
+ * Diagnostics from every thread, without the real-time threads ever waiting on the
+ * console. Each thread queues its messages in its own single-producer ring, so logging
+ * takes no locks and makes no system calls; if the ring is full the message is dropped
+ * and counted. A background thread collects the messages from all the rings every few
+ * milliseconds, puts them back in order, formats them and writes them out. Errors go
+ * to the error stream (std::cerr by default) and everything else to std::cout.
+ *
+ * Filtering happens twice: TOUCHKEY_LOG_MAX_LEVEL removes levels at compile time, and
+ * setLevel() chooses which of the rest are queued at run time.
+ */
+
+class Logger {
+    friend class LogMessage;
+
+public:
+    // ***** Level *****
+    static int level() { return level_; }
+    static void setLevel(int level) { level_ = level; }
+
+    // ***** Output *****
+    //
+    // Where formatted messages are written. The streams must stay valid until changed.
+    static void setOutput(std::ostream *output, std::ostream *errorOutput);
+
+    // Write everything queued so far before returning
+    static void flush();
+
+    // Messages lost because a thread's ring was full
+    static unsigned long droppedMessages();
+
+    // Turn a record into text
+    static std::string format(LogRecord const& record);
+
+private:
+    // Messages queued by one thread
+    struct Ring {
+        Ring() : writePosition(0), readPosition(0), abandoned(false) {}
+
+        boost::atomic<unsigned int> writePosition;
+        boost::atomic<unsigned int> readPosition;
+        boost::atomic<bool> abandoned;              // Thread has exited; free once drained
+        LogRecord records[kLogRingSize];
+    };
+
+    Logger();
+
+    static Logger& instance();
+    static void createInstance();
+    static void shutdownInstance();
+    static void abandonRing(Ring *ring);
+
+    void enqueue(LogRecord& record);
+    void shutdown();
+    void writerLoop();
+    void writeQueued();
+
+    static int level_;
+    static Logger *instance_;
+    static boost::once_flag instanceFlag_;
+
+    boost::thread_specific_ptr<Ring> threadRing_;   // This thread's ring, created on first use
+    std::vector<Ring*> rings_;                      // All rings, for the writer
+    boost::mutex ringsMutex_;                       // Protects rings_ (taken once per thread, not per message)
+    boost::mutex writeMutex_;                       // One writer at a time (thread or flush())
+    boost::atomic<boost::uint64_t> sequence_;
+    boost::atomic<unsigned long> dropped_;
+    std::ostream *output_, *errorOutput_;
+
+    boost::thread writerThread_;
+    volatile bool shouldStop_;
+};
+
+#endif /* defined(__touchkeys__Logger__) */
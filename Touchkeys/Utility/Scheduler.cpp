@@ -8,8 +8,8 @@
  */
 
 #include "Scheduler.h"
+#include "Logger.h"
 #include <boost/date_time.hpp>
-#undef DEBUG_SCHEDULER
 
 using namespace boost::posix_time;
 using std::cout;
@@ -18,6 +18,9 @@ using std::cout;
 void Scheduler::start(timestamp_type where) {
 	if(isRunning_)
 		return;
+	// Find the start time, against which our offsets will be measured.  Set it here
+	// rather than in the thread so startTime() is valid as soon as we return.
+	startTime_ = microsec_clock::universal_time();
 	thread_ = boost::thread(Scheduler::staticRunLoop, this, where);
 }
 
@@ -26,6 +29,11 @@ void Scheduler::start(timestamp_type where) {
 void Scheduler::stop() {
 	if(!isRunning_)
 		return;
+	if(isManual_) {
+		isManual_ = false;
+		isRunning_ = false;
+		return;
+	}
 	thread_.interrupt();
 	thread_.join();
 	isRunning_ = false;
@@ -35,9 +43,68 @@ void Scheduler::stop() {
 timestamp_type Scheduler::currentTimestamp() {
 	if(!isRunning_)
 		return 0;
+	if(isManual_)
+		return manualTimestamp_;
 	return ptime_to_timestamp(microsec_clock::universal_time() - startTime_);
 }
 
+// Go back to the system clock after startManual(), keeping the original start time
+// so timestamps carry on from where they were before (and clocks referenced to
+// startTime() stay valid).
+void Scheduler::resume() {
+	if(isRunning_ && !isManual_)
+		return;
+	stop();
+	if(startTime_.is_not_a_date_time()) {
+		start(0);
+		return;
+	}
+	thread_ = boost::thread(Scheduler::staticRunLoop, this, 0);
+}
+
+// Start the scheduler on a manual clock beginning at the given timestamp. Any
+// running thread is stopped first; events stay in the queue. The start time is
+// left alone for resume().
+void Scheduler::startManual(timestamp_type where) {
+	stop();
+	manualTimestamp_ = where;
+	isManual_ = true;
+	isRunning_ = true;
+}
+
+// Move the manual clock forward to the given timestamp, executing every event
+// scheduled up to and including that time. While each event runs, the clock reads
+// the event's own timestamp. The mutex is released around each action so it can
+// schedule or unschedule events itself.
+void Scheduler::advanceTo(timestamp_type timestamp) {
+	if(!isManual_)
+		return;
+	
+	boost::unique_lock<boost::mutex> lock(eventMutex_);
+	
+	while(!events_.empty() && events_.begin()->first <= timestamp) {
+		std::multimap<timestamp_type, std::pair<void*, action> >::iterator it = events_.begin();
+		void *who = it->second.first;
+		action actionFunction = it->second.second;
+		
+		if(it->first > manualTimestamp_)
+			manualTimestamp_ = it->first;
+		events_.erase(it);
+		
+		lock.unlock();
+		timestamp_type timeOfNextEvent = actionFunction();
+		lock.lock();
+		
+		if(timeOfNextEvent > 0) {
+			events_.insert(std::pair<timestamp_type,std::pair<void*, action> >
+						   (timeOfNextEvent, std::pair<void*, action>(who, actionFunction)));
+		}
+	}
+	
+	if(timestamp > manualTimestamp_)
+		manualTimestamp_ = timestamp;
+}
+
 // Schedule a new event
 void Scheduler::schedule(void *who, action func, timestamp_type timestamp) {
     bool newActionWillComeFirst = false;
@@ -60,9 +127,7 @@ void Scheduler::schedule(void *who, action func, timestamp_type timestamp) {
 
 // Remove an existing event
 void Scheduler::unschedule(void *who, timestamp_type timestamp) {
-#ifdef DEBUG_SCHEDULER
-    std::cerr << "Scheduler::unschedule: " << who << ", " << timestamp << std::endl;
-#endif
+    TOUCHKEY_LOG(kLogLevelTrace, "Scheduler::unschedule: {}, {}") << who << timestamp;
     
 	eventMutex_.lock();
 	// Find all events with this timestamp, and remove only the ones matching the given source
@@ -72,13 +137,9 @@ void Scheduler::unschedule(void *who, timestamp_type timestamp) {
         // Remove all events from this source
         it = events_.begin();
         while(it != events_.end()) {
-#ifdef DEBUG_SCHEDULER
-            std::cerr << "| (" << it->first << ", " << it->second.first << ")\n";
-#endif
+            TOUCHKEY_LOG(kLogLevelTrace, "| ({}, {})") << it->first << it->second.first;
             if(it->second.first == who) {
-#ifdef DEBUG_SCHEDULER
-                std::cerr << "--> erased " << it->first << ", " << it->second.first << ")\n";
-#endif
+                TOUCHKEY_LOG(kLogLevelTrace, "--> erased ({}, {})") << it->first << it->second.first;
                 events_.erase(it++);
             }
             else
@@ -90,9 +151,7 @@ void Scheduler::unschedule(void *who, timestamp_type timestamp) {
         it = events_.find(timestamp);
         while(it != events_.end()) {
             if(it->second.first == who) {
-#ifdef DEBUG_SCHEDULER
-                std::cerr << "--> erased " << it->first << ", " << it->second.first << ")\n";
-#endif
+                TOUCHKEY_LOG(kLogLevelTrace, "--> erased ({}, {})") << it->first << it->second.first;
                 events_.erase(it++);
             }
             else
@@ -100,9 +159,7 @@ void Scheduler::unschedule(void *who, timestamp_type timestamp) {
         }
     }
 	eventMutex_.unlock();
-#ifdef DEBUG_SCHEDULER
-    std::cerr << "Scheduler::unschedule: done\n";
-#endif
+    TOUCHKEY_LOG(kLogLevelTrace, "Scheduler::unschedule: done");
 	// No need to wake up the thread...
 }
 
@@ -121,8 +178,6 @@ void Scheduler::clear() {
 
 void Scheduler::runLoop(timestamp_type starting_timestamp) {
 	
-	// Find the start time, against which our offsets will be measured.
-	startTime_ = microsec_clock::universal_time();	
 	isRunning_ = true;
 	
 	try {
@@ -35,7 +35,7 @@ public:
 	//
 	// Note: This class is not copy-constructable.
 	
-	Scheduler() : isRunning_(false) {}
+	Scheduler() : isRunning_(false), isManual_(false), manualTimestamp_(0) {}
 	
 	// ***** Destructor *****
 	
@@ -51,6 +51,22 @@ public:
 	bool isRunning() { return isRunning_; }
 	timestamp_type currentTimestamp();
 	
+	// ***** Manual Clock *****
+	//
+	// For offline processing (e.g. replaying a log) the scheduler can follow a clock
+	// which the caller advances, instead of the system clock. No thread runs; events
+	// are executed in timestamp order in the caller's thread from advanceTo(), so the
+	// results don't depend on how fast the caller goes.
+	
+	void startManual(timestamp_type where = 0);
+	void advanceTo(timestamp_type timestamp);
+	void resume();
+	bool isManual() { return isManual_; }
+	
+	// Clock time corresponding to timestamp 0.  Other time bases (e.g. device
+	// frame clocks) can be referenced to this to share the scheduler's timeline.
+	boost::posix_time::ptime startTime() { return startTime_; }
+	
 	// ***** Event Management Methods *****
 	//
 	// This interface provides the ability to schedule and unschedule events for
@@ -70,6 +86,8 @@ private:
 	boost::condition_variable eventCondition_;
 	boost::mutex eventMutex_;
 	bool isRunning_;
+	bool isManual_;
+	volatile timestamp_type manualTimestamp_;
 	
 	// Collection of future events to execute
 	boost::posix_time::ptime startTime_;
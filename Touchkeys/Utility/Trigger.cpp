@@ -8,13 +8,11 @@
  */
 
 #include "Trigger.h"
+#include "Logger.h"
 
-#undef DEBUG_TRIGGERS
 
 void TriggerSource::sendTrigger(timestamp_type timestamp) {
-#ifdef DEBUG_TRIGGERS
-    std::cerr << "sendTrigger (" << this << ")\n";
-#endif
+    TOUCHKEY_LOG(kLogLevelTrace, "sendTrigger ({})") << this;
     
     if(triggerDestinationsModified_) {
         triggerSourceMutex_.lock();
@@ -26,18 +24,14 @@ void TriggerSource::sendTrigger(timestamp_type timestamp) {
 	TriggerDestination* target;
 	while(it != triggerDestinations_.end()) {	// Advance the iterator before sending the trigger
 		target = *it;							// in case the triggerReceived routine causes the object to unregister
-#ifdef DEBUG_TRIGGERS
-        std::cerr << " --> " << target << std::endl;
-#endif
+        TOUCHKEY_LOG(kLogLevelTrace, " --> {}") << target;
 		target->triggerReceived(this, timestamp);
         it++;
 	}
 }
 
 void TriggerSource::addTriggerDestination(TriggerDestination* dest) { 
-#ifdef DEBUG_TRIGGERS
-    std::cerr << "addTriggerDestination (" << this << "): " << dest << "\n";
-#endif
+    TOUCHKEY_LOG(kLogLevelTrace, "addTriggerDestination ({}): {}") << this << dest;
 	if(dest == 0 || (void*)dest == (void*)this)
 		return;
 	triggerSourceMutex_.lock();
@@ -53,9 +47,7 @@ void TriggerSource::addTriggerDestination(TriggerDestination* dest) {
 }
 
 void TriggerSource::removeTriggerDestination(TriggerDestination* dest) {
-#ifdef DEBUG_TRIGGERS
-    std::cerr << "removeTriggerDestination (" << this << "): " << dest << "\n";
-#endif
+    TOUCHKEY_LOG(kLogLevelTrace, "removeTriggerDestination ({}): {}") << this << dest;
 	triggerSourceMutex_.lock();
     // Check whether this trigger is actually present
     if(triggerDestinations_.count(dest) != 0) {
@@ -69,9 +61,7 @@ void TriggerSource::removeTriggerDestination(TriggerDestination* dest) {
 }	
 
 void TriggerSource::clearTriggerDestinations() {
-#ifdef DEBUG_TRIGGERS
-    std::cerr << "clearTriggerDestinations (" << this << ")\n";
-#endif
+    TOUCHKEY_LOG(kLogLevelTrace, "clearTriggerDestinations ({})") << this;
 	triggerSourceMutex_.lock();
     processAddRemoveQueue();
 	std::set<TriggerDestination*>::iterator it;
@@ -84,21 +74,15 @@ void TriggerSource::clearTriggerDestinations() {
 // Process everything in the add and remove groups and transfer them
 // into the main set of trigger destinations. Do this with mutex locked.
 void TriggerSource::processAddRemoveQueue() {
-#ifdef DEBUG_TRIGGERS
-    std::cerr << "processAddRemoveQueue (" << this << ")\n";
-#endif
+    TOUCHKEY_LOG(kLogLevelTrace, "processAddRemoveQueue ({})") << this;
     std::set<TriggerDestination*>::iterator it;
     for(it = triggersToAdd_.begin(); it != triggersToAdd_.end(); ++it) {
         triggerDestinations_.insert(*it);
-#ifdef DEBUG_TRIGGERS
-        std::cerr << " --> added " << *it << std::endl;
-#endif
+        TOUCHKEY_LOG(kLogLevelTrace, " --> added {}") << *it;
     }
     for(it = triggersToRemove_.begin(); it != triggersToRemove_.end(); ++it) {
         triggerDestinations_.erase(*it);
-#ifdef DEBUG_TRIGGERS
-        std::cerr << " --> removed " << *it << std::endl;
-#endif
+        TOUCHKEY_LOG(kLogLevelTrace, " --> removed {}") << *it;
     }
     triggersToAdd_.clear();
     triggersToRemove_.clear();